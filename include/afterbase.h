@@ -6,6 +6,7 @@
 #include "../libAfterBase/layout.h"
 #include "../libAfterBase/mystring.h"
 #include "../libAfterBase/os.h"
+#include "../libAfterBase/outqueue.h"
 #include "../libAfterBase/parse.h"
 #include "../libAfterBase/regexp.h"
 #include "../libAfterBase/safemalloc.h"
@@ -71,6 +71,17 @@ desc_long_compare_func (ASHashableValue value1, ASHashableValue value2)
     return ((long)value2 - (long)value1);
 }
 
+/* open addressing slots are marked with item->next : */
+#define ASHASH_SLOT_EMPTY		((ASHashItem*)NULL)
+#define ASHASH_SLOT_REMOVED		((ASHashItem*)0x01)
+#define ASHASH_SLOT_USED		((ASHashItem*)0x02)
+
+#define ASHASH_MAX_SIZE			0xFFFF
+#define ASHASH_REHASH_STEP		2			/* buckets moved per add/remove */
+#define ASHASH_SCATTER_MULT		40503		/* 2^16 / golden ratio */
+
+#define IS_OPEN_ASHASH(h)		get_flags((h)->flags, ASHASH_OPEN_ADDRESSING)
+
 void
 init_ashash (ASHashTable * hash, Bool freeresources)
 {
@@ -78,17 +89,24 @@ init_ashash (ASHashTable * hash, Bool freeresources)
 	if (hash)
 	{
 		if (freeresources)
+		{
 			if (hash->buckets)
 				free (hash->buckets);
+			if (hash->old_buckets)
+				free (hash->old_buckets);
+			if (hash->slots)
+				free (hash->slots);
+		}
 		memset (hash, 0x00, sizeof (ASHashTable));
 	}
 }
 
 ASHashTable  *
-create_ashash (ASHashKey size,
+create_ashash_ext (ASHashKey size,
 			   ASHashKey (*hash_func) (ASHashableValue, ASHashKey),
 			   long (*compare_func) (ASHashableValue, ASHashableValue),
-			   void (*item_destroy_func) (ASHashableValue, void *))
+			   void (*item_destroy_func) (ASHashableValue, void *),
+			   ASFlagType flags)
 {
 	ASHashTable  *hash;
 
@@ -101,7 +119,14 @@ create_ashash (ASHashKey size,
 
 	init_ashash (hash, False);
 
-	hash->buckets = safecalloc (size, sizeof (ASHashBucket));
+	hash->flags = flags;
+	if (IS_OPEN_ASHASH(hash))
+	{
+		if (size < 4)
+			size = 4 ;
+		hash->slots = safecalloc (size, sizeof (ASHashItem));
+	}else
+		hash->buckets = safecalloc (size, sizeof (ASHashBucket));
 	hash->size = size;
 
 	if (hash_func)
@@ -119,6 +144,15 @@ create_ashash (ASHashKey size,
 	return hash;
 }
 
+ASHashTable  *
+create_ashash (ASHashKey size,
+			   ASHashKey (*hash_func) (ASHashableValue, ASHashKey),
+			   long (*compare_func) (ASHashableValue, ASHashableValue),
+			   void (*item_destroy_func) (ASHashableValue, void *))
+{
+	return create_ashash_ext (size, hash_func, compare_func, item_destroy_func, 0);
+}
+
 static void
 destroy_ashash_bucket (ASHashBucket * bucket, void (*item_destroy_func) (ASHashableValue, void *))
 {
@@ -134,6 +168,283 @@ destroy_ashash_bucket (ASHashBucket * bucket, void (*item_destroy_func) (ASHasha
 	*bucket = NULL;
 }
 
+static        ASHashResult
+add_item_to_bucket (ASHashBucket * bucket, ASHashItem * item, long (*compare_func) (ASHashableValue, ASHashableValue))
+{
+	ASHashItem  **tmp;
+
+	/* first check if we already have this item */
+	for (tmp = bucket; *tmp != NULL; tmp = &((*tmp)->next))
+	{
+		register long res = compare_func ((*tmp)->value, item->value);
+
+		if (res == 0)
+			return ((*tmp)->data == item->data) ? ASH_ItemExistsSame : ASH_ItemExistsDiffer;
+		else if (res > 0)
+			break;
+	}
+	/* now actually add this item */
+	item->next = (*tmp);
+	*tmp = item;
+	return ASH_Success;
+}
+
+/***** Incremental rehashing of chained tables *****/
+
+/* moves up to max_buckets non-empty old buckets into the new table */
+static void
+rehash_ashash_step (ASHashTable * hash, unsigned int max_buckets)
+{
+	unsigned int  skipped = 0;
+
+	while (hash->rehash_pos < hash->old_size && max_buckets > 0)
+	{
+		ASHashItem   *item = hash->old_buckets[hash->rehash_pos], *next;
+
+		hash->old_buckets[hash->rehash_pos++] = NULL;
+		if (item == NULL)
+		{	/* empty buckets are cheap to skip, but not for free */
+			if (++skipped >= 8)
+			{
+				skipped = 0;
+				--max_buckets;
+			}
+			continue;
+		}
+		for (; item != NULL; item = next)
+		{
+			ASHashKey     key = hash->hash_func (item->value, hash->size);
+
+			next = item->next;
+			item->next = NULL;
+			if (hash->buckets[key] == NULL)
+				hash->buckets_used++;
+			add_item_to_bucket (&(hash->buckets[key]), item, hash->compare_func);
+		}
+		--max_buckets;
+	}
+	if (hash->rehash_pos >= hash->old_size)
+	{
+		free (hash->old_buckets);
+		hash->old_buckets = NULL;
+		hash->old_size = 0;
+		hash->rehash_pos = 0;
+	}
+}
+
+static inline void
+finish_ashash_rehash (ASHashTable * hash)
+{
+	if (hash->old_buckets)
+		rehash_ashash_step (hash, hash->old_size);
+}
+
+static void
+grow_chained_ashash (ASHashTable * hash)
+{
+	unsigned int  new_size = (unsigned int)hash->size * 2 + 1;
+
+	if (new_size > ASHASH_MAX_SIZE)
+		new_size = ASHASH_MAX_SIZE;
+	LOCAL_DEBUG_OUT( "hash %p: %ld items - growing from %d to %d buckets", hash, hash->items_num, hash->size, new_size );
+	hash->old_buckets = hash->buckets;
+	hash->old_size = hash->size;
+	hash->rehash_pos = 0;
+	hash->buckets = safecalloc (new_size, sizeof (ASHashBucket));
+	hash->size = new_size;
+	hash->buckets_used = 0;
+	hash->most_recent = NULL;
+}
+
+/* returns bucket that value belongs to - in old table if it was not moved yet */
+static inline ASHashBucket *
+get_ashash_bucket (const ASHashTable * hash, ASHashableValue value, Bool *in_old)
+{
+	ASHashKey     key;
+
+	*in_old = False;
+	if (hash->old_buckets)
+	{
+		key = hash->hash_func (value, hash->old_size);
+		if (key >= hash->old_size)
+			return NULL;
+		if (key >= hash->rehash_pos)
+		{
+			*in_old = True;
+			return &(hash->old_buckets[key]);
+		}
+	}
+	key = hash->hash_func (value, hash->size);
+	return (key < hash->size) ? &(hash->buckets[key]) : NULL;
+}
+
+/***** Open addressing *****/
+
+static inline ASHashItem *
+find_ashash_slot (const ASHashTable * hash, ASHashableValue value, ASHashItem **free_slot)
+{
+	ASHashKey     key = hash->hash_func (value, hash->size);
+	ASHashKey     i;
+
+	if (free_slot)
+		*free_slot = NULL;
+	if (key >= hash->size)
+		return NULL;
+	/* most of our hash functions yield runs of adjacent keys, which linear
+	 * probing turns into long clusters - scattering them first : */
+	key = (ASHashKey)(((CARD32)key * ASHASH_SCATTER_MULT) % hash->size);
+	for (i = 0; i < hash->size; ++i)
+	{
+		register ASHashItem *slot = &(hash->slots[key]);
+
+		if (slot->next == ASHASH_SLOT_EMPTY)
+		{
+			if (free_slot && *free_slot == NULL)
+				*free_slot = slot;
+			break;
+		}
+		if (slot->next == ASHASH_SLOT_USED)
+		{
+			if (hash->compare_func (slot->value, value) == 0)
+				return slot;
+		}else if (free_slot && *free_slot == NULL)
+			*free_slot = slot;
+		if (++key >= hash->size)
+			key = 0;
+	}
+	return NULL;
+}
+
+static void open_ashash2chained (ASHashTable * hash);
+
+/* rebuilds slots array dropping removed slots, and growing it if needed */
+static void
+rehash_open_ashash (ASHashTable * hash)
+{
+	ASHashItem   *old_slots = hash->slots;
+	ASHashKey     old_size = hash->size;
+	unsigned int  new_size = old_size;
+	ASHashKey     i;
+
+	while ((hash->items_num + 1) * 2 > new_size && new_size < ASHASH_MAX_SIZE)
+		new_size = new_size * 2 + 1;
+	if (new_size > ASHASH_MAX_SIZE)
+		new_size = ASHASH_MAX_SIZE;
+	if ((hash->items_num + 1) * 4 > new_size * 3)
+	{	/* out of keys - chaining will have to do */
+		open_ashash2chained (hash);
+		return;
+	}
+	LOCAL_DEBUG_OUT( "hash %p: %ld items - rehashing from %d to %d slots", hash, hash->items_num, old_size, new_size );
+	hash->slots = safecalloc (new_size, sizeof (ASHashItem));
+	hash->size = new_size;
+	hash->slots_used = 0;
+	hash->most_recent = NULL;
+	for (i = 0; i < old_size; ++i)
+		if (old_slots[i].next == ASHASH_SLOT_USED)
+		{
+			ASHashItem   *slot;
+
+			find_ashash_slot (hash, old_slots[i].value, &slot);
+			*slot = old_slots[i];
+			hash->slots_used++;
+		}
+	free (old_slots);
+}
+
+static void
+open_ashash2chained (ASHashTable * hash)
+{
+	ASHashItem   *slots = hash->slots;
+	ASHashKey     i, size = hash->size;
+
+	LOCAL_DEBUG_OUT( "hash %p: %ld items - switching to chaining", hash, hash->items_num );
+	clear_flags (hash->flags, ASHASH_OPEN_ADDRESSING);
+	hash->slots = NULL;
+	hash->slots_used = 0;
+	hash->buckets = safecalloc (size, sizeof (ASHashBucket));
+	hash->buckets_used = 0;
+	hash->most_recent = NULL;
+	for (i = 0; i < size; ++i)
+		if (slots[i].next == ASHASH_SLOT_USED)
+		{
+			ASHashItem   *item = safecalloc (1, sizeof (ASHashItem));
+			ASHashKey     key = hash->hash_func (slots[i].value, size);
+
+			item->value = slots[i].value;
+			item->data = slots[i].data;
+			if (hash->buckets[key] == NULL)
+				hash->buckets_used++;
+			add_item_to_bucket (&(hash->buckets[key]), item, hash->compare_func);
+		}
+	free (slots);
+}
+
+static ASHashResult
+add_open_hash_item (ASHashTable * hash, ASHashableValue value, void *data)
+{
+	ASHashItem   *slot, *free_slot;
+
+	if (hash->hash_func (value, hash->size) >= hash->size)
+        return ASH_BadParameter;
+	if ((slot = find_ashash_slot (hash, value, &free_slot)) != NULL)
+		return (slot->data == data) ? ASH_ItemExistsSame : ASH_ItemExistsDiffer;
+
+	if (free_slot == NULL || (free_slot->next == ASHASH_SLOT_EMPTY &&
+							  ((unsigned long)hash->slots_used + 1) * 4 > (unsigned long)hash->size * 3))
+	{
+		if (get_flags (hash->flags, ASHASH_FIXED_SIZE))
+		{	/* leaving at least one empty slot */
+			if (free_slot == NULL || (free_slot->next == ASHASH_SLOT_EMPTY &&
+									  hash->slots_used + 1 >= hash->size))
+				return ASH_BadParameter;
+		}else
+		{
+			rehash_open_ashash (hash);
+			if (!IS_OPEN_ASHASH(hash))
+				return add_hash_item (hash, value, data);
+			find_ashash_slot (hash, value, &free_slot);
+		}
+	}
+	if (free_slot->next == ASHASH_SLOT_EMPTY)
+		hash->slots_used++;
+	free_slot->next = ASHASH_SLOT_USED;
+	free_slot->value = value;
+	free_slot->data = data;
+	hash->most_recent = free_slot;
+	hash->items_num++;
+	hash->buckets_used = hash->items_num;
+	return ASH_Success;
+}
+
+static void
+remove_open_hash_slot (ASHashTable * hash, ASHashItem * slot, Bool destroy, Bool keep_data)
+{
+	if (hash->most_recent == slot)
+		hash->most_recent = NULL;
+	if (hash->item_destroy_func && destroy)
+		hash->item_destroy_func (slot->value, keep_data ? NULL : slot->data);
+	slot->value = 0;
+	slot->data = NULL;
+	/* no need for a marker if probing would stop here anyway */
+	{
+		ASHashKey     next = (slot - hash->slots) + 1;
+
+		if (next >= hash->size)
+			next = 0;
+		if (hash->slots[next].next == ASHASH_SLOT_EMPTY)
+		{
+			slot->next = ASHASH_SLOT_EMPTY;
+			hash->slots_used--;
+		}else
+			slot->next = ASHASH_SLOT_REMOVED;
+	}
+	hash->items_num--;
+	hash->buckets_used = hash->items_num;
+}
+
+/***** Generic functionality *****/
+
 void
 flush_ashash (ASHashTable * hash)
 {
@@ -141,9 +452,33 @@ LOCAL_DEBUG_CALLER_OUT( " hash = %p", hash  );
 	if (hash)
 	{
 		register int  i = hash->size;
-		while( --i >= 0 )
-			if (hash->buckets[i])
-				destroy_ashash_bucket (&(hash->buckets[i]), hash->item_destroy_func);
+
+		if (IS_OPEN_ASHASH(hash))
+		{
+			while( --i >= 0 )
+			{
+				if (hash->slots[i].next == ASHASH_SLOT_USED && hash->item_destroy_func)
+					hash->item_destroy_func (hash->slots[i].value, hash->slots[i].data);
+			}
+			memset (hash->slots, 0x00, hash->size * sizeof (ASHashItem));
+			hash->slots_used = 0 ;
+		}else
+		{
+			while( --i >= 0 )
+				if (hash->buckets[i])
+					destroy_ashash_bucket (&(hash->buckets[i]), hash->item_destroy_func);
+			if (hash->old_buckets)
+			{
+				i = hash->old_size;
+				while( --i >= (int)hash->rehash_pos )
+					if (hash->old_buckets[i])
+						destroy_ashash_bucket (&(hash->old_buckets[i]), hash->item_destroy_func);
+				free (hash->old_buckets);
+				hash->old_buckets = NULL;
+				hash->old_size = 0;
+				hash->rehash_pos = 0;
+			}
+		}
 		hash->items_num = 0 ;
 		hash->buckets_used = 0 ;
 		hash->most_recent = NULL ;
@@ -163,27 +498,6 @@ LOCAL_DEBUG_CALLER_OUT( " hash = %p, *hash = %p", hash, *hash  );
 	}
 }
 
-static        ASHashResult
-add_item_to_bucket (ASHashBucket * bucket, ASHashItem * item, long (*compare_func) (ASHashableValue, ASHashableValue))
-{
-	ASHashItem  **tmp;
-
-	/* first check if we already have this item */
-	for (tmp = bucket; *tmp != NULL; tmp = &((*tmp)->next))
-	{
-		register long res = compare_func ((*tmp)->value, item->value);
-
-		if (res == 0)
-			return ((*tmp)->data == item->data) ? ASH_ItemExistsSame : ASH_ItemExistsDiffer;
-		else if (res > 0)
-			break;
-	}
-	/* now actually add this item */
-	item->next = (*tmp);
-	*tmp = item;
-	return ASH_Success;
-}
-
 #ifdef DEBUG_ALLOCS
 #undef add_hash_item
 #undef safecalloc
@@ -203,14 +517,19 @@ check_hash_item_reused (ASHashItem *item)
 ASHashResult
 add_hash_item (ASHashTable * hash, ASHashableValue value, void *data)
 {
-	ASHashKey     key;
+	ASHashBucket *bucket;
 	ASHashItem   *item;
 	ASHashResult  res;
+	Bool          in_old;
 
 	if (hash == NULL)
         return ASH_BadParameter;
-	key = hash->hash_func (value, hash->size);
-	if (key >= hash->size)
+	if (IS_OPEN_ASHASH(hash))
+		return add_open_hash_item (hash, value, data);
+
+	if (hash->old_buckets)
+		rehash_ashash_step (hash, ASHASH_REHASH_STEP);
+	if ((bucket = get_ashash_bucket (hash, value, &in_old)) == NULL)
         return ASH_BadParameter;
 
 #ifndef DEBUG_ALLOCS
@@ -226,13 +545,17 @@ add_hash_item (ASHashTable * hash, ASHashableValue value, void *data)
 	item->value = value;
 	item->data = data;
 
-	res = add_item_to_bucket (&(hash->buckets[key]), item, hash->compare_func);
+	res = add_item_to_bucket (bucket, item, hash->compare_func);
 	if (res == ASH_Success)
 	{
 		hash->most_recent = item ;
 		hash->items_num++;
-		if (hash->buckets[key]->next == NULL)
+		if ((*bucket)->next == NULL && !in_old)
 			hash->buckets_used++;
+		if (hash->old_buckets == NULL && hash->size < ASHASH_MAX_SIZE &&
+			!get_flags (hash->flags, ASHASH_FIXED_SIZE) &&
+			hash->items_num > (unsigned long)hash->size * ASHASH_MAX_CHAIN)
+			grow_chained_ashash (hash);
 	} else
 		free_ashash_item(item);
 	return res;
@@ -249,6 +572,21 @@ print_ashash (ASHashTable * hash, void (*item_print_func) (ASHashableValue value
 	register int  i;
 	ASHashItem   *item;
 
+	if (IS_OPEN_ASHASH(hash))
+	{
+		for (i = 0; i < hash->size; i++)
+			if (hash->slots[i].next == ASHASH_SLOT_USED)
+			{
+				fprintf (stderr, "Slot # %d:", i);
+				if (item_print_func)
+					item_print_func (hash->slots[i].value);
+				else
+					fprintf (stderr, "[0x%lX(%ld)]", hash->slots[i].value, hash->slots[i].value);
+				fprintf (stderr, "\n");
+			}
+		return;
+	}
+	finish_ashash_rehash (hash);
 	for (i = 0; i < hash->size; i++)
 	{
 		if (hash->buckets[i] == NULL)
@@ -269,6 +607,21 @@ print_ashash2 (ASHashTable * hash, void (*item_print_func) (ASHashableValue valu
 	register int  i;
 	ASHashItem   *item;
 
+	if (IS_OPEN_ASHASH(hash))
+	{
+		for (i = 0; i < hash->size; i++)
+			if (hash->slots[i].next == ASHASH_SLOT_USED)
+			{
+				fprintf (stderr, "Slot # %d:", i);
+				if (item_print_func)
+					item_print_func (hash->slots[i].value, hash->slots[i].data);
+				else
+					fprintf (stderr, "[0x%lX(%ld):%p]", hash->slots[i].value, hash->slots[i].value, hash->slots[i].data);
+				fprintf (stderr, "\n");
+			}
+		return;
+	}
+	finish_ashash_rehash (hash);
 	for (i = 0; i < hash->size; i++)
 	{
 		if (hash->buckets[i] == NULL)
@@ -307,15 +660,28 @@ find_item_in_bucket (ASHashBucket * bucket,
 ASHashResult
 get_hash_item (const ASHashTable * hash, ASHashableValue value, void **trg)
 {
-	ASHashKey     key;
 	ASHashItem  **pitem = NULL;
 
 	if (hash)
 	{
-		key = hash->hash_func (value, hash->size);
-		if (key < hash->size)
-			pitem = find_item_in_bucket (&(hash->buckets[key]), value, hash->compare_func);
-		LOCAL_DEBUG_OUT ("key = %d, pitem = %p", key, pitem);
+		if (IS_OPEN_ASHASH(hash))
+		{
+			ASHashItem   *slot = find_ashash_slot (hash, value, NULL);
+
+			if (slot == NULL)
+				return ASH_ItemNotExists;
+			if (trg)
+				*trg = slot->data;
+			return ASH_Success;
+		}else
+		{
+			Bool          in_old;
+			ASHashBucket *bucket = get_ashash_bucket (hash, value, &in_old);
+
+			if (bucket)
+				pitem = find_item_in_bucket (bucket, value, hash->compare_func);
+			LOCAL_DEBUG_OUT ("bucket = %p, pitem = %p", bucket, pitem);
+		}
 	}
 	if (pitem)
 		if (*pitem)
@@ -339,14 +705,27 @@ void flush_ashash_memory_pool()
 ASHashResult
 remove_hash_item (ASHashTable * hash, ASHashableValue value, void **trg, Bool destroy)
 {
-	ASHashKey     key = 0;
+	ASHashBucket *bucket = NULL;
 	ASHashItem  **pitem = NULL;
+	Bool          in_old = False;
 
 	if (hash)
 	{
-		key = hash->hash_func (value, hash->size);
-		if (key < hash->size)
-			pitem = find_item_in_bucket (&(hash->buckets[key]), value, hash->compare_func);
+		if (IS_OPEN_ASHASH(hash))
+		{
+			ASHashItem   *slot = find_ashash_slot (hash, value, NULL);
+
+			if (slot == NULL)
+				return ASH_ItemNotExists;
+			if (trg)
+				*trg = slot->data;
+			remove_open_hash_slot (hash, slot, destroy, (trg != NULL));
+			return ASH_Success;
+		}
+		if (hash->old_buckets)
+			rehash_ashash_step (hash, ASHASH_REHASH_STEP);
+		if ((bucket = get_ashash_bucket (hash, value, &in_old)) != NULL)
+			pitem = find_item_in_bucket (bucket, value, hash->compare_func);
 	}
 	if (pitem)
 		if (*pitem)
@@ -366,7 +745,7 @@ remove_hash_item (ASHashTable * hash, ASHashableValue value, void **trg, Bool de
 			free_ashash_item(*pitem);
 
             *pitem = next;
-			if (hash->buckets[key] == NULL)
+			if (*bucket == NULL && !in_old)
 				hash->buckets_used--;
 			hash->items_num--;
 
@@ -375,53 +754,57 @@ remove_hash_item (ASHashTable * hash, ASHashableValue value, void **trg, Bool de
 	return ASH_ItemNotExists;
 }
 
+static long (*sort_compare_func) (ASHashableValue, ASHashableValue) = NULL;
+
+static int
+compare_sorted_slots (const void *p1, const void *p2)
+{
+	long res = sort_compare_func ((*(ASHashItem**)p1)->value, (*(ASHashItem**)p2)->value);
+
+	return (res > 0) ? 1 : ((res < 0) ? -1 : 0);
+}
+
+/* items are collected and sorted at once, as merging sorted buckets costs
+ * O(items*buckets), which gets prohibitive once tables grow */
 unsigned long
 sort_hash_items (ASHashTable * hash, ASHashableValueBase * values, void **data, unsigned long max_items)
 {
-	if (hash)
-	{
-		ASHashBucket *buckets;
-		register ASHashKey i;
-		ASHashKey     k = 0, top = hash->buckets_used - 1, bottom = 0;
-		unsigned long count_in = 0;
+	ASHashItem  **sorted;
+	unsigned long count = 0, i;
 
-		if (hash->buckets_used == 0 || hash->items_num == 0)
-			return 0;
+	if (hash == NULL || hash->items_num == 0)
+		return 0;
+	if (max_items == 0 || max_items > hash->items_num)
+		max_items = hash->items_num;
 
-		if (max_items == 0)
-			max_items = hash->items_num;
+	sorted = safemalloc (hash->items_num * sizeof (ASHashItem*));
+	if (IS_OPEN_ASHASH(hash))
+	{
+		for (i = 0; i < hash->size; ++i)
+			if (hash->slots[i].next == ASHASH_SLOT_USED)
+				sorted[count++] = &(hash->slots[i]);
+	}else
+	{
+		ASHashItem   *item;
 
-		buckets = safecalloc (hash->buckets_used, sizeof (ASHashBucket));
-		for (i = 0; i < hash->size; i++)
-			if (hash->buckets[i])
-				buckets[k++] = hash->buckets[i];
-		while (max_items-- > 0)
-		{
-			k = bottom;
-			for (i = bottom + 1; i <= top; i++)
-			{
-				if (buckets[i])
-					if (hash->compare_func (buckets[k]->value, buckets[i]->value) > 0)
-						k = i;
-			}
-            if (values)
-				*(values++) = buckets[k]->value;
-			if (data)
-				*(data++) = buckets[k]->data;
-			count_in++;
-			buckets[k] = buckets[k]->next;
-			/* a little optimization : */
-			while (buckets[bottom] == NULL && bottom < top)
-				bottom++;
-			while (buckets[top] == NULL && top > bottom)
-				top--;
-			if( buckets[top] == NULL )
-				break;
-		}
-		free (buckets);
-		return count_in;
+		finish_ashash_rehash (hash);
+		for (i = 0; i < hash->size; ++i)
+			for (item = hash->buckets[i]; item != NULL; item = item->next)
+				sorted[count++] = item;
 	}
-	return 0;
+	sort_compare_func = hash->compare_func;
+	qsort (sorted, count, sizeof (ASHashItem*), compare_sorted_slots);
+	if (max_items > count)
+		max_items = count;
+	for (i = 0; i < max_items; ++i)
+	{
+		if (values)
+			*(values++) = sorted[i]->value;
+		if (data)
+			*(data++) = sorted[i]->data;
+	}
+	free (sorted);
+	return max_items;
 }
 
 unsigned long
@@ -429,7 +812,26 @@ list_hash_items (ASHashTable * hash, ASHashableValueBase * values, void **data,
 {
 	unsigned long count_in = 0;
 
+	if (hash && IS_OPEN_ASHASH(hash))
+	{
+		ASHashKey     i;
+
+		if (max_items == 0)
+			max_items = hash->items_num;
+		for (i = 0; i < hash->size && count_in < max_items; i++)
+			if (hash->slots[i].next == ASHASH_SLOT_USED)
+			{
+				if (values)
+					*(values++) = hash->slots[i].value;
+				if (data)
+					*(data++) = hash->slots[i].data;
+				++count_in;
+			}
+		return count_in;
+	}
 	if (hash)
+	{
+		finish_ashash_rehash (hash);
 		if (hash->buckets_used > 0 && hash->items_num > 0)
 		{
 			register ASHashItem *item;
@@ -449,11 +851,29 @@ list_hash_items (ASHashTable * hash, ASHashableValueBase * values, void **data,
 						return count_in;
 				}
 		}
+	}
 	return count_in;
 }
 
 /***** Iterator functionality *****/
 
+static Bool
+next_open_hash_slot (ASHashIterator * iterator, int i)
+{
+	ASHashTable  *hash = iterator->hash;
+
+	for (; i < hash->size; i++)
+		if (hash->slots[i].next == ASHASH_SLOT_USED)
+		{
+			iterator->curr_bucket = i;
+			iterator->curr_slot = &(hash->slots[i]);
+			return True;
+		}
+	iterator->curr_bucket = hash->size;
+	iterator->curr_slot = NULL;
+	return False;
+}
+
 Bool
 start_hash_iteration (ASHashTable * hash, ASHashIterator * iterator)
 {
@@ -461,6 +881,13 @@ start_hash_iteration (ASHashTable * hash, ASHashIterator * iterator)
 	{
 		register int  i;
 
+		if (IS_OPEN_ASHASH(hash))
+		{
+			iterator->hash = hash;
+			iterator->curr_item = &(iterator->curr_slot);
+			return next_open_hash_slot (iterator, 0);
+		}
+		finish_ashash_rehash (hash);
 		for (i = 0; i < hash->size; i++)
 			if (hash->buckets[i] != NULL)
 				break;
@@ -483,6 +910,9 @@ next_hash_item (ASHashIterator * iterator)
 		{
             ASHashItem **curr = iterator->curr_item;
 
+			if (IS_OPEN_ASHASH(iterator->hash))
+				return next_open_hash_slot (iterator, iterator->curr_bucket + 1);
+
             if( *curr )
                 curr = &((*curr)->next) ;
 
@@ -515,6 +945,15 @@ remove_curr_hash_item (ASHashIterator * iterator, Bool destroy)
 		{
             ASHashItem *removed = *(iterator->curr_item);
 
+			if (IS_OPEN_ASHASH(iterator->hash))
+			{
+				if (removed)
+				{
+					remove_open_hash_slot (iterator->hash, removed, destroy, False);
+					iterator->curr_slot = NULL;
+				}
+				return;
+			}
             if(removed)
             {
                 ASHashTable *hash = iterator->hash ;
@@ -561,18 +1000,15 @@ curr_hash_data (ASHashIterator * iterator)
 /************************************************************************/
 ASHashKey pointer_hash_value (ASHashableValue value, ASHashKey hash_size)
 {
-    union
-    {
-        void *ptr;
-        ASHashKey key[2];
-    } mix;
-    register  ASHashKey key;
+	/* low bits are alignment, and all of the high bits have to be mixed in
+	 * so that large tables get more then 4096 distinct keys */
+	register unsigned long key = ((unsigned long)value)>>4;
 
-    mix.ptr = (void*)value;
-    key = mix.key[0]^mix.key[1] ;
+	key ^= (key>>16)>>16;		/* no-op with 32bit longs */
+	key ^= key>>16;
     if( hash_size == 256 )
-		return (key>>4)&0x0FF;
-    return (key>>4) % hash_size;
+		return (key^(key>>8))&0x0FF;
+    return key % hash_size;
 }
 
 /* case sensitive strings hash */
@@ -809,3 +1245,136 @@ color_hash_value (ASHashableValue value, ASHashKey hash_size)
 	}
 	return (ASHashKey) (h % (CARD32) hash_size);
 }
+
+#ifdef TEST_ASHASH
+/* checks all three flavours against each other and times them :
+ * fixed size chaining ( as it was before tables learned to grow ),
+ * chaining with incremental rehashing, and open addressing */
+#include <sys/time.h>
+
+static double
+time_passed (struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static char **test_strings = NULL;
+
+static ASHashTable *
+create_test_hash (int flavour, Bool strings)
+{
+	static ASFlagType flags[3] = { ASHASH_FIXED_SIZE, 0, ASHASH_OPEN_ADDRESSING };
+
+	if (strings)
+		return create_ashash_ext (0, string_hash_value, string_compare, NULL, flags[flavour]);
+	return create_ashash_ext (0, pointer_hash_value, NULL, NULL, flags[flavour]);
+}
+
+static int
+check_hash (int flavour, Bool strings, int count)
+{
+	ASHashTable  *hash = create_test_hash (flavour, strings);
+	ASHashIterator i;
+	ASHashableValueBase *values;
+	int           k, errors = 0;
+	void         *data;
+#define TEST_KEY(k)	(strings ? (ASHashableValueBase)test_strings[k] : (ASHashableValueBase)(0x8000000UL + (k)*48))
+
+	for (k = 0; k < count; ++k)
+		if (add_hash_item (hash, TEST_KEY(k), (void*)(long)(k+1)) != ASH_Success)
+			++errors;
+	if (add_hash_item (hash, TEST_KEY(0), (void*)1) != ASH_ItemExistsSame)
+		++errors;
+	for (k = 0; k < count; k += 2)
+		if (remove_hash_item (hash, TEST_KEY(k), NULL, False) != ASH_Success)
+			++errors;
+	for (k = 0; k < count; ++k)
+	{
+		ASHashResult  res = get_hash_item (hash, TEST_KEY(k), &data);
+
+		if ((k&1) ? (res != ASH_Success || data != (void*)(long)(k+1)) : (res != ASH_ItemNotExists))
+			++errors;
+	}
+	if (hash->items_num != count / 2)
+		++errors;
+	k = 0;
+	if (start_hash_iteration (hash, &i))
+		do
+		{
+			if ((long)curr_hash_data (&i) & 0x01)
+				++errors;				/* removed item came back */
+			++k;
+		}while (next_hash_item (&i));
+	if (k != count / 2)
+		++errors;
+	values = safecalloc (count, sizeof (ASHashableValueBase));
+	if (sort_hash_items (hash, values, NULL, 0) != count / 2)
+		++errors;
+	for (k = 1; k < count / 2; ++k)
+		if (hash->compare_func (values[k - 1], values[k]) >= 0)
+			++errors;
+	free (values);
+	destroy_ashash (&hash);
+	return errors;
+#undef TEST_KEY
+}
+
+static void
+time_hash (int flavour, Bool strings, int count, int lookups)
+{
+	ASHashTable  *hash = create_test_hash (flavour, strings);
+	struct timeval start;
+	double        add_time, get_time, remove_time;
+	int           k, r;
+	void         *data;
+	static char  *names[3] = { "fixed chained", "growing chained", "open addressing" };
+#define TEST_KEY(k)	(strings ? (ASHashableValueBase)test_strings[k] : (ASHashableValueBase)(0x8000000UL + (k)*48))
+
+	gettimeofday (&start, NULL);
+	for (k = 0; k < count; ++k)
+		add_hash_item (hash, TEST_KEY(k), (void*)(long)(k+1));
+	add_time = time_passed (&start);
+	gettimeofday (&start, NULL);
+	for (r = 0; r < lookups; ++r)
+		for (k = 0; k < count; ++k)
+			get_hash_item (hash, TEST_KEY((k*7919)%count), &data);
+	get_time = time_passed (&start);
+	gettimeofday (&start, NULL);
+	for (k = 0; k < count; ++k)
+		remove_hash_item (hash, TEST_KEY(k), NULL, False);
+	remove_time = time_passed (&start);
+	printf ("%7d %s keys, %-16s: add %8.2fms, %dx get %8.2fms, remove %8.2fms\n",
+			count, strings ? "string " : "pointer", names[flavour], add_time, lookups, get_time, remove_time);
+	destroy_ashash (&hash);
+#undef TEST_KEY
+}
+
+int
+main (int argc, char **argv)
+{
+	static int    counts[] = { 100, 1000, 10000, 50000 };
+	int           c, f, k, errors = 0;
+	Bool          strings;
+
+	test_strings = safecalloc (counts[3], sizeof (char*));
+	for (k = 0; k < counts[3]; ++k)
+	{
+		test_strings[k] = safemalloc (32);
+		sprintf (test_strings[k], "window_%d_%x", k, k * 2654435761U);
+	}
+	for (strings = False; strings <= True; ++strings)
+		for (f = 0; f < 3; ++f)
+			for (c = 0; c < 4; ++c)
+				errors += check_hash (f, strings, counts[c]);
+	printf ("consistency check : %d errors\n", errors);
+
+	for (strings = False; strings <= True; ++strings)
+		for (c = 0; c < 4; ++c)
+			for (f = 0; f < 3; ++f)
+				time_hash (f, strings, counts[c], counts[c] < 10000 ? 100 : (counts[c] < 50000 ? 10 : 1));
+	return (errors == 0) ? 0 : 1;
+}
+#endif
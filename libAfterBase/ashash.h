@@ -68,14 +68,34 @@ typedef struct ASHashTable
     ASHashKey (*hash_func) (ASHashableValue value, ASHashKey hash_size);
   long (*compare_func) (ASHashableValue value1, ASHashableValue value2);
   void (*item_destroy_func) (ASHashableValue value, void *data);
+
+#define ASHASH_OPEN_ADDRESSING	(0x01<<0)	/* no buckets - items are stored in slots
+											 * array and collisions are probed linearly */
+#define ASHASH_FIXED_SIZE		(0x01<<1)	/* never resize the table */
+  ASFlagType flags ;
+
+  /* chained tables grow once there are more then ASHASH_MAX_CHAIN items per
+   * bucket. Items are moved into new buckets a few buckets at a time on
+   * every add/remove. Items from old buckets below rehash_pos were
+   * already moved : */
+  ASHashBucket *old_buckets;
+  ASHashKey old_size;
+  unsigned int rehash_pos;
+
+  /* open addressing tables grow once used slots exceed 3/4 of size : */
+  ASHashItem *slots;
+  ASHashKey slots_used;			/* including removed ones */
 }
 ASHashTable;
 
+#define ASHASH_MAX_CHAIN		2
+
 typedef struct ASHashIterator
 {
   ASHashKey curr_bucket;
   ASHashItem **curr_item;
   ASHashTable *hash;
+  ASHashItem *curr_slot;		/* used with open addressing tables */
 }
 ASHashIterator;
 
@@ -91,6 +111,13 @@ ASHashTable *create_ashash (ASHashKey size,
                 ASHashKey (*hash_func) (ASHashableValue,ASHashKey),
                 long (*compare_func) (ASHashableValue,  ASHashableValue),
                 void (*item_destroy_func) (ASHashableValue,void *));
+/* same as above, but flags can request open addressing ( cache-friendly for
+ * tables that are mostly looked up and seldom iterated ), or fixed size */
+ASHashTable *create_ashash_ext (ASHashKey size,
+                ASHashKey (*hash_func) (ASHashableValue,ASHashKey),
+                long (*compare_func) (ASHashableValue,  ASHashableValue),
+                void (*item_destroy_func) (ASHashableValue,void *),
+                ASFlagType flags);
 void print_ashash (ASHashTable * hash,
 		   	void (*item_print_func) (ASHashableValue value));
 void print_ashash2 (ASHashTable * hash,
@@ -135,6 +162,7 @@ unsigned long list_hash_items (ASHashTable * hash, ASHashableValueBase * values,
 			       void **data, unsigned long max_items);
 
 
+/* adding items to the table may resize it, so don't do it while iterating */
 Bool start_hash_iteration (ASHashTable * hash, ASHashIterator * iterator);
 Bool next_hash_item (ASHashIterator * iterator);
 ASHashableValue curr_hash_value (ASHashIterator * iterator);
@@ -0,0 +1,722 @@
+/*
+ * Copyright (c) 2026 The AfterStep Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#undef LOCAL_DEBUG
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>							/* for writev() */
+
+#include "astypes.h"
+#include "output.h"
+#include "safemalloc.h"
+#include "ashash.h"
+#include "outqueue.h"
+
+#define PREALLOCED_PACKETS_NUM		256
+#define PREALLOCED_PACKET_DATA_LEN	128
+#define MIN_OUTPUT_QUEUE_SIZE		16
+#define MAX_WRITEV_IOVECS			64
+
+static CARD8 _as_prealloced_packet_data[PREALLOCED_PACKETS_NUM][PREALLOCED_PACKET_DATA_LEN];
+static ASOutputPacket _as_prealloced_packets[PREALLOCED_PACKETS_NUM];
+static ASOutputPacket *_as_free_packets = NULL;
+static Bool _as_prealloced_init = False;
+
+ASOutputPacket *
+create_output_packet (const void *data, int size)
+{
+	ASOutputPacket *packet;
+
+	if (!_as_prealloced_init)
+	{
+		int i = PREALLOCED_PACKETS_NUM;
+
+		while (--i >= 0)
+		{
+			_as_prealloced_packets[i].data = &_as_prealloced_packet_data[i][0];
+			_as_prealloced_packets[i].prealloced_idx = i + 1;
+			_as_prealloced_packets[i].next_free = _as_free_packets;
+			_as_free_packets = &_as_prealloced_packets[i];
+		}
+		_as_prealloced_init = True;
+	}
+	if (size <= PREALLOCED_PACKET_DATA_LEN && _as_free_packets != NULL)
+	{
+		packet = _as_free_packets;
+		_as_free_packets = packet->next_free;
+		packet->next_free = NULL;
+	} else
+	{
+		packet = safemalloc (sizeof (ASOutputPacket) + size);
+		packet->next_free = NULL;
+		packet->data = (CARD8 *) (packet + 1);
+		packet->prealloced_idx = 0;
+	}
+	packet->size = size;
+	packet->ref_count = 1;
+	memcpy (packet->data, data, size);
+	return packet;
+}
+
+void
+release_output_packet (ASOutputPacket *packet)
+{
+	if (--(packet->ref_count) > 0)
+		return;
+	if (packet->prealloced_idx == 0)
+		free (packet);
+	else
+	{
+		packet->next_free = _as_free_packets;
+		_as_free_packets = packet;
+	}
+}
+
+/* Position of the last queued packet for each state slot of the key : */
+typedef struct ASPendingState
+{
+	ASFlagType queued;						/* bit per state slot */
+	CARD32     seq[OUTPUT_QUEUE_MAX_STATES];
+}ASPendingState;
+
+static void
+destroy_pending_state (ASHashableValue value, void *data)
+{
+	if (data)
+		free (data);
+}
+
+static inline ASOutputQueueEntry *
+output_queue_entry (ASOutputQueue *q, int offset)
+{
+	return &(q->entries[(q->head + offset) & (q->size - 1)]);
+}
+
+static ASPendingState *
+supersede_pending_state (ASOutputQueue *q, ASHashableValue key, int state)
+{
+	ASPendingState *pending = NULL;
+
+	if (q->pending_states == NULL)
+		q->pending_states = create_ashash (0, NULL, NULL, destroy_pending_state);
+	if (get_hash_item (q->pending_states, key, (void **) &pending) != ASH_Success)
+	{
+		pending = safecalloc (1, sizeof (ASPendingState));
+		add_hash_item (q->pending_states, key, pending);
+	} else if (get_flags (pending->queued, 0x01 << state))
+	{
+		CARD32 offset = pending->seq[state] - q->seq;
+
+		/* it could have been sent already, or be halfway through */
+		if (offset < (CARD32) q->used)
+		{
+			ASOutputQueueEntry *old = output_queue_entry (q, offset);
+
+			if (old->packet != NULL && old->done == 0)
+			{
+				LOCAL_DEBUG_OUT ("dropping superseded packet %p, state %d", old->packet, state);
+				release_output_packet (old->packet);
+				old->packet = NULL;
+				++(q->dropped);
+			}
+		}
+	}
+	set_flags (pending->queued, 0x01 << state);
+	return pending;
+}
+
+void
+output_queue_barrier (ASOutputQueue *q, ASHashableValue key, ASFlagType states)
+{
+	ASPendingState *pending = NULL;
+
+	if (q->pending_states == NULL)
+		return;
+	if (get_flags (states, OUTPUT_QUEUE_ALL_STATES) == OUTPUT_QUEUE_ALL_STATES)
+		remove_hash_item (q->pending_states, key, NULL, True);
+	else if (get_hash_item (q->pending_states, key, (void **) &pending) == ASH_Success)
+		clear_flags (pending->queued, states);
+}
+
+/* moves live entries over the holes left by superseded ones, keeping
+ * their order, and updating positions of the pending states */
+static void
+compact_output_queue (ASOutputQueue *q)
+{
+	int i, k = 0;
+
+	for (i = 0; i < q->used; ++i)
+	{
+		ASOutputQueueEntry *curr = output_queue_entry (q, i);
+		ASPendingState *pending = NULL;
+
+		if (curr->packet == NULL)
+			continue;
+		if (k < i)
+		{
+			if (curr->state >= 0 && q->pending_states &&
+				get_hash_item (q->pending_states, AS_HASHABLE (curr->key), (void **) &pending) == ASH_Success &&
+				pending->seq[curr->state] == q->seq + i)
+				pending->seq[curr->state] = q->seq + k;
+			*output_queue_entry (q, k) = *curr;
+			curr->packet = NULL;
+		}
+		++k;
+	}
+	LOCAL_DEBUG_OUT ("squeezed %d superseded entries out of %d", q->used - k, q->used);
+	q->used = k;
+	q->dropped = 0;
+}
+
+void
+append_output_queue (ASOutputQueue *q, ASOutputPacket *packet, ASHashableValue key, int state)
+{
+	ASOutputQueueEntry *elem;
+	ASPendingState *pending = NULL;
+
+	if (state >= OUTPUT_QUEUE_MAX_STATES)
+		state = -1;
+	if (state >= 0)
+		pending = supersede_pending_state (q, key, state);
+
+	/* reclaiming holes, if that frees at least half of the ring */
+	if (q->used >= q->size && q->dropped > 0 && q->dropped * 2 >= q->used)
+		compact_output_queue (q);
+	if (q->used >= q->size)
+	{
+		/* unwrapping the ring into the bigger array */
+		int new_size = q->size * 2;
+		ASOutputQueueEntry *new_entries;
+		int i;
+
+		if (new_size < MIN_OUTPUT_QUEUE_SIZE)
+			new_size = MIN_OUTPUT_QUEUE_SIZE;
+		new_entries = safemalloc (new_size * sizeof (ASOutputQueueEntry));
+		for (i = 0; i < q->used; ++i)
+			new_entries[i] = *output_queue_entry (q, i);
+		if (q->entries)
+			free (q->entries);
+		q->entries = new_entries;
+		q->size = new_size;
+		q->head = 0;
+	}
+	elem = output_queue_entry (q, q->used);
+	elem->packet = packet;
+	elem->done = 0;
+	elem->state = state;
+	elem->key = key;
+	if (pending)
+		pending->seq[state] = q->seq + q->used;
+	++(packet->ref_count);
+	++(q->used);
+	LOCAL_DEBUG_OUT ("packet %p: size = %d, refs = %d, queued %d", packet, packet->size, packet->ref_count, q->used);
+}
+
+static void
+output_queue_pop (ASOutputQueue *q)
+{
+	if (q->used > 0)
+	{
+		ASOutputQueueEntry *elem = &(q->entries[q->head]);
+
+		if (elem->packet)
+			release_output_packet (elem->packet);
+		else
+			--(q->dropped);
+		elem->packet = NULL;
+		q->head = (q->head + 1) & (q->size - 1);
+		--(q->used);
+		++(q->seq);
+	}
+}
+
+int
+flush_output_queue (ASOutputQueue *q, int fd)
+{
+	struct iovec iov[MAX_WRITEV_IOVECS];
+
+	while (q->used > 0)
+	{
+		int iov_num = 0;
+		int bytes_to_write = 0;
+		int bytes_written = 0;
+		Bool short_write;
+		int i;
+
+		/* gathering as much of the queue as we can into a single writev(),
+		 * skipping superseded entries */
+		for (i = 0; iov_num < MAX_WRITEV_IOVECS && i < q->used; ++i)
+		{
+			ASOutputQueueEntry *curr = output_queue_entry (q, i);
+
+			if (curr->packet == NULL)
+				continue;
+			iov[iov_num].iov_base = &(curr->packet->data[curr->done]);
+			iov[iov_num].iov_len = curr->packet->size - curr->done;
+			bytes_to_write += iov[iov_num].iov_len;
+			++iov_num;
+		}
+		if (iov_num > 0)
+			bytes_written = writev (fd, iov, iov_num);
+		LOCAL_DEBUG_OUT ("wrote %d bytes of %d in %d packets into fd %d", bytes_written, bytes_to_write, iov_num, fd);
+
+		/* the write returns EWOULDBLOCK or EAGAIN if the pipe is full.
+		 * (This is non-blocking I/O). SunOS returns EWOULDBLOCK, OSF/1
+		 * returns EAGAIN under these conditions. */
+		if (bytes_written < 0)
+			return (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		/* short write means the pipe is full - no point trying again now */
+		short_write = (bytes_written < bytes_to_write);
+
+		while (q->used > 0)
+		{
+			ASOutputQueueEntry *curr = &(q->entries[q->head]);
+			int left;
+
+			if (curr->packet == NULL)
+			{
+				output_queue_pop (q);
+				continue;
+			}
+			if (bytes_written <= 0)
+				break;
+			left = curr->packet->size - curr->done;
+			if (bytes_written < left)
+			{
+				curr->done += bytes_written;
+				break;
+			}
+			bytes_written -= left;
+			output_queue_pop (q);
+		}
+		if (short_write)
+			return 0;
+	}
+	if (q->pending_states)
+		flush_ashash (q->pending_states);
+	return 1;
+}
+
+void
+purge_output_queue (ASOutputQueue *q)
+{
+	while (q->used > 0)
+		output_queue_pop (q);
+	if (q->entries)
+		free (q->entries);
+	if (q->pending_states)
+		destroy_ashash (&(q->pending_states));
+	memset (q, 0x00, sizeof (ASOutputQueue));
+}
+
+#ifdef TEST_OUTQUEUE
+/* checks appending to the queue, including wrapping around the ring,
+ * packets shared by several queues getting back to the pool only once
+ * everybody is done with them, and flushing into the socket that accepts
+ * only part of the data at a time */
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#define TEST_PACKETS_NUM	2000
+
+static int
+test_packet_size (int i)
+{
+	/* both pooled and malloced ones, and some that never fit in one write */
+	return ((i % 500) == 499) ? 20000 : 4 + (i * 37) % 300;
+}
+
+static ASOutputPacket *
+make_test_packet (int i)
+{
+	static CARD8 buf[20000];
+	int k, size = test_packet_size (i);
+
+	for (k = 0; k < size; ++k)
+		buf[k] = (CARD8) (i * 7 + k);
+	return create_output_packet (buf, size);
+}
+
+/* reads whatever is available, and checks it against what was sent */
+static int
+test_read_stream (int fd, int max_bytes, int *packet, int *offset)
+{
+	CARD8 buf[4096];
+	int k, errors = 0;
+	int bytes = read (fd, buf, max_bytes < (int) sizeof (buf) ? max_bytes : (int) sizeof (buf));
+
+	for (k = 0; k < bytes; ++k)
+	{
+		if (buf[k] != (CARD8) (*packet * 7 + *offset))
+			++errors;
+		if (++(*offset) >= test_packet_size (*packet))
+		{
+			*offset = 0;
+			++(*packet);
+		}
+	}
+	return errors;
+}
+
+static int
+test_append ()
+{
+	ASOutputQueue q;
+	int i, k, errors = 0;
+
+	memset (&q, 0x00, sizeof (q));
+	for (i = 0; i < TEST_PACKETS_NUM; ++i)
+	{
+		ASOutputPacket *p = make_test_packet (i);
+
+		append_output_queue (&q, p, AS_HASHABLE (0), -1);
+		release_output_packet (p);
+		/* dropping some off the head, so that the ring wraps around */
+		if ((i % 3) == 2)
+		{
+			output_queue_pop (&q);
+			if (q.entries[(q.head - 1) & (q.size - 1)].packet != NULL)
+				++errors;
+		}
+	}
+	if (q.used != TEST_PACKETS_NUM - TEST_PACKETS_NUM / 3 || q.seq != TEST_PACKETS_NUM / 3)
+		++errors;
+	if (q.size < q.used || (q.size & (q.size - 1)) != 0)
+		++errors;
+	for (k = 0; k < q.used; ++k)
+	{
+		ASOutputPacket *p = output_queue_entry (&q, k)->packet;
+
+		i = TEST_PACKETS_NUM / 3 + k;
+		if (p == NULL || p->ref_count != 1 || p->size != test_packet_size (i) || p->data[0] != (CARD8) (i * 7))
+			++errors;
+	}
+	purge_output_queue (&q);
+	if (q.entries != NULL || q.used != 0)
+		++errors;
+	return errors;
+}
+
+static int
+test_shared_packets ()
+{
+	ASOutputQueue q1, q2;
+	ASOutputPacket *small, *large, *next;
+	int fds[2], errors = 0;
+	CARD8 buf[512];
+
+	memset (&q1, 0x00, sizeof (q1));
+	memset (&q2, 0x00, sizeof (q2));
+	small = make_test_packet (0);
+	large = make_test_packet (4);
+	if (small->prealloced_idx == 0 || large->prealloced_idx != 0)
+		++errors;
+	append_output_queue (&q1, small, AS_HASHABLE (0), -1);
+	append_output_queue (&q2, small, AS_HASHABLE (0), -1);
+	append_output_queue (&q1, large, AS_HASHABLE (0), -1);
+	append_output_queue (&q2, large, AS_HASHABLE (0), -1);
+	if (small->ref_count != 3 || large->ref_count != 3)
+		++errors;
+	release_output_packet (small);
+	release_output_packet (large);
+	if (small->ref_count != 2 || large->ref_count != 2)
+		++errors;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return errors + 1;
+	if (flush_output_queue (&q1, fds[0]) != 1 || q1.used != 0)
+		++errors;
+	if (read (fds[1], buf, sizeof (buf)) != small->size + large->size)
+		++errors;
+	if (small->ref_count != 1 || large->ref_count != 1)
+		++errors;
+	/* last reference gone - pooled packet is the first one to be reused */
+	purge_output_queue (&q2);
+	next = make_test_packet (1);
+	if (next != small)
+		++errors;
+	release_output_packet (next);
+	close (fds[0]);
+	close (fds[1]);
+	return errors;
+}
+
+static int
+test_partial_writes ()
+{
+	ASOutputQueue q;
+	int fds[2], sndbuf = 4096;
+	int i, res, errors = 0, would_block = 0, partial = 0;
+	int packet = 0, offset = 0;
+
+	memset (&q, 0x00, sizeof (q));
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return 1;
+	setsockopt (fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+	fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+
+	for (i = 0; i < TEST_PACKETS_NUM; ++i)
+	{
+		ASOutputPacket *p = make_test_packet (i);
+
+		append_output_queue (&q, p, AS_HASHABLE (0), -1);
+		release_output_packet (p);
+	}
+	/* reading odd amounts, so that writes keep ending in the middle of packets */
+	while ((res = flush_output_queue (&q, fds[0])) == 0 && would_block < TEST_PACKETS_NUM * 10)
+	{
+		++would_block;
+		if (q.used > 0 && q.entries[q.head].done > 0)
+			++partial;
+		errors += test_read_stream (fds[1], 1000 + (would_block * 97) % 3000, &packet, &offset);
+	}
+	if (res != 1 || q.used != 0 || would_block == 0 || partial == 0)
+		++errors;
+	while (packet < TEST_PACKETS_NUM)
+	{
+		int last = packet * 10000 + offset;
+
+		errors += test_read_stream (fds[1], 4096, &packet, &offset);
+		if (last == packet * 10000 + offset)
+			break;
+	}
+	if (packet != TEST_PACKETS_NUM || offset != 0)
+		++errors;
+
+	/* peer going away is an error, and nothing gets lost from the queue */
+	close (fds[1]);
+	for (i = 0; i < 4; ++i)
+	{
+		ASOutputPacket *p = make_test_packet (i);
+
+		append_output_queue (&q, p, AS_HASHABLE (0), -1);
+		release_output_packet (p);
+	}
+	if (flush_output_queue (&q, fds[0]) != -1 || q.used != 4)
+		++errors;
+	purge_output_queue (&q);
+	close (fds[0]);
+	printf ("partial writes : %d flushes would block, %d ended mid-packet\n", would_block, partial);
+	return errors;
+}
+
+static int
+compare_test_ids (const void *a, const void *b)
+{
+	return (*(CARD32 *) a < *(CARD32 *) b) ? -1 : (*(CARD32 *) a > *(CARD32 *) b);
+}
+
+/* coalescing tests use 4 byte packets carrying just their id : */
+static void
+append_test_id (ASOutputQueue *q, CARD32 id, long key, int state)
+{
+	ASOutputPacket *p = create_output_packet (&id, sizeof (id));
+
+	append_output_queue (q, p, AS_HASHABLE (key), state);
+	release_output_packet (p);
+}
+
+/* flushes the queue, and checks that exactly expected ids came out */
+static int
+check_test_ids (ASOutputQueue *q, CARD32 *expected, int expected_num)
+{
+	int fds[2], res, got = 0, errors = 0;
+	CARD32 id;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return 1;
+	fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+	do
+	{
+		res = flush_output_queue (q, fds[0]);
+		while (read (fds[1], &id, sizeof (id)) == sizeof (id))
+		{
+			if (got >= expected_num || id != expected[got])
+				++errors;
+			++got;
+		}
+	}while (res == 0);
+	if (res != 1 || got != expected_num || q->used != 0 || q->dropped != 0)
+		++errors;
+	close (fds[0]);
+	close (fds[1]);
+	return errors;
+}
+
+static int
+test_coalescing ()
+{
+	static CARD32 expected[] = { 2, 4, 5, 6, 7, 9 };
+	ASOutputQueue q;
+	int errors = 0;
+
+	memset (&q, 0x00, sizeof (q));
+	append_test_id (&q, 1, 100, 0);		/* superseded by 3 */
+	append_test_id (&q, 2, 100, -1);	/* not a state - always stays */
+	append_test_id (&q, 3, 100, 0);		/* superseded by 8 */
+	append_test_id (&q, 4, 100, 1);		/* different state of the same key */
+	append_test_id (&q, 5, 200, 0);		/* same state of different key */
+	append_test_id (&q, 6, 200, 1);		/* superseded by nothing - barrier */
+	output_queue_barrier (&q, AS_HASHABLE (200), OUTPUT_QUEUE_ALL_STATES);
+	append_test_id (&q, 7, 200, 1);
+	append_test_id (&q, 8, 100, 0);		/* superseded by 9 */
+	append_test_id (&q, 9, 100, 0);
+	if (q.used != 9 || q.dropped != 3)
+		++errors;
+	errors += check_test_ids (&q, expected, sizeof (expected) / sizeof (expected[0]));
+
+	/* once sent, packet cannot be superseded anymore */
+	append_test_id (&q, 10, 100, 0);
+	expected[0] = 10;
+	errors += check_test_ids (&q, expected, 1);
+	append_test_id (&q, 11, 100, 0);
+	expected[0] = 11;
+	errors += check_test_ids (&q, expected, 1);
+	purge_output_queue (&q);
+	return errors;
+}
+
+/* window introduced to the module the way afterstep does it, with its
+ * configuration followed by the names, while configuration and names keep
+ * changing before module gets to read any of it. States and barriers are
+ * the same AddToQueue() uses : configuration is state 0, window name is
+ * state 2, icon name is state 4; res class and res name are barriers for
+ * everything, and names are barriers for configuration. */
+#define TEST_WINDOW			0x1400001
+#define TEST_CONFIG_STATES	((0x01<<0)|(0x01<<1))
+
+static int
+test_window_introduction ()
+{
+	static CARD32 expected[] = { 1, 2, 3, 4, 6, 7, 8, 10 };
+	ASOutputQueue q;
+	int errors = 0;
+
+	memset (&q, 0x00, sizeof (q));
+	append_test_id (&q, 1, TEST_WINDOW, 0);					/* M_CONFIGURE_WINDOW */
+	output_queue_barrier (&q, AS_HASHABLE (TEST_WINDOW), OUTPUT_QUEUE_ALL_STATES);
+	append_test_id (&q, 2, TEST_WINDOW, -1);				/* M_RES_CLASS */
+	output_queue_barrier (&q, AS_HASHABLE (TEST_WINDOW), OUTPUT_QUEUE_ALL_STATES);
+	append_test_id (&q, 3, TEST_WINDOW, -1);				/* M_RES_NAME */
+	output_queue_barrier (&q, AS_HASHABLE (TEST_WINDOW), TEST_CONFIG_STATES);
+	append_test_id (&q, 4, TEST_WINDOW, 4);					/* M_ICON_NAME */
+	output_queue_barrier (&q, AS_HASHABLE (TEST_WINDOW), TEST_CONFIG_STATES);
+	append_test_id (&q, 5, TEST_WINDOW, 2);					/* M_WINDOW_NAME */
+	append_test_id (&q, 6, 0, -1);							/* M_END_WINDOWLIST */
+	/* changes broadcasted after that : */
+	append_test_id (&q, 7, TEST_WINDOW, 0);					/* followed by name - stays */
+	output_queue_barrier (&q, AS_HASHABLE (TEST_WINDOW), TEST_CONFIG_STATES);
+	append_test_id (&q, 8, TEST_WINDOW, 2);					/* supersedes 5 */
+	append_test_id (&q, 9, TEST_WINDOW, 0);					/* superseded by 10 */
+	append_test_id (&q, 10, TEST_WINDOW, 0);
+	/* configuration introducing the window must come before anything else
+	 * about it, and before M_END_WINDOWLIST */
+	if (q.dropped != 2)
+		++errors;
+	errors += check_test_ids (&q, expected, sizeof (expected) / sizeof (expected[0]));
+	purge_output_queue (&q);
+	return errors;
+}
+
+/* peer not reading while the same states keep getting updated must not
+ * make the queue grow */
+static int
+test_bounded_coalescing ()
+{
+	ASOutputQueue q;
+	CARD32 *expected = safecalloc (TEST_PACKETS_NUM * 10 + 8, sizeof (CARD32));
+	int i, expected_num = 0, errors = 0, max_size = 0;
+	int last[8];
+
+	memset (&q, 0x00, sizeof (q));
+	for (i = 0; i < TEST_PACKETS_NUM * 100; ++i)
+	{
+		append_test_id (&q, i, i & 0x03, (i >> 2) & 0x01);
+		if (q.size > max_size)
+			max_size = q.size;
+	}
+	if (max_size > MIN_OUTPUT_QUEUE_SIZE)
+		++errors;
+	/* last update of each key/state pair survives, in the order of updates */
+	for (i = TEST_PACKETS_NUM * 100 - 8; i < TEST_PACKETS_NUM * 100; ++i)
+		expected[expected_num++] = i;
+	errors += check_test_ids (&q, expected, expected_num);
+
+	/* mixed with regular packets, ring only needs to fit those */
+	expected_num = 0;
+	for (i = 0; i < TEST_PACKETS_NUM * 100; ++i)
+	{
+		if ((i % 10) == 0)
+		{
+			append_test_id (&q, i, 0, -1);
+			expected[expected_num++] = i;
+		} else
+		{
+			append_test_id (&q, i, i & 0x03, (i >> 2) & 0x01);
+			last[i & 0x07] = i;
+		}
+	}
+	if (q.size > TEST_PACKETS_NUM * 10 * 4 || q.used - q.dropped != expected_num + 8)
+		++errors;
+	for (i = 0; i < 8; ++i)
+		expected[expected_num++] = last[i];
+	/* regular packets and the states interleave - sorting by id */
+	qsort (expected, expected_num, sizeof (CARD32), compare_test_ids);
+	errors += check_test_ids (&q, expected, expected_num);
+	printf ("bounded coalescing : ring of %d entries for %d updates\n", max_size, TEST_PACKETS_NUM * 100);
+	purge_output_queue (&q);
+	free (expected);
+	return errors;
+}
+
+int
+main (int argc, char **argv)
+{
+	int errors, total = 0;
+
+	signal (SIGPIPE, SIG_IGN);
+	errors = test_append ();
+	printf ("append : %d errors\n", errors);
+	total += errors;
+	errors = test_shared_packets ();
+	printf ("shared packets : %d errors\n", errors);
+	total += errors;
+	errors = test_partial_writes ();
+	printf ("partial writes : %d errors\n", errors);
+	total += errors;
+	errors = test_coalescing ();
+	printf ("coalescing : %d errors\n", errors);
+	total += errors;
+	errors = test_window_introduction ();
+	printf ("window introduction : %d errors\n", errors);
+	total += errors;
+	errors = test_bounded_coalescing ();
+	printf ("bounded coalescing : %d errors\n", errors);
+	total += errors;
+	return (total == 0) ? 0 : 1;
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef OUTQUEUE_H_HEADER_INCLUDED
+#define OUTQUEUE_H_HEADER_INCLUDED
+
+#include "ashash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Queue of data waiting to be written into non-blocking pipe or socket :
+ *  o packets are reference counted, so that the same data sent to many
+ *    peers is stored once, and shared by all their queues. Small packets
+ *    are taken from preallocated pool.
+ *  o queue is a ring buffer that grows in powers of 2, so appending is O(1).
+ *  o flush_output_queue() writes as many queued packets as it can with a
+ *    single writev(), and keeps track of partially written ones.
+ *  o packet carrying complete state of something (identified by key and
+ *    state slot) supersedes older packet for the same key and slot that
+ *    is still waiting in the queue - older one gets dropped. Holes left
+ *    by dropped packets are squeezed out instead of growing the ring, so
+ *    stream of updates to the same state needs no more space than one.
+ */
+
+typedef struct ASOutputPacket
+{
+	struct ASOutputPacket *next_free;
+	CARD8                 *data;
+	int                    size;
+	int                    ref_count;
+	int                    prealloced_idx;	/* 0 for malloced packets */
+}ASOutputPacket;
+
+typedef struct ASOutputQueueEntry
+{
+	ASOutputPacket *packet;             /* NULL if superseded */
+	int             done;               /* bytes already written */
+	int             state;              /* -1 if does not supersede anything */
+	ASHashableValueBase key;
+}ASOutputQueueEntry;
+
+typedef struct ASOutputQueue
+{
+	ASOutputQueueEntry  *entries;       /* ring buffer of queued packets */
+	int                  size;          /* always power of 2 */
+	int                  head, used;
+	int                  dropped;       /* superseded entries still in the ring */
+	CARD32               seq;           /* sequence number of the head entry */
+	struct ASHashTable  *pending_states;/* key -> queued state packets */
+}ASOutputQueue;
+
+#define OUTPUT_QUEUE_MAX_STATES		8
+#define OUTPUT_QUEUE_ALL_STATES		((0x01<<OUTPUT_QUEUE_MAX_STATES)-1)
+
+ASOutputPacket *create_output_packet (const void *data, int size);
+/* destroys packet (or returns it to the pool) when ref_count reaches 0 */
+void release_output_packet (ASOutputPacket *packet);
+
+/* state < 0 means that packet does not supersede anything : */
+void append_output_queue (ASOutputQueue *q, ASOutputPacket *packet,
+                          ASHashableValue key, int state);
+/* nothing queued for the key in any of the states (bitmask) before barrier
+ * is ever dropped : */
+void output_queue_barrier (ASOutputQueue *q, ASHashableValue key, ASFlagType states);
+/* returns 1 if everything got written, 0 if fd would block and -1 on error */
+int  flush_output_queue (ASOutputQueue *q, int fd);
+/* releases all the queued packets and memory used by the queue */
+void purge_output_queue (ASOutputQueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
 # include <time.h>
@@ -36,80 +37,231 @@
 #include "astypes.h"
 #include "output.h"
 #include "safemalloc.h"
+#include "ashash.h"
 #include "timer.h"
 
-static void   timer_get_time (time_t * sec, time_t * usec);
-static void   mytimer_delete (Timer * timer);
+/* Timers live in a slot array, so that they can be referred to by index from
+ * the heap and from the by-data chains, and so that ids can be validated.
+ * Id is a slot index + 1 in the lower bits, and slot generation in the rest */
+#define TIMER_SLOT_BITS		20
+#define TIMER_SLOT_MASK		((0x01UL<<TIMER_SLOT_BITS)-1)
+#define TIMER_GEN_MASK		(~0UL>>TIMER_SLOT_BITS)
 
-static Timer *timer_first = NULL;
+static Timer *timer_slots = NULL;
+static int    timer_slots_num = 0;
+static int    timer_free_slots = 0;
+static int   *timer_free_list = NULL;   /* stack of free slot indexes */
+
+static int   *timer_heap = NULL;         /* slot indexes ordered by deadline */
+static int    timer_heap_used = 0;
+
+static ASHashTable *timers_by_data = NULL;  /* data -> most recent timer slot */
+static unsigned long timer_serial = 0;
+
+#ifdef TEST_TIMER
+/* tests run on a clock of their own, so that deadlines are exact */
+static time_t test_clock_sec = 1000, test_clock_usec = 0;
+#endif
 
 static void
 timer_get_time (time_t * sec, time_t * usec)
 {
 	struct timeval tv;
+#ifdef TEST_TIMER
+	*sec = test_clock_sec;
+	*usec = test_clock_usec;
+	return;
+#endif
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
 
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+	{
+		*sec = ts.tv_sec;
+		*usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
 	gettimeofday (&tv, NULL);
 	*sec = tv.tv_sec;
 	*usec = tv.tv_usec;
 }
 
-void
-timer_new (time_t msec, void (*handler) (void *), void *data)
+static inline Bool
+timer_earlier (const Timer *t1, const Timer *t2)
 {
-	Timer        *timer;
-	time_t        sec, usec;
+	if (t1->sec != t2->sec)
+		return (t1->sec < t2->sec);
+	if (t1->usec != t2->usec)
+		return (t1->usec < t2->usec);
+	return (t1->serial < t2->serial);
+}
 
-	timer = (Timer *) safecalloc (1, sizeof (Timer));
+static inline void
+timer_heap_place (int idx, int slot)
+{
+	timer_heap[idx] = slot;
+	timer_slots[slot].heap_idx = idx;
+}
 
-	timer->next = timer_first;
-	timer_first = timer;
+static void
+timer_heap_sift_up (int idx)
+{
+	int slot = timer_heap[idx];
 
-	timer_get_time (&sec, &usec);
-	timer->sec = sec + (msec * 1000 + usec) / 1000000;
-	timer->usec = (msec * 1000 + usec) % 1000000;
-	timer->data = data;
-	timer->handler = handler;
+	while (idx > 0)
+	{
+		int parent = (idx - 1) >> 1;
+		if (!timer_earlier (&timer_slots[slot], &timer_slots[timer_heap[parent]]))
+			break;
+		timer_heap_place (idx, timer_heap[parent]);
+		idx = parent;
+	}
+	timer_heap_place (idx, slot);
+}
 
-	LOCAL_DEBUG_OUT( "added task for data = %p, sec = %ld, usec = %ld", data, timer->sec, timer->usec );
+static void
+timer_heap_sift_down (int idx)
+{
+	int slot = timer_heap[idx];
 
+	while (1)
+	{
+		int child = idx * 2 + 1;
+		if (child >= timer_heap_used)
+			break;
+		if (child + 1 < timer_heap_used &&
+			timer_earlier (&timer_slots[timer_heap[child + 1]], &timer_slots[timer_heap[child]]))
+			++child;
+		if (!timer_earlier (&timer_slots[timer_heap[child]], &timer_slots[slot]))
+			break;
+		timer_heap_place (idx, timer_heap[child]);
+		idx = child;
+	}
+	timer_heap_place (idx, slot);
+}
+
+static int
+timer_get_first_by_data (void *data)
+{
+	void *hdata = NULL;
+
+	if (timers_by_data != NULL &&
+		get_hash_item (timers_by_data, AS_HASHABLE (data), &hdata) == ASH_Success)
+		return (int) (long) hdata;
+	return -1;
+}
+
+static void
+timer_set_first_by_data (void *data, int slot)
+{
+	if (timers_by_data == NULL)
+		timers_by_data = create_ashash (0, pointer_hash_value, NULL, NULL);
+	remove_hash_item (timers_by_data, AS_HASHABLE (data), NULL, False);
+	if (slot >= 0)
+		add_hash_item (timers_by_data, AS_HASHABLE (data), (void *) (long) slot);
 }
 
 static Timer *
-timer_extract (Timer * timer)
+timer_from_id (ASTimerID id)
 {
-	if (timer == NULL)
+	long slot = (long) (id & TIMER_SLOT_MASK) - 1;
+
+	if (slot < 0 || slot >= timer_slots_num)
+		return NULL;
+	if (timer_slots[slot].heap_idx < 0 ||
+		timer_slots[slot].generation != ((id >> TIMER_SLOT_BITS) & TIMER_GEN_MASK))
 		return NULL;
+	return &timer_slots[slot];
+}
+
+ASTimerID
+timer_new (time_t msec, void (*handler) (void *), void *data)
+{
+	Timer        *timer;
+	time_t        sec, usec;
+	int           slot, first;
 
-	if (timer_first == timer)
-		timer_first = timer->next;
-	else if (timer_first != NULL)
+	if (timer_free_slots == 0)
 	{
-		Timer        *ptr;
-
-		for (ptr = timer_first; ptr->next != NULL; ptr = ptr->next)
-			if (ptr->next == timer)
-				break;
-		if (ptr->next == timer)
-			ptr->next = timer->next;
-		else
-			timer = NULL;
+		int old_num = timer_slots_num;
+		int i;
+
+		if (old_num > (int)TIMER_SLOT_MASK - 1)
+		{
+			show_error ("too many timers pending - timer for data %p not added", data);
+			return 0;
+		}
+		timer_slots_num = (old_num == 0) ? 16 : old_num * 2;
+		if (timer_slots_num > (int)TIMER_SLOT_MASK - 1)
+			timer_slots_num = (int)TIMER_SLOT_MASK - 1;
+		timer_slots = realloc (timer_slots, timer_slots_num * sizeof (Timer));
+		timer_heap = realloc (timer_heap, timer_slots_num * sizeof (int));
+		timer_free_list = realloc (timer_free_list, timer_slots_num * sizeof (int));
+		memset (&timer_slots[old_num], 0x00, (timer_slots_num - old_num) * sizeof (Timer));
+		/* lowest slots get used first */
+		for (i = timer_slots_num - 1; i >= old_num; --i)
+		{
+			timer_slots[i].heap_idx = -1;
+			timer_free_list[timer_free_slots++] = i;
+		}
 	}
+	slot = timer_free_list[--timer_free_slots];
+	timer = &timer_slots[slot];
+
+	timer_get_time (&sec, &usec);
+	timer->sec = sec + (msec * 1000 + usec) / 1000000;
+	timer->usec = (msec * 1000 + usec) % 1000000;
+	timer->data = data;
+	timer->handler = handler;
+	timer->serial = ++timer_serial;
+
+	/* most recently added timer is found first by data */
+	timer->prev_by_data = -1;
+	timer->next_by_data = first = timer_get_first_by_data (data);
+	if (first >= 0)
+		timer_slots[first].prev_by_data = slot;
+	timer_set_first_by_data (data, slot);
 
-	if (timer != NULL)
-		timer->next = NULL;
+	timer_heap[timer_heap_used] = slot;
+	timer_heap_sift_up (timer_heap_used++);
 
-	return timer;
+	LOCAL_DEBUG_OUT( "added task for data = %p, sec = %ld, usec = %ld", data, timer->sec, timer->usec );
+	return ((timer->generation & TIMER_GEN_MASK) << TIMER_SLOT_BITS) | (slot + 1);
 }
 
 static void
 mytimer_delete (Timer * timer)
 {
-	if (timer == NULL)
-		return;
+	int slot, idx;
 
-	timer_extract (timer);
+	if (timer == NULL || timer->heap_idx < 0)
+		return;
+	slot = timer - timer_slots;
+
+	/* unlinking from data chain */
+	if (timer->prev_by_data >= 0)
+		timer_slots[timer->prev_by_data].next_by_data = timer->next_by_data;
+	else
+		timer_set_first_by_data (timer->data, timer->next_by_data);
+	if (timer->next_by_data >= 0)
+		timer_slots[timer->next_by_data].prev_by_data = timer->prev_by_data;
+
+	/* replacing with the last heap element, and restoring heap order */
+	idx = timer->heap_idx;
+	if (idx < --timer_heap_used)
+	{
+		int moved = timer_heap[timer_heap_used];
+		timer_heap_place (idx, moved);
+		timer_heap_sift_up (idx);
+		timer_heap_sift_down (timer_slots[moved].heap_idx);
+	}
 
-	free (timer);
+	timer->heap_idx = -1;
+	timer->generation = (timer->generation + 1) & TIMER_GEN_MASK;
+	timer->data = NULL;
+	timer->handler = NULL;
+	timer_free_list[timer_free_slots++] = slot;
 }
 
 static void
@@ -133,19 +285,14 @@ void tv_add_ms(struct timeval *tv, time_t ms) {
 Bool timer_delay_till_next_alarm (time_t * sec, time_t * usec)
 {
 	Timer        *timer;
-	long         tsec, tusec = 0;
+	long         tsec, tusec;
 
-	if (timer_first == NULL)
+	if (timer_heap_used == 0)
 		return False;
 
-	tsec = 0x7fffffff;
-
-	for (timer = timer_first; timer != NULL; timer = (*timer).next)
-		if ((*timer).sec < tsec || ((*timer).sec == tsec && (*timer).usec <= tusec))
-		{
-			tsec = (*timer).sec;
-			tusec = (*timer).usec;
-		}
+	timer = &timer_slots[timer_heap[0]];
+	tsec = timer->sec;
+	tusec = timer->usec;
 
 	timer_get_time (sec, usec);
 	LOCAL_DEBUG_OUT( "next :  sec = %ld, usec = %ld( curr %ld, %ld)", tsec, tusec, *sec, *usec );
@@ -164,61 +311,225 @@ Bool timer_delay_till_next_alarm (time_t * sec, time_t * usec)
 
 Bool timer_handle (void)
 {
-	Bool          success = False;
-	Timer        *timer, *good_timer = NULL;
+	Timer        *timer;
 	time_t        sec, usec;
+	void        (*handler) (void *);
+	void         *data;
+
+	if (timer_heap_used == 0)
+		return False;
 
 	timer_get_time (&sec, &usec);
-	for (timer = timer_first; timer != NULL; timer = timer->next)
-		if (timer->sec < sec || (timer->sec == sec && timer->usec <= usec))
-		{  /* oldest event gets executed first ! */
-			if( good_timer != NULL )
-				if( good_timer->sec < timer->sec || (timer->sec == good_timer->sec && timer->usec > good_timer->usec ))
-					continue;
-			good_timer = timer ;
-		}
-	if (good_timer != NULL)
-	{
-		LOCAL_DEBUG_OUT( "handling task for sec = %ld, usec = %ld( curr %ld, %ld)", good_timer->sec, good_timer->usec, sec, usec );
-		timer_extract (good_timer);
-		good_timer->handler (good_timer->data);
-		mytimer_delete (good_timer);
-		success = True;
-	}
-	return success;
+	timer = &timer_slots[timer_heap[0]];	/* oldest event gets executed first ! */
+	if (timer->sec > sec || (timer->sec == sec && timer->usec > usec))
+		return False;
+
+	LOCAL_DEBUG_OUT( "handling task for sec = %ld, usec = %ld( curr %ld, %ld)", timer->sec, timer->usec, sec, usec );
+	/* handler may add or remove timers, moving slots around */
+	handler = timer->handler;
+	data = timer->data;
+	mytimer_delete (timer);
+	handler (data);
+	return True;
+}
+
+Bool timer_remove (ASTimerID id)
+{
+	Timer        *timer = timer_from_id (id);
+
+	if (timer == NULL)
+		return False;
+	mytimer_delete (timer);
+	return True;
 }
 
 Bool timer_remove_by_data (void *data)
 {
-	Bool          success = False;
-	Timer        *timer;
+	int           slot = timer_get_first_by_data (data);
 
-	for (timer = timer_first; timer != NULL; timer = (*timer).next)
-		if ((*timer).data == data)
-			break;
-	if (timer != NULL)
-	{
-		mytimer_delete (timer);
-		success = True;
-	}
-	return success;
+	if (slot < 0)
+		return False;
+	mytimer_delete (&timer_slots[slot]);
+	return True;
 }
 
 void
 timer_remove_all ()
 {
-	while(timer_first != NULL)
+	while (timer_heap_used > 0)
+		mytimer_delete (&timer_slots[timer_heap[timer_heap_used - 1]]);
+}
+
+Bool timer_find_by_data (void *data)
+{
+	return (timer_get_first_by_data (data) >= 0) ? True : False;
+}
+
+#ifdef TEST_TIMER
+/* checks that timers fire in deadline order, with ties resolved in order of
+ * addition, that removal from the middle of the heap keeps it consistent,
+ * and that stale ids do not cancel timers that reuse their slot */
+#define TEST_TIMERS_NUM		1000
+
+static int    fired[TEST_TIMERS_NUM * 2];
+static int    fired_num = 0;
+
+static void
+test_handler (void *data)
+{
+	fired[fired_num++] = (int) (long) data;
+}
+
+static void
+test_requeue_handler (void *data)
+{
+	test_handler (data);
+	/* timer added from inside of handler with zero delay fires next */
+	timer_new (0, test_handler, (void *) ((long) data + TEST_TIMERS_NUM));
+}
+
+static void
+test_advance_clock (time_t msec)
+{
+	test_clock_usec += (msec % 1000) * 1000;
+	test_clock_sec += msec / 1000 + test_clock_usec / 1000000;
+	test_clock_usec %= 1000000;
+}
+
+static int
+test_check_heap ()
+{
+	int           i, errors = 0;
+
+	for (i = 0; i < timer_heap_used; ++i)
 	{
-		mytimer_delete (timer_first);
+		if (timer_slots[timer_heap[i]].heap_idx != i)
+			++errors;
+		if (i > 0 && timer_earlier (&timer_slots[timer_heap[i]], &timer_slots[timer_heap[(i - 1) >> 1]]))
+			++errors;
 	}
+	return errors;
 }
 
-Bool timer_find_by_data (void *data)
+static int
+test_fire_all (time_t *delays, Bool *removed)
 {
-	Timer        *timer;
+	int           i, errors = 0, expected = 0;
+
+	test_advance_clock (1000);
+	fired_num = 0;
+	while (timer_handle ())
+		;
+	if (timer_heap_used != 0)
+		++errors;
+	for (i = 0; i < TEST_TIMERS_NUM; ++i)
+		if (removed == NULL || !removed[i])
+			++expected;
+	if (fired_num != expected)
+		++errors;
+	for (i = 0; i < fired_num; ++i)
+	{
+		int           k = fired[i];
+
+		if (removed && removed[k])
+			++errors;
+		/* earlier deadline first, and equal deadlines in order of addition */
+		if (i > 0 && (delays[k] < delays[fired[i - 1]] ||
+					  (delays[k] == delays[fired[i - 1]] && k < fired[i - 1])))
+			++errors;
+	}
+	return errors;
+}
 
-	for (timer = timer_first; timer != NULL; timer = (*timer).next)
-		if ((*timer).data == data)
-			break;
-	return (timer != NULL) ? True : False;
+int
+main (int argc, char **argv)
+{
+	static time_t delays[TEST_TIMERS_NUM];
+	static ASTimerID ids[TEST_TIMERS_NUM];
+	static Bool   removed[TEST_TIMERS_NUM];
+	ASTimerID     stale_id, new_id;
+	time_t        sec, usec;
+	int           i, errors, total = 0;
+
+	/* heap order and equal-deadline ties : */
+	errors = 0;
+	for (i = 0; i < TEST_TIMERS_NUM; ++i)
+	{
+		delays[i] = (i * 7919) % 97;	/* plenty of duplicates */
+		ids[i] = timer_new (delays[i], test_handler, (void *) (long) i);
+		if (ids[i] == 0)
+			++errors;
+	}
+	errors += test_check_heap ();
+	if (!timer_delay_till_next_alarm (&sec, &usec) || sec != 0 || usec != 0)
+		++errors;	/* earliest deadline is "now" */
+	errors += test_fire_all (delays, NULL);
+	printf ("heap order and ties : %d errors\n", errors);
+	total += errors;
+
+	/* removal from the middle of the heap : */
+	errors = 0;
+	for (i = 0; i < TEST_TIMERS_NUM; ++i)
+	{
+		ids[i] = timer_new (delays[i], test_handler, (void *) (long) i);
+		removed[i] = False;
+	}
+	for (i = 1; i < TEST_TIMERS_NUM; i += 3)
+	{
+		if (!timer_remove (ids[i]))
+			++errors;
+		if (timer_remove (ids[i]))
+			++errors;	/* removed twice */
+		removed[i] = True;
+		errors += test_check_heap ();
+	}
+	for (i = 2; i < TEST_TIMERS_NUM; i += 6)
+	{
+		if (!timer_remove_by_data ((void *) (long) i) || timer_find_by_data ((void *) (long) i))
+			++errors;
+		removed[i] = True;
+		errors += test_check_heap ();
+	}
+	errors += test_fire_all (delays, removed);
+	printf ("removal from the middle : %d errors\n", errors);
+	total += errors;
+
+	/* stale ids : */
+	errors = 0;
+	stale_id = timer_new (10, test_handler, (void *) 1);
+	test_advance_clock (10);
+	i = fired_num;
+	if (!timer_handle () || fired_num != i + 1 || fired[i] != 1)
+		++errors;
+	if (timer_remove (stale_id))
+		++errors;	/* already fired */
+	/* new timer reuses the slot of the one that fired */
+	new_id = timer_new (10, test_handler, (void *) 2);
+	if ((new_id & TIMER_SLOT_MASK) != (stale_id & TIMER_SLOT_MASK) || new_id == stale_id)
+		++errors;
+	if (timer_remove (stale_id) || !timer_find_by_data ((void *) 2))
+		++errors;
+	if (timer_remove (0) || timer_remove (new_id + TEST_TIMERS_NUM * 4) || timer_remove (~0UL))
+		++errors;
+	if (!timer_remove (new_id) || timer_find_by_data ((void *) 2))
+		++errors;
+	printf ("stale ids : %d errors\n", errors);
+	total += errors;
+
+	/* timers added from inside of a handler : */
+	errors = 0;
+	fired_num = 0;
+	timer_new (5, test_requeue_handler, (void *) 0);
+	timer_new (5, test_handler, (void *) 1);
+	test_advance_clock (5);
+	while (timer_handle ())
+		;
+	if (fired_num != 3 || fired[0] != 0 || fired[1] != 1 || fired[2] != TEST_TIMERS_NUM)
+		++errors;
+	printf ("timers added by handlers : %d errors\n", errors);
+	total += errors;
+
+	timer_remove_all ();
+	return (total == 0) ? 0 : 1;
 }
+#endif
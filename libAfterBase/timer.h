@@ -12,9 +12,16 @@ extern "C" {
  *    select())
  *
  * Notes:
- *  o this timer code is not intended to handle large numbers of timeout
- *    events; if large numbers of events are needed, timer should be
- *    rewritten to be a priority queue
+ *  o timers are kept in a binary min-heap ordered by deadline, so adding and
+ *    removing timers is O(log n), and finding next deadline is O(1).
+ *    Timers are also indexed by data, so that timer_remove_by_data() and
+ *    timer_find_by_data() do not have to scan all of them.
+ *  o deadlines are measured with monotonic clock, where available, so that
+ *    changing system time does not stall or fire timers.
+ *  o timer_new() returns an id that can later be used to cancel exactly that
+ *    timer with timer_remove(); ids are never 0 and do not get reused for a
+ *    long time, so it is safe to cancel a timer that has already fired.
+ *  o timers with the same deadline fire in the order they were added.
  *  o timers may be created (with timer_new()) at any point, including
  *    inside a timer handler
  *  o example of use:
@@ -30,19 +37,26 @@ extern "C" {
  *    }
  */
 
+typedef unsigned long ASTimerID;
+
 typedef struct Timer
 {
-  struct Timer *next;
   void *data;
   time_t sec;
   time_t usec;
   void (*handler) (void *timer);
+  /* private : */
+  unsigned long serial;				/* order of addition - breaks deadline ties */
+  unsigned long generation;			/* incremented every time slot gets freed */
+  int heap_idx;						/* -1 if slot is free */
+  int next_by_data, prev_by_data;	/* slots of other timers with same data */
 }
 Timer;
 
-void timer_new (time_t msec, void (*handler) (void *), void *data);
+ASTimerID timer_new (time_t msec, void (*handler) (void *), void *data);
 Bool timer_delay_till_next_alarm (time_t * sec, time_t * usec);
 Bool timer_handle (void);
+Bool timer_remove (ASTimerID id);
 Bool timer_remove_by_data (void *data);
 void timer_remove_all ();
 Bool timer_find_by_data (void *data);
@@ -8,6 +8,7 @@
 #include "asvisual.h"
 #include "blender.h"
 #include "asimage.h"
+#include "asthread.h"
 #include "imencdec.h"
 #include "ascmap.h"
 #undef HAVE_FREETYPE
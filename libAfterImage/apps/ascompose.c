@@ -194,6 +194,9 @@ void usage(void) {
 		"  -o --output file   output to file\n"
 		"  -t --type type     type of file to output to\n"
         "  -c --compress level compression level\n"
+		" Performance options : \n"
+		"  -j --threads count number of threads to use for heavy transformations,\n"
+		"                     such as blur. 0 - use all available CPUs.\n"
 		" Feedback options : \n"
 		"  -V --verbose       increase verbosity\n"
 		"  -q --quiet	      output as little information as possible\n"
@@ -371,6 +374,8 @@ int main(int argc, char** argv) {
 			doc_save_type = argv[++i];
         } else if ((!strcmp(argv[i], "--compress") || !strcmp(argv[i], "-c")) && i < argc + 1) {
             doc_compress = argv[++i];
+		} else if ((!strcmp(argv[i], "--threads") || !strcmp(argv[i], "-j")) && i < argc + 1) {
+			set_asimage_thread_count( atoi( argv[++i] ) );
 		} else if (!strcmp(argv[i], "--interactive") || !strcmp(argv[i], "-I")) {
             compose_type = COMPOSE_Interactive ;
 		} else if (strcmp(argv[i], "--click-timeout") == 0 && i < argc + 1) {
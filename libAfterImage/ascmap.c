@@ -49,6 +49,12 @@
 #include <stdarg.h>
 #endif
 #include <ctype.h>
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 #ifdef _WIN32
 # include "win32/afterbase.h"
@@ -697,3 +703,491 @@ check_colorindex_counts( cmap->hash );
 	return mapped_im ;
 }
 
+/***********************************************************************************/
+/* octree quantizer :                                                              */
+/***********************************************************************************/
+/* Colors are counted in 32x32x32 histogram first. Occupied histogram cells are then
+ * arranged into an octree 5 levels deep, and the tree gets pruned bottom-up, least
+ * populated nodes first, until there is no more than max_colors leaves left. Pixels
+ * are mapped using 15 bit inverse colormap, where closest colorcell for each
+ * histogram cell is cached as soon as it gets looked up.
+ */
+#define OCTREE_DEPTH			5
+#define OCTREE_CELLS			(0x01<<(OCTREE_DEPTH*3))
+#define OCTREE_MAX_NODES		(1+8+64+512+4096)
+
+#define OCTREE_PACKED2CELL(p)	((((p)>>9)&0x7C00)|(((p)>>6)&0x03E0)|(((p)>>3)&0x001F))
+#define OCTREE_CELL_RED(c)		((((c)>>7)&0x00F8)|0x04)
+#define OCTREE_CELL_GREEN(c)	((((c)>>2)&0x00F8)|0x04)
+#define OCTREE_CELL_BLUE(c)		((((c)<<3)&0x00F8)|0x04)
+#define OCTREE_CELL_CHILD(c,l)	(((((c)>>(14-(l)))&0x01)<<2)|((((c)>>(9-(l)))&0x01)<<1)|(((c)>>(4-(l)))&0x01))
+
+/* all the colors in the cell share top 5 bits, so only lower 3 bits need to be
+ * summed up, and that will not overflow : */
+typedef struct ASOctreeHistogram
+{
+	CARD32 count[OCTREE_CELLS] ;
+	CARD32 red[OCTREE_CELLS], green[OCTREE_CELLS], blue[OCTREE_CELLS] ;
+}ASOctreeHistogram;
+
+#define OCTREE_CELL_SUM(top,low,count)	((double)((top)&0x00F8)*(count)+(double)(low))
+
+typedef struct ASOctreeNode
+{
+	CARD32 count ;
+	double red, green, blue ;
+	int    children[8] ;                    /* node index or, at the last level,
+											 * histogram cell+1 ; 0 if none */
+	int    level ;
+	Bool   leaf ;
+}ASOctreeNode;
+
+/* 4x4 ordered dither matrix : */
+static const CARD8 _as_octree_bayer[4][4] =
+{ { 0, 8, 2,10 }, {12, 4,14, 6 }, { 3,11, 1, 9 }, {15, 7,13, 5 } };
+
+static int
+compare_octree_nodes( const void *a, const void *b )
+{
+	CARD32 ca = (*(ASOctreeNode**)a)->count ;
+	CARD32 cb = (*(ASOctreeNode**)b)->count ;
+	return (ca < cb)? -1 : ((ca > cb)? 1 : 0);
+}
+
+static inline void
+add_octree_colormap_item( ASColormap *cmap, CARD32 count, double red, double green, double blue )
+{
+	register ASColormapEntry *pentry = &(cmap->entries[cmap->count++]);
+	pentry->red   = (CARD8)(red/count + 0.5) ;
+	pentry->green = (CARD8)(green/count + 0.5) ;
+	pentry->blue  = (CARD8)(blue/count + 0.5) ;
+}
+
+static void
+octree2colormap( ASOctreeNode *nodes, int node, ASOctreeHistogram *hist, ASColormap *cmap )
+{
+	register ASOctreeNode *pnode = &(nodes[node]);
+	int i ;
+	if( pnode->leaf )
+	{
+		add_octree_colormap_item( cmap, pnode->count, pnode->red, pnode->green, pnode->blue );
+		return ;
+	}
+	for( i = 0 ; i < 8 ; ++i )
+		if( pnode->children[i] != 0 )
+		{
+			if( pnode->level == OCTREE_DEPTH-1 )
+			{
+				int cell = pnode->children[i]-1 ;
+				CARD32 count = hist->count[cell] ;
+				add_octree_colormap_item( cmap, count, OCTREE_CELL_SUM(cell>>7,hist->red[cell],count),
+										  OCTREE_CELL_SUM(cell>>2,hist->green[cell],count),
+										  OCTREE_CELL_SUM(cell<<3,hist->blue[cell],count) );
+			}else
+				octree2colormap( nodes, pnode->children[i], hist, cmap );
+		}
+}
+
+static void
+build_octree_colormap( ASOctreeHistogram *hist, ASColormap *cmap, unsigned int max_colors )
+{
+	ASOctreeNode *nodes = safecalloc( OCTREE_MAX_NODES, sizeof(ASOctreeNode) );
+	ASOctreeNode **order = safemalloc( OCTREE_MAX_NODES*sizeof(ASOctreeNode*) );
+	int nodes_num = 1 ;
+	unsigned int leaves = 0 ;
+	int cell, level, i ;
+
+	for( cell = 0 ; cell < OCTREE_CELLS ; ++cell )
+		if( hist->count[cell] > 0 )
+		{
+			CARD32 count = hist->count[cell] ;
+			double red = OCTREE_CELL_SUM(cell>>7,hist->red[cell],count);
+			double green = OCTREE_CELL_SUM(cell>>2,hist->green[cell],count);
+			double blue = OCTREE_CELL_SUM(cell<<3,hist->blue[cell],count);
+			int node = 0 ;
+			for( level = 0 ; level < OCTREE_DEPTH ; ++level )
+			{
+				register ASOctreeNode *pnode = &(nodes[node]);
+				int child = OCTREE_CELL_CHILD(cell,level);
+				pnode->count += count ;
+				pnode->red   += red ;
+				pnode->green += green ;
+				pnode->blue  += blue ;
+				if( level == OCTREE_DEPTH-1 )
+					pnode->children[child] = cell+1 ;
+				else
+				{
+					if( pnode->children[child] == 0 )
+					{
+						nodes[nodes_num].level = level+1 ;
+						pnode->children[child] = nodes_num++ ;
+					}
+					node = pnode->children[child] ;
+				}
+			}
+			++leaves ;
+		}
+
+	/* by the time we get to some level - all the nodes below it are leaves already,
+	 * so each reduction replaces node's children with the node itself : */
+	for( level = OCTREE_DEPTH-1 ; level >= 0 && leaves > max_colors ; --level )
+	{
+		int order_num = 0 ;
+		for( i = 0 ; i < nodes_num ; ++i )
+			if( nodes[i].level == level )
+				order[order_num++] = &(nodes[i]);
+		qsort( order, order_num, sizeof(ASOctreeNode*), compare_octree_nodes );
+		for( i = 0 ; i < order_num && leaves > max_colors ; ++i )
+		{
+			int k, children = 0 ;
+			for( k = 0 ; k < 8 ; ++k )
+				if( order[i]->children[k] != 0 )
+					++children ;
+			order[i]->leaf = True ;
+			leaves -= children-1 ;
+		}
+	}
+
+	cmap->count = 0 ;
+	cmap->entries = safemalloc( MAX(leaves,1)*sizeof( ASColormapEntry) );
+	if( leaves > 0 )
+		octree2colormap( nodes, 0, hist, cmap );
+	free( order );
+	free( nodes );
+}
+
+static int
+closest_octree_color( ASColormap *cmap, int cell )
+{
+	int red = OCTREE_CELL_RED(cell), green = OCTREE_CELL_GREEN(cell), blue = OCTREE_CELL_BLUE(cell);
+	int best = 0, best_dist = 0x7FFFFFFF ;
+	register unsigned int i ;
+	for( i = 0 ; i < cmap->count ; ++i )
+	{
+		register ASColormapEntry *pentry = &(cmap->entries[i]);
+		int dg = (int)pentry->green-green, dr, db, dist ;
+		if( (dist = dg*dg) >= best_dist )
+			continue;
+		dr = (int)pentry->red-red ;
+		db = (int)pentry->blue-blue ;
+		dist += dr*dr+db*db ;
+		if( dist < best_dist )
+		{
+			best_dist = dist ;
+			best = i ;
+			if( dist == 0 )
+				break;
+		}
+	}
+	return best;
+}
+
+/* pos and neg hold dither offsets replicated into all three color bytes, pattern
+ * repeating every 4 pixels. Results must match for all code paths : */
+static inline void
+octree_dither_cells_c( const int *src, CARD32 *cells, int x, int width, const CARD32 *pos, const CARD32 *neg )
+{
+	for( ; x < width ; ++x )
+	{
+		int offset = (int)(pos[x&0x03]&0x00FF) - (int)(neg[x&0x03]&0x00FF);
+		int red   = ((src[x]>>16)&0x00FF)+offset ;
+		int green = ((src[x]>>8 )&0x00FF)+offset ;
+		int blue  = ( src[x]     &0x00FF)+offset ;
+		red   = (red   < 0)? 0 : ((red   > 255)? 255 : red);
+		green = (green < 0)? 0 : ((green > 255)? 255 : green);
+		blue  = (blue  < 0)? 0 : ((blue  > 255)? 255 : blue);
+		cells[x] = ((red&0x00F8)<<7)|((green&0x00F8)<<2)|(blue>>3) ;
+	}
+}
+
+#ifdef HAVE_SSE2
+static __attribute__((target("sse2"))) void
+octree_dither_cells_sse2( const int *src, CARD32 *cells, int width, const CARD32 *pos, const CARD32 *neg )
+{
+	__m128i vpos = _mm_loadu_si128( (const __m128i*)pos );
+	__m128i vneg = _mm_loadu_si128( (const __m128i*)neg );
+	__m128i rmask = _mm_set1_epi32( 0x7C00 ), gmask = _mm_set1_epi32( 0x03E0 ), bmask = _mm_set1_epi32( 0x001F );
+	int x = 0 ;
+	for( ; x+4 <= width ; x += 4 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)&(src[x]) );
+		v = _mm_subs_epu8( _mm_adds_epu8( v, vpos ), vneg );
+		v = _mm_or_si128( _mm_or_si128( _mm_and_si128( _mm_srli_epi32( v, 9 ), rmask ),
+										_mm_and_si128( _mm_srli_epi32( v, 6 ), gmask ) ),
+						  _mm_and_si128( _mm_srli_epi32( v, 3 ), bmask ) );
+		_mm_storeu_si128( (__m128i*)&(cells[x]), v );
+	}
+	octree_dither_cells_c( src, cells, x, width, pos, neg );
+}
+#endif
+
+#ifdef HAVE_AVX2
+static __attribute__((target("avx2"))) void
+octree_dither_cells_avx2( const int *src, CARD32 *cells, int width, const CARD32 *pos, const CARD32 *neg )
+{
+	__m256i vpos = _mm256_loadu_si256( (const __m256i*)pos );
+	__m256i vneg = _mm256_loadu_si256( (const __m256i*)neg );
+	__m256i rmask = _mm256_set1_epi32( 0x7C00 ), gmask = _mm256_set1_epi32( 0x03E0 ), bmask = _mm256_set1_epi32( 0x001F );
+	int x = 0 ;
+	for( ; x+8 <= width ; x += 8 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*)&(src[x]) );
+		v = _mm256_subs_epu8( _mm256_adds_epu8( v, vpos ), vneg );
+		v = _mm256_or_si256( _mm256_or_si256( _mm256_and_si256( _mm256_srli_epi32( v, 9 ), rmask ),
+											  _mm256_and_si256( _mm256_srli_epi32( v, 6 ), gmask ) ),
+							 _mm256_and_si256( _mm256_srli_epi32( v, 3 ), bmask ) );
+		_mm256_storeu_si256( (__m256i*)&(cells[x]), v );
+	}
+	octree_dither_cells_c( src, cells, x, width, pos, neg );
+}
+#endif
+
+static void
+octree_dither_cells( const int *src, CARD32 *cells, int width, const CARD32 *pos, const CARD32 *neg )
+{
+#ifdef HAVE_AVX2
+	if( asimage_avx2_supported() )
+	{
+		octree_dither_cells_avx2( src, cells, width, pos, neg );
+		return;
+	}
+#endif
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+	{
+		octree_dither_cells_sse2( src, cells, width, pos, neg );
+		return;
+	}
+#endif
+	octree_dither_cells_c( src, cells, 0, width, pos, neg );
+}
+
+static int *
+colormap_asimage_octree( ASImage *im, ASColormap *cmap, unsigned int max_colors, unsigned int dither, int opaque_threshold )
+{
+	int *mapped_im = NULL;
+	ASImageDecoder *imdec ;
+	ASOctreeHistogram *hist ;
+	CARD32 *a, *r, *g, *b ;
+	CARD32 *cells ;
+	int *inverse ;
+	int amplitude = 0 ;
+	START_TIME(started);
+
+	int *dst ;
+	unsigned int y ;
+	register int x ;
+
+	if((imdec = start_image_decoding( NULL /* default visual */ , im,
+		                              SCL_DO_ALL, 0, 0, im->width, 0, NULL)) == NULL )
+	{
+		LOCAL_DEBUG_OUT( "failed to start image decoding%s", "");
+		return NULL;
+	}
+
+    if( max_colors == 0 )
+		max_colors = 256 ;
+	if( dither == -1 )
+		dither = 4 ;
+	else if( dither >= 8 )
+		dither = 7 ;
+	/* dither is in bits stripped, same as with hash quantizer, so 4 bits
+	 * translate into +-8 : */
+	if( dither >= 2 )
+		amplitude = 0x01<<dither ;
+
+	dst = mapped_im = safemalloc( im->width*im->height*sizeof(int));
+	memset(cmap, 0x00, sizeof(ASColormap));
+	hist = safecalloc( 1, sizeof(ASOctreeHistogram) );
+
+	a = imdec->buffer.alpha ;
+	r = imdec->buffer.red ;
+	g = imdec->buffer.green ;
+	b = imdec->buffer.blue ;
+
+	for( y = 0 ; y < im->height ; y++ )
+	{
+		int im_width = im->width ;
+		imdec->decode_image_scanline( imdec );
+		if( opaque_threshold > 0 && !cmap->has_opaque)
+		{
+			x = im->width ;
+			while( --x >= 0  )
+			  	if( a[x] != 0x00FF )
+				{
+					cmap->has_opaque = True;
+					break;
+				}
+		}
+		for( x = 0; x < im_width ; x++ )
+		{
+			if( (int)a[x] < opaque_threshold )	dst[x] = -1 ;
+			else
+			{
+				int cell ;
+				dst[x] = (r[x]<<16)|(g[x]<<8)|b[x] ;
+				cell = OCTREE_PACKED2CELL(dst[x]);
+				++(hist->count[cell]);
+				hist->red[cell]   += r[x]&0x07 ;
+				hist->green[cell] += g[x]&0x07 ;
+				hist->blue[cell]  += b[x]&0x07 ;
+			}
+		}
+		dst += im_width ;
+	}
+	stop_image_decoding( &imdec );
+	SHOW_TIME("color counting",started);
+
+	build_octree_colormap( hist, cmap, max_colors );
+	free( hist );
+	SHOW_TIME("colormap calculation",started);
+
+	inverse = safemalloc( OCTREE_CELLS*sizeof(int) );
+	for( x = 0 ; x < OCTREE_CELLS ; ++x )
+		inverse[x] = -1 ;
+	cells = safemalloc( im->width*sizeof(CARD32) );
+	dst = mapped_im ;
+	for( y = 0 ; y < im->height ; ++y )
+	{
+		CARD32 pos[8], neg[8] ;
+		for( x = 0 ; x < 8 ; ++x )
+		{
+			int offset = amplitude? ((2*_as_octree_bayer[y&0x03][x&0x03]+1)*amplitude)/32 - amplitude/2 : 0 ;
+			pos[x] = (offset > 0)?  offset*0x010101 : 0 ;
+			neg[x] = (offset < 0)? -offset*0x010101 : 0 ;
+		}
+		octree_dither_cells( dst, cells, im->width, pos, neg );
+		for( x = 0 ; x < (int)im->width ; ++x )
+			if( dst[x] >= 0 )
+			{
+				register int cell = cells[x] ;
+				if( inverse[cell] < 0 )
+					inverse[cell] = closest_octree_color( cmap, cell );
+				dst[x] = inverse[cell] ;
+			}else
+				dst[x] = cmap->count ;
+		dst += im->width ;
+	}
+	free( cells );
+	free( inverse );
+	SHOW_TIME("color mapping",started);
+
+	return mapped_im ;
+}
+
+int *
+colormap_asimage_ext( ASImage *im, ASColormap *cmap, unsigned int max_colors, unsigned int dither, int opaque_threshold, int method )
+{
+	if( method != ASCMAP_QUANTIZE_OCTREE )
+		return colormap_asimage( im, cmap, max_colors, dither, opaque_threshold );
+	if( im == NULL || cmap == NULL || im->width == 0 )
+		return NULL;
+	return colormap_asimage_octree( im, cmap, max_colors, dither, opaque_threshold );
+}
+
+#ifdef TEST_ASCMAP
+/* Quantizes image with both methods, checking the result and reporting mean
+ * squared error - usage : test_ascmap [image_file [max_colors [dither]]]
+ * bench_ascmap also reports time it takes each method to quantize the image.
+ */
+#include "afterimage.h"
+
+#ifdef BENCHMARK_ASCMAP
+#define BENCH_ASCMAP_RUNS	20
+#else
+#define BENCH_ASCMAP_RUNS	1
+#endif
+
+static int
+test_quantizer( ASImage *im, int method, unsigned int max_colors, unsigned int dither )
+{
+	ASImageDecoder *imdec ;
+	ASColormap cmap ;
+	int *mapped_im = NULL ;
+	double error = 0 ;
+	int failed = 0 ;
+	clock_t started = clock();
+	double secs ;
+	unsigned int x, y ;
+	int i ;
+
+	for( i = 0 ; i < BENCH_ASCMAP_RUNS ; ++i )
+	{
+		if( mapped_im )
+		{
+			free( mapped_im );
+			destroy_colormap( &cmap, True );
+		}
+		mapped_im = colormap_asimage_ext( im, &cmap, max_colors, dither, 0, method );
+	}
+	secs = (double)(clock()-started)/CLOCKS_PER_SEC/BENCH_ASCMAP_RUNS ;
+	if( mapped_im == NULL )
+		return 1;
+
+	if( cmap.count > max_colors )
+	{
+		fprintf( stderr, "colormap too big : %u colors\n", cmap.count );
+		++failed ;
+	}
+	if((imdec = start_image_decoding( NULL, im, SCL_DO_COLOR, 0, 0, im->width, 0, NULL)) != NULL )
+	{
+		for( y = 0 ; y < im->height ; ++y )
+		{
+			int *row = &(mapped_im[y*im->width]);
+			imdec->decode_image_scanline( imdec );
+			for( x = 0 ; x < im->width ; ++x )
+			{
+				ASColormapEntry *pentry ;
+				double dr, dg, db ;
+				if( row[x] < 0 || row[x] >= (int)cmap.count )
+				{
+					if( failed++ == 0 )
+						fprintf( stderr, "bad index %d at %ux%u\n", row[x], x, y );
+					continue;
+				}
+				pentry = &(cmap.entries[row[x]]);
+				dr = (double)pentry->red-(double)imdec->buffer.red[x] ;
+				dg = (double)pentry->green-(double)imdec->buffer.green[x] ;
+				db = (double)pentry->blue-(double)imdec->buffer.blue[x] ;
+				error += dr*dr+dg*dg+db*db ;
+			}
+		}
+		stop_image_decoding( &imdec );
+	}
+	printf( "%-7s: %3u colors, mean squared error %8.2f", (method == ASCMAP_QUANTIZE_OCTREE)?"octree":"hash",
+			cmap.count, error/(im->width*im->height) );
+#ifdef BENCHMARK_ASCMAP
+	printf( ", %.2f ms", secs*1000 );
+#endif
+	printf( "\n" );
+	free( mapped_im );
+	destroy_colormap( &cmap, True );
+	return failed;
+}
+
+int main(int argc, char **argv )
+{
+	ASVisual *asv ;
+	ASImage *im ;
+	const char *file = (argc > 1)? argv[1] : "apps/rose512.jpg" ;
+	unsigned int max_colors = (argc > 2)? atoi(argv[2]) : 256 ;
+	unsigned int dither = (argc > 3)? atoi(argv[3]) : 4 ;
+	int failed = 0 ;
+
+	set_output_threshold(OUTPUT_LEVEL_DEBUG);
+	asv = create_asvisual( NULL, 0, 0, NULL );
+	if( (im = file2ASImage( file, 0xFFFFFFFF, SCREEN_GAMMA, 0, NULL )) == NULL )
+	{
+		show_error( "failed to load image \"%s\"", file );
+		return 1;
+	}
+	printf( "%s : %ux%u, %u colors, dither %u\n", file, im->width, im->height, max_colors, dither );
+	failed += test_quantizer( im, ASCMAP_QUANTIZE_HASH, max_colors, dither );
+	failed += test_quantizer( im, ASCMAP_QUANTIZE_OCTREE, max_colors, dither );
+
+	destroy_asimage( &im );
+	destroy_asvisual( asv, False );
+	printf( "%s\n", failed? "FAILED" : "passed" );
+	return failed? 1 : 0 ;
+}
+#endif
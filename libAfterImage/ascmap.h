@@ -34,7 +34,7 @@ extern "C" {
  *          ASColormap
  *
  * Functions :
- *          colormap_asimage(), destroy_colormap()
+ *          colormap_asimage(), colormap_asimage_ext(), destroy_colormap()
  *
  * Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -209,9 +209,37 @@ ASColormap *color_hash2colormap     ( ASColormap *cmap,
  * DESCRIPTION
  * Destroys ASColormap object created using colormap_asimage.
  *********/
+/****f* libAfterImage/colormap_asimage_ext()
+ * NAME
+ * colormap_asimage_ext()
+ * SYNOPSIS
+ * int *colormap_asimage_ext( ASImage *im, ASColormap *cmap,
+ *                            unsigned int max_colors, unsigned int dither,
+ *                            int opaque_threshold, int method );
+ * INPUTS
+ * method           - ASCMAP_QUANTIZE_HASH or ASCMAP_QUANTIZE_OCTREE
+ * Other inputs and return value are the same as with colormap_asimage().
+ * DESCRIPTION
+ * ASCMAP_QUANTIZE_HASH is the same as calling colormap_asimage().
+ * ASCMAP_QUANTIZE_OCTREE counts colors at 5 bits per channel, builds
+ * octree out of them and merges least used branches until max_colors is
+ * reached. Colorcells are averages of the merged colors. Pixels are
+ * mapped with ordered dithering, its strength defined by dither the
+ * same way it is for colormap_asimage() - 0 and 1 mean no dithering.
+ * Closest colorcell search is done only once for each of 32768 possible
+ * 15 bit colors. That is considerably faster on photos than hash
+ * method.
+ * cmap->hash is not used by ASCMAP_QUANTIZE_OCTREE and is left NULL.
+ *********/
+#define ASCMAP_QUANTIZE_HASH	0
+#define ASCMAP_QUANTIZE_OCTREE	1
+
 int *colormap_asimage( ASImage *im, ASColormap *cmap,
 	                   unsigned int max_colors, unsigned int dither,
 					   int opaque_threshold );
+int *colormap_asimage_ext( ASImage *im, ASColormap *cmap,
+	                       unsigned int max_colors, unsigned int dither,
+					       int opaque_threshold, int method );
 void destroy_colormap( ASColormap *cmap, Bool reusable );
 
 #ifdef __cplusplus
@@ -45,6 +45,14 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_FCNTL_H) && defined(HAVE_UNISTD_H)
+# define HAVE_GLYPH_CACHE
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <errno.h>
+#endif
 #ifdef DO_CLOCKING
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
@@ -82,6 +90,7 @@
 #endif
 #include "asfont.h"
 #include "asimage.h"
+#include "scanline.h"
 #include "asvisual.h"
 
 #ifdef HAVE_XRENDER
@@ -124,6 +133,12 @@ LOCAL_DEBUG_OUT( "Freetype library is %p", fontman->ft_library );
 
 	fontman->fonts_hash = create_ashash( 7, string_hash_value, string_compare, asfont_destroy );
 
+	if( getenv( ASFONT_GLYPH_CACHE_ENVVAR ) != NULL ) 
+	{
+		char *filename = copy_replace_envvar( getenv( ASFONT_GLYPH_CACHE_ENVVAR ) );
+		set_font_manager_glyph_cache( fontman, filename, 0 );
+		free( filename );
+	}
 	return fontman;
 }
 
@@ -134,6 +149,8 @@ destroy_font_manager( ASFontManager *fontman, Bool reusable )
 	{
 
         destroy_ashash( &(fontman->fonts_hash) );
+		/* no glyphs point into the cache anymore : */
+		set_font_manager_glyph_cache( fontman, NULL, 0 );
 
 #ifdef HAVE_FREETYPE
 		FT_Done_FreeType( fontman->ft_library);
@@ -149,7 +166,281 @@ destroy_font_manager( ASFontManager *fontman, Bool reusable )
 	}
 }
 
+/*************************************************************************/
+/* Glyph cache shared between processes. It is a file mapped read-only   */
+/* into every process using it, consisting of the header with hash table */
+/* of glyphs, followed by glyph entries, each immediately followed by    */
+/* its RLE encoded pixmap. Entries are only ever appended, using         */
+/* pwrite() while holding the lock on the file, and are linked into the  */
+/* hash table last, so that readers never need to lock anything.         */
+/*************************************************************************/
+#define ASGLYPH_CACHE_MAGIC 	0x43475341		/* "ASGC" */
+#define ASGLYPH_CACHE_VERSION	1
+#define ASGLYPH_CACHE_BUCKETS	4096
+#define ASGLYPH_CACHE_COMBINING	0x80000000		/* glyph is used as combining mark */
+#define ASGLYPH_CACHE_METRICS	0x7FFFFFFF		/* pseudo-glyph holding font's height */
+
+typedef struct ASGlyphCacheHeader
+{
+	CARD32 magic, version ;
+	CARD32 size ;				/* of the entire file */
+	CARD32 used ;				/* offset of the first unused byte */
+	CARD32 buckets[ASGLYPH_CACHE_BUCKETS] ;	/* offsets of the first entries */
+}ASGlyphCacheHeader;
+
+typedef struct ASGlyphCacheEntry
+{
+	CARD32 next ;				/* offset of the next entry in the bucket */
+	CARD32 font_id[2] ;
+	CARD32 gid ;
+	short  width, height, lead, step, ascend, descend ;
+	CARD32 pixmap_size ;
+	/* pixmap follows */
+}ASGlyphCacheEntry;
+
+typedef struct ASGlyphCache
+{
+	int 	fd ;
+	CARD8  *map ;
+	size_t 	size ;
+}ASGlyphCache;
+
+#ifdef HAVE_GLYPH_CACHE
+static Bool
+lock_glyph_cache( int fd, Bool lock )
+{
+	struct flock fl ;
+	memset( &fl, 0x00, sizeof(fl));
+	fl.l_type = lock?F_WRLCK:F_UNLCK ;
+	fl.l_whence = SEEK_SET ;
+	while( fcntl( fd, F_SETLKW, &fl ) == -1 ) 
+		if( errno != EINTR ) 
+			return False;
+	return True;
+}
+
+static ASGlyphCache *
+open_glyph_cache( const char *filename, size_t size )
+{
+	ASGlyphCacheHeader hdr ;
+	ASGlyphCache *cache = NULL ;
+	struct stat st ;
+	int fd ;
+	
+	if( size < sizeof(ASGlyphCacheHeader) || size > 0x7FFFFFFF ) 
+		size = ASFONT_GLYPH_CACHE_DEFAULT_SIZE ;
+	if( (fd = open( filename, O_RDWR|O_CREAT, 0600 )) < 0 ) 
+	{
+		show_warning( "failed to open glyph cache \"%s\" - glyphs will not be shared", filename );
+		return NULL;
+	}
+	if( lock_glyph_cache( fd, True ) && fstat( fd, &st ) == 0 )
+	{
+		memset( &hdr, 0x00, sizeof(hdr));
+		if( st.st_size == 0 )
+		{/* we are the first to use it */
+			hdr.magic = ASGLYPH_CACHE_MAGIC ;
+			hdr.version = ASGLYPH_CACHE_VERSION ;
+			hdr.size = size ;
+			hdr.used = sizeof(ASGlyphCacheHeader) ;
+			if( ftruncate( fd, size ) != 0 || 
+				pwrite( fd, &hdr, sizeof(hdr), 0 ) != sizeof(hdr) ) 
+				hdr.magic = 0 ;
+			st.st_size = size ;
+		}else if( pread( fd, &hdr, sizeof(hdr), 0 ) != sizeof(hdr) ) 
+			hdr.magic = 0 ;
+
+		if( hdr.magic != ASGLYPH_CACHE_MAGIC || hdr.version != ASGLYPH_CACHE_VERSION || 
+			hdr.size != st.st_size || hdr.used > hdr.size ) 
+			show_warning( "glyph cache \"%s\" is invalid - glyphs will not be shared", filename );
+		else
+		{
+			void *map = mmap( NULL, hdr.size, PROT_READ, MAP_SHARED, fd, 0 );
+			if( map != MAP_FAILED ) 
+			{
+				cache = safecalloc( 1, sizeof(ASGlyphCache));
+				cache->fd = fd ;
+				cache->map = map ;
+				cache->size = hdr.size ;
+			}
+		}
+		lock_glyph_cache( fd, False );
+	}
+	if( cache == NULL ) 
+		close( fd );
+	return cache;
+}
+
+static void
+close_glyph_cache( ASGlyphCache *cache )
+{
+	munmap( cache->map, cache->size );
+	close( cache->fd );
+	free( cache );
+}
+#endif
+
+Bool
+set_font_manager_glyph_cache( ASFontManager *fontman, const char *filename, size_t size )
+{
+	if( fontman == NULL ) 
+		return False;
+	/* open fonts may have glyphs pointing into the old cache : */
+	if( fontman->fonts_hash && fontman->fonts_hash->items_num > 0 ) 
+		return False;
+#ifdef HAVE_GLYPH_CACHE
+	if( fontman->glyph_cache ) 
+	{
+		close_glyph_cache( fontman->glyph_cache );
+		fontman->glyph_cache = NULL ;
+	}
+	if( filename ) 
+		fontman->glyph_cache = open_glyph_cache( filename, size );
+#endif
+	return (fontman->glyph_cache != NULL || filename == NULL);
+}
+
 #ifdef HAVE_FREETYPE
+static void
+make_glyph_cache_id( ASFont *font, const char *filename, int size ) 
+{
+	CARD32 h1 = 0x811C9DC5, h2 = 0x01000193 ;
+	CARD32 data[6] ;
+	int i ;
+#ifdef HAVE_GLYPH_CACHE
+	struct stat st ;
+	if( stat( filename, &st ) == 0 ) 
+	{ /* font file may get replaced with something else under the same name */
+		data[0] = (CARD32)st.st_size ;
+		data[1] = (CARD32)st.st_mtime ;
+	}else
+#endif
+		data[0] = data[1] = 0 ;
+	data[2] = font->ft_face->face_index ;
+	data[3] = size ;
+	data[4] = get_flags( font->flags, ASF_Monospaced )?1:0 ;
+	data[5] = ASGLYPH_CACHE_VERSION ;
+	for( i = 0 ; filename[i] ; ++i ) 
+	{
+		h1 = (h1^(CARD8)filename[i])*0x01000193 ;
+		h2 = (h2^(CARD8)filename[i])*0x0100008F + (h2>>15) ;
+	}
+	for( i = 0 ; i < (int)(sizeof(data)/sizeof(CARD32)) ; ++i ) 
+	{
+		h1 = (h1^data[i])*0x01000193 ;
+		h2 = (h2^data[i])*0x0100008F + (h2>>15) ;
+	}
+	font->glyph_cache_id[0] = h1 ;
+	font->glyph_cache_id[1] = h2 ;
+}
+
+static CARD32
+glyph_cache_bucket( ASFont *font, CARD32 gid )
+{
+	return ((font->glyph_cache_id[0]^font->glyph_cache_id[1])*31 + gid*0x9E3779B1)%ASGLYPH_CACHE_BUCKETS ;
+}
+
+static ASGlyphCacheEntry *
+find_cached_glyph( ASGlyphCache *cache, ASFont *font, CARD32 gid )
+{
+	ASGlyphCacheHeader *hdr = (ASGlyphCacheHeader*)cache->map ;
+	CARD32 offset = hdr->buckets[glyph_cache_bucket( font, gid )] ;
+	/* file could be corrupted by someone else, so we check everything : */
+	while( offset >= sizeof(ASGlyphCacheHeader) && 
+		   offset <= cache->size - sizeof(ASGlyphCacheEntry) && (offset&0x03) == 0 ) 
+	{
+		ASGlyphCacheEntry *e = (ASGlyphCacheEntry*)(cache->map+offset);
+		if( e->gid == gid && 
+			e->font_id[0] == font->glyph_cache_id[0] && e->font_id[1] == font->glyph_cache_id[1] )
+		{
+			if( e->pixmap_size > cache->size - offset - sizeof(ASGlyphCacheEntry) ) 
+				break;
+			return e;
+		}
+		if( e->next >= offset ) /* new entries are appended and linked in front */
+			break;
+		offset = e->next ;
+	}
+	return NULL;
+}
+
+static Bool
+get_cached_glyph( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc )
+{
+	ASGlyphCacheEntry *e ;
+	CARD32 gid = glyph ;
+	
+	if( font->fontman == NULL || font->fontman->glyph_cache == NULL ) 
+		return False;
+	if( uc >= 0x0300 && uc <= 0x0362 ) 
+		gid |= ASGLYPH_CACHE_COMBINING ;
+	if( (e = find_cached_glyph( font->fontman->glyph_cache, font, gid )) == NULL ) 
+		return False;
+	asg->font_gid = glyph ;
+	asg->width = e->width ;
+	asg->height = e->height ;
+	asg->lead = e->lead ;
+	asg->step = e->step ;
+	asg->ascend = e->ascend ;
+	asg->descend = e->descend ;
+	asg->pixmap = (CARD8*)(e+1) ;
+	return True;
+}
+
+/* returns pointer to the copy of the pixmap in the cache, or NULL if it 
+ * could not be added */
+static CARD8 *
+add_cached_glyph( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc, CARD8 *pixmap, int pixmap_size )
+{
+	CARD8 *cached = NULL ;
+#ifdef HAVE_GLYPH_CACHE
+	ASGlyphCache *cache ;
+	ASGlyphCacheHeader *hdr ;
+	ASGlyphCacheEntry e, *found ;
+	CARD32 offset, bucket, entry_size ;
+
+	if( font->fontman == NULL || (cache = font->fontman->glyph_cache) == NULL ) 
+		return NULL;
+	hdr = (ASGlyphCacheHeader*)cache->map ;
+	memset( &e, 0x00, sizeof(e));
+	e.gid = glyph ;
+	if( uc >= 0x0300 && uc <= 0x0362 ) 
+		e.gid |= ASGLYPH_CACHE_COMBINING ;
+	e.font_id[0] = font->glyph_cache_id[0] ;
+	e.font_id[1] = font->glyph_cache_id[1] ;
+	e.width = asg->width ;
+	e.height = asg->height ;
+	e.lead = asg->lead ;
+	e.step = asg->step ;
+	e.ascend = asg->ascend ;
+	e.descend = asg->descend ;
+	e.pixmap_size = pixmap_size ;
+	entry_size = (sizeof(e) + pixmap_size + 3)&(~0x03) ;
+	bucket = glyph_cache_bucket( font, e.gid );
+
+	if( entry_size > cache->size || hdr->used > cache->size - entry_size )
+		return NULL;                       /* full - no point in locking */
+	if( !lock_glyph_cache( cache->fd, True ) ) 
+		return NULL;
+	/* someone else might have rendered it in the mean time : */
+	if( (found = find_cached_glyph( cache, font, e.gid )) != NULL ) 
+		cached = (CARD8*)(found+1);
+	else if( (offset = hdr->used) <= cache->size - entry_size && offset >= sizeof(ASGlyphCacheHeader) ) 
+	{
+		CARD32 used = offset + entry_size ;
+		e.next = hdr->buckets[bucket] ;
+		if( pwrite( cache->fd, &e, sizeof(e), offset ) == sizeof(e) && 
+			(pixmap_size == 0 || pwrite( cache->fd, pixmap, pixmap_size, offset+sizeof(e) ) == pixmap_size) && 
+			pwrite( cache->fd, &used, sizeof(CARD32), (char*)&(hdr->used) - (char*)hdr ) == sizeof(CARD32) && 
+			/* now that its all written - we can make it visible to others : */
+			pwrite( cache->fd, &offset, sizeof(CARD32), (char*)&(hdr->buckets[bucket]) - (char*)hdr ) == sizeof(CARD32) ) 
+			cached = cache->map + offset + sizeof(e) ;
+	}
+	lock_glyph_cache( cache->fd, False );
+#endif
+	return cached;
+}
+
 static int load_freetype_glyphs( ASFont *font );
 #endif
 #ifndef X_DISPLAY_MISSING
@@ -226,6 +517,8 @@ LOCAL_DEBUG_OUT( "face found : %p", face );
 					FT_Set_Pixel_Sizes( font->ft_face, size, size );
 					/* but let make our own cell width smaller then height */
 					font->space_size = size*2/3 ;
+					if( fontman->glyph_cache ) 
+						make_glyph_cache_id( font, realfilename, size );
 	   				load_freetype_glyphs( font );
 				}
 			}else if( verbose )
@@ -370,12 +663,280 @@ release_font( ASFont *font )
 static inline void
 free_glyph_data( register ASGlyph *asg )
 {
-    if( asg->pixmap )
-        free( asg->pixmap );
-/*fprintf( stderr, "\t\t%p\n", asg->pixmap );*/
+	/* pixmap belongs to font's atlas, and is freed along with it */
     asg->pixmap = NULL ;
 }
 
+/*************************************************************************/
+/* Glyph atlas : RLE encoded pixmaps of the glyphs are packed together   */
+/* into large pages, instead of being allocated one by one.              */
+/*************************************************************************/
+#define ASGLYPH_ATLAS_PAGE_SIZE		(16*1024)
+
+typedef struct ASGlyphAtlas
+{
+	struct ASGlyphAtlas *next ;
+	size_t size, used ;
+	/* data immediately follows here */
+}ASGlyphAtlas;
+
+static CARD8 *
+alloc_glyph_pixmap( ASGlyphAtlas **patlas, size_t size )
+{
+	ASGlyphAtlas *page = *patlas ;
+	CARD8 *pixmap ;
+
+	if( page == NULL || page->used + size > page->size )
+	{
+		size_t page_size = (size > ASGLYPH_ATLAS_PAGE_SIZE)? size : ASGLYPH_ATLAS_PAGE_SIZE ;
+		page = safemalloc( sizeof(ASGlyphAtlas)+page_size );
+		page->size = page_size ;
+		page->used = 0 ;
+		if( *patlas != NULL && size > ASGLYPH_ATLAS_PAGE_SIZE/2 ) 
+		{	/* keep filling current page, since there is still plenty of space left in it */
+			page->next = (*patlas)->next ;
+			(*patlas)->next = page ;
+		}else
+		{	
+			page->next = *patlas ;
+			*patlas = page ;
+		}
+	}
+	pixmap = (CARD8*)(page+1) + page->used ;
+	page->used += size ;
+	return pixmap;
+}
+
+static void
+destroy_glyph_atlas( ASGlyphAtlas **patlas )
+{
+	while( *patlas )
+	{
+		ASGlyphAtlas *next = (*patlas)->next ;
+		free( *patlas );
+		*patlas = next ;
+	}
+}
+
+/*************************************************************************/
+/* Glyphs loaded on demand are kept in locale_glyphs hash, with pixmaps  */
+/* in separate lazy_atlas. When that grows over the limit, glyphs not    */
+/* used since the previous trimming are dropped, and the rest are        */
+/* compacted into the new atlas.                                         */
+/*************************************************************************/
+#define ASFONT_LAZY_GLYPHS_MEMORY	(256*1024)	/* bytes of RLE encoded pixmaps */
+
+typedef struct ASLazyGlyph
+{
+	ASGlyph 	 glyph ;			/* must be first - hash stores pointers to it */
+	unsigned int last_used ;		/* font's glyphs_clock at the time */
+	int 		 pixmap_size ;
+}ASLazyGlyph;
+
+static void
+trim_asfont_glyphs( ASFont *font )
+{
+	ASHashIterator i ;
+	ASGlyphAtlas *old_atlas ;
+	ASHashableValueBase *evicted = NULL ;
+	int evicted_num = 0, k ;
+
+	++(font->glyphs_clock);
+	if( font->lazy_glyphs_memory <= ASFONT_LAZY_GLYPHS_MEMORY || font->locale_glyphs == NULL ) 
+		return;
+
+	old_atlas = font->lazy_atlas ;
+	font->lazy_atlas = NULL ;
+	font->lazy_glyphs_memory = 0 ;
+	evicted = safemalloc( font->locale_glyphs->items_num*sizeof(ASHashableValueBase) );
+	if( start_hash_iteration (font->locale_glyphs, &i) )
+		do 
+		{
+			ASLazyGlyph *lg = curr_hash_data( &i );
+			if( lg == NULL ) 
+				continue;
+			if( lg->last_used < font->glyphs_trim_clock ) 
+				evicted[evicted_num++] = curr_hash_value( &i );
+			else if( lg->glyph.pixmap && lg->pixmap_size > 0 ) /* not in shared cache */
+			{
+				CARD8 *pixmap = alloc_glyph_pixmap( &(font->lazy_atlas), lg->pixmap_size );
+				memcpy( pixmap, lg->glyph.pixmap, lg->pixmap_size );
+				lg->glyph.pixmap = pixmap ;
+				font->lazy_glyphs_memory += lg->pixmap_size ;
+			}
+		}while( next_hash_item( &i ) );
+	LOCAL_DEBUG_OUT( "font %p: evicting %d glyphs, %d bytes remain", font, evicted_num, font->lazy_glyphs_memory );
+	for( k = 0 ; k < evicted_num ; ++k ) 
+		remove_hash_item( font->locale_glyphs, evicted[k], NULL, True );
+	free( evicted );
+	destroy_glyph_atlas( &old_atlas );
+	font->glyphs_trim_clock = font->glyphs_clock ;
+}
+
+/*************************************************************************/
+/* Cache of rendered text runs : window titles and menu items are drawn  */
+/* over and over again, so we keep few most recently rendered images for */
+/* each font, and hand out their copies (that share pixel data).          */
+/*************************************************************************/
+#define ASFONT_TEXT_RUNS_MAX		64
+#define ASFONT_TEXT_RUN_MAX_PIXELS	(512*64)	/* don't keep pages of text */
+
+typedef struct ASTextRun
+{
+	struct ASTextRun *prev, *next ;	/* circular list - head->prev is the least recently used */
+	CARD32 			 hash ;
+	ASTextAttributes attr ;				/* tab_stops point into key */
+	int 			 compression ;
+	int 			 text_size ;		/* in bytes */
+	int 			 key_size ;
+	CARD8 			*key ;				/* text followed by tab stops */
+	ASImage 		*im ;
+}ASTextRun;
+
+static void
+destroy_text_run( ASTextRun *run )
+{
+	if( run->im )
+		destroy_asimage( &(run->im) );
+	free( run->key );
+	free( run );
+}
+
+static void
+flush_text_runs( ASFont *font )
+{
+	while( font->text_runs )
+	{
+		ASTextRun *run = font->text_runs ;
+		if( run->next == run )
+			font->text_runs = NULL ;
+		else
+		{
+			run->prev->next = run->next ;
+			run->next->prev = run->prev ;
+			font->text_runs = run->next ;
+		}
+		destroy_text_run( run );
+	}
+	font->text_runs_num = 0 ;
+}
+
+/* size in bytes of length characters of the text : */
+static int
+get_text_size_bytes( const char *text, ASCharType char_type, int length )
+{
+	int size = 0 ;
+	if( char_type == ASCT_UTF8 )
+	{
+		if( length <= 0 ) 
+			size = strlen( text );
+		else
+			while( --length >= 0 ) 
+				size += UTF8_CHAR_SIZE(text[size]);
+	}else if( char_type == ASCT_Unicode )
+	{
+		register UNICODE_CHAR *uc_ptr = (UNICODE_CHAR*)text ;
+		if( length <= 0 ) 
+			while( uc_ptr[length] != 0 ) ++length ;
+		size = length*sizeof(UNICODE_CHAR) ;
+	}else
+		size = (length <= 0)? strlen( text ) : length ;
+	return size;
+}
+
+/* fills the key, returning hash value of the text run : */
+static CARD32 
+make_text_run_key( ASTextRun *run, const char *text, ASTextAttributes *attr, int compression, int length )
+{
+	CARD32 hash = 2166136261U ; /* FNV-1a */
+	int tab_stops_size = 0 ;
+	int i ;
+	CARD8 *ptr ;
+
+	run->attr = *attr ;
+	run->compression = compression ;
+	run->text_size = get_text_size_bytes( text, attr->char_type, length );
+	if( get_flags( attr->rendition_flags, ASTA_UseTabStops ) && attr->tab_stops ) 
+		tab_stops_size = attr->tab_stops_num*sizeof(unsigned int);
+	else
+	{	
+		run->attr.tab_stops = NULL ;
+		run->attr.tab_stops_num = 0 ;
+	}
+	run->key_size = run->text_size + tab_stops_size ;
+	run->key = safemalloc( run->key_size );
+	memcpy( run->key, text, run->text_size );
+	if( tab_stops_size > 0 ) 
+	{	
+		memcpy( run->key+run->text_size, attr->tab_stops, tab_stops_size );
+		run->attr.tab_stops = (unsigned int*)(run->key+run->text_size);
+	}
+	for( ptr = run->key, i = 0 ; i < run->key_size ; ++i ) 
+		hash = (hash^ptr[i])*16777619U ;
+	hash = (hash^(CARD32)attr->type)*16777619U ;
+	hash = (hash^attr->fore_color)*16777619U ;
+	return hash ;
+}
+
+static ASTextRun *
+find_text_run( ASFont *font, ASTextRun *probe )
+{
+	ASTextRun *run = font->text_runs ;
+	if( run ) 
+		do
+		{
+			if( run->hash == probe->hash && run->key_size == probe->key_size &&
+				run->text_size == probe->text_size && run->compression == probe->compression && 
+				run->attr.rendition_flags == probe->attr.rendition_flags &&
+				run->attr.type == probe->attr.type && 
+				run->attr.char_type == probe->attr.char_type &&
+				run->attr.tab_size == probe->attr.tab_size &&
+				run->attr.origin == probe->attr.origin &&
+				run->attr.tab_stops_num == probe->attr.tab_stops_num &&
+				run->attr.fore_color == probe->attr.fore_color &&
+				memcmp( run->key, probe->key, run->key_size ) == 0 ) 
+			{
+				if( run != font->text_runs ) 
+				{	/* move it to the front : */
+					run->prev->next = run->next ;
+					run->next->prev = run->prev ;
+					run->next = font->text_runs ;
+					run->prev = font->text_runs->prev ;
+					run->prev->next = run ;
+					run->next->prev = run ;
+					font->text_runs = run ;
+				}
+				return run;
+			}
+			run = run->next ;
+		}while( run != font->text_runs );
+	return NULL;
+}
+
+static void
+add_text_run( ASFont *font, ASTextRun *run )
+{
+	if( font->text_runs_num >= ASFONT_TEXT_RUNS_MAX ) 
+	{	/* evicting the least recently used : */
+		ASTextRun *lru = font->text_runs->prev ;
+		lru->prev->next = lru->next ;
+		lru->next->prev = lru->prev ;
+		destroy_text_run( lru );
+		--(font->text_runs_num);
+	}
+	if( font->text_runs_num == 0 ) 
+		run->next = run->prev = run ;
+	else
+	{
+		run->next = font->text_runs ;
+		run->prev = font->text_runs->prev ;
+		run->prev->next = run ;
+		run->next->prev = run ;
+	}
+	font->text_runs = run ;
+	++(font->text_runs_num);
+}
+
 static void
 destroy_glyph_range( ASGlyphRange **pgr )
 {
@@ -420,6 +981,9 @@ destroy_font( ASFont *font )
         free_glyph_data( &(font->default_glyph) );
         if( font->locale_glyphs )
 			destroy_ashash( &(font->locale_glyphs) );
+		flush_text_runs( font );
+		destroy_glyph_atlas( &(font->atlas) );
+		destroy_glyph_atlas( &(font->lazy_atlas) );
         font->magic = 0 ;
 		free( font );
 	}
@@ -459,9 +1023,9 @@ asfont_destroy (ASHashableValue value, void *data)
 /*************************************************************************/
 
 static unsigned char *
-compress_glyph_pixmap( unsigned char *src, unsigned char *buffer,
+compress_glyph_pixmap( ASGlyphAtlas **patlas, unsigned char *src, unsigned char *buffer,
                        unsigned int width, unsigned int height,
-					   int src_step )
+					   int src_step, int *psize )
 {
 	unsigned char *pixmap ;
 	register unsigned char *dst = buffer ;
@@ -508,7 +1072,11 @@ compress_glyph_pixmap( unsigned char *src, unsigned char *buffer,
 			count |= 0x40 ;
 		dst[i++] = count;
 	}
-    pixmap  = safemalloc( i/*+(32-(i&0x01F) )*/);
+	if( psize ) 
+		*psize = i ;
+	if( patlas == NULL ) /* caller wants to decide where to keep it */
+		return buffer;
+    pixmap  = alloc_glyph_pixmap( patlas, i );
 /*fprintf( stderr, "pixmap alloced %p size %d(%d)", pixmap, i, i+(32-(i&0x01F) )); */
 	memcpy( pixmap, buffer, i );
 
@@ -844,7 +1412,7 @@ LOCAL_DEBUG_OUT( "loading glyph range of %lu-%lu", r->min_char, r->max_char );
 				}	 */
 				r->glyphs[i].step = font->space_size ;
 			}	 
-			r->glyphs[i].pixmap = compress_glyph_pixmap( buffer, compressed_buf, r->glyphs[i].width, height, r->glyphs[i].width );
+			r->glyphs[i].pixmap = compress_glyph_pixmap( &(font->atlas), buffer, compressed_buf, r->glyphs[i].width, height, r->glyphs[i].width, NULL );
 			r->glyphs[i].height = height ;
 			r->glyphs[i].ascend = xfs->ascent ;
 			r->glyphs[i].descend = xfs->descent ;
@@ -912,7 +1480,7 @@ make_X11_default_glyph( ASFont *font, XFontStruct *xfs )
 	}
 	for( x = 0 ; x < width ; ++x )
 		row[x] = 0xFF;
-	font->default_glyph.pixmap = compress_glyph_pixmap( buf, compressed_buf, width, height, width );
+	font->default_glyph.pixmap = compress_glyph_pixmap( &(font->atlas), buf, compressed_buf, width, height, width, NULL );
 	font->default_glyph.width = width ;
 	font->default_glyph.step = width ;
 	font->default_glyph.height = height ;
@@ -1004,7 +1572,7 @@ load_X11_glyphs( Display *dpy, ASFont *font, XFontStruct *xfs )
 
 #ifdef HAVE_FREETYPE
 static void
-load_glyph_freetype( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc )
+load_glyph_freetype( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc, ASGlyphAtlas **patlas, int *psize )
 {
 	register FT_Face face ;
 	static CARD8 *glyph_compress_buf = NULL, *glyph_scaling_buf = NULL ;
@@ -1027,6 +1595,13 @@ load_glyph_freetype( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc )
 		return;
 	}
 
+	if( get_cached_glyph( font, asg, glyph, uc ) ) 
+	{
+		if( psize ) 
+			*psize = 0 ; /* does not take any of our memory */
+		return;
+	}
+
 	face = font->ft_face;
 	if( FT_Load_Glyph( face, glyph, FT_LOAD_DEFAULT ) )
 		return;
@@ -1127,9 +1702,23 @@ load_glyph_freetype( ASFont *font, ASGlyph *asg, int glyph, UNICODE_CHAR uc )
 		}	 
 	
 		/* we better do some RLE encoding in attempt to preserv memory */
-		asg->pixmap  = compress_glyph_pixmap( src, glyph_compress_buf, asg->width, asg->height, src_step );
 		asg->ascend  = face->glyph->bitmap_top;
 		asg->descend = bmap->rows - asg->ascend;
+		if( font->fontman->glyph_cache ) 
+		{
+			int size = 0 ;
+			CARD8 *pixmap = compress_glyph_pixmap( NULL, src, glyph_compress_buf, asg->width, asg->height, src_step, &size );
+			if( (asg->pixmap = add_cached_glyph( font, asg, glyph, uc, pixmap, size )) != NULL ) 
+				size = 0 ;
+			else
+			{
+				asg->pixmap = alloc_glyph_pixmap( patlas, size );
+				memcpy( asg->pixmap, pixmap, size );
+			}
+			if( psize ) 
+				*psize = size ;
+		}else
+			asg->pixmap  = compress_glyph_pixmap( patlas, src, glyph_compress_buf, asg->width, asg->height, src_step, psize );
 		LOCAL_DEBUG_OUT( "glyph %p with FT index %u is %dx%d ascend = %d, lead = %d, bmap_top = %d", 
 							asg, glyph, asg->width, asg->height, asg->ascend, asg->lead, 
 							face->glyph->bitmap_top );
@@ -1165,8 +1754,11 @@ load_freetype_locale_glyph( ASFont *font, UNICODE_CHAR uc )
 	ASGlyph *asg = NULL ;
 	if( FT_Get_Char_Index( font->ft_face, uc) != 0 )
 	{
-		asg = safecalloc( 1, sizeof(ASGlyph));
-		load_glyph_freetype( font, asg, FT_Get_Char_Index( font->ft_face, uc), uc);
+		ASLazyGlyph *lg = safecalloc( 1, sizeof(ASLazyGlyph));
+		asg = &(lg->glyph);
+		load_glyph_freetype( font, asg, FT_Get_Char_Index( font->ft_face, uc), uc, &(font->lazy_atlas), &(lg->pixmap_size));
+		lg->last_used = font->glyphs_clock ;
+		font->lazy_glyphs_memory += lg->pixmap_size ;
 		if( add_hash_item( font->locale_glyphs, AS_HASHABLE(uc), asg ) != ASH_Success )
 		{
 			LOCAL_DEBUG_OUT( "Failed to add glyph %p for char %ld to hash", asg, uc );
@@ -1188,35 +1780,68 @@ load_freetype_locale_glyph( ASFont *font, UNICODE_CHAR uc )
 	return asg;
 }
 
+/* Glyph's bitmap is placed on the pixel grid by flooring/ceiling its
+ * outline's bounding box, so we can tell the size of rendered glyph
+ * without actually rendering it : */
 static void
-load_freetype_locale_glyphs( unsigned long min_char, unsigned long max_char, ASFont *font )
+estimate_freetype_glyphs_height( unsigned long min_char, unsigned long max_char, ASFont *font )
 {
-	register unsigned long i = min_char ;
-LOCAL_DEBUG_CALLER_OUT( "min_char = %lu, max_char = %lu, font = %p", min_char, max_char, font );
-	if( font->locale_glyphs == NULL )
-		font->locale_glyphs = create_ashash( 0, NULL, NULL, asglyph_destroy );
-	while( i <= max_char )
-	{
-		load_freetype_locale_glyph( font, CHAR2UNICODE(i));
-		++i;
+	FT_Face face = font->ft_face ;
+	unsigned long i ;
+	for( i = min_char ; i <= max_char ; ++i ) 
+	{
+		FT_UInt gid = FT_Get_Char_Index( face, CHAR2UNICODE(i) );
+		int ascend, descend ;
+		if( gid == 0 || FT_Load_Glyph( face, gid, FT_LOAD_DEFAULT ) ) 
+			continue;
+		if( face->glyph->format == FT_GLYPH_FORMAT_OUTLINE ) 
+		{
+			FT_Glyph_Metrics *m = &(face->glyph->metrics);
+			if( m->width <= 0 || m->height <= 0 ) 
+				continue;
+			ascend = (int)((m->horiBearingY+63)>>6) ;
+			descend = (int)(-((m->horiBearingY - m->height)>>6)) ;
+		}else if( face->glyph->format == FT_GLYPH_FORMAT_BITMAP && face->glyph->bitmap.rows > 0 )
+		{
+			ascend = face->glyph->bitmap_top ;
+			descend = face->glyph->bitmap.rows - ascend ;
+		}else
+			continue;
+		if( ascend > font->max_ascend )
+			font->max_ascend = ascend ;
+		if( descend > font->max_descend )
+			font->max_descend = descend ;
 	}
-	LOCAL_DEBUG_OUT( "font attr(%d,%d,%d)", font->max_ascend, font->max_descend, font->max_height );
 }
 
-
 static int
 load_freetype_glyphs( ASFont *font )
 {
 	int max_ascend = 0, max_descend = 0;
 	ASGlyphRange *r ;
+	ASGlyph metrics ;
 
     /* we preload only codes in range 0x21-0xFF in current charset */
 	/* if draw_unicode_text is used and we need some other glyphs
 	 * we'll just need to add them on demand */
 	font->codemap = split_freetype_glyph_range( 0x0021, 0x007F, font->ft_face );
 
-	load_glyph_freetype( font, &(font->default_glyph), 0, 0);/* special no-symbol glyph */
-    load_freetype_locale_glyphs( 0x0080, 0x00FF, font );
+	load_glyph_freetype( font, &(font->default_glyph), 0, 0, &(font->atlas), NULL);/* special no-symbol glyph */
+	/* the rest of the glyphs will be loaded when needed - we only want 
+	 * to know how tall they are : */
+	font->locale_glyphs = create_ashash( 0, NULL, NULL, asglyph_destroy );
+	memset( &metrics, 0x00, sizeof(metrics));
+	if( get_cached_glyph( font, &metrics, ASGLYPH_CACHE_METRICS, 0 ) ) 
+	{
+		font->max_ascend = metrics.ascend ;
+		font->max_descend = metrics.descend ;
+	}else
+	{
+		estimate_freetype_glyphs_height( 0x0080, 0x00FF, font );
+		metrics.ascend = font->max_ascend ;
+		metrics.descend = font->max_descend ;
+		add_cached_glyph( font, &metrics, ASGLYPH_CACHE_METRICS, 0, NULL, 0 );
+	}
 	if( font->codemap == NULL )
 	{
 		font->max_height = font->default_glyph.ascend+font->default_glyph.descend;
@@ -1244,7 +1869,7 @@ load_freetype_glyphs( ASFont *font )
 				{
 					ASGlyph *asg = &(r->glyphs[i-min_char]);
 					UNICODE_CHAR uc = CHAR2UNICODE(i);
-					load_glyph_freetype( font, asg, FT_Get_Char_Index( font->ft_face, uc), uc);
+					load_glyph_freetype( font, asg, FT_Get_Char_Index( font->ft_face, uc), uc, &(font->atlas), NULL);
 /* Not needed ?
  * 					if( asg->lead >= 0 || asg->lead+asg->width > 3 )
  *						font->pen_move_dir = LEFT_TO_RIGHT ;
@@ -1263,7 +1888,7 @@ load_freetype_glyphs( ASFont *font )
 	 	font->max_height = font->max_ascend+font->max_descend;
 	}
 	/* flushing out compression buffer : */
-	load_glyph_freetype(NULL, NULL, 0, 0);
+	load_glyph_freetype(NULL, NULL, 0, 0, NULL, NULL);
 	return max_ascend+max_descend;
 }
 #endif
@@ -1293,8 +1918,8 @@ LOCAL_DEBUG_OUT( "Found glyph for char %lu (%p)", uc, asg );
 		asg = load_freetype_locale_glyph( font, uc );
 LOCAL_DEBUG_OUT( "glyph for char %lu  loaded as %p", uc, asg );
 #endif
-	}else
-		asg = hdata.vptr ;
+	}else if( (asg = hdata.vptr) != NULL ) 
+		((ASLazyGlyph*)asg)->last_used = font->glyphs_clock ;
 LOCAL_DEBUG_OUT( "%sFound glyph for char %lu ( %p )", asg?"":"Did not ", uc, asg );
 	return asg?asg:&(font->default_glyph) ;
 }
@@ -1558,6 +2183,7 @@ get_text_glyph_list (const char *text, ASFont *font, ASCharType char_type, int l
 		if ((length = get_text_length (char_type, text)) <= 0)
 			return NULL;
 	
+	trim_asfont_glyphs( font );
 	glyphs = safecalloc( length+1, sizeof(ASGlyph*));
 	if (char_type == ASCT_Char)
 	{
@@ -1674,6 +2300,7 @@ get_text_size_internal( const char *src_text, ASFont *font, ASTextAttributes *at
 	if( src_text == NULL || font == NULL )
 		return False;
 	
+	trim_asfont_glyphs( font );
 	offset_3d_x += font->spacing_x ;
 	offset_3d_y += font->spacing_y ;
 
@@ -1867,8 +2494,26 @@ draw_text_internal( const char *text, ASFont *font, ASTextAttributes *attr, int
 	int offset_3d_x = 0, offset_3d_y = 0  ;
 	CARD32 back_color = 0 ;
 	CARD32 alpha_7 = 0x007F, alpha_9 = 0x009F, alpha_A = 0x00AF, alpha_C = 0x00CF, alpha_F = 0x00FF, alpha_E = 0x00EF;
+	ASTextRun *run = NULL ;
 	START_TIME(started);	   
 
+	if( text == NULL || font == NULL ) 
+		return NULL;
+	trim_asfont_glyphs( font );
+	/* line breaking below alters the text, so we can't cache that : */
+	if( attr->width == 0 ) 
+	{
+		ASTextRun *cached ;
+		run = safecalloc( 1, sizeof(ASTextRun));
+		run->hash = make_text_run_key( run, text, attr, compression, length );
+		if( (cached = find_text_run( font, run )) != NULL ) 
+		{
+			free( run->key );
+			free( run );
+			return clone_asimage( cached->im, SCL_DO_ALL );
+		}
+	}
+
 	// Perform line breaks if a fixed width is specified
 	// TODO: this is a quick and dirty fix and should work for now, but we really should fix it 
 	// so we don't have to calculate text size so many times as well as make it UNICODE friendly
@@ -1896,11 +2541,15 @@ draw_text_internal( const char *text, ASFont *font, ASTextAttributes *attr, int
 	}	    
 
 LOCAL_DEBUG_CALLER_OUT( "text = \"%s\", font = %p, compression = %d", text, font, compression );
-	if( !get_text_glyph_map( text, font, &map, attr, length) )
-		return NULL;
-	
-	if( map.width <= 0 ) 
+	if( !get_text_glyph_map( text, font, &map, attr, length) || map.width <= 0 )
+	{
+		if( run ) 
+		{
+			free( run->key );
+			free( run );
+		}
 		return NULL;
+	}
 
 	apply_text_3D_type( attr->type, &offset_3d_x, &offset_3d_y );
 
@@ -2104,6 +2753,18 @@ LOCAL_DEBUG_OUT( "line_height is %d, space_size is %d, base_line is %d", line_he
 		free( rgb_memory );
 	if( rgb_scanlines ) 
 		free( rgb_scanlines );
+	if( run ) 
+	{
+		if( im->width*im->height <= ASFONT_TEXT_RUN_MAX_PIXELS ) 
+		{	
+			run->im = clone_asimage( im, SCL_DO_ALL );
+			add_text_run( font, run );
+		}else
+		{
+			free( run->key );
+			free( run );
+		}
+	}
 	SHOW_TIME("", started);
 	return im;
 }
@@ -2171,6 +2832,7 @@ Bool set_asfont_glyph_spacing( ASFont* font, int x, int y )
 	{
 		font->spacing_x = (x < 0 )? 0: x;
 		font->spacing_y = (y < 0 )? 0: y;
+		flush_text_runs( font );
 		return True ;
 	}
 	return False ;
@@ -70,6 +70,17 @@ extern "C" {
 /* magic number identifying ASFont data structure */
 #define MAGIC_ASFONT            0xA3A3F098
 
+/****d* libAfterImage/ASFONT_GLYPH_CACHE_ENVVAR
+ * NAME
+ * ASFONT_GLYPH_CACHE_ENVVAR - name of the environment variable holding 
+ * the filename of glyph cache shared between processes.
+ * See set_font_manager_glyph_cache().
+ * SOURCE
+ */
+#define ASFONT_GLYPH_CACHE_ENVVAR	"AFTERIMAGE_GLYPH_CACHE"
+#define ASFONT_GLYPH_CACHE_DEFAULT_SIZE	(4*1024*1024)
+/*************/
+
 /****d* libAfterImage/ASFontType
  * NAME
  * ASFontType - Supported types of fonts - Xlib or FreeType 2
@@ -205,6 +216,20 @@ typedef struct ASFont
 	unsigned long	xrender_glyphset ;  /* GlyphSet is the actuall datatype, 
 										 * but for easier compilation - 
 										 * we use generic which is the same */ 
+
+	struct ASGlyphAtlas *atlas ;	/* pages that RLE encoded pixmaps of
+									 * all the glyphs are packed into */
+	struct ASTextRun *text_runs ;	/* recently rendered text, most 
+									 * recently used first */
+	int 			  text_runs_num ;
+	/* glyphs outside of ASCII range are loaded on first use, and 
+	 * least recently used of them are dropped when they take up too 
+	 * much memory : */
+	struct ASGlyphAtlas *lazy_atlas ;
+	size_t			  lazy_glyphs_memory ;
+	unsigned int	  glyphs_clock, glyphs_trim_clock ;
+	CARD32			  glyph_cache_id[2] ; /* identifies font file, face and
+										   * size in shared glyph cache */
 }ASFont;
 /*************/
 /****s* libAfterImage/ASFontManager
@@ -238,6 +263,7 @@ typedef struct ASFontManager
 #else
 	void       *pad ;
 #endif
+	struct ASGlyphCache *glyph_cache ; /* glyphs shared with other processes */
 }ASFontManager;
 /*************/
 
@@ -319,6 +345,8 @@ typedef struct ASTextAttributes
  * and if needed FreeType library is initialized as well.
  * ASFontManager object returned by this functions has to be open at all
  * times untill text drawing is no longer needed.
+ * If AFTERIMAGE_GLYPH_CACHE environment variable is set - glyph cache 
+ * in that file will be used. See set_font_manager_glyph_cache().
  *********/
 /****f* libAfterImage/asfont/destroy_font_manager()
  * NAME
@@ -340,6 +368,30 @@ typedef struct ASTextAttributes
 struct ASFontManager *create_font_manager( Display *dpy, const char * font_path, struct ASFontManager *reusable_memory );
 void    destroy_font_manager( struct ASFontManager *fontman, Bool reusable );
 
+/****f* libAfterImage/asfont/set_font_manager_glyph_cache()
+ * NAME
+ * set_font_manager_glyph_cache()
+ * SYNOPSIS
+ * Bool set_font_manager_glyph_cache( ASFontManager *fontman,
+ *                                    const char *filename,
+ *                                    size_t size );
+ * INPUTS
+ * fontman  - pointer to valid ASFontManager object.
+ * filename - file to keep glyphs in. NULL disables the cache.
+ * size     - size of the file to create, if it does not exist yet.
+ *            0 means ASFONT_GLYPH_CACHE_DEFAULT_SIZE.
+ * RETURN VALUE
+ * True if cache could be opened, False otherwise.
+ * DESCRIPTION
+ * Glyphs of FreeType fonts rendered by any process using the same cache
+ * file are stored in it, keyed by font file, face, size and glyph index.
+ * Other processes then map them read-only instead of rendering their own
+ * copy. When the file could not be opened or mapped, or once it fills up,
+ * glyphs are rendered and kept locally as usual.
+ * Cache can only be changed while there are no fonts open with fontman.
+ *********/
+Bool set_font_manager_glyph_cache( struct ASFontManager *fontman, const char *filename, size_t size );
+
 /****f* libAfterImage/asfont/open_freetype_font()
  * NAME
  * open_freetype_font()
@@ -423,6 +475,10 @@ void    destroy_font_manager( struct ASFontManager *fontman, Bool reusable );
  * loaded already, and if so - returns pointer to relevant structure.
  * Otherwise it tryes to load font as FreeType font first, and then
  * Xlib font, unless exact font type is specifyed.
+ * Only glyphs for ASCII characters are rendered right away for FreeType 
+ * fonts. Others are rendered when text using them is drawn for the first 
+ * time, and least recently used ones are unloaded if they take up more 
+ * then 256Kb.
  *********/
 /****f* libAfterImage/asfont/release_font()
  * NAME
@@ -476,6 +532,10 @@ int            release_font( struct ASFont *font );
 void    print_asfont( FILE* stream, struct ASFont* font);
 void 	print_asglyph( FILE* stream, struct ASFont* font, unsigned long c);
 
+/* Returns NULL terminated array of glyphs for the text. Glyphs outside 
+ * of ASCII range are loaded on demand and may get unloaded, when font is 
+ * used again, so returned pointers are valid only until next call to 
+ * get_text_glyph_list(), get_text_size() or draw_text() with that font. */
 ASGlyph** get_text_glyph_list (const char *text, ASFont *font, ASCharType char_type, int length);
 
 /****f* libAfterImage/asfont/draw_text()
@@ -520,6 +580,10 @@ ASGlyph** get_text_glyph_list (const char *text, ASFont *font, ASCharType char_t
  * channel of ASImage.
  * get_text_size() can be used to determine the size of the text about
  * to be drawn, so that appropriate drawable can be prepared.
+ * Each font keeps up to 64 most recently rendered pieces of text, and
+ * when same text is requested again with the same attributes, a copy
+ * sharing pixel data with the cached image is returned right away.
+ * Cache is flushed when font's glyph spacing changes.
  *********/
 struct ASImage *draw_text( const char *text,
 	                       struct ASFont *font, ASText3DType type,
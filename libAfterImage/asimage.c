@@ -117,6 +117,51 @@ Bool asimage_use_mmx = True;
 #else
 Bool asimage_use_mmx = False;
 #endif
+#ifdef HAVE_SSE2
+Bool asimage_use_sse2 = True;
+#else
+Bool asimage_use_sse2 = False;
+#endif
+#ifdef HAVE_AVX2
+Bool asimage_use_avx2 = True;
+#else
+Bool asimage_use_avx2 = False;
+#endif
+
+/* SSE2/AVX2 code paths are compiled with per-function target attributes,
+ * so we have to check that CPU actually has them before using them.
+ * Detection is done only once : */
+Bool
+asimage_sse2_supported()
+{
+#ifdef HAVE_SSE2
+	static int sse2_detected = -1 ;
+	if( sse2_detected < 0 )
+	{
+		__builtin_cpu_init();
+		sse2_detected = __builtin_cpu_supports("sse2")?1:0 ;
+	}
+	return ( asimage_use_sse2 && sse2_detected );
+#else
+	return False;
+#endif
+}
+
+Bool
+asimage_avx2_supported()
+{
+#ifdef HAVE_AVX2
+	static int avx2_detected = -1 ;
+	if( avx2_detected < 0 )
+	{
+		__builtin_cpu_init();
+		avx2_detected = __builtin_cpu_supports("avx2")?1:0 ;
+	}
+	return ( asimage_use_avx2 && avx2_detected );
+#else
+	return False;
+#endif
+}
 
 /* *********************   ASImage  ************************************/
 void
@@ -201,7 +246,10 @@ asimage_start (ASImage * im, unsigned int width, unsigned int height, unsigned i
 		alloc_asimage_channels( im );
 
 		if( compression == 0 ) 
+		{
 			set_flags( im->flags, ASIM_NO_COMPRESSION );
+			im->storage_policy = ASIM_STORAGE_AUTO ;
+		}
 	}
 }
 
@@ -697,7 +745,9 @@ flip_gradient( ASGradient *orig, int flip )
     grad->color = safemalloc( npoints*sizeof(ARGB32) );
     grad->offset = safemalloc( npoints*sizeof(double) );
 
-	if( get_flags(flip, FLIP_VERTICAL) )
+	if( get_flags(type, GRADIENT_TYPE_RADIAL|GRADIENT_TYPE_CONIC) )
+		;	/* symmetrical enough around the center */
+	else if( get_flags(flip, FLIP_VERTICAL) )
 	{
 		Bool upsidedown = get_flags(flip, FLIP_UPSIDEDOWN) ;
 		switch(type)
@@ -798,6 +848,73 @@ destroy_image_layers( register ASImageLayer *l, int count, Bool reusable )
 /* **********************************************************************/
 /*  Compression/decompression 										   */
 /* **********************************************************************/
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+/* scanlines of the same image may get stored from several threads at once 
+ * (see asthread.h) so storage policy sampling must be atomic : */
+#define POLICY_FETCH_ADD(var,val)	__sync_fetch_and_add(&(var),(val))
+#define POLICY_GET(var)				__sync_fetch_and_add(&(var),0)
+#define POLICY_SWITCH(var,from,to)	(void)__sync_bool_compare_and_swap(&(var),(from),(to))
+#else
+#define POLICY_FETCH_ADD(var,val)	(((var)+=(val))-(val))
+#define POLICY_GET(var)				(var)
+#define POLICY_SWITCH(var,from,to)	do{ if((var)==(from)) (var)=(to); }while(0)
+#endif
+
+int 
+set_asimage_storage_policy( ASImage *im, int policy )
+{
+	int old_policy = ASIM_STORAGE_RLE ;
+	if( !AS_ASSERT(im) )
+	{
+		old_policy = im->storage_policy ;
+		if( policy == ASIM_STORAGE_AUTO ) 
+		{
+			im->storage_sampled_lines = 0 ;
+			im->storage_sampled_raw = 0 ;
+			im->storage_sampled_stored = 0 ;
+		}else if( policy != ASIM_STORAGE_RAW ) 
+			policy = ASIM_STORAGE_RLE ;
+		im->storage_policy = policy ;
+	}
+	return old_policy;
+}
+
+int 
+get_asimage_storage_policy( ASImage *im )
+{
+	return AS_ASSERT(im)?ASIM_STORAGE_RLE:POLICY_GET(im->storage_policy);
+}
+
+static inline ASFlagType 
+asimage_line_compression( ASImage *im )
+{
+	return (POLICY_GET(im->storage_policy) == ASIM_STORAGE_RAW)? 0 : ASStorage_RLEDiffCompress ;
+}
+
+/* with ASIM_STORAGE_AUTO - accounts for compression of the stored line, and 
+ * picks final policy once enough lines have been stored : */
+static inline void
+sample_asimage_storage( ASImage *im, ASStorageID id )
+{
+	ASStorageSlot slot ;
+
+	if( POLICY_GET(im->storage_policy) != ASIM_STORAGE_AUTO )
+		return;
+	if( !query_storage_slot( NULL, id, &slot ) )
+		return;
+	POLICY_FETCH_ADD( im->storage_sampled_raw, slot.uncompressed_size );
+	POLICY_FETCH_ADD( im->storage_sampled_stored, slot.size );
+	if( POLICY_FETCH_ADD( im->storage_sampled_lines, 1 ) == ASIM_STORAGE_SAMPLE_LINES-1 )
+	{
+		unsigned long raw = POLICY_GET(im->storage_sampled_raw) ;
+		unsigned long stored = POLICY_GET(im->storage_sampled_stored) ;
+		int policy = ( stored*100 > raw*(100-ASIM_STORAGE_MIN_SAVINGS) )? ASIM_STORAGE_RAW : ASIM_STORAGE_RLE ;
+		
+		LOCAL_DEBUG_OUT( "image %p : sampled %lu bytes stored in %lu - switching to policy %d", im, raw, stored, policy );
+		POLICY_SWITCH( im->storage_policy, ASIM_STORAGE_AUTO, policy );
+	}
+}
+
 size_t
 asimage_add_line_mono (ASImage * im, ColorPart color, CARD8 value, unsigned int y)
 {
@@ -821,37 +938,43 @@ asimage_add_line (ASImage * im, ColorPart color, register CARD32 * data, unsigne
 		return 0;
 	if( im->channels[color][y] ) 
 		forget_data( NULL, im->channels[color][y] ); 
-	im->channels[color][y] = store_data( NULL, (CARD8*)data, im->width*4, ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+	im->channels[color][y] = store_data( NULL, (CARD8*)data, im->width*4, asimage_line_compression(im)|ASStorage_32Bit, 0);
+	sample_asimage_storage( im, im->channels[color][y] );
 	return im->width;
 }
 
 size_t
 asimage_add_line_bgra (ASImage * im, register CARD32 * data, unsigned int y)
 {
+	ASFlagType compression ;
+	int i ;
 	if (AS_ASSERT(im) )
 		return 0;
 	if (y >= im->height)
 		return 0;
+	compression = asimage_line_compression(im) ;
 	if( im->channels[IC_ALPHA][y] ) 
 		forget_data( NULL, im->channels[IC_ALPHA][y] ); 
 	im->channels[IC_ALPHA][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_24BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											compression|ASStorage_32Bit, 0);
 	if( im->channels[IC_RED][y] ) 
 		forget_data( NULL, im->channels[IC_RED][y] ); 
 	im->channels[IC_RED][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_16BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											compression|ASStorage_32Bit, 0);
 	if( im->channels[IC_GREEN][y] ) 
 		forget_data( NULL, im->channels[IC_GREEN][y] ); 
 	im->channels[IC_GREEN][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_8BitShift|ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											compression|ASStorage_32Bit, 0);
 	if( im->channels[IC_BLUE][y] ) 
 		forget_data( NULL, im->channels[IC_BLUE][y] ); 
 	im->channels[IC_BLUE][y] = store_data( NULL, (CARD8*)data, im->width*4, 
 	                                        ASStorage_Masked|
-											ASStorage_RLEDiffCompress|ASStorage_32Bit, 0);
+											compression|ASStorage_32Bit, 0);
+	for( i = 0 ; i < IC_NUM_CHANNELS ; ++i ) 
+		sample_asimage_storage( im, im->channels[i][y] );
 	return im->width;
 }
 
@@ -1249,6 +1372,7 @@ clone_asimage( ASImage *src, ASFlagType filter )
 		if( get_flags( src->flags, ASIM_DATA_NOT_USEFUL ) )
 			set_flags( dst->flags, ASIM_DATA_NOT_USEFUL );
 		dst->back_color = src->back_color ;
+		set_asimage_storage_policy( dst, get_asimage_storage_policy( src ) );
 		for( chan = 0 ; chan < IC_NUM_CHANNELS;  chan++ )
 			if( get_flags( filter, 0x01<<chan) )
 			{
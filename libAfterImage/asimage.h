@@ -185,6 +185,14 @@ typedef struct ASImage
 #define ASIM_NAME_IS_FILENAME	(0x01<<7)
 
   ASFlagType			 flags ;    /* combination of the above flags */
+
+  int                    storage_policy ; /* how scanlines are stored - see
+									 * set_asimage_storage_policy() */
+  unsigned int           storage_sampled_lines ;
+  unsigned int           storage_sampled_raw, storage_sampled_stored ;
+  									/* sizes of scanlines stored while
+									 * ASIM_STORAGE_AUTO policy is being
+									 * decided upon */
   
 } ASImage;
 /*******/
@@ -332,12 +340,21 @@ typedef struct ASImageLayer
  * GRADIENT_TYPE_ORIENTATION will cause gradient direction to be rotated 
  * by 90 degrees. When combined with GRADIENT_TYPE_DIAG - rotates gradient 
  * direction by 135 degrees.
+ * NAME
+ * GRADIENT_TYPE_RADIAL makes gradient go from the center of the image
+ * (offset 0.) to its corners (offset 1.). Other flags are ignored then.
+ * NAME
+ * GRADIENT_TYPE_CONIC makes gradient sweep around the center of the
+ * image clockwise, starting and ending at 3 o'clock. Other flags are
+ * ignored then.
  * SOURCE
  */
 #define GRADIENT_TYPE_DIAG          (0x01<<0)
 #define GRADIENT_TYPE_ORIENTATION   (0x01<<1)
 #define GRADIENT_TYPE_MASK          (GRADIENT_TYPE_ORIENTATION| \
 									 GRADIENT_TYPE_DIAG)
+#define GRADIENT_TYPE_RADIAL        (0x01<<2)
+#define GRADIENT_TYPE_CONIC         (0x01<<3)
 /********/
 
 /****d* libAfterImage/asimage/GRADIENT_TYPE
@@ -351,6 +368,10 @@ typedef struct ASImageLayer
  * GRADIENT_Top2Bottom vertical top to bottom gradient.
  * NAME 
  * GRADIENT_BottomLeft2TopRight diagonal bottom-left to top-right.
+ * NAME 
+ * GRADIENT_Radial from the center outwards.
+ * NAME 
+ * GRADIENT_Conic clockwise around the center.
  * SOURCE
  */
 #define GRADIENT_Left2Right        		0
@@ -358,6 +379,8 @@ typedef struct ASImageLayer
 #define GRADIENT_Top2Bottom				GRADIENT_TYPE_ORIENTATION
 #define GRADIENT_BottomLeft2TopRight    (GRADIENT_TYPE_DIAG| \
  									 	 GRADIENT_TYPE_ORIENTATION)
+#define GRADIENT_Radial					GRADIENT_TYPE_RADIAL
+#define GRADIENT_Conic					GRADIENT_TYPE_CONIC
 /********/
 
 /****s* libAfterImage/ASGradient
@@ -366,7 +389,8 @@ typedef struct ASImageLayer
  * DESCRIPTION
  * libAfterImage includes functionality to draw multipoint gradients in
  * 4 different directions left->right, top->bottom and diagonal
- * lefttop->rightbottom and bottomleft->topright. Each gradient described
+ * lefttop->rightbottom and bottomleft->topright, as well as radial and
+ * conic gradients around the center of the image. Each gradient described
  * by type, number of colors (or anchor points), ARGB values for each
  * color and offsets of each point from the beginning of gradient in
  * fractions of entire length. There should be at least 2 anchor points.
@@ -445,7 +469,57 @@ typedef struct ASGradient
 #define ASIM_COMPRESSION_NONE       0
 #define ASIM_COMPRESSION_FULL	   100
 
+/****d* libAfterImage/asimage/storage_policy
+ * FUNCTION
+ * Defines how scanlines of ASImage are kept in ASStorage.
+ * NAME 
+ * ASIM_STORAGE_RLE defined as 0 - RLE compress scanlines. That is the 
+ * default, as it saves lots of memory on typical UI images.
+ * NAME 
+ * ASIM_STORAGE_RAW defined as 1 - store scanlines uncompressed, which 
+ * saves CPU time on storing and decoding them. Good for short lived 
+ * images, like intermediate results of transformations.
+ * NAME 
+ * ASIM_STORAGE_AUTO defined as 2 - RLE compress first 
+ * ASIM_STORAGE_SAMPLE_LINES scanlines stored, and then switch to 
+ * ASIM_STORAGE_RAW if compression saved less then 
+ * ASIM_STORAGE_MIN_SAVINGS percent of memory, or to ASIM_STORAGE_RLE 
+ * otherwise. Used for images created with ASIM_COMPRESSION_NONE.
+ * SEE ALSO
+ * set_asimage_storage_policy()
+ ********/
+#define ASIM_STORAGE_RLE			0
+#define ASIM_STORAGE_RAW			1
+#define ASIM_STORAGE_AUTO			2
+
+#define ASIM_STORAGE_SAMPLE_LINES	16
+#define ASIM_STORAGE_MIN_SAVINGS	25  /* percent */
+
 extern Bool asimage_use_mmx ;
+/****d* libAfterImage/asimage/asimage_use_sse2
+ * NAME
+ * asimage_use_sse2
+ * NAME
+ * asimage_use_avx2
+ * NAME
+ * asimage_sse2_supported()
+ * NAME
+ * asimage_avx2_supported()
+ * SYNOPSIS
+ * Bool asimage_sse2_supported();
+ * Bool asimage_avx2_supported();
+ * DESCRIPTION
+ * asimage_use_sse2 and asimage_use_avx2 are set to True when library has
+ * been compiled with SSE2/AVX2 code paths. Application can set them to
+ * False to force use of plain C code.
+ * asimage_sse2_supported() and asimage_avx2_supported() return True only
+ * if respective flag is set AND CPU we are running on supports that
+ * instruction set. CPU is queried only once.
+ ********/
+extern Bool asimage_use_sse2 ;
+extern Bool asimage_use_avx2 ;
+Bool asimage_sse2_supported();
+Bool asimage_avx2_supported();
 
 /****f* libAfterImage/asimage/asimage_init()
  * NAME 
@@ -483,6 +557,8 @@ extern Bool asimage_use_mmx ;
  * compression - level of compression to perform on image data.
  *               compression has to be in range of 0-100 with 100
  *               signifying highest level of compression.
+ *               ASIM_COMPRESSION_NONE selects ASIM_STORAGE_AUTO storage 
+ *               policy, anything else - ASIM_STORAGE_RLE.
  * NOTES
  * In order to resize ASImage structure after asimage_start() has been
  * called, asimage_init() must be invoked to free all the memory, and
@@ -560,6 +636,33 @@ ASImage *create_static_asimage( unsigned int width, unsigned int height, unsigne
 ASImage *clone_asimage( ASImage *src, ASFlagType filter );
 void destroy_asimage( ASImage **im );
 Bool asimage_replace (ASImage *im, ASImage *from);
+/****f* libAfterImage/asimage/set_asimage_storage_policy()
+ * NAME
+ * set_asimage_storage_policy()
+ * NAME
+ * get_asimage_storage_policy()
+ * SYNOPSIS
+ * int set_asimage_storage_policy( ASImage *im, int policy );
+ * int get_asimage_storage_policy( ASImage *im );
+ * INPUTS
+ * im				- pointer to valid ASImage structure.
+ * policy           - one of ASIM_STORAGE_RLE, ASIM_STORAGE_RAW, 
+ *                    ASIM_STORAGE_AUTO.
+ * RETURN VALUE
+ * set_asimage_storage_policy() returns previous policy.
+ * get_asimage_storage_policy() returns current policy. Once 
+ * ASIM_STORAGE_AUTO has seen enough scanlines it is replaced with 
+ * ASIM_STORAGE_RAW or ASIM_STORAGE_RLE.
+ * DESCRIPTION
+ * Selects the way scanlines stored into the image from now on are kept
+ * in memory. Scanlines already stored are not affected. Both kinds of 
+ * scanlines could be mixed in the same image, and decoding works the 
+ * same for both.
+ * SEE ALSO
+ * storage_policy
+ *********/
+int set_asimage_storage_policy( ASImage *im, int policy );
+int get_asimage_storage_policy( ASImage *im );
 /****f* libAfterImage/asimage/set_asimage_vector()
  * NAME
  * set_asimage_vector() This function replaces contents of the vector 
@@ -100,7 +100,9 @@ static char* cdata_str = XML_CDATA_STR;
  * 	gradient  - render multipoint gradient.
  * 	mirror    - create mirror copy of an image.
  * 	blur      - perform gaussian blur on an image.
- * 	rotate    - rotate/flip image in 90 degree increments.
+ * 	rotate    - rotate image by arbitrary angle.
+ * 	transform - apply arbitrary affine transformation (skew, etc.) to an
+ *              image.
  * 	scale     - scale an image to arbitrary size.
  * 	slice     - enlarge image to arbitrary size leaving corners unchanged.
  * 	crop      - crop an image to arbitrary size.
@@ -142,6 +144,38 @@ static char* cdata_str = XML_CDATA_STR;
 static ASImageManager *_as_xml_image_manager = NULL ;
 static ASFontManager *_as_xml_font_manager = NULL ;
 
+/* memoization state of the compiled pipeline currently being run : */
+typedef struct ASImageXMLNode
+{
+	CARD32 	 key[2] ;  		/* hash of the subtree and of everything it reads */
+	ASImage *memo ;			/* result built for that key, kept in pipeline's memo */
+}ASImageXMLNode;
+
+struct ASImageXMLPipeline
+{
+	ASVisual 		*asv;
+	ASImageManager 	*imman, *own_imman ;
+	ASFontManager 	*fontman, *own_fontman ;
+	ASFlagType 		 flags ;
+	int 			 verbose ;
+	Window 			 display_win ;
+	char 			*path ;
+
+	xml_elem_t 		*doc ;
+	ASHashTable 	*nodes ;		/* xml_elem_t* -> ASImageXMLNode* for memoizable tags */
+	ASImageManager 	*memo ;
+	unsigned long 	 memo_serial ;
+
+	char 		   **stored_ids ;	/* ids stored in imman by the last run */
+	int 			 stored_ids_num, stored_ids_size ;
+
+	ASImage 		*scaled, *scaled_src ;	/* last result scaled to the target size */
+};
+
+static ASImageXMLPipeline *_as_xml_pipeline = NULL ;
+
+static ASImage *scale_xml_pipeline_result( ASImageXMLPipeline *pipeline, ASImage *im, int width, int height );
+
 void set_xml_image_manager( ASImageManager *imman )
 {
 	_as_xml_image_manager = imman ;
@@ -201,8 +235,13 @@ compose_asimage_xml_from_doc(ASVisual *asv, ASImageManager *imman, ASFontManager
 	ASImage* im = NULL;
 	ASImageManager *my_imman = imman, *old_as_xml_imman = _as_xml_image_manager ;
 	ASFontManager  *my_fontman = fontman, *old_as_xml_fontman = _as_xml_font_manager ;
+	ASImageXMLPipeline *old_as_xml_pipeline = _as_xml_pipeline ;
 	int my_imman_curr_dir_path_idx = MAX_SEARCH_PATHS ;
 
+	/* documents included while running a pipeline are not part of it : */
+	if( _as_xml_pipeline && _as_xml_pipeline->doc != doc )
+		_as_xml_pipeline = NULL ;
+
 	if (doc)
 	{
 		int old_target_width = -1;
@@ -267,7 +306,11 @@ compose_asimage_xml_from_doc(ASVisual *asv, ASImageManager *imman, ASFontManager
 			int scale_height = (target_height>0)?target_height:im->height;
 			if (im->width != scale_width || im->height != scale_height)
 			  {
-			  	ASImage *tmp = scale_asimage( asv, im, scale_width, scale_height, ASA_ASImage, 100, ASIMAGE_QUALITY_DEFAULT );
+			  	ASImage *tmp ;
+				if( _as_xml_pipeline )
+					tmp = scale_xml_pipeline_result( _as_xml_pipeline, im, scale_width, scale_height );
+				else
+					tmp = scale_asimage( asv, im, scale_width, scale_height, ASA_ASImage, 100, ASIMAGE_QUALITY_DEFAULT );
 				if (tmp != NULL)
 				  {
 				  	safe_asimage_destroy(im);
@@ -301,6 +344,7 @@ LOCAL_DEBUG_OUT( "result im = %p, im->imman	= %p, my_imman = %p, im->magic = %8.
 		_as_xml_font_manager =  old_as_xml_fontman ;
 
 	}
+	_as_xml_pipeline = old_as_xml_pipeline ;
 	LOCAL_DEBUG_OUT( "returning im = %p, im->imman	= %p, im->magic = %8.8lX", im, im?im->imageman:NULL, im?im->magic:0 );
 	return im;
 }
@@ -325,12 +369,332 @@ compose_asimage_xml(ASVisual *asv, ASImageManager *imman, ASFontManager *fontman
 	return im;
 }
 
+/* Compiled pipelines :
+ * tags that neither read nor modify anything but their own attributes,
+ * their subtags and variables are memoized by the hash of all of those,
+ * so that re-running the same document only rebuilds the tags whose
+ * inputs have changed. */
+#define ASXML_NODE_IMPURE 		(0x01<<0)
+#define ASXML_NODE_DEFINES_ID 	(0x01<<1)
 
-Bool save_asimage_to_file(const char *file2bsaved, ASImage *im,
-	           const char *strtype,
-			   const char *compress,
-			   const char *opacity,
-			   int delay, int replace)
+static void
+destroy_xml_pipeline_node( ASHashableValue value, void *data )
+{
+	ASImageXMLNode *node = (ASImageXMLNode*)data ;
+	if( node )
+	{
+		if( node->memo )
+			release_asimage( node->memo );
+		free( node );
+	}
+}
+
+static ASFlagType
+compile_xml_node( ASImageXMLPipeline *pipeline, xml_elem_t *doc )
+{
+	static const char *impure_tags[] = { "recall", "release", "save", "set", "printf", "color", "if", "unless", NULL };
+	ASFlagType node_flags = 0, sub_flags = 0 ;
+	xml_elem_t *parm, *ptr ;
+	int i ;
+
+	if( IsCDATA(doc) )
+		return 0;
+
+	for( ptr = doc->child ; ptr ; ptr = ptr->next )
+		sub_flags |= compile_xml_node( pipeline, ptr );
+
+	for( i = 0 ; impure_tags[i] ; ++i )
+		if( !strcmp( doc->tag, impure_tags[i] ) )
+			set_flags( node_flags, ASXML_NODE_IMPURE );
+
+	parm = xml_parse_parm(doc->parm, NULL);
+	for( ptr = parm ; ptr ; ptr = ptr->next )
+	{
+		if( !strcmp(ptr->tag, "id") )
+			set_flags( node_flags, ASXML_NODE_DEFINES_ID );
+		else if( !strcmp(ptr->tag, "fgimage") || !strcmp(ptr->tag, "bgimage") ||
+				 !strcmp(ptr->tag, "srcid") || !strcmp(ptr->tag, "default_src") ||
+				 (!strcmp(ptr->tag, "src") && !strcmp(ptr->parm, "xroot:")) )
+			set_flags( node_flags, ASXML_NODE_IMPURE );
+	}
+	xml_elem_delete(NULL, parm);
+
+	/* images named inside of the subtree must be stored on every run,
+	 * so only the named tag itself may be recalled from memo : */
+	if( !get_flags( node_flags|sub_flags, ASXML_NODE_IMPURE ) &&
+		!get_flags( sub_flags, ASXML_NODE_DEFINES_ID ) )
+		add_hash_item( pipeline->nodes, AS_HASHABLE(doc), safecalloc( 1, sizeof(ASImageXMLNode)) );
+
+	return node_flags|sub_flags;
+}
+
+static inline void
+hash_xml_string( CARD32 *key, const char *str )
+{
+	register CARD32 h1 = key[0], h2 = key[1] ;
+	if( str )
+		for( ; *str ; ++str )
+		{
+			h1 = (h1 ^ (CARD8)*str)*16777619U ;
+			h2 = h2*31 + (CARD8)*str ;
+		}
+	/* terminator keeps "ab","c" apart from "a","bc" */
+	key[0] = (h1 ^ 0xFF)*16777619U ;
+	key[1] = h2*31 + 0xFF ;
+}
+
+static void
+hash_xml_int( CARD32 *key, int val )
+{
+	char buf[32] ;
+	sprintf( buf, "%d", val );
+	hash_xml_string( key, buf );
+}
+
+static void
+hash_xml_subtree( CARD32 *key, xml_elem_t *doc, ASImageManager *imman )
+{
+	hash_xml_string( key, doc->tag );
+	hash_xml_string( key, doc->parm );
+	if( !IsCDATA(doc) )
+	{
+		xml_elem_t *parm = xml_parse_parm(doc->parm, NULL);
+		xml_elem_t *ptr ;
+
+		for( ptr = parm ; ptr ; ptr = ptr->next )
+		{
+			const char *val = ptr->parm ;
+			if( !strcmp(ptr->tag, "refid") )
+			{
+				ASImage *refimg = fetch_asimage( imman, val );
+				hash_xml_int( key, refimg?(int)refimg->width:-1 );
+				hash_xml_int( key, refimg?(int)refimg->height:-1 );
+				if( refimg )
+					release_asimage( refimg );
+			}
+			/* same variable syntax as parse_math() */
+			while( val && (val = strchr( val, '$' )) != NULL )
+			{
+				int len = 0 ;
+				char *name ;
+				++val ;
+				while( val[len] && !isspace((int)val[len]) && strchr( "+-*/!)", val[len] ) == NULL )
+					++len ;
+				name = mystrndup( val, len );
+				hash_xml_string( key, name );
+				hash_xml_int( key, asxml_var_get( name ) );
+				free( name );
+				val += len ;
+			}
+		}
+		xml_elem_delete(NULL, parm);
+
+		for( ptr = doc->child ; ptr ; ptr = ptr->next )
+			hash_xml_subtree( key, ptr, imman );
+	}
+	hash_xml_string( key, NULL );
+}
+
+static ASImage *
+recall_xml_memo( ASImageManager *imman, xml_elem_t *doc, ASImageXMLNode **node_ret )
+{
+	ASHashData hdata = {0} ;
+	ASImageXMLNode *node ;
+	CARD32 key[2] = { 2166136261U, 5381 };
+
+	*node_ret = NULL ;
+	if( _as_xml_pipeline == NULL ||
+		get_hash_item( _as_xml_pipeline->nodes, AS_HASHABLE(doc), &hdata.vptr ) != ASH_Success )
+		return NULL;
+
+	node = (ASImageXMLNode*)hdata.vptr ;
+	hash_xml_subtree( key, doc, imman );
+	if( node->memo && node->key[0] == key[0] && node->key[1] == key[1] )
+		return dup_asimage( node->memo );
+
+	if( node->memo )
+	{
+		release_asimage( node->memo );
+		node->memo = NULL ;
+	}
+	node->key[0] = key[0] ;
+	node->key[1] = key[1] ;
+	*node_ret = node ;
+	return NULL;
+}
+
+static ASImage *
+memoize_xml_result( ASImageXMLNode *node, ASImage *result )
+{
+	ASImageXMLPipeline *pipeline = _as_xml_pipeline ;
+	ASImage *memo = result ;
+	char name[64] ;
+
+	/* images owned by someone else are cheap to clone - rows are refcounted */
+	if( result->imageman != NULL )
+		memo = clone_asimage( result, SCL_DO_ALL );
+	if( memo == NULL )
+		return result;
+
+	sprintf( name, "memo.%lu", ++(pipeline->memo_serial) );
+	if( store_asimage( pipeline->memo, memo, name ) )
+	{
+		node->memo = memo ;
+		if( memo == result )
+			dup_asimage( result );
+	}else if( memo != result )
+		destroy_asimage( &memo );
+	return result;
+}
+
+static void
+remember_xml_pipeline_id( ASImageXMLPipeline *pipeline, const char *id )
+{
+	if( pipeline->stored_ids_num >= pipeline->stored_ids_size )
+	{
+		pipeline->stored_ids_size += 16 ;
+		pipeline->stored_ids = realloc( pipeline->stored_ids, pipeline->stored_ids_size*sizeof(char*) );
+	}
+	pipeline->stored_ids[pipeline->stored_ids_num++] = mystrdup( id );
+}
+
+static void
+forget_xml_pipeline_ids( ASImageXMLPipeline *pipeline )
+{
+	while( pipeline->stored_ids_num > 0 )
+	{
+		char *id = pipeline->stored_ids[--(pipeline->stored_ids_num)] ;
+		release_asimage_by_name( pipeline->imman, id );
+		free( id );
+	}
+}
+
+static ASImage *
+scale_xml_pipeline_result( ASImageXMLPipeline *pipeline, ASImage *im, int width, int height )
+{
+	ASImage *tmp ;
+	char name[64] ;
+
+	if( pipeline->scaled && pipeline->scaled_src == im &&
+		(int)pipeline->scaled->width == width && (int)pipeline->scaled->height == height )
+		return dup_asimage( pipeline->scaled );
+
+	tmp = scale_asimage( pipeline->asv, im, width, height, ASA_ASImage, 100, ASIMAGE_QUALITY_DEFAULT );
+	/* only memoized results stay the same from one run to the next : */
+	if( tmp && im->imageman == pipeline->memo )
+	{
+		if( pipeline->scaled )
+		{
+			release_asimage( pipeline->scaled );
+			release_asimage( pipeline->scaled_src );
+			pipeline->scaled = pipeline->scaled_src = NULL ;
+		}
+		sprintf( name, "memo.%lu", ++(pipeline->memo_serial) );
+		if( store_asimage( pipeline->memo, tmp, name ) )
+		{
+			pipeline->scaled = tmp ;
+			pipeline->scaled_src = dup_asimage( im );
+			dup_asimage( tmp );
+		}
+	}
+	return tmp;
+}
+
+ASImageXMLPipeline *
+compile_asimage_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontman, char *doc_str, ASFlagType flags, int verbose, Window display_win, const char *path )
+{
+	ASImageXMLPipeline *pipeline = NULL ;
+	xml_elem_t *doc = xml_parse_doc(doc_str, NULL);
+
+	if( doc )
+	{
+		xml_elem_t *ptr ;
+
+		pipeline = safecalloc( 1, sizeof(ASImageXMLPipeline) );
+		pipeline->asv = asv ;
+		pipeline->flags = flags ;
+		pipeline->verbose = verbose ;
+		pipeline->display_win = display_win ;
+		pipeline->path = mystrdup( path );
+		pipeline->doc = doc ;
+		if( imman == NULL )
+			imman = pipeline->own_imman = create_generic_imageman( path );
+		if( fontman == NULL )
+			fontman = pipeline->own_fontman = create_generic_fontman( asv->dpy, path );
+		pipeline->imman = imman ;
+		pipeline->fontman = fontman ;
+		pipeline->memo = create_image_manager( NULL, 0.0, NULL );
+		pipeline->nodes = create_ashash( 0, pointer_hash_value, NULL, destroy_xml_pipeline_node );
+
+		for( ptr = doc->child ; ptr ; ptr = ptr->next )
+			compile_xml_node( pipeline, ptr );
+	}
+	return pipeline;
+}
+
+ASImage *
+run_asimage_xml_pipeline( ASImageXMLPipeline *pipeline, int target_width, int target_height )
+{
+	ASImage *im = NULL ;
+
+	if( pipeline )
+	{
+		ASImageXMLPipeline *old_as_xml_pipeline = _as_xml_pipeline ;
+
+		/* ids from the last run would otherwise shadow this run's images */
+		forget_xml_pipeline_ids( pipeline );
+		_as_xml_pipeline = pipeline ;
+		im = compose_asimage_xml_from_doc( pipeline->asv, pipeline->imman, pipeline->fontman, pipeline->doc,
+										   pipeline->flags, pipeline->verbose, pipeline->display_win, pipeline->path,
+										   target_width, target_height );
+		_as_xml_pipeline = old_as_xml_pipeline ;
+
+		if( im && im->imageman != NULL )
+		{/* caller must be free to keep result around after pipeline is gone : */
+			ASImage *tmp = clone_asimage( im, SCL_DO_ALL );
+			safe_asimage_destroy( im );
+			im = tmp ;
+		}
+	}
+	return im;
+}
+
+void
+destroy_asimage_xml_pipeline( ASImageXMLPipeline **ppipeline )
+{
+	if( ppipeline && *ppipeline )
+	{
+		ASImageXMLPipeline *pipeline = *ppipeline ;
+
+		forget_xml_pipeline_ids( pipeline );
+		if( pipeline->stored_ids )
+			free( pipeline->stored_ids );
+		if( pipeline->scaled )
+		{
+			release_asimage( pipeline->scaled );
+			release_asimage( pipeline->scaled_src );
+		}
+		destroy_ashash( &(pipeline->nodes) );
+		destroy_image_manager( pipeline->memo, False );
+		if( pipeline->own_imman )
+			destroy_image_manager( pipeline->own_imman, False );
+		if( pipeline->own_fontman )
+			destroy_font_manager( pipeline->own_fontman, False );
+		xml_elem_delete( NULL, pipeline->doc );
+		if( pipeline->path )
+			free( pipeline->path );
+		free( pipeline );
+		*ppipeline = NULL ;
+	}
+}
+
+
+static Bool
+parse_save_params( ASImageExportParams *params_ret,
+	           	   const char *strtype,
+			   	   const char *compress,
+			   	   const char *opacity,
+			   	   int delay )
 {
 	ASImageExportParams params ;
 
@@ -392,6 +756,20 @@ Bool save_asimage_to_file(const char *file2bsaved, ASImage *im,
 		show_error("File type not found.");
 		return(0);
 	}
+	*params_ret = params ;
+	return True;
+}
+
+Bool save_asimage_to_file(const char *file2bsaved, ASImage *im,
+	           const char *strtype,
+			   const char *compress,
+			   const char *opacity,
+			   int delay, int replace)
+{
+	ASImageExportParams params ;
+
+	if( !parse_save_params( &params, strtype, compress, opacity, delay ) )
+		return False;
 
 	if( replace && file2bsaved )
 		unlink( file2bsaved );
@@ -400,6 +778,23 @@ Bool save_asimage_to_file(const char *file2bsaved, ASImage *im,
 
 }
 
+Bool save_asimage_to_file_async(const char *file2bsaved, ASImage *im,
+	           const char *strtype,
+			   const char *compress,
+			   const char *opacity,
+			   int delay, int replace)
+{
+	ASImageExportParams params ;
+
+	if( !parse_save_params( &params, strtype, compress, opacity, delay ) )
+		return False;
+
+	if( replace && file2bsaved )
+		unlink( file2bsaved );
+
+	return ASImage2file_async(im, NULL, file2bsaved, params.type, &params, 0);
+}
+
 void show_asimage(ASVisual *asv, ASImage* im, Window w, long delay)
 {
 #ifndef X_DISPLAY_MISSING
@@ -464,6 +859,8 @@ ASImage *commit_xml_image_built( ASImageXMLState *state, char *id, ASImage *resu
 				/* normally generated image will be destroyed right away, so we need to
 			 	* increase ref count, in order to preserve it for future uses : */
 				dup_asimage( result );
+				if( _as_xml_pipeline && _as_xml_pipeline->imman == state->imman )
+					remember_xml_pipeline_id( _as_xml_pipeline, id );
 			}
 		}
 	}
@@ -1264,7 +1661,7 @@ handle_asxml_tag_if( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm)
  * NAME
  * gradient - render multipoint gradient.
  * SYNOPSIS
- * <gradient id="new_id" angle="degrees"
+ * <gradient id="new_id" angle="degrees" type="linear|radial|conic"
  *           refid="refid" width="pixels" height="pixels"
  *           colors ="color1 color2 color3 [...]"
  *           offsets="fraction1 fraction2 fraction3 [...]"/>
@@ -1291,6 +1688,10 @@ handle_asxml_tag_if( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm)
  *          direction of the gradient.  Currently the only supported
  *          values are 0, 45, 90, 135, 180, 225, 270, 315.  0 means left
  *          to right, 90 means top to bottom, etc.
+ * type     Optional.  Default is "linear". "radial" gradient goes from
+ *          the center of the image to its corners, and "conic" goes
+ *          clockwise around the center, starting at 3 o'clock. angle is
+ *          ignored for both.
  *****/
 static ASImage *
 handle_asxml_tag_gradient( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm, int width, int height)
@@ -1300,9 +1701,14 @@ handle_asxml_tag_gradient( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t*
 	double angle = 0;
 	char* color_str = NULL;
 	char* offset_str = NULL;
+	int analytic_type = 0 ;
 	LOCAL_DEBUG_OUT("doc = %p, parm = %p, width = %d, height = %d", doc, parm, width, height );
 	for (ptr = parm ; ptr ; ptr = ptr->next) {
 		if (!strcmp(ptr->tag, "angle")) angle = strtod(ptr->parm, NULL);
+		else if (!strcmp(ptr->tag, "type")) {
+			if (!mystrcasecmp(ptr->parm, "radial")) analytic_type = GRADIENT_Radial;
+			else if (!mystrcasecmp(ptr->parm, "conic")) analytic_type = GRADIENT_Conic;
+		}
 		else if (!strcmp(ptr->tag, "colors")) color_str = ptr->parm;
 		else if (!strcmp(ptr->tag, "offsets")) offset_str = ptr->parm;
 	}
@@ -1329,6 +1735,10 @@ handle_asxml_tag_gradient( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t*
 		} else {
 			gradient.type = GRADIENT_BottomLeft2TopRight;
 		}
+		if (analytic_type) {
+			gradient.type = analytic_type;
+			reverse = 0;
+		}
 		for (p = color_str ; isspace((int)*p) ; p++);
 		for (npoints1 = 0 ; *p ; npoints1++) {
 			if (*p) for ( ; *p && !isspace((int)*p) ; p++);
@@ -1774,15 +2184,16 @@ handle_asxml_tag_mirror( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* pa
 
 /****** libAfterImage/asimagexml/rotate
  * NAME
- * rotate - rotate an image in 90 degree increments (flip).
+ * rotate - rotate an image by arbitrary angle.
  * SYNOPSIS
- *  <rotate id="new_id" angle="degrees"
+ *  <rotate id="new_id" angle="degrees" filter="bilinear|bicubic"
  * 			width="pixels" height="pixels" refid="refid">
   * ATTRIBUTES
  * id       Optional. Image will be given this name for future reference.
- * angle    Required.  Given in degrees.  Possible values are currently
- *          "90", "180", and "270".  Rotates the image through the given
- *          angle.
+ * angle    Required.  Given in degrees.  Rotates the image
+ *          counterclockwise through the given angle.
+ * filter   Optional.  Default is "bilinear". Interpolation used for
+ *          angles other than multiples of 90 degrees.
  * width    Optional.  The result will have this width.
  * height   Optional.  The result will have this height.
  * refid    Optional.  An image ID defined with the "id" parameter for
@@ -1792,7 +2203,29 @@ handle_asxml_tag_mirror( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* pa
  * NOTES
  * This tag applies to the first image contained within the tag.  Any
  * further images will be discarded.
+ * Multiples of 90 degrees are done exactly by flipping the image. Any
+ * other angle resamples the image, and unless width and height are
+ * given, result is just large enough to fit rotated image, with
+ * transparent corners.
  ******/
+static int
+parse_asxml_transform_filter( const char *str )
+{
+	if( str && mystrcasecmp( str, "bicubic" ) == 0 )
+		return TRANSFORM_FILTER_BICUBIC ;
+	return TRANSFORM_FILTER_BILINEAR ;
+}
+
+static Bool
+asxml_tag_has_size( xml_elem_t* parm, const char *tag )
+{
+	xml_elem_t* ptr ;
+	for (ptr = parm ; ptr ; ptr = ptr->next)
+		if (!strcmp(ptr->tag, tag))
+			return True;
+	return False;
+}
+
 static ASImage *
 handle_asxml_tag_rotate( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm, ASImage *imtmp, int width, int height)
 {
@@ -1800,16 +2233,32 @@ handle_asxml_tag_rotate( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* pa
 	xml_elem_t* ptr ;
 	double angle = 0;
 	int dir = 0;
+	int filter = TRANSFORM_FILTER_BILINEAR ;
 	LOCAL_DEBUG_OUT("doc = %p, parm = %p, imtmp = %p, width = %d, height = %d", doc, parm, imtmp, width, height );
 	for (ptr = parm ; ptr ; ptr = ptr->next)
+	{
 		if (!strcmp(ptr->tag, "angle")) angle = strtod(ptr->parm, NULL);
+		else if (!strcmp(ptr->tag, "filter")) filter = parse_asxml_transform_filter(ptr->parm);
+	}
 
 	angle = fmod(angle, 2 * PI);
-	if (angle > 2 * PI * 7 / 8 || angle < 2 * PI * 1 / 8)
+	if( angle < 0 )
+		angle += 2 * PI ;
+	if( fmod(angle, PI / 2) != 0 )
+	{
+		result = rotate_asimage(state->asv, imtmp, angle,
+								asxml_tag_has_size(parm, "width")?width:0,
+								asxml_tag_has_size(parm, "height")?height:0,
+								filter, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT);
+		if( state->verbose > 1 )
+			show_progress("Rotating image [%f degrees].", angle);
+		return result;
+	}
+	if (angle == 0)
 		dir = 0;
-	else if (angle < 2 * PI * 3 / 8)
+	else if (angle == PI / 2)
 		dir = FLIP_VERTICAL;
-	else if (angle < 2 * PI * 5 / 8)
+	else if (angle == PI)
 		dir = FLIP_UPSIDEDOWN;
 	else
 		dir = FLIP_VERTICAL | FLIP_UPSIDEDOWN;
@@ -1830,6 +2279,91 @@ handle_asxml_tag_rotate( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* pa
 	return result;
 }
 
+/****** libAfterImage/asimagexml/transform
+ * NAME
+ * transform - apply arbitrary affine transformation to an image.
+ * SYNOPSIS
+ *  <transform id="new_id" refid="refid" width="pixels" height="pixels"
+ *             matrix="xx xy yx yy x0 y0" rotate="degrees"
+ *             skew_x="degrees" skew_y="degrees"
+ *             filter="bilinear|bicubic">
+ * ATTRIBUTES
+ * id       Optional. Image will be given this name for future reference.
+ * refid    Optional.  An image ID defined with the "id" parameter for
+ *          any previously created image.  If set, percentages in "width"
+ *          and "height" will be derived from the width and height of the
+ *          refid image.
+ * width    Optional.  The result will have this width.
+ * height   Optional.  The result will have this height.
+ * matrix   Optional.  Maps source point (x,y) onto
+ *          (xx*x + xy*y + x0, yx*x + yy*y + y0). Default is identity.
+ * rotate   Optional.  Counterclockwise rotation angle in degrees.
+ * skew_x   Optional.  Horizontal skew angle in degrees.
+ * skew_y   Optional.  Vertical skew angle in degrees.
+ * filter   Optional.  Default is "bilinear".
+ * NOTES
+ * This tag applies to the first image contained within the tag.  Any
+ * further images will be discarded.
+ * Image is rotated first, then skewed, and then transformed by the
+ * matrix, all around its center. If width or height is not given, then
+ * result is just large enough to fit transformed image along that
+ * axis, otherwise it is centered in the result, and then moved by x0/y0.
+ ******/
+static ASImage *
+handle_asxml_tag_transform( ASImageXMLState *state, xml_elem_t* doc, xml_elem_t* parm, ASImage *imtmp, int width, int height)
+{
+	ASImage *result = NULL ;
+	xml_elem_t* ptr ;
+	ASAffineTransform m = {1., 0., 0., 1., 0., 0.};
+	double angle = 0, skew_x = 0, skew_y = 0 ;
+	double xx, xy, yx, yy ;
+	int filter = TRANSFORM_FILTER_BILINEAR ;
+	LOCAL_DEBUG_OUT("doc = %p, parm = %p, imtmp = %p, width = %d, height = %d", doc, parm, imtmp, width, height );
+	for (ptr = parm ; ptr ; ptr = ptr->next)
+	{
+		if (!strcmp(ptr->tag, "matrix"))
+			sscanf(ptr->parm, "%lf %lf %lf %lf %lf %lf", &m.xx, &m.xy, &m.yx, &m.yy, &m.x0, &m.y0);
+		else if (!strcmp(ptr->tag, "rotate")) angle = strtod(ptr->parm, NULL);
+		else if (!strcmp(ptr->tag, "skew_x")) skew_x = strtod(ptr->parm, NULL);
+		else if (!strcmp(ptr->tag, "skew_y")) skew_y = strtod(ptr->parm, NULL);
+		else if (!strcmp(ptr->tag, "filter")) filter = parse_asxml_transform_filter(ptr->parm);
+	}
+	/* matrix * skew_y * skew_x : */
+	skew_x = tan(skew_x*3.14159265358979323846/180.);
+	skew_y = tan(skew_y*3.14159265358979323846/180.);
+	xx = m.xx + m.xy*skew_y ;
+	xy = m.xx*skew_x + m.xy*(skew_y*skew_x + 1.) ;
+	yx = m.yx + m.yy*skew_y ;
+	yy = m.yx*skew_x + m.yy*(skew_y*skew_x + 1.) ;
+	/* ... * rotation : */
+	if( angle != 0 )
+	{
+		double s = sin(angle*3.14159265358979323846/180.);
+		double c = cos(angle*3.14159265358979323846/180.);
+		m.xx = xx*c - xy*s ;
+		m.xy = xx*s + xy*c ;
+		m.yx = yx*c - yy*s ;
+		m.yy = yx*s + yy*c ;
+	}else
+	{
+		m.xx = xx ;	m.xy = xy ;
+		m.yx = yx ;	m.yy = yy ;
+	}
+	if( asxml_tag_has_size(parm, "width") )
+		m.x0 += width*0.5 - (m.xx*imtmp->width + m.xy*imtmp->height)*0.5 ;
+	else
+		width = 0 ;
+	if( asxml_tag_has_size(parm, "height") )
+		m.y0 += height*0.5 - (m.yx*imtmp->width + m.yy*imtmp->height)*0.5 ;
+	else
+		height = 0 ;
+
+	result = transform_asimage(state->asv, imtmp, &m, width, height, filter, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT);
+	if( state->verbose > 1 )
+		show_progress("Transforming image [%f %f %f %f %f %f].", m.xx, m.xy, m.yx, m.yy, m.x0, m.y0);
+	return result;
+}
+
 /****** libAfterImage/asimagexml/scale
  * NAME
  * scale - scale image to arbitrary size
@@ -2343,6 +2877,7 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 		char* width_str = NULL;
 		char* height_str = NULL;
 		ASImage *refimg = NULL ;
+		ASImageXMLNode *memo_node = NULL ;
 		int width = 0, height = 0 ;
 		LOCAL_DEBUG_OUT("parm = %p", parm);
 
@@ -2366,7 +2901,11 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 		if( refid )
 			refimg = fetch_asimage( imman, refid);
 
-		if (!strcmp(doc->tag, "composite"))
+		if( (result = recall_xml_memo( imman, doc, &memo_node )) != NULL )
+		{
+			if( verbose > 1 )
+				show_progress("Reusing memoized result of <%s> tag (%dx%d).", doc->tag, result->width, result->height);
+		}else if (!strcmp(doc->tag, "composite"))
 			result = handle_asxml_tag_composite( &state, doc, parm );
 		else if (!strcmp(doc->tag, "text"))
 			result = handle_asxml_tag_text( &state, doc, parm );
@@ -2423,6 +2962,7 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 						HANDLE_SIZED_TAG(bevel);
 						HANDLE_SIZED_TAG(mirror);
 						HANDLE_SIZED_TAG(rotate);
+						HANDLE_SIZED_TAG(transform);
 						HANDLE_SIZED_TAG(scale);
 						HANDLE_SIZED_TAG(slice);
 						HANDLE_SIZED_TAG(crop);
@@ -2443,6 +2983,10 @@ build_image_from_xml( ASVisual *asv, ASImageManager *imman, ASFontManager *fontm
 		if( refimg )
 			release_asimage( refimg );
 
+		/* results borrowed from subtags further down are never memoized */
+		if( memo_node && result )
+			result = memoize_xml_result( memo_node, result );
+
 		if (rparm) *rparm = parm;
 		else xml_elem_delete(NULL, parm);
 	}
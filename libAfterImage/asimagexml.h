@@ -62,6 +62,45 @@ compose_asimage_xml_from_doc(ASVisual *asv,
 							 const char *path, 
 							 int target_width, int target_height);
 
+/****f* libAfterImage/asimagexml/compile_asimage_xml()
+ * NAME
+ * compile_asimage_xml() - parse xml document once for repeated rendering.
+ * run_asimage_xml_pipeline() - render compiled document at given size.
+ * destroy_asimage_xml_pipeline() - free compiled document and its memo.
+ * SYNOPSIS
+ * ASImageXMLPipeline *compile_asimage_xml( ASVisual *asv,
+ *                          struct ASImageManager *imman,
+ *                          struct ASFontManager *fontman,
+ *                          char *doc_str, ASFlagType flags,
+ *                          int verbose, Window display_win,
+ *                          const char *path);
+ * ASImage *run_asimage_xml_pipeline( ASImageXMLPipeline *pipeline,
+ *                                    int target_width,
+ *                                    int target_height );
+ * void destroy_asimage_xml_pipeline( ASImageXMLPipeline **ppipeline );
+ * DESCRIPTION
+ * Each run produces the same image compose_asimage_xml_at_size() would,
+ * except that images named by the previous run are released first.
+ * Results of tags that depend only on their attributes, subtags and
+ * variables are kept between runs, and are reused as long as none of
+ * those change - so that changing target size only rebuilds tags that
+ * refer to $target.width/$target.height. recall, release, save, set,
+ * printf, color, if and unless tags, tags containing any of those, and
+ * tags containing named images are always rebuilt.
+ * Returned image is not tracked by any image manager.
+ *********/
+typedef struct ASImageXMLPipeline ASImageXMLPipeline;
+
+ASImageXMLPipeline *
+compile_asimage_xml(ASVisual *asv,
+                    struct ASImageManager *imman,
+					struct ASFontManager *fontman,
+					char *doc_str, ASFlagType flags,
+					int verbose, Window display_win,
+					const char *path);
+ASImage *run_asimage_xml_pipeline( ASImageXMLPipeline *pipeline, int target_width, int target_height );
+void destroy_asimage_xml_pipeline( ASImageXMLPipeline **ppipeline );
+
 void show_asimage(ASVisual *asv, ASImage* im, Window w, long delay);
 ASImage* build_image_from_xml( ASVisual *asv,
                                struct ASImageManager *imman,
@@ -73,6 +112,13 @@ Bool save_asimage_to_file(const char* file2bsaved, ASImage *im,
 						  const char *compress,
 						  const char *opacity,
 			  			  int delay, int replace);
+/* same as above, but PNG, JPEG and TIFF files are written in the background
+ * ( see ASImage2file_async() ) */
+Bool save_asimage_to_file_async(const char* file2bsaved, ASImage *im,
+	    			      const char* strtype,
+						  const char *compress,
+						  const char *opacity,
+			  			  int delay, int replace);
 
 
 #ifdef __cplusplus
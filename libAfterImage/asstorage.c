@@ -50,6 +50,9 @@
 #include <stdlib.h>
 #endif
 #include <memory.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifndef HAVE_ZLIB_H
 #include "zlib/zlib.h"
@@ -69,8 +72,151 @@
 
 ASStorage *_as_default_storage = NULL ;
 
-#define get_default_asstorage()   (_as_default_storage?_as_default_storage:(_as_default_storage=create_asstorage()))
+/* Storage may be accessed from several threads at once, when row bands of
+ * the image are processed in parallel (see asthread.h). Locking is done
+ * on two levels :
+ *  - blocks_lock protects the array of blocks itself. It is held for
+ *    reading while any of the blocks is accessed, and for writing only
+ *    while blocks are created or destroyed;
+ *  - each block is guarded by one of the AS_STORAGE_LOCK_STRIPES mutexes,
+ *    selected by block index. It is held while slots of the block are
+ *    searched, read or modified, including their reference counts;
+ *  - index_lock guards index of blocks by largest free slot, and is only
+ *    ever taken for a short while, without taking any other locks.
+ * Compression buffers are kept per thread, so that data is compressed
+ * without holding any locks. No more then one stripe is ever locked at a
+ * time by the same thread, and blocks_lock is never upgraded from read
+ * to write - that keeps us clear of deadlocks.
+ */
+#ifdef HAVE_PTHREAD
+#define AS_STORAGE_LOCK_STRIPES		16
+
+typedef struct ASStorageLocks
+{
+	pthread_rwlock_t blocks_lock ;
+	pthread_mutex_t  stripes[AS_STORAGE_LOCK_STRIPES] ;
+	pthread_mutex_t  index_lock ;
+}ASStorageLocks;
+
+#define STORAGE_LOCKS(s)		((ASStorageLocks*)((s)->locks))
+#define READ_LOCK_BLOCKS(s)		pthread_rwlock_rdlock( &(STORAGE_LOCKS(s)->blocks_lock) )
+#define WRITE_LOCK_BLOCKS(s)	pthread_rwlock_wrlock( &(STORAGE_LOCKS(s)->blocks_lock) )
+#define UNLOCK_BLOCKS(s)		pthread_rwlock_unlock( &(STORAGE_LOCKS(s)->blocks_lock) )
+#define LOCK_BLOCK(s,idx)		pthread_mutex_lock( &(STORAGE_LOCKS(s)->stripes[(idx)%AS_STORAGE_LOCK_STRIPES]) )
+#define UNLOCK_BLOCK(s,idx)		pthread_mutex_unlock( &(STORAGE_LOCKS(s)->stripes[(idx)%AS_STORAGE_LOCK_STRIPES]) )
+#define LOCK_INDEX(s)			pthread_mutex_lock( &(STORAGE_LOCKS(s)->index_lock) )
+#define UNLOCK_INDEX(s)			pthread_mutex_unlock( &(STORAGE_LOCKS(s)->index_lock) )
+
+static pthread_mutex_t __as_default_storage_lock = PTHREAD_MUTEX_INITIALIZER ;
+#else
+#define READ_LOCK_BLOCKS(s)		do{}while(0)
+#define WRITE_LOCK_BLOCKS(s)	do{}while(0)
+#define UNLOCK_BLOCKS(s)		do{}while(0)
+#define LOCK_BLOCK(s,idx)		do{}while(0)
+#define UNLOCK_BLOCK(s,idx)		do{}while(0)
+#define LOCK_INDEX(s)			do{}while(0)
+#define UNLOCK_INDEX(s)			do{}while(0)
+#endif
+
+/* default storage is created by whichever thread needs it first, and is 
+ * read without taking the lock from then on : */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define LOAD_DEFAULT_STORAGE()		__atomic_load_n( &_as_default_storage, __ATOMIC_ACQUIRE )
+#define STORE_DEFAULT_STORAGE(s)	__atomic_store_n( &_as_default_storage, (s), __ATOMIC_RELEASE )
+#elif defined(HAVE_PTHREAD)
+#define LOAD_DEFAULT_STORAGE()		NULL	/* always go through the lock */
+#define STORE_DEFAULT_STORAGE(s)	(_as_default_storage = (s))
+#else
+#define LOAD_DEFAULT_STORAGE()		_as_default_storage
+#define STORE_DEFAULT_STORAGE(s)	(_as_default_storage = (s))
+#endif
+
+/* memory usage statistics are updated from under different locks : */
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#define STAT_ADD(var,val)		__sync_fetch_and_add( &(var), (val) )
+#define STAT_SUB(var,val)		__sync_fetch_and_sub( &(var), (val) )
+#else
+#define STAT_ADD(var,val)		((var) += (val))
+#define STAT_SUB(var,val)		((var) -= (val))
+#endif
+
+/* Per thread state : compression buffers, and the block this thread
+ * has last stored data into. New data is placed into that block first,
+ * so that threads mostly work on different blocks (and different stripes)
+ * instead of all piling up on the first block with free space.
+ * Size of new blocks requested by image loaders is kept here as well, 
+ * so that loaders running in different threads don't step on each other : */
+typedef struct ASStorageThreadData
+{
+	ASStorageDiff  *diff_buf ;
+	CARD8          *comp_buf ;
+	size_t          comp_buf_size ;
+
+	ASStorage      *storage ;
+	int             block_idx ;
+
+	int             block_size ;	/* 0 - use storage->default_block_size */
+}ASStorageThreadData;
 
+#ifdef HAVE_PTHREAD
+static pthread_key_t  __as_storage_thread_key ;
+static pthread_once_t __as_storage_thread_key_once = PTHREAD_ONCE_INIT ;
+
+static void
+destroy_storage_thread_data( void *data )
+{
+	ASStorageThreadData *td = (ASStorageThreadData*)data ;
+	if( td )
+	{
+		if( td->comp_buf )
+			free( td->comp_buf );
+		if( td->diff_buf )
+			free( td->diff_buf );
+		free( td );
+	}
+}
+
+static void
+init_storage_thread_key()
+{
+	pthread_key_create( &__as_storage_thread_key, destroy_storage_thread_data );
+}
+#else
+static ASStorageThreadData __as_storage_thread_data = { NULL, NULL, 0, NULL, -1, 0 };
+#endif
+
+static ASStorageThreadData *
+get_storage_thread_data()
+{
+#ifdef HAVE_PTHREAD
+	ASStorageThreadData *td ;
+	pthread_once( &__as_storage_thread_key_once, init_storage_thread_key );
+	td = pthread_getspecific( __as_storage_thread_key );
+	if( td == NULL )
+	{
+		td = safecalloc( 1, sizeof(ASStorageThreadData));
+		td->block_idx = -1 ;
+		pthread_setspecific( __as_storage_thread_key, td );
+	}
+	return td;
+#else
+	return &__as_storage_thread_data;
+#endif
+}
+
+static void
+reserve_storage_buffers( ASStorageThreadData *td, int size )
+{
+	if( (int)td->comp_buf_size < size )
+	{
+		td->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
+		td->comp_buf = realloc( td->comp_buf, td->comp_buf_size );
+		td->diff_buf = realloc( td->diff_buf, td->comp_buf_size*sizeof(ASStorageDiff) );
+#ifdef DEBUG_ALLOCS
+		show_debug( __FILE__,"reserve_storage_buffers",__LINE__," realloced compression buffer to %d+%d*%d",td->comp_buf_size, td->comp_buf_size, sizeof(ASStorageDiff) );
+#endif
+	}
+}
 
 /************************************************************************/
 /* Private Functions : 													*/
@@ -710,7 +856,7 @@ copy_data32_24bitshift_masked( CARD8 *buffer, CARD32 *data32, int size)
 
 
 static CARD8* 
-compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *flags, int *compressed_size,
+compress_stored_data( ASStorageThreadData *td, CARD8 *data, int size, ASFlagType *flags, int *compressed_size,
 					  CARD32 bitmap_threshold )
 {
 	/* TODO: just a stub for now - need to implement compression */
@@ -773,16 +919,8 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 		int uncompressed_size = size ;
 
 		clear_flags( *flags, ASStorage_RLEDiffCompress );
-		if( (int)storage->comp_buf_size < size ) 
-		{	
-			storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-			storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-			storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-		}
-		buffer = storage->comp_buf ;
+		reserve_storage_buffers( td, size );
+		buffer = td->comp_buf ;
 		if( buffer ) 
 		{
 			if( get_flags( *flags, ASStorage_Bitmap ) )
@@ -802,18 +940,18 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 				{	
 					uncompressed_size = size / 4 ;
 					compute_diff_func[get_flags(*flags,ASStorage_Masked)?1:0]
-					                 [ASStorage_Flags2ShiftIdx(*flags)](storage->diff_buf, data, uncompressed_size );
+					                 [ASStorage_Flags2ShiftIdx(*flags)](td->diff_buf, data, uncompressed_size );
 				}else
-					compute_diff8( storage->diff_buf, data, uncompressed_size ); 	  
+					compute_diff8( td->diff_buf, data, uncompressed_size ); 	  
 				
 				if( tint != 255 )
 				{
 					int i;
-					ASStorageDiff *diff = storage->diff_buf ; 
+					ASStorageDiff *diff = td->diff_buf ; 
 					for( i = 0 ; i < uncompressed_size ; ++i ) 
 						diff[i] = (diff[i]*tint)/256 ;
 				}	 
-				comp_size = rlediff_compress( buffer, storage->diff_buf, uncompressed_size );
+				comp_size = rlediff_compress( buffer, td->diff_buf, uncompressed_size );
 			}
 
 			if( comp_size == 0 )	 
@@ -823,8 +961,8 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 			}else
 			{	
 				set_flags( *flags, ASStorage_RLEDiffCompress );
-				UncompressedSize += size ;
-				CompressedSize += comp_size ;
+				STAT_ADD( UncompressedSize, size );
+				STAT_ADD( CompressedSize, comp_size );
 			}
 		}else
 			buffer = data ;	 
@@ -839,17 +977,9 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 		{
 			CARD32 *data32 = (CARD32*)data ;
 			size /= 4;
-			if( (int)(storage->comp_buf_size) < size ) 
-			{	
-				storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-				storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-				storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-
-			}
-			buffer = storage->comp_buf ;
+			comp_size = size ;
+			reserve_storage_buffers( td, size );
+			buffer = td->comp_buf ;
 			if( tint != 0x000000FF ) 
 			{	
 				copy_data32_tinted_func [get_flags(*flags,ASStorage_Masked)?1:0]
@@ -862,16 +992,8 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 			}	 
 		}else if( tint != 0x000000FF ) 
 		{
-			if( (int)storage->comp_buf_size < size ) 
-			{	
-				storage->comp_buf_size = ((size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
-				storage->comp_buf = realloc( storage->comp_buf, storage->comp_buf_size );
-				storage->diff_buf = realloc( storage->diff_buf, storage->comp_buf_size*sizeof(ASStorageDiff) );
-#ifdef DEBUG_ALLOCS
-			show_debug( __FILE__,"compress_stored_data",__LINE__," realloced compression buffer to %d+%d*%d",storage->comp_buf_size, storage->comp_buf_size, sizeof(ASStorageDiff) );
-#endif 
-			}
-			buffer = storage->comp_buf ;
+			reserve_storage_buffers( td, size );
+			buffer = td->comp_buf ;
 			for( comp_size = 0 ; comp_size < size ; ++comp_size )
 				buffer[comp_size] = (((CARD32)data[comp_size])*tint)>>8 ;
 		}	 
@@ -882,7 +1004,7 @@ compress_stored_data( ASStorage *storage, CARD8 *data, int size, ASFlagType *fla
 }
 
 static CARD8 *
-decompress_stored_data( ASStorage *storage, CARD8 *data, int size, int uncompressed_size, 
+decompress_stored_data( ASStorageThreadData *td, CARD8 *data, int size, int uncompressed_size, 
 						ASFlagType flags, CARD8 bitmap_value )
 {
 	CARD8  *buffer = data ;
@@ -890,7 +1012,8 @@ decompress_stored_data( ASStorage *storage, CARD8 *data, int size, int uncompres
 	LOCAL_DEBUG_OUT( "size = %d, uncompressed_size = %d, flags = 0x%lX", size, uncompressed_size, flags );
 	if( get_flags( flags, ASStorage_RLEDiffCompress ))
 	{
-		buffer = storage->comp_buf ;
+		reserve_storage_buffers( td, uncompressed_size );
+		buffer = td->comp_buf ;
 		if( get_flags( flags, ASStorage_Bitmap ) )
 			rlediff_decompress_bitmap( buffer, data, size, bitmap_value );	 
 		else			
@@ -920,6 +1043,7 @@ add_storage_slots( ASStorageBlock *block )
 #ifndef DEBUG_ALLOCS
 	LOCAL_DEBUG_OUT( "reallocing %d slots pointers (%d)", block->slots_count, size );
 	block->slots = realloc( block->slots, size);
+	block->unused_slots = realloc( block->unused_slots, block->slots_count*sizeof(int));
 	LOCAL_DEBUG_OUT( "reallocated %d slots pointers", block->slots_count );
 #else
 	if( block->slots == NULL ) 
@@ -927,19 +1051,143 @@ add_storage_slots( ASStorageBlock *block )
 	else
 		show_debug( __FILE__,"add_storage_slots",__LINE__,"reallocating %d slots pointers", block->slots_count );
 	block->slots = guarded_realloc( block->slots, block->slots_count*sizeof(ASStorageSlot*));
+	block->unused_slots = guarded_realloc( block->unused_slots, block->slots_count*sizeof(int));
 #endif
-	UsedMemory += count*sizeof(ASStorageSlot*) ;
+	STAT_ADD( UsedMemory, count*(sizeof(ASStorageSlot*)+sizeof(int)) );
 	memset( &(block->slots[i]),	0x00, count*sizeof(ASStorageSlot*) );
 }
 
 
 
+/* Free slots of each block are kept in lists segregated by size class,
+ * so that finding free slot of sufficient size does not require walking
+ * through all the slots. Lists are linked by slot index, stored in 
+ * ref_count and reserved fields of the free slot header, which are otherwise
+ * unused, and which are preserved when defragmentation moves slots around.
+ */
+#define AS_STORAGE_NO_SLOT		0xFFFF
+/* how many slots of the same size class to check looking for the best fit : */
+#define AS_STORAGE_BIN_SCAN_MAX		4
+/* how many times to retry picking block from the index, in case some other 
+ * thread took the space before us : */
+#define AS_STORAGE_INDEX_RETRIES	4
+
+#define FreeSlotNext(slot)		((slot)->ref_count)
+#define FreeSlotPrev(slot)		((slot)->reserved)
+
+static inline int 
+storage_size_class( CARD32 size )
+{
+	int c = 0 ;
+	while( size > 1 ) 
+	{
+		size = size>>1 ;
+		++c ;
+	}
+	return c;
+}
+
+static inline int 
+lowest_bit( CARD32 mask )
+{
+	int i = 0 ;
+	while( (mask&0x01) == 0 ) 
+	{
+		mask = mask>>1 ;
+		++i ;
+	}
+	return i;
+}
+
+/* mask of size classes every member of which is larger then size : */
+static inline CARD32 
+classes_above( int size )
+{
+	int c = storage_size_class( size )+1 ;
+	return (c >= AS_STORAGE_FREE_BINS)? 0 : ~((((CARD32)0x01)<<c)-1) ;
+}
+
+static inline void
+add_free_slot( ASStorageBlock *block, ASStorageSlot *slot )
+{
+	int c = storage_size_class( ASStorageSlot_USABLE_SIZE(slot) );
+	int head = block->free_bins[c] ;
+
+	FreeSlotPrev(slot) = AS_STORAGE_NO_SLOT ;
+	if( head >= 0 ) 
+	{
+		FreeSlotNext(slot) = head ;
+		FreeSlotPrev(block->slots[head]) = slot->index ;
+	}else
+		FreeSlotNext(slot) = AS_STORAGE_NO_SLOT ;
+	block->free_bins[c] = slot->index ;
+	block->free_bins_mask |= (((CARD32)0x01)<<c) ;
+}
+
+/* slot size must not change while it is in the list : */
+static inline void
+remove_free_slot( ASStorageBlock *block, ASStorageSlot *slot )
+{
+	int c = storage_size_class( ASStorageSlot_USABLE_SIZE(slot) );
+	int next = FreeSlotNext(slot), prev = FreeSlotPrev(slot) ;
+
+	if( prev != AS_STORAGE_NO_SLOT ) 
+		FreeSlotNext(block->slots[prev]) = next ;
+	else if( next != AS_STORAGE_NO_SLOT ) 
+		block->free_bins[c] = next ;
+	else
+	{
+		block->free_bins[c] = -1 ;
+		block->free_bins_mask &= ~(((CARD32)0x01)<<c) ;
+	}	 
+	if( next != AS_STORAGE_NO_SLOT ) 
+		FreeSlotPrev(block->slots[next]) = prev ;
+	FreeSlotNext(slot) = 0 ;
+	FreeSlotPrev(slot) = 0 ;
+}
+
+/* returns free slot with usable size of at least size bytes : */
+static ASStorageSlot *
+find_free_slot( ASStorageBlock *block, int size )
+{
+	int c = storage_size_class( size );
+	CARD32 mask ;
+
+	if( get_flags( block->free_bins_mask, ((CARD32)0x01)<<c ) )
+	{/* best fit among the few slots of the same size class : */
+		ASStorageSlot *best = NULL ; 
+		int i = block->free_bins[c], checked = 0 ;
+		while( checked++ < AS_STORAGE_BIN_SCAN_MAX ) 
+		{
+			ASStorageSlot *slot = block->slots[i] ;
+			int usable = ASStorageSlot_USABLE_SIZE(slot) ;
+			if( usable >= size && (best == NULL || usable < (int)ASStorageSlot_USABLE_SIZE(best)) )
+			{
+				best = slot ;
+				if( usable == size ) 
+					break;
+			}
+			if( FreeSlotNext(slot) == AS_STORAGE_NO_SLOT ) 
+				break;
+			i = FreeSlotNext(slot) ;
+		}
+		if( best ) 
+			return best;
+	}
+	/* otherwise any slot of larger class will do : */
+	mask = block->free_bins_mask & classes_above( size );
+	if( mask == 0 ) 
+		return NULL;
+	return block->slots[block->free_bins[lowest_bit(mask)]];
+}
+
 static ASStorageBlock *
 create_asstorage_block( int useable_size )
 {
 	int allocate_size = (sizeof(ASStorageBlock)+ ASStorageSlot_SIZE + useable_size) ; 
 	void *ptr ;	
 	ASStorageBlock *block ;
+	int i ;
 
 	if( allocate_size%AS_STORAGE_PAGE_SIZE > 0 ) 
 		allocate_size = ((allocate_size/AS_STORAGE_PAGE_SIZE)+1)*AS_STORAGE_PAGE_SIZE ;
@@ -953,7 +1201,7 @@ create_asstorage_block( int useable_size )
 		PRINT_MEM_STATS(msg);
 	}
 #endif
-	UsedMemory += allocate_size ;
+	STAT_ADD( UsedMemory, allocate_size );
 	if( ptr == NULL ) 
 		return NULL;
 	block = ptr ;
@@ -963,10 +1211,14 @@ create_asstorage_block( int useable_size )
 	block->slots_count = 0 ;
 	add_storage_slots( block ) ;   
 	
-	if( block->slots == NULL ) 
+	if( block->slots == NULL || block->unused_slots == NULL ) 
 	{	
+		if( block->slots )
+			free( block->slots );
+		if( block->unused_slots )
+			free( block->unused_slots );
 		free( ptr ); 
-		UsedMemory -= allocate_size ;
+		STAT_SUB( UsedMemory, allocate_size );
 #ifdef DEBUG_ALLOCS
 		show_debug( __FILE__,"create_asstorage_block",__LINE__,"freeing block %p, size = %d, total used = %d", ptr, allocate_size, UsedMemory );
 #endif
@@ -982,6 +1234,11 @@ create_asstorage_block( int useable_size )
 	block->slots[0]->index = 0 ;
 	block->last_used = 0;
 	block->first_free = 0 ;
+
+	for( i = 0 ; i < AS_STORAGE_FREE_BINS ; ++i ) 
+		block->free_bins[i] = -1 ;
+	add_free_slot( block, block->slots[0] );
+	block->index_class = block->index_next = block->index_prev = -1 ;
 	
 	LOCAL_DEBUG_OUT("Storage block created : block ptr = %p, slots ptr = %p", block, block->slots );
 	
@@ -991,17 +1248,19 @@ create_asstorage_block( int useable_size )
 static void
 destroy_asstorage_block( ASStorageBlock *block )
 {
-	UsedMemory -= block->slots_count * sizeof(ASStorageSlot*) ;
-	UsedMemory -= block->size + sizeof(ASStorageBlock) ;
+	STAT_SUB( UsedMemory, block->slots_count * (sizeof(ASStorageSlot*)+sizeof(int)) );
+	STAT_SUB( UsedMemory, block->size + sizeof(ASStorageBlock) );
 
 #ifndef DEBUG_ALLOCS
 	free( block->slots );
+	free( block->unused_slots );
 	free( block );	  
 #else	
 	{
 		char msg[256];
 		sprintf( msg, "freeing block %p, size = %d, total used = %d", block, block->size, UsedMemory );
 		guarded_free( block->slots );
+		guarded_free( block->unused_slots );
 		guarded_free( block );
 		PRINT_MEM_STATS(msg);
 	}
@@ -1009,28 +1268,21 @@ destroy_asstorage_block( ASStorageBlock *block )
 
 }
 
+/* Adds new block large enough to hold compressed_size bytes, reusing
+ * empty entry in the array of blocks if possible. Storage must be locked
+ * for writing. Returns index of the new block, or -1 on failure. */
 static int
-select_storage_block( ASStorage *storage, int compressed_size, ASFlagType flags, int block_id_start )
+add_storage_block( ASStorage *storage, int compressed_size )
 {
-	int i ;
+	int i, block_size ;
 	int new_block = -1 ; 
 	compressed_size += ASStorageSlot_SIZE;
-	i = block_id_start - 1 ;
-	if( i < 0 ) 
-		i = 0 ;
-	for( ; i < storage->blocks_count ; ++i ) 
-	{
-		ASStorageBlock *block = storage->blocks[i];
-		if( block )
-		{	
-			if( block->total_free > compressed_size && 
-				block->total_free > AS_STORAGE_NOUSE_THRESHOLD && 
-				block->last_used+2 < AS_STORAGE_MAX_SLOTS_CNT  )
-				return i+1;
-		}else if( new_block < 0 ) 
+	for( i = 0 ; i < storage->blocks_count ; ++i ) 
+		if( storage->blocks[i] == NULL )
+		{
 			new_block = i ;
-	}		
-	/* no available blocks found - need to allocate a new block */
+			break;
+		}
 	if( new_block  < 0 ) 
 	{
 		i = new_block = storage->blocks_count ;
@@ -1039,17 +1291,22 @@ select_storage_block( ASStorage *storage, int compressed_size, ASFlagType flags,
 		storage->blocks = realloc( storage->blocks, storage->blocks_count*sizeof(ASStorageBlock*));
 #else
 		storage->blocks = guarded_realloc( storage->blocks, storage->blocks_count*sizeof(ASStorageBlock*));
-		show_debug( __FILE__,"select_storage_block",__LINE__,"reallocated %d blocks pointers", storage->blocks_count );
+		show_debug( __FILE__,"add_storage_block",__LINE__,"reallocated %d blocks pointers", storage->blocks_count );
 #endif		   
-		UsedMemory += 16*sizeof(ASStorageBlock*) ;
+		STAT_ADD( UsedMemory, 16*sizeof(ASStorageBlock*) );
 
 		while( ++i < storage->blocks_count )
 			storage->blocks[i] = NULL ;
 	}	 
-	storage->blocks[new_block] = create_asstorage_block( max(storage->default_block_size, compressed_size) );		
+	/* leaving room for alignment of the first slot and for the header of free slot 
+	 * that follows data, or else large data may never fit into the new block : */
+	block_size = get_storage_thread_data()->block_size ;
+	if( block_size <= 0 ) 
+		block_size = storage->default_block_size ;
+	storage->blocks[new_block] = create_asstorage_block( max(block_size, compressed_size+2*ASStorageSlot_SIZE) );		
 	if( storage->blocks[new_block] == NULL )  /* memory allocation failed ! */ 
 		new_block = -1 ;
-	return new_block+1;
+	return new_block;
 }
 
 static inline void
@@ -1072,26 +1329,13 @@ destroy_storage_slot( ASStorageBlock *block, int index )
 		}
 		block->last_used = i<0?0:i;	 
 	}else if( index < block->last_used ) 
-		++(block->unused_count);
-}
-
-static inline void 
-join_storage_slots( ASStorageBlock *block, ASStorageSlot *from_slot, ASStorageSlot *to_slot )
-{
-	ASStorageSlot *s, *next = AS_STORAGE_GetNextSlot(from_slot);
-
-	from_slot->size = ASStorageSlot_USABLE_SIZE(from_slot);	
-	do
 	{
-		s = next ;
-		next = AS_STORAGE_GetNextSlot(s);
-		from_slot->size += ASStorageSlot_FULL_SIZE(s) ;	
-		LOCAL_DEBUG_OUT( "from  = %p, s = %p, next = %p, to = %p, from->size = %ld", from_slot, s, next, to_slot, from_slot->size );
-		destroy_storage_slot( block, s->index );
-	}while( s < to_slot );	
+		++(block->unused_count);
+		if( block->unused_slots_num < block->slots_count ) 
+			block->unused_slots[(block->unused_slots_num)++] = index ;
+	}
 }
 
-
 static inline void
 defragment_storage_block( ASStorageBlock *block )
 {
@@ -1100,6 +1344,10 @@ defragment_storage_block( ASStorageBlock *block )
 	unsigned long total_free = 0 ;
 	brk = next_used = block->start ; 
 	
+	/* all the free slots will be merged into one at the end of the block : */
+	for( i = 0 ; i < AS_STORAGE_FREE_BINS ; ++i ) 
+		block->free_bins[i] = -1 ;
+	block->free_bins_mask = 0 ;
 	
 	for( i = 0 ; i <= block->last_used ; ++i ) 
 	{
@@ -1154,7 +1402,8 @@ defragment_storage_block( ASStorageBlock *block )
 		brk = AS_STORAGE_GetNextSlot(brk);
 	}
 	
-	if( total_free > 0 )
+	/* even header-sized tail must be marked free, so that slots chain is intact : */
+	if( brk < block->end )
 	{
 		if( first_free < 0  ) 
 		{
@@ -1175,6 +1424,7 @@ defragment_storage_block( ASStorageBlock *block )
 		block->slots[first_free] = brk ;
 		if( block->last_used < first_free ) 
 			block->last_used = first_free ;
+		add_free_slot( block, brk );
 	}
 	
 	block->total_free = total_free ;
@@ -1189,83 +1439,84 @@ defragment_storage_block( ASStorageBlock *block )
 				exit(0);
 			}
 	block->unused_count = 0 ;
-	for( i = 0 ; i < block->last_used ; ++i ) 
+	block->unused_slots_num = 0 ;
+	for( i = block->last_used-1 ; i >= 0 ; --i ) 
 	{
 		if( slots[i] == NULL ) 
+		{
 			++(block->unused_count);
+			block->unused_slots[(block->unused_slots_num)++] = i ;
+		}
 	}
 }
 
 static ASStorageSlot *
-select_storage_slot( ASStorageBlock *block, int size )
+select_storage_slot( ASStorageBlock *block, int size, Bool allow_defrag )
 {
-	int i = block->first_free ;
-	LOCAL_DEBUG_OUT( "first_free = %d, last_used = %d, long_searches = %d", block->first_free, block->last_used, block->long_searches );
-	if( block->long_searches < 5 ) 
-	{	
-		int max_i = block->last_used ;
-		ASStorageSlot **slots = block->slots ;
-		int empty_slots_checked = 0 ;
+	/* slot must have enough space for the data and for the header of the 
+	 * free slot that will hold the remainder : */
+	ASStorageSlot *slot = find_free_slot( block, size+ASStorageSlot_SIZE );
 
-		if( max_i > i + 50 ) 
-			max_i = i+50 ; 
-		
-		while( i <= max_i )
+	LOCAL_DEBUG_OUT( "block = %p, size = %d, slot = %p, free_bins_mask = 0x%lX", block, size, slot, block->free_bins_mask );
+	if( slot == NULL && allow_defrag ) 
+	{/* no free slots of sufficient size - need to do defragmentation */
+		defragment_storage_block( block );
+		slot = find_free_slot( block, size+ASStorageSlot_SIZE );
+	}
+	if( slot ) 
+		remove_free_slot( block, slot );
+	return slot;
+}
+
+/* returns index of unused entry in slots array, growing it if needed : */
+static int
+get_unused_slot_index( ASStorageBlock *block )
+{
+	if( block->unused_count >= block->slots_count/10 || block->last_used >= block->slots_count-1 )
+		while( block->unused_slots_num > 0 ) 
 		{
-			ASStorageSlot *slot = slots[i] ;
-			LOCAL_DEBUG_OUT( "block = %p, max_i = %d, slots[%d] = %p", block, max_i, i, slot );
-			if( slot != NULL )
+			int i = block->unused_slots[--(block->unused_slots_num)] ;
+			/* entries may go stale as last_used moves back and forth : */
+			if( i < block->last_used && block->slots[i] == NULL ) 
 			{
-				if( slot->flags == 0 )
-				{	  
-					int single_slot_size = size+ASStorageSlot_SIZE ; 
-					int size_to_match = single_slot_size+ASStorageSlot_SIZE ;
-					++empty_slots_checked ;
-					
-					do
-					{
-						ASStorageSlot *next_slot = AS_STORAGE_GetNextSlot(slot);		   
-						if( next_slot > block->end )
-							break;
-
-						LOCAL_DEBUG_OUT( "start = %p, slot = %p, slot->size = %ld, end = %p, size = %d, size_to_match = %d", block->start, slot, slot->size, block->end, size, size_to_match );
-						if((int)ASStorageSlot_USABLE_SIZE(slot) >= single_slot_size )
-						{	
-							if( empty_slots_checked > 50 ) ++(block->long_searches);
-							return slot;
-						}
-						if( (int)ASStorageSlot_FULL_SIZE(slot)  >= size_to_match )
-						{
-							join_storage_slots( block, slots[i], slot );
-							if( empty_slots_checked > 50 ) ++(block->long_searches);
-							return slots[i];
-						}	
-						size_to_match -= ASStorageSlot_FULL_SIZE(slot);
-						slot = next_slot;		
-						/* make sure we has not exceeded boundaries of the block */									   
-					}while( slot->flags == 0 );
-				}
+				if( block->unused_count <= 0 ) 
+					show_warning( "Storage error : unused_count out of range (%d )", block->unused_count );
+				else					  
+					--(block->unused_count);
+				return i;
 			}
-			++i ;
 		}
+	if( block->last_used >= block->slots_count-1 ) 
+	{
+		add_storage_slots( block );
+		if( block->last_used >= block->slots_count-1 ) 
+			return -1;
 	}
-		
-	/* no free slots of sufficient size - need to do defragmentation */
-	defragment_storage_block( block );
-	block->long_searches = 0 ;
-	i = block->first_free;
-	if( i >= block->slots_count ) 
-		return NULL;
-    if( block->slots[i] == NULL || (int)block->slots[i]->size < size ) 
-		return NULL;
-	return block->slots[i];		   
+	return ++(block->last_used) ;
+}
+
+/* merges free slot with free slots following it, and adds it to free lists : */
+static inline void
+coalesce_free_slot( ASStorageBlock *block, ASStorageSlot *slot )
+{
+	ASStorageSlot *next ;
+	while( (next = AS_STORAGE_GetNextSlot(slot)) < block->end && next->flags == 0 ) 
+	{
+		remove_free_slot( block, next );
+		slot->size = ASStorageSlot_USABLE_SIZE(slot) + ASStorageSlot_FULL_SIZE(next) ;
+		block->total_free += ASStorageSlot_SIZE ;
+		destroy_storage_slot( block, next->index );
+	}	 
+	add_free_slot( block, slot );
 }
 
 static inline Bool
 split_storage_slot( ASStorageBlock *block, ASStorageSlot *slot, int to_size )
 {
 	int old_size = ASStorageSlot_USABLE_SIZE(slot) ;
+	CARD32 old_slot_size = slot->size ;
 	ASStorageSlot *new_slot ;
+	int i ;
 
 	LOCAL_DEBUG_OUT( "slot->size = %ld", slot->size );
 	
@@ -1281,61 +1532,32 @@ split_storage_slot( ASStorageBlock *block, ASStorageSlot *slot, int to_size )
 	if( new_slot >=  block->end )
 		return True;
 
+	/* now we need to find where this slot's pointer we should store */		   
+	if( (i = get_unused_slot_index( block )) < 0 ) 
+	{
+		slot->size = old_slot_size ;
+		return False;
+	}
+
 	new_slot->flags = 0 ;
 	new_slot->ref_count = 0 ;
 	LOCAL_DEBUG_OUT( "old_size = %d, full_size = %ld", old_size, ASStorageSlot_FULL_SIZE(slot) );
 	new_slot->size = old_size - ASStorageSlot_FULL_SIZE(slot) ;											   
 	new_slot->uncompressed_size = 0 ;
-	
-	new_slot->index = 0 ;
-	/* now we need to find where this slot's pointer we should store */		   
-	if( block->unused_count < block->slots_count/10 && block->last_used < block->slots_count-1 )
-	{	
-		new_slot->index = ++(block->last_used) ;
-	}else
-	{
-		register int i, max_i = block->slots_count ;
-		register ASStorageSlot **slots = block->slots ;
-		LOCAL_DEBUG_OUT( "max_i = %d", max_i );
-		
-		for( i = 0 ; i < max_i ; ++i ) 
-			if( slots[i] == NULL ) 
-				break;
-		LOCAL_DEBUG_OUT( "i = %d", i );
-		if( i >= max_i ) 
-		{
-			if( block->slots_count >= AS_STORAGE_MAX_SLOTS_CNT )
-				return False;
-			else
-			{
-				i = block->slots_count ;
-				block->last_used = i ;
-				add_storage_slots( block );
-				slots = block->slots ;
-			}	 
-		}
-		LOCAL_DEBUG_OUT( "i = %d", i );
- 		new_slot->index = i ;		
-		if( i < block->last_used )
-		{
-			if( block->unused_count <= 0 ) 
-				show_warning( "Storage error : unused_count out of range (%d )", block->unused_count );
-			else					  
-				--(block->unused_count);
-		}
-	}	
+	new_slot->index = i ;
 	LOCAL_DEBUG_OUT( "new_slot = %p, new_slot->index = %d, new_slot->size = %ld", new_slot, new_slot->index, new_slot->size );
-	block->slots[new_slot->index] = new_slot ;
+	block->slots[i] = new_slot ;
+	coalesce_free_slot( block, new_slot );
 	return True;
 }
 
 static int
-store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compressed_size, int ref_count, ASFlagType flags )
+store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compressed_size, int ref_count, ASFlagType flags, Bool allow_defrag )
 {
 	ASStorageSlot *slot ;
 	CARD8 *dst ;
 	Bool bad_slot = True ;
-	slot = select_storage_slot( block, compressed_size );
+	slot = select_storage_slot( block, compressed_size, allow_defrag );
 	LOCAL_DEBUG_OUT( "selected slot %p for size %d (compressed %d) and flags %lX", slot, size, compressed_size, flags );
 	
 	if( slot == NULL ) 
@@ -1363,6 +1585,7 @@ store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compresse
 	if( !split_storage_slot( block, slot, compressed_size ) ) 
 	{
 		show_error( "failed to split storage to store data in block. Usable size = %d, desired size = %d", ASStorageSlot_USABLE_SIZE(slot), compressed_size+ASStorageSlot_SIZE );
+		add_free_slot( block, slot );
 		return 0 ;
 	}
 	LOCAL_DEBUG_OUT( "block = %p", block );
@@ -1375,16 +1598,7 @@ store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compresse
 	slot->ref_count = ref_count;
 	slot->size = compressed_size ;
 	slot->uncompressed_size = size ;
-
-	if( slot->index == block->first_free ) 
-	{
-		int i = block->first_free ;
-		while( ++i <= block->last_used ) 
-			if( block->slots[i] && 
-				block->slots[i]->flags == 0 && block->slots[i]->size > 0 ) 
-				break;
-		block->first_free = i ;
-	}
+	++(block->used_count);
 
 	LOCAL_DEBUG_OUT( "slot index = %d", slot->index );
  
@@ -1392,33 +1606,155 @@ store_data_in_block( ASStorageBlock *block, CARD8 *data, int size, int compresse
 }
 
 
+/* Storage keeps an index of blocks by size class of the largest free slot,
+ * so that block with enough space can be found right away. It is guarded
+ * by its own lock, as it is updated while only block itself is locked : */
+static void
+unlink_indexed_block( ASStorage *storage, ASStorageBlock *block )
+{
+	int c = block->index_class ;
+	if( c < 0 ) 
+		return;
+	if( block->index_prev >= 0 ) 
+		storage->blocks[block->index_prev]->index_next = block->index_next ;
+	else
+		storage->block_bins[c] = block->index_next ;
+	if( block->index_next >= 0 ) 
+		storage->blocks[block->index_next]->index_prev = block->index_prev ;
+	if( storage->block_bins[c] < 0 ) 
+		storage->block_bins_mask &= ~(((CARD32)0x01)<<c) ;
+	block->index_class = block->index_next = block->index_prev = -1 ;
+}
+
+/* must be called after free slots of the block have changed, while block 
+ * is still locked : */
+static void
+update_block_index( ASStorage *storage, int block_idx )
+{
+	ASStorageBlock *block = storage->blocks[block_idx] ;
+	int c = -1 ;
+
+	if( block == NULL ) 
+		return;
+	/* blocks that ran out of slot indexes are of no use : */
+	if( block->free_bins_mask != 0 && block->last_used+2 < AS_STORAGE_MAX_SLOTS_CNT )
+	{
+		CARD32 mask = block->free_bins_mask ;
+		c = 0 ;
+		while( (mask = mask>>1) != 0 ) 
+			++c ;
+	}
+	if( c == block->index_class ) 
+		return;
+
+	LOCK_INDEX(storage);
+	unlink_indexed_block( storage, block );
+	if( c >= 0 ) 
+	{
+		int head = storage->block_bins[c] ;
+		block->index_next = head ;
+		if( head >= 0 ) 
+			storage->blocks[head]->index_prev = block_idx ;
+		storage->block_bins[c] = block_idx ;
+		storage->block_bins_mask |= (((CARD32)0x01)<<c) ;
+		block->index_class = c ;
+	}
+	UNLOCK_INDEX(storage);
+}
+
+/* returns index of the block having the smallest free slot that is still 
+ * larger then size : */
+static int
+find_indexed_block( ASStorage *storage, int size )
+{
+	int block_idx = -1 ;
+	CARD32 mask ;
+
+	LOCK_INDEX(storage);
+	mask = storage->block_bins_mask & classes_above( size );
+	if( mask != 0 ) 
+		block_idx = storage->block_bins[lowest_bit(mask)] ;
+	UNLOCK_INDEX(storage);
+	return block_idx;
+}
+
+/* Block must be locked by the caller. Unless allow_defrag is set, only 
+ * free slots already available are considered : */
+static ASStorageID 
+store_data_in_block_idx( ASStorage *storage, int block_idx, CARD8* data, int size, int compressed_size, 
+						 int ref_count, ASFlagType flags, Bool allow_defrag )
+{
+	ASStorageBlock *block = storage->blocks[block_idx];
+	int slot_id ;
+
+	if( block == NULL || block->last_used+2 >= AS_STORAGE_MAX_SLOTS_CNT ) 
+		return 0;
+	if( allow_defrag ) 
+		if( block->total_free <= compressed_size+ASStorageSlot_SIZE || 
+			block->total_free <= AS_STORAGE_NOUSE_THRESHOLD )
+			return 0;
+
+	slot_id = store_data_in_block( block, data, size, compressed_size, ref_count, flags, allow_defrag );
+	update_block_index( storage, block_idx );
+	LOCAL_DEBUG_OUT( "block %d, slot id %X", block_idx, slot_id );
+	if( slot_id > 0 )	
+		return make_asstorage_id( block_idx+1, slot_id );
+
+	if( allow_defrag && block->total_free >= compressed_size+ASStorageSlot_SIZE  ) 
+		show_error( "failed to store data in block. Total free size = %d, desired size = %d", block->total_free, compressed_size+ASStorageSlot_SIZE );
+	return 0;
+}
+
 static ASStorageID 
 store_compressed_data( ASStorage *storage, CARD8* data, int size, int compressed_size, int ref_count, ASFlagType flags )
 {
-	int id = 0 ;
-	int block_id = 0;
-	
-	do
-	{	
-		block_id = select_storage_block( storage, compressed_size, flags, block_id );
-		LOCAL_DEBUG_OUT( "selected block %d", block_id );
-		if( block_id > 0 ) 
-		{
-			int slot_id = store_data_in_block(  storage->blocks[block_id-1], 
-												data, size, 
-												compressed_size, ref_count, flags );
+	ASStorageThreadData *td = get_storage_thread_data();
+	ASStorageID id = 0 ;
+	int block_idx, i ;
 
-			LOCAL_DEBUG_OUT( "slot id %X", slot_id );
-			if( slot_id > 0 )	
-				id = make_asstorage_id( block_id, slot_id );
-			else
-				if( storage->blocks[block_id-1]->total_free >= compressed_size+ASStorageSlot_SIZE  ) 
-				{
-					show_error( "failed to store data in block. Total free size = %d, desired size = %d", storage->blocks[block_id-1]->total_free, compressed_size+ASStorageSlot_SIZE );
-					break;
-				}
+	READ_LOCK_BLOCKS(storage);
+	/* 1) block we've used last time - that keeps threads apart : */
+	block_idx = (td->storage == storage)? td->block_idx : -1 ;
+	if( block_idx >= 0 && block_idx < storage->blocks_count && storage->blocks[block_idx] != NULL ) 
+	{
+		LOCK_BLOCK(storage,block_idx);
+		id = store_data_in_block_idx( storage, block_idx, data, size, compressed_size, ref_count, flags, False );
+		UNLOCK_BLOCK(storage,block_idx);
+	}
+	/* 2) best fitting block from the index : */
+	for( i = 0 ; i < AS_STORAGE_INDEX_RETRIES && id == 0 ; ++i ) 
+	{
+		if( (block_idx = find_indexed_block( storage, compressed_size+ASStorageSlot_SIZE )) < 0 ) 
+			break;
+		LOCK_BLOCK(storage,block_idx);
+		id = store_data_in_block_idx( storage, block_idx, data, size, compressed_size, ref_count, flags, False );
+		UNLOCK_BLOCK(storage,block_idx);
+	}
+	/* 3) blocks that have enough free space, but too fragmented to use 
+	 *    it without defragmentation : */
+	for( block_idx = 0 ; block_idx < storage->blocks_count && id == 0 ; ++block_idx ) 
+		if( storage->blocks[block_idx] != NULL ) 
+		{
+			LOCK_BLOCK(storage,block_idx);
+			id = store_data_in_block_idx( storage, block_idx, data, size, compressed_size, ref_count, flags, True );
+			UNLOCK_BLOCK(storage,block_idx);
 		}
-	}while( block_id != 0 && id == 0 );
+	UNLOCK_BLOCKS(storage);
+
+	if( id == 0 ) 
+	{ /* no available blocks found - need to allocate a new block */
+		WRITE_LOCK_BLOCKS(storage);
+		block_idx = add_storage_block( storage, compressed_size );
+		LOCAL_DEBUG_OUT( "added block %d", block_idx );
+		if( block_idx >= 0 ) 
+			id = store_data_in_block_idx( storage, block_idx, data, size, compressed_size, ref_count, flags, False );
+		UNLOCK_BLOCKS(storage);
+	}
+	if( id != 0 ) 
+	{
+		td->storage = storage ;
+		td->block_idx = StorageID2BlockIdx(id);
+	}
 	return id ;		
 }	  
 
@@ -1454,119 +1790,133 @@ free_storage_slot( ASStorageBlock *block, ASStorageSlot *slot)
 {
 	slot->flags = 0 ;
 	block->total_free += ASStorageSlot_USABLE_SIZE(slot) ;
+	--(block->used_count);
+	coalesce_free_slot( block, slot );
 }	 
 
 static Bool 
 is_block_empty( ASStorageBlock *block)
 {
-	int i = block->last_used+1;
-	ASStorageSlot **slots = block->slots ;
-	while( --i >= 0 ) 
-	{
-		if( slots[i] )
-			if( slots[i]->flags != 0 ) 
-				return False;	 
-	}	
-	return True;	
+	return (block->used_count <= 0);	
 }	 
 
 static void 
 free_storage_block( ASStorage *storage, int block_idx  )
 {
 	ASStorageBlock *block = storage->blocks[block_idx] ;
+	unlink_indexed_block( storage, block );
 	storage->blocks[block_idx] = NULL ;
 	destroy_asstorage_block( block );
 }	 
 
+/* Looks up slot by its id, optionally following references. On success 
+ * slot's block is left locked, and its index is returned in *pblock_idx, 
+ * while *pid is set to the id of the slot found. Storage must be locked
+ * for reading. */
 static ASStorageSlot *
-convert_slot_to_ref( ASStorage *storage, ASStorageID id )	
+lock_storage_slot( ASStorage *storage, ASStorageID *pid, int *pblock_idx, Bool follow_refs )
 {
-	int block_idx = StorageID2BlockIdx(id);
-	ASStorageBlock *block;
+	ASStorageID id = *pid ;
+
+	while( id != 0 ) 
+	{
+		int block_idx = StorageID2BlockIdx(id);
+		ASStorageSlot *slot ;
+		ASStorageID target_id = 0;
+
+		if( block_idx < 0 || block_idx >= storage->blocks_count ) 
+			break;
+		LOCK_BLOCK(storage,block_idx);
+		slot = find_storage_slot( storage->blocks[block_idx], id );
+		LOCAL_DEBUG_OUT( "id = %lX, slot = %p", id, slot );
+		if( slot == NULL ) 
+		{
+			UNLOCK_BLOCK(storage,block_idx);
+			break;
+		}
+		if( !follow_refs || !get_flags( slot->flags, ASStorage_Reference) )
+		{
+			*pid = id ;
+			*pblock_idx = block_idx ;
+			return slot;
+		}
+		memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
+		UNLOCK_BLOCK(storage,block_idx);
+		LOCAL_DEBUG_OUT( "target_id = %lX", target_id );
+		if( target_id == id ) 
+		{
+			show_error( "reference refering to self id = %lX", id );
+			break;
+		}
+		id = target_id ;
+	}
+	return NULL;
+}
+
+static void 
+make_reference_slot( ASStorageBlock *block, ASStorageSlot *ref_slot, ASStorageID target_id )
+{
+	split_storage_slot( block, ref_slot, sizeof(ASStorageID));
+	ref_slot->uncompressed_size = sizeof(ASStorageID) ; 
+	set_flags( ref_slot->flags, ASStorage_Reference );
+	clear_flags( ref_slot->flags, ASStorage_CompressionType );
+	memcpy( ASStorage_Data(ref_slot), (CARD8*)&target_id, sizeof(ASStorageID));				 
+}
+
+/* Moves data of the slot into the new slot in the same block, and turns
+ * the original slot into a reference to it, so that it could be shared.
+ * Block must be locked. If there is no space left in the block - NULL is 
+ * returned and it is up to the caller to relocate data into a different 
+ * block, which can only be done after the block is unlocked. */
+static ASStorageSlot *
+convert_slot_to_ref( ASStorage *storage, int block_idx, ASStorageID id )	
+{
+	ASStorageBlock *block = storage->blocks[block_idx];
 	ASStorageID target_id = 0;
 	int slot_id = 0 ;
 	int ref_index, body_index ;
 	ASStorageSlot *ref_slot, *body_slot ;
 	
-	block = find_storage_block(storage, id);
-	
 	LOCAL_DEBUG_OUT( "block = %p, block->total_free = %d", block, block->total_free );
 	/* Two strategies here - 1 - the fast one - we try to allocate new slot 
 	 * and avoid copying the body of the data over - we can do that only if
 	 * there is enough space in its block, otherwise we have to relocate it 
-	 * into different block, which is slower.
+	 * into different block, which is slower, and is done by dup_data().
 	 */
 	if( block->total_free > sizeof(ASStorageID))
 	{	
 		slot_id = store_data_in_block(  block, (CARD8*)&target_id, 
 										sizeof(ASStorageID), sizeof(ASStorageID), 0, 
-										ASStorage_Reference );
+										ASStorage_Reference, True );
 	}
 	LOCAL_DEBUG_OUT( "block = %p, block->total_free = %d, slot_id = 0x%X", block, block->total_free, slot_id );
 	
-	if( slot_id > 0 )
-	{ 	/* We can use fast strategy : now we need to swap contents of the slots */
-		ref_index = slot_id-1 ;
-		ref_slot = block->slots[ref_index] ;
-	
-		body_index = StorageID2SlotIdx(id) ; 
-		body_slot = block->slots[body_index] ;
-	
-		block->slots[ref_index] = body_slot ;
-		body_slot->index = ref_index ;
+	if( slot_id <= 0 )
+		return NULL;
 
-		block->slots[body_index] = ref_slot ; 
-		ref_slot->index = body_index ;
+	/* We can use fast strategy : now we need to swap contents of the slots */
+	ref_index = slot_id-1 ;
+	ref_slot = block->slots[ref_index] ;
 
-		target_id = make_asstorage_id( block_idx+1, slot_id );
-		if( target_id == id ) 
-		{
-			show_error( "Reference ID is the same as target_id: id = %lX, slot_id = %d", id, slot_id );
-#ifndef NO_DEBUG_OUTPUT
-			{	int *a = NULL ; *a = 0 ;}
-#endif						   
-		}
-		/* don't increment refcount, becouse we oonly have one published reference to it so far */
-		/* ++(body_slot->ref_count); */
-	}else
-	{/* otherwise we have to relocate the actuall body into a different block, 
-	  * which is somewhat tricky : */
-		ref_index = StorageID2SlotIdx(id); ;
-		ref_slot = block->slots[ref_index] ;
-		
-		if( block->total_free > (int)ref_slot->size )
-		{
-			/* there is a danger of us trying to reuse same block and defragmented it in between,
-			 * which will screw up the data */
-#ifndef NO_DEBUG_OUTPUT
-			fprintf( stderr, "\t\t %s:%d DANGEROUS RELOCATION! size = %ld",  __FILE__, __LINE__, ref_slot->size );
-#endif						   
-			memcpy( storage->comp_buf, ASStorage_Data(ref_slot), ref_slot->size );
-			target_id = store_compressed_data(  storage, storage->comp_buf, 
-										   		ref_slot->uncompressed_size, 
-										   		ref_slot->size, ref_slot->ref_count, ref_slot->flags );
-		}else	 
-			target_id = store_compressed_data( storage, ASStorage_Data(ref_slot), 
-										   	ref_slot->uncompressed_size, 
-										   	ref_slot->size, ref_slot->ref_count, ref_slot->flags );
-		/* lets do this again, in case block was defragmented */
-		ref_slot = block->slots[ref_index] ;
-
-		if( target_id == 0 ) 
-			return NULL;		
-		if( target_id == id ) 
-		{	
-			show_error( "Reference ID is the same as target_id: id = %lX" );
+	body_index = StorageID2SlotIdx(id) ; 
+	body_slot = block->slots[body_index] ;
+
+	block->slots[ref_index] = body_slot ;
+	body_slot->index = ref_index ;
+
+	block->slots[body_index] = ref_slot ; 
+	ref_slot->index = body_index ;
+
+	target_id = make_asstorage_id( block_idx+1, slot_id );
+	if( target_id == id ) 
+	{
+		show_error( "Reference ID is the same as target_id: id = %lX, slot_id = %d", id, slot_id );
 #ifndef NO_DEBUG_OUTPUT
-			{	int *a = NULL ; *a = 0 ;}
+		{	int *a = NULL ; *a = 0 ;}
 #endif						   
-		}
-		
-		split_storage_slot( block, ref_slot, sizeof(ASStorageID));
-		ref_slot->uncompressed_size = sizeof(ASStorageID) ; 
-		set_flags( ref_slot->flags, ASStorage_Reference );
-		clear_flags( ref_slot->flags, ASStorage_CompressionType );
-	}	 
+	}
+	/* don't increment refcount, becouse we oonly have one published reference to it so far */
+	/* ++(body_slot->ref_count); */
 	memcpy( ASStorage_Data(ref_slot), (CARD8*)&target_id, sizeof(ASStorageID));				 
 
 	return ref_slot;
@@ -1579,6 +1929,7 @@ typedef struct
 	
 	unsigned int threshold ;
 	int start, end, runs_count ;
+	int shift ;
 }ASStorageDstBuffer;
 
 typedef void (*data_cpy_func_type)(ASStorageDstBuffer *, void *, size_t);
@@ -1600,6 +1951,15 @@ static void card8_card32_cpy( ASStorageDstBuffer *dst, void *src, size_t size)
 		dst32[i] = src8[i] ;
 }	 
 
+static void card8_card32_shifted_cpy( ASStorageDstBuffer *dst, void *src, size_t size)
+{
+	register CARD32 *dst32 = (CARD32*)dst->buffer + dst->offset ;
+	register CARD8  *src8  = (CARD8*)src ;
+	register int i, shift = dst->shift ;
+	for( i = 0 ;  i < (int)size ; ++i ) 
+		dst32[i] = ((CARD32)src8[i])<<shift ;
+}	 
+
 static void 
 card8_threshold( ASStorageDstBuffer *dst, void *src, size_t size)
 {
@@ -1662,59 +2022,60 @@ static int
 fetch_data_int( ASStorage *storage, ASStorageID id, ASStorageDstBuffer *buffer, int offset, int buf_size, CARD8 bitmap_value, 
 		  		data_cpy_func_type cpy_func, int *original_size)
 {
-	ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
+	ASStorageSlot *slot ;
+	int block_idx = -1 ;
+	int res = 0 ;
+
+	if( buffer == NULL || buf_size <= 0 ) 
+		return 0;
+
+	READ_LOCK_BLOCKS(storage);
+	slot = lock_storage_slot( storage, &id, &block_idx, True );
 	LOCAL_DEBUG_OUT( "slot = %p", slot );
-	if( slot && buffer && buf_size > 0 )
+	if( slot )
 	{
 		int uncomp_size = slot->uncompressed_size ;
+		CARD8 *tmp ;
 		*original_size = uncomp_size ;
-		if( get_flags( slot->flags, ASStorage_Reference) )
-		{
-			ASStorageID target_id = 0;
-			memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
-			LOCAL_DEBUG_OUT( "target_id = %lX", target_id );
-			if( target_id != 0 ) 
-				return fetch_data_int(storage, target_id, buffer, offset, buf_size, bitmap_value, cpy_func, original_size);
-			else
-				return 0;
-		}	 
 
 		LOCAL_DEBUG_OUT( "flags = %X, index = %d, size = %ld, uncompressed_size = %d", 
 							slot->flags, slot->index, slot->size, uncomp_size );
 		if( bitmap_value == 0 ) 
 			bitmap_value = AS_STORAGE_DEFAULT_BMAP_VALUE ;
 
-		{
-			CARD8 *tmp = decompress_stored_data( storage, ASStorage_Data(slot), slot->size,
-													uncomp_size, slot->flags, bitmap_value );
-			while( offset > uncomp_size ) offset -= uncomp_size ; 
-			while( offset < 0 ) offset += uncomp_size ; 
+		/* slot may be moved by defragmentation as soon as block is unlocked, 
+		 * so we copy data out while still holding the lock : */
+		tmp = decompress_stored_data( get_storage_thread_data(), ASStorage_Data(slot), slot->size,
+									  uncomp_size, slot->flags, bitmap_value );
+		while( offset > uncomp_size ) offset -= uncomp_size ; 
+		while( offset < 0 ) offset += uncomp_size ; 
 			
-			if( get_flags( slot->flags, ASStorage_NotTileable ) )
-				if( buf_size > uncomp_size - offset ) 
-					buf_size = uncomp_size - offset ;
-			if( offset > 0 ) 
-			{
-				int to_copy = uncomp_size-offset ; 
-				if( to_copy > buf_size ) 
-					to_copy = buf_size ;
-				cpy_func( buffer, tmp+offset, to_copy ); 															
-				buffer->offset = to_copy ;
-			}
-			LOCAL_DEBUG_OUT( "offset = %d", buffer->offset );
-			while( buffer->offset < buf_size ) 
-			{
-				int to_copy = buf_size - buffer->offset ; 
-				if( to_copy > uncomp_size ) 
-					to_copy = uncomp_size ;
-				cpy_func( buffer, tmp, to_copy ); 															
-				buffer->offset += to_copy;
-			}
+		if( get_flags( slot->flags, ASStorage_NotTileable ) )
+			if( buf_size > uncomp_size - offset ) 
+				buf_size = uncomp_size - offset ;
+		if( offset > 0 ) 
+		{
+			int to_copy = uncomp_size-offset ; 
+			if( to_copy > buf_size ) 
+				to_copy = buf_size ;
+			cpy_func( buffer, tmp+offset, to_copy ); 															
+			buffer->offset = to_copy ;
 		}
+		LOCAL_DEBUG_OUT( "offset = %d", buffer->offset );
+		while( buffer->offset < buf_size ) 
+		{
+			int to_copy = buf_size - buffer->offset ; 
+			if( to_copy > uncomp_size ) 
+				to_copy = uncomp_size ;
+			cpy_func( buffer, tmp, to_copy ); 															
+			buffer->offset += to_copy;
+		}
+		UNLOCK_BLOCK(storage,block_idx);
 		LOCAL_DEBUG_OUT( "uncompressed_size = %d", buffer->offset );
-		return buffer->offset ;
+		res = buffer->offset ;
 	}
-	return 0;
+	UNLOCK_BLOCKS(storage);
+	return res;
 }
 
 /************************************************************************/
@@ -1728,27 +2089,66 @@ create_asstorage()
 #else
 	ASStorage *storage = guarded_calloc(1, sizeof(ASStorage));
 #endif
-	UsedMemory += sizeof(ASStorage) ;
+	STAT_ADD( UsedMemory, sizeof(ASStorage) );
 	if( storage )
+	{
+		int i ;
 		storage->default_block_size = AS_STORAGE_DEF_BLOCK_SIZE ;
+		for( i = 0 ; i < AS_STORAGE_FREE_BINS ; ++i ) 
+			storage->block_bins[i] = -1 ;
+#ifdef HAVE_PTHREAD
+		{
+			ASStorageLocks *locks = safecalloc( 1, sizeof(ASStorageLocks));
+			pthread_rwlock_init( &(locks->blocks_lock), NULL );
+			for( i = 0 ; i < AS_STORAGE_LOCK_STRIPES ; ++i ) 
+				pthread_mutex_init( &(locks->stripes[i]), NULL );
+			pthread_mutex_init( &(locks->index_lock), NULL );
+			storage->locks = locks ;
+		}
+#endif
+	}
 	return storage ;
 }
 
+static ASStorage *
+get_default_asstorage()
+{
+	ASStorage *storage = LOAD_DEFAULT_STORAGE();
+
+	if( storage == NULL )
+	{
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock( &__as_default_storage_lock );
+#endif
+		if( (storage = _as_default_storage) == NULL )
+		{
+			storage = create_asstorage();
+			STORE_DEFAULT_STORAGE( storage );
+		}
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock( &__as_default_storage_lock );
+#endif
+	}
+	return storage;
+}
+
+/* Block size is only changed for the calling thread - loaders running 
+ * concurrently each get blocks sized for their own image, and restoring 
+ * old value in one of them does not affect the others : */
 int 
 set_asstorage_block_size( ASStorage *storage, int new_size )
 {
+	ASStorageThreadData *td = get_storage_thread_data();
 	int old_size ;
 	
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
 	
-	old_size = storage->default_block_size ; 
-#if 1
+	old_size = (td->block_size > 0)? td->block_size : storage->default_block_size ; 
 	if( new_size > AS_STORAGE_DEF_BLOCK_SIZE ) 
-		storage->default_block_size = new_size; 
+		td->block_size = new_size; 
 	else
-		storage->default_block_size = AS_STORAGE_DEF_BLOCK_SIZE; 
-#endif
+		td->block_size = 0; 
 	return old_size;
 }
 
@@ -1765,7 +2165,7 @@ destroy_asstorage(ASStorage **pstorage)
 			for( i = 0 ; i < storage->blocks_count ; ++i ) 
 				if( storage->blocks[i] ) 
 					destroy_asstorage_block( storage->blocks[i] );
-			UsedMemory -= storage->blocks_count * sizeof(ASStorageBlock*) ;
+			STAT_SUB( UsedMemory, storage->blocks_count * sizeof(ASStorageBlock*) );
 #ifndef DEBUG_ALLOCS
 			free( storage->blocks );
 #else	
@@ -1777,8 +2177,20 @@ destroy_asstorage(ASStorage **pstorage)
 			free( storage->comp_buf);
 		if( storage->diff_buf )
 			free( storage->diff_buf);
+#ifdef HAVE_PTHREAD
+		if( storage->locks )
+		{
+			ASStorageLocks *locks = STORAGE_LOCKS(storage);
+			int i ;
+			for( i = 0 ; i < AS_STORAGE_LOCK_STRIPES ; ++i ) 
+				pthread_mutex_destroy( &(locks->stripes[i]) );
+			pthread_mutex_destroy( &(locks->index_lock) );
+			pthread_rwlock_destroy( &(locks->blocks_lock) );
+			free( locks );
+		}
+#endif
 
-		UsedMemory -= sizeof(ASStorage) ;
+		STAT_SUB( UsedMemory, sizeof(ASStorage) );
 #ifndef DEBUG_ALLOCS
 		free( storage );
 #else	
@@ -1791,8 +2203,17 @@ destroy_asstorage(ASStorage **pstorage)
 void 
 flush_default_asstorage()
 {
-	if( _as_default_storage != NULL )
-		destroy_asstorage(&_as_default_storage);
+	ASStorage *storage ;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &__as_default_storage_lock );
+#endif
+	storage = _as_default_storage ;
+	STORE_DEFAULT_STORAGE( NULL );
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &__as_default_storage_lock );
+#endif
+	if( storage != NULL )
+		destroy_asstorage(&storage);
 }
 
 ASStorageID 
@@ -1817,7 +2238,7 @@ store_data(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, CARD8 bi
 			 
 	if( !get_flags(flags, ASStorage_Reference))
 		if( get_flags( flags, ASStorage_CompressionType ) || get_flags( flags, ASStorage_32Bit ) )
-			buffer = compress_stored_data( storage, data, size, &flags, &compressed_size, bitmap_threshold32 );
+			buffer = compress_stored_data( get_storage_thread_data(), data, size, &flags, &compressed_size, bitmap_threshold32 );
 	
 	return store_compressed_data( storage, buffer, 
 								  get_flags( flags, ASStorage_32Bit )?size/4:size, 
@@ -1848,7 +2269,7 @@ store_data_tinted(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, C
 	
 	if( !get_flags(flags, ASStorage_Reference))
 		if( get_flags( flags, ASStorage_CompressionType ) || get_flags( flags, ASStorage_32Bit ) )
-			buffer = compress_stored_data( storage, data, size, &flags, &compressed_size, tint32 );
+			buffer = compress_stored_data( get_storage_thread_data(), data, size, &flags, &compressed_size, tint32 );
 	
 	return store_compressed_data( storage, buffer, 
 								  get_flags( flags, ASStorage_32Bit )?size/4:size, 
@@ -1897,6 +2318,31 @@ fetch_data32(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int
 	return 0 ;	
 }
 
+int  
+fetch_data32_shifted(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int buf_size, CARD8 bitmap_value, int shift, int *original_size)
+{
+	int dumm ;
+	if( shift == 0 ) 
+		return fetch_data32( storage, id, buffer, offset, buf_size, bitmap_value, original_size );
+
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	
+	if( original_size == NULL ) 
+		original_size = &dumm ;
+	*original_size = 0;
+	if( storage != NULL && id != 0 )
+	{
+		ASStorageDstBuffer buf ; 
+		buf.offset = 0 ; 
+		buf.buffer = buffer ;
+		buf.shift = shift ;
+	  	
+		return fetch_data_int( storage, id, &buf, offset, buf_size, bitmap_value, card8_card32_shifted_cpy, original_size );
+	}
+	return 0 ;	
+}
+
 int  
 threshold_stored_data(ASStorage *storage, ASStorageID id, unsigned int *runs, int width, unsigned int threshold)
 {
@@ -1936,32 +2382,62 @@ threshold_stored_data(ASStorage *storage, ASStorageID id, unsigned int *runs, in
 Bool 
 query_storage_slot(ASStorage *storage, ASStorageID id, ASStorageSlot *dst )
 {
+	Bool res = False ;
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
 	
 	if( storage != NULL && id != 0 && dst != NULL )
 	{	
-		ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
-		LOCAL_DEBUG_OUT( "slot = %p", slot );
-		if( slot )
+		int block_idx = -1 ;
+		ASStorageSlot *slot ;
+		READ_LOCK_BLOCKS(storage);
+		if( (slot = lock_storage_slot( storage, &id, &block_idx, True )) != NULL )
 		{
-			if( get_flags( slot->flags, ASStorage_Reference) )
-			{
-				ASStorageID target_id = 0;
-			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
-				LOCAL_DEBUG_OUT( "target_id = %lX", target_id );
-				if( target_id == id ) 
-				{
-					show_error( "reference refering to self id = %lX", id );
-					return False;
-				}
-				return query_storage_slot(storage, target_id, dst);
-			}	 
 			*dst = *slot ;
-			return True ;
+			res = True ;
+			UNLOCK_BLOCK(storage,block_idx);
 		}
+		UNLOCK_BLOCKS(storage);
 	}
-	return False;	  
+	return res;	  
+}
+
+int 
+fetch_compressed_data(ASStorage *storage, ASStorageID id, CARD8 *buffer, int buf_size, ASStorageSlot *dst )
+{
+	int res = -1 ;
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	
+	if( storage != NULL && id != 0 )
+	{	
+		int block_idx = -1 ;
+		ASStorageSlot *slot ;
+		READ_LOCK_BLOCKS(storage);
+		if( (slot = lock_storage_slot( storage, &id, &block_idx, True )) != NULL )
+		{
+			res = slot->size ;
+			if( dst ) 
+				*dst = *slot ;
+			if( buffer != NULL && buf_size >= res ) 
+				memcpy( buffer, ASStorage_Data(slot), res );
+			UNLOCK_BLOCK(storage,block_idx);
+		}
+		UNLOCK_BLOCKS(storage);
+	}
+	return res;	  
+}
+
+ASStorageID 
+import_compressed_data(ASStorage *storage, CARD8 *data, int compressed_size, int uncompressed_size, ASFlagType flags )
+{
+	if( storage == NULL ) 
+		storage = get_default_asstorage();
+	if( compressed_size <= 0 || data == NULL || storage == NULL ) 
+		return 0;
+	/* only flags describing the data itself are meaningfull : */
+	flags &= ~(ASStorage_Used|ASStorage_Reference) ;
+	return store_compressed_data( storage, data, uncompressed_size, compressed_size, 0, flags );
 }
 
 int 
@@ -2028,20 +2504,27 @@ forget_data(ASStorage *storage, ASStorageID id)
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
 	
-	if( storage != NULL && id != 0 ) 
+	/* references are released one at a time, so that we never hold 
+	 * locks on two blocks at once : */
+	while( storage != NULL && id != 0 ) 
 	{
-		ASStorageBlock *block = find_storage_block( storage, id );
- 		ASStorageSlot  *slot  = find_storage_slot( block, id );				
-		if( block && slot ) 
+		ASStorageID target_id = 0;
+		int block_idx = -1 ;
+		Bool block_empty = False ;
+		ASStorageSlot  *slot ;
+
+		READ_LOCK_BLOCKS(storage);
+		if( (slot = lock_storage_slot( storage, &id, &block_idx, False )) != NULL ) 
 		{
+			ASStorageBlock *block = storage->blocks[block_idx] ;
 			if( get_flags( slot->flags, ASStorage_Reference) )
 			{
-				ASStorageID target_id = 0;
 			 	memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));				   
-				if( target_id != id ) 
-					forget_data( storage, target_id );					
-				else
+				if( target_id == id ) 
+				{
 					show_error( "reference refering to self id = %lX", id );
+					target_id = 0 ;
+				}
 			}	 
 			LOCAL_DEBUG_OUT( "id = %lX, ref_count = %d;", id, slot->ref_count );
 			if( slot->ref_count >= 1 ) 
@@ -2049,57 +2532,123 @@ forget_data(ASStorage *storage, ASStorageID id)
 			else
 			{	
 				free_storage_slot(block, slot);
-				if( is_block_empty(block) ) 
-					free_storage_block( storage, StorageID2BlockIdx(id) );
+				block_empty = is_block_empty(block);
+				update_block_index( storage, block_idx );
 			}
+			UNLOCK_BLOCK(storage,block_idx);
 		}	 
+		UNLOCK_BLOCKS(storage);
+
+		if( block_empty ) 
+		{ /* some other thread could have stored something in it in the mean time : */
+			WRITE_LOCK_BLOCKS(storage);
+			if( storage->blocks[block_idx] != NULL && is_block_empty(storage->blocks[block_idx]) ) 
+				free_storage_block( storage, block_idx );
+			UNLOCK_BLOCKS(storage);
+		}
+		id = target_id ;
 	}			  
 }
 
 ASStorageID 
 dup_data(ASStorage *storage, ASStorageID id)
 {
-	ASStorageID new_id = 0 ;
+	ASStorageID new_id = 0, target_id = 0 ;
+	ASStorageSlot *slot, body ;
+	CARD8 *body_data = NULL ;
+	int block_idx = -1 ;
+	Bool referenced = False ;
 
 	if( storage == NULL ) 
 		storage = get_default_asstorage();
 	   
-	if( storage != NULL && id != 0 )
-	{	
-		ASStorageSlot *slot = find_storage_slot( find_storage_block( storage, id ), id );
-		LOCAL_DEBUG_OUT( "slot = %p, slot->index = %d, index(id) = %ld", slot, slot?slot->index:-1, StorageID2SlotIdx(id) );
-		if( slot )
+	if( storage == NULL || id == 0 )
+		return 0;
+
+	READ_LOCK_BLOCKS(storage);
+	if( (slot = lock_storage_slot( storage, &id, &block_idx, False )) != NULL ) 
+	{
+		LOCAL_DEBUG_OUT( "slot = %p, slot->index = %d, index(id) = %ld", slot, slot->index, StorageID2SlotIdx(id) );
+		if( !get_flags( slot->flags, ASStorage_Reference )) 
+		{	
+			ASStorageSlot *new_slot = convert_slot_to_ref( storage, block_idx, id );
+			if( new_slot == NULL ) 
+			{ /* no space left in the block - body will have to be relocated, 
+			   * lets make a copy of it, as block may have been defragmented : */
+				slot = find_storage_slot( storage->blocks[block_idx], id );
+				body = *slot ;
+				body_data = safemalloc( slot->size );
+				memcpy( body_data, ASStorage_Data(slot), slot->size );
+			}else
+				slot = new_slot;
+			update_block_index( storage, block_idx );
+		}
+		if( body_data == NULL ) 
+			memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));
+		UNLOCK_BLOCK(storage,block_idx);
+	}
+	UNLOCK_BLOCKS(storage);
+
+	if( body_data != NULL ) 
+	{ /* relocating the actuall body into a different block : */
+		ASStorageID body_id = store_compressed_data( storage, body_data, body.uncompressed_size, 
+													 body.size, body.ref_count, body.flags );
+		free( body_data );
+		if( body_id == id ) 
 		{
-			ASStorageSlot *target_slot = NULL;
-			ASStorageID target_id = id ;
-			if( !get_flags( slot->flags, ASStorage_Reference )) 
-			{	
-				ASStorageSlot *new_slot = convert_slot_to_ref( storage, id );
-				if( new_slot != NULL ) 
-					slot = new_slot;
+			show_error( "Reference ID is the same as target_id: id = %lX", id );
+			body_id = 0 ;
+		}
+		if( body_id != 0 ) 
+		{
+			READ_LOCK_BLOCKS(storage);
+			if( (slot = lock_storage_slot( storage, &id, &block_idx, False )) != NULL ) 
+			{
+				if( get_flags( slot->flags, ASStorage_Reference ) )
+				{ /* another thread has done it before us */
+					memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));
+				}else
+				{
+					make_reference_slot( storage->blocks[block_idx], slot, body_id );
+					update_block_index( storage, block_idx );
+					target_id = body_id ;
+					body_id = 0 ;
+				}
+				UNLOCK_BLOCK(storage,block_idx);
 			}
-				
-			if( get_flags( slot->flags, ASStorage_Reference )) 
-			{   
-				memcpy( &target_id, ASStorage_Data(slot), sizeof( ASStorageID ));
-				/* from now on - slot is a reference slot, so we just need to 
-			 	 * duplicate it and increase ref_count of target */
-				if( target_id != id ) 
-					target_slot = find_storage_slot( find_storage_block( storage, target_id ), target_id );
-				else
-					show_error( "reference refering to self id = %lX", id );
-			}else
-				target_slot = slot ; 	
-			
-			LOCAL_DEBUG_OUT( "target_slot = %p, slot = %p", target_slot, slot );
-			if( target_slot == NULL ) 
-				return 0;
-			/* doing it here as store_data() may change slot pointers */
-			++(target_slot->ref_count);			   
-			new_id = store_data( storage, (CARD8*)&target_id, sizeof(ASStorageID), ASStorage_Reference, 0);
-			LOCAL_DEBUG_OUT( "new_id = 0x%lX, target_id = %lX, target->ref_count = %d", new_id, target_id, target_slot->ref_count );
+			UNLOCK_BLOCKS(storage);
+			if( body_id != 0 ) 
+				forget_data( storage, body_id );
 		}
 	}
+
+	if( target_id == 0 ) 
+		return 0;
+	if( target_id == id ) 
+	{
+		show_error( "reference refering to self id = %lX", id );
+		return 0;
+	}
+	/* from now on - slot is a reference slot, so we just need to 
+	 * duplicate it and increase ref_count of target */
+	READ_LOCK_BLOCKS(storage);
+	if( (slot = lock_storage_slot( storage, &target_id, &block_idx, False )) != NULL ) 
+	{
+		++(slot->ref_count);
+		referenced = True ;
+		LOCAL_DEBUG_OUT( "target_id = %lX, target->ref_count = %d", target_id, slot->ref_count );
+		UNLOCK_BLOCK(storage,block_idx);
+	}
+	UNLOCK_BLOCKS(storage);
+	
+	if( referenced ) 
+	{
+		new_id = store_compressed_data( storage, (CARD8*)&target_id, sizeof(ASStorageID), 
+										sizeof(ASStorageID), 0, ASStorage_Reference );
+		LOCAL_DEBUG_OUT( "new_id = 0x%lX, target_id = %lX", new_id, target_id );
+		if( new_id == 0 ) 
+			forget_data( storage, target_id );
+	}
 	return new_id;
 }
 
@@ -2246,9 +2795,9 @@ test_data_integrity( CARD8 *a, CARD8* b, int size, ASFlagType flags )
 		if( get_flags( flags, ASStorage_Bitmap ) )
 		{	
 			if( get_flags( flags, ASStorage_32Bit ) )
-				fail = ( (a[i] >  threshold8 && b32[i] <= threshold32 )||(a[i] <= threshold8 && b32[i] > threshold32));
+				fail = ( (a[i] >= threshold8 && b32[i] <  threshold32 )||(a[i] <  threshold8 && b32[i] >= threshold32));
 			else
-				fail = ( (a[i] >  threshold8 && b[i] <= threshold8 )||(a[i] <= threshold8 && b[i] >  threshold8));
+				fail = ( (a[i] >= threshold8 && b[i] <  threshold8 )||(a[i] <  threshold8 && b[i] >= threshold8));
 
 		}else
 		{
@@ -2643,6 +3192,117 @@ test_asstorage(Bool interactive, int all_test_count, ASFlagType test_flags )
 	return 0 ;
 }
 
+#ifdef BENCHMARK_ASSTORAGE
+/* Benchmark of slot allocation with large number of live slots - 
+ * usage : bench_asstorage [-n live_slots] [-o operations]
+ */
+#define BENCH_DEF_LIVE_SLOTS	(128*1024)
+#define BENCH_DEF_OPERATIONS	(1024*1024)
+#define BENCH_MAX_SIZE			2048
+
+static double 
+bench_seconds( clock_t started )
+{
+	double secs = (double)(clock()-started)/CLOCKS_PER_SEC ;
+	return (secs > 0)? secs : 1.0/CLOCKS_PER_SEC ;
+}
+
+static int
+bench_data_size()
+{   /* mostly scanline sized data, with occasional larger chunks : */
+	return ((random()&0x0F) == 0)? 1+random()%BENCH_MAX_SIZE : 1+random()%(BENCH_MAX_SIZE/8) ;
+}
+
+int main(int argc, char **argv )
+{
+	int live_count = BENCH_DEF_LIVE_SLOTS ;
+	int ops_count = BENCH_DEF_OPERATIONS ;
+	ASStorage *storage ;
+	ASStorageID *ids ;
+	int *sizes ;
+	int i, failed = 0, stores = 0, forgets = 0, dups = 0, fetches = 0 ;
+	clock_t started ;
+	double secs ;
+	
+	for( i = 1 ; i < argc ; ++i ) 
+	{	
+		if( i+1 < argc && strcmp(argv[i], "-n") == 0 ) 
+			live_count = atoi( argv[++i] );
+		else if( i+1 < argc && strcmp(argv[i], "-o") == 0 ) 
+			ops_count = atoi( argv[++i] );
+	}
+	if( live_count < 1 ) 
+		live_count = 1 ;
+	
+	/* something resembling image data, so that RLE has work to do : */
+	for( i = 0 ; i < BENCH_MAX_SIZE ; ++i ) 
+		Buffer[i] = (i&0x20)? (CARD8)(i>>3) : (CARD8)(random()&0x03) ;
+	ids = safecalloc( live_count, sizeof(ASStorageID));
+	sizes = safecalloc( live_count, sizeof(int));
+	storage = create_asstorage();
+
+	started = clock();
+	for( i = 0 ; i < live_count ; ++i ) 
+	{
+		sizes[i] = bench_data_size();
+		if( (ids[i] = store_data( storage, &(Buffer[0]), sizes[i], ASStorage_RLEDiffCompress, 0 )) == 0 ) 
+			++failed ;
+	}
+	secs = bench_seconds( started );
+	printf( "fill    : %d slots in %.3f sec - %.0f stores/sec, %d blocks, memory used %lu\n", 
+			live_count, secs, live_count/secs, storage->blocks_count, (unsigned long)UsedMemory );
+
+	started = clock();
+	for( i = 0 ; i < ops_count ; ++i ) 
+	{
+		int k = random()%live_count ;
+		int op = random()&0x03 ;
+		
+		if( op == 0 ) 
+		{
+			if( fetch_data( storage, ids[k], &(Buffer[BENCH_MAX_SIZE]), 0, sizes[k], 0, NULL) != sizes[k] ) 
+				++failed ;
+			++fetches ;
+		}else
+		{/* replacing slot keeps number of live slots constant : */
+			forget_data( storage, ids[k] );
+			++forgets ;
+			if( op == 1 ) 
+			{	
+				int src = random()%live_count ;
+				if( src == k ) 
+					src = (k+1)%live_count ;
+				ids[k] = dup_data( storage, ids[src] );
+				sizes[k] = sizes[src] ;
+				++dups ;
+			}else
+			{
+				sizes[k] = bench_data_size();
+				ids[k] = store_data( storage, &(Buffer[0]), sizes[k], ASStorage_RLEDiffCompress, 0 );
+				++stores ;
+			}
+			if( ids[k] == 0 ) 
+				++failed ;
+		}
+	}
+	secs = bench_seconds( started );
+	printf( "churn   : %d ops (%d stores, %d forgets, %d dups, %d fetches) in %.3f sec - %.0f ops/sec\n", 
+			ops_count, stores, forgets, dups, fetches, secs, ops_count/secs );
+	printf( "          %d blocks, memory used %lu\n", storage->blocks_count, (unsigned long)UsedMemory );
+
+	started = clock();
+	for( i = 0 ; i < live_count ; ++i ) 
+		forget_data( storage, ids[i] );
+	secs = bench_seconds( started );
+	printf( "release : %d slots in %.3f sec - %.0f forgets/sec\n", live_count, secs, live_count/secs );
+	
+	destroy_asstorage( &storage );
+	free( sizes );
+	free( ids );
+	printf( "failed operations : %d\n", failed );
+	return (failed > 0)?1:0;
+}
+#else
 int main(int argc, char **argv )
 {
 	Bool interactive = False ; 
@@ -2710,5 +3370,6 @@ int main(int argc, char **argv )
 	stop_image_decoding( &imdec );
 	return res;
 }
+#endif /* BENCHMARK_ASSTORAGE */
 #endif
 
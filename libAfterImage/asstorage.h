@@ -16,6 +16,8 @@
 #define AS_STORAGE_MAX_BLOCK_CNT   	(0x01<<AS_STORAGE_BLOCK_ID_BITS)
 /* #define AS_STORAGE_DEF_BLOCK_SIZE	(1024*256)  */
 #define AS_STORAGE_DEF_BLOCK_SIZE	(1024*128)  /* 128 Kb */  
+/* free slots are kept in lists segregated by size class - floor(log2(size)) : */
+#define AS_STORAGE_FREE_BINS		32
 #define AS_STORAGE_NOUSE_THRESHOLD	(1024*8)  /* 8 Kb if total_free < 8K we should not try and use that 
 											   *  block as we may fall into trap constantly defragmenting it
 											   *  so we prefer to leave memory unused since 2 pages is not too much to loose */  
@@ -148,7 +150,17 @@ typedef struct ASStorageBlock
 	int slots_count, unused_count ;
 	int first_free, last_used ;
 	int long_searches ;
-
+	
+	int used_count ;
+	/* lists of free slots, linked through free slots' ref_count (next) and 
+	 * reserved (prev) fields, with one list per size class : */
+	int 	free_bins[AS_STORAGE_FREE_BINS] ;
+	CARD32 	free_bins_mask ;  /* bit set for each non-empty list */
+	/* indexes of NULL entries in slots array, so we don't have to search : */
+	int    *unused_slots ; 
+	int 	unused_slots_num ;
+	/* place in storage's index of blocks by largest free slot :*/
+	int 	index_class, index_next, index_prev ;
 }ASStorageBlock;
 
 typedef struct ASStorage
@@ -159,15 +171,26 @@ typedef struct ASStorage
 	ASStorageBlock **blocks ;
 	int 			blocks_count;
 
+	/* compression buffers are now kept per thread - these are unused : */
 	ASStorageDiff  *diff_buf ;
 	CARD8  *comp_buf ;
 	size_t 	comp_buf_size ; 
 
+	void   *locks ;  /* private to asstorage.c - used when built with pthreads */
+
+	/* lists of blocks by size class of the largest free slot they have : */
+	int 	block_bins[AS_STORAGE_FREE_BINS] ;
+	CARD32 	block_bins_mask ;
 }ASStorage;
 
 
 typedef CARD32 ASStorageID ;
 
+/* When built with pthreads support, functions below may be called from 
+ * several threads at once. Each block of the storage has its own lock, and 
+ * each thread prefers to store new data into the block it used last, so 
+ * threads working on different images rarely have to wait for each other.
+ * Reference counts of shared data are updated under the lock of its block. */
 ASStorageID store_data(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, CARD8 bitmap_threshold);
 ASStorageID store_data_tinted(ASStorage *storage, CARD8 *data, int size, ASFlagType flags, CARD16 tint);
 
@@ -176,6 +199,8 @@ ASStorageID store_data_tinted(ASStorage *storage, CARD8 *data, int size, ASFlagT
  * available data - data will be tiled to accomodate this size, unless NotTileable is set */
 int  fetch_data(ASStorage *storage, ASStorageID id, CARD8 *buffer, int offset, int buf_size, CARD8 bitmap_value, int *original_size);
 int  fetch_data32(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int buf_size, CARD8 bitmap_value, int *original_size);
+/* same as above, only each value is shifted left by shift bits as it is copied into buffer : */
+int  fetch_data32_shifted(ASStorage *storage, ASStorageID id, CARD32 *buffer, int offset, int buf_size, CARD8 bitmap_value, int shift, int *original_size);
 int  threshold_stored_data(ASStorage *storage, ASStorageID id, unsigned int *runs, int width, unsigned int threshold);
 
 /* slot identified by id will be marked as unused */
@@ -186,6 +211,14 @@ void print_storage(ASStorage *storage);
 int print_storage_slot(ASStorage *storage, ASStorageID id);
 Bool query_storage_slot(ASStorage *storage, ASStorageID id, ASStorageSlot *dst );
 
+/* Copies data exactly as it is kept in the slot - compressed, into buffer if it 
+ * is large enough, and header of the slot into dst. Returns size of the 
+ * compressed data, or -1 if there is no such slot. Data and header could be 
+ * given to import_compressed_data() later to recreate the slot, possibly in 
+ * another process, without compressing it again : */
+int  fetch_compressed_data(ASStorage *storage, ASStorageID id, CARD8 *buffer, int buf_size, ASStorageSlot *dst );
+ASStorageID import_compressed_data(ASStorage *storage, CARD8 *data, int compressed_size, int uncompressed_size, ASFlagType flags );
+
 /* returns new ID without copying data. Data will be stored as copy-on-right. 
  * Reference count of the data will be increased. If optional dst_id is specified - 
  * its data will be erased, and it will point to the data of src_id: 
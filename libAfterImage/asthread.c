@@ -0,0 +1,283 @@
+/* This file contains code for parallel processing of image row bands */
+/********************************************************************/
+/* Copyright (c) 2026 The AfterStep Team                            */
+/********************************************************************/
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#undef LOCAL_DEBUG
+
+#ifdef _WIN32
+#include "win32/config.h"
+#else
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+# include "win32/afterbase.h"
+#else
+# include "afterbase.h"
+#endif
+
+#include "asthread.h"
+
+static int __as_thread_count = 1 ;
+
+#ifdef HAVE_PTHREAD
+
+typedef struct ASThreadPool
+{
+	pthread_mutex_t lock ;
+	pthread_cond_t  work_ready, work_done ;
+
+	pthread_t      *threads ;
+	int             threads_num ;  /* worker threads - caller is not counted */
+	Bool            quit ;
+	Bool            busy ;         /* some thread is waiting on current job */
+
+	/* current job : */
+	unsigned long   generation ;
+	ASBandFunc      func ;
+	void           *data ;
+	int             height, band_height ;
+	int             bands_num, next_band, bands_done ;
+}ASThreadPool;
+
+static ASThreadPool    *__as_thread_pool = NULL ;
+static pthread_mutex_t  __as_thread_pool_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+/* must be called with pool->lock held. Lock is released while func runs */
+static void
+run_pending_bands( ASThreadPool *pool )
+{
+	while( pool->next_band < pool->bands_num )
+	{
+		int band_start = (pool->next_band++)*pool->band_height ;
+		int band_end = band_start + pool->band_height ;
+		ASBandFunc func = pool->func ;
+		void *data = pool->data ;
+
+		if( band_end > pool->height )
+			band_end = pool->height ;
+		pthread_mutex_unlock( &(pool->lock) );
+		func( data, band_start, band_end );
+		pthread_mutex_lock( &(pool->lock) );
+		if( ++(pool->bands_done) >= pool->bands_num )
+			pthread_cond_signal( &(pool->work_done) );
+	}
+}
+
+static void *
+asimage_band_worker( void *arg )
+{
+	ASThreadPool *pool = (ASThreadPool*)arg ;
+	unsigned long generation = 0 ;
+
+	pthread_mutex_lock( &(pool->lock) );
+	while( !pool->quit )
+	{
+		if( pool->generation == generation )
+		{
+			pthread_cond_wait( &(pool->work_ready), &(pool->lock) );
+			continue;
+		}
+		generation = pool->generation ;
+		run_pending_bands( pool );
+	}
+	pthread_mutex_unlock( &(pool->lock) );
+	return NULL;
+}
+
+static ASThreadPool *
+create_asimage_thread_pool( int threads_num )
+{
+	ASThreadPool *pool = safecalloc( 1, sizeof(ASThreadPool));
+	int i ;
+
+	pthread_mutex_init( &(pool->lock), NULL );
+	pthread_cond_init( &(pool->work_ready), NULL );
+	pthread_cond_init( &(pool->work_done), NULL );
+	pool->threads = safecalloc( threads_num, sizeof(pthread_t));
+	for( i = 0 ; i < threads_num ; ++i )
+	{
+		if( pthread_create( &(pool->threads[i]), NULL, asimage_band_worker, pool ) != 0 )
+		{
+			show_warning( "failed to start image processing thread %d of %d", i+1, threads_num );
+			break;
+		}
+		++(pool->threads_num);
+	}
+	return pool;
+}
+
+static void
+stop_asimage_thread_pool( ASThreadPool *pool )
+{
+	int i ;
+
+	pthread_mutex_lock( &(pool->lock) );
+	pool->quit = True ;
+	pthread_cond_broadcast( &(pool->work_ready) );
+	pthread_mutex_unlock( &(pool->lock) );
+
+	for( i = 0 ; i < pool->threads_num ; ++i )
+		pthread_join( pool->threads[i], NULL );
+
+	pthread_cond_destroy( &(pool->work_done) );
+	pthread_cond_destroy( &(pool->work_ready) );
+	pthread_mutex_destroy( &(pool->lock) );
+	free( pool->threads );
+	free( pool );
+}
+
+static ASThreadPool *
+get_asimage_thread_pool()
+{
+	ASThreadPool *pool ;
+
+	pthread_mutex_lock( &__as_thread_pool_lock );
+	if( __as_thread_pool == NULL && __as_thread_count > 1 )
+		__as_thread_pool = create_asimage_thread_pool( __as_thread_count-1 );
+	pool = __as_thread_pool ;
+	pthread_mutex_unlock( &__as_thread_pool_lock );
+	return pool;
+}
+
+#endif /* HAVE_PTHREAD */
+
+/*************************************************************************/
+/* Public Functions :                                                    */
+/*************************************************************************/
+int
+set_asimage_thread_count( int count )
+{
+	int old_count = __as_thread_count ;
+#ifdef HAVE_PTHREAD
+	if( count == 0 )
+	{
+#ifdef _SC_NPROCESSORS_ONLN
+		count = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+	}
+	if( count < 1 )
+		count = 1 ;
+	else if( count > ASIMAGE_MAX_THREADS )
+		count = ASIMAGE_MAX_THREADS ;
+
+	if( count != old_count )
+	{
+		destroy_asimage_thread_pool();
+		__as_thread_count = count ;
+	}
+#endif
+	return old_count;
+}
+
+int
+get_asimage_thread_count()
+{
+	return __as_thread_count;
+}
+
+int
+run_asimage_bands( ASBandFunc func, void *data, int height, int granularity )
+{
+#ifdef HAVE_PTHREAD
+	int bands_num = __as_thread_count ;
+	ASThreadPool *pool = NULL ;
+
+	if( func == NULL || height <= 0 )
+		return 0;
+
+	if( granularity < 1 )
+		granularity = 1 ;
+	if( bands_num > height/ASIMAGE_MIN_BAND_HEIGHT )
+		bands_num = height/ASIMAGE_MIN_BAND_HEIGHT ;
+
+	if( bands_num > 1 && (pool = get_asimage_thread_pool()) != NULL )
+	{
+		int band_height ;
+
+		pthread_mutex_lock( &(pool->lock) );
+		if( bands_num > pool->threads_num+1 )
+			bands_num = pool->threads_num+1 ;
+		band_height = (height+bands_num-1)/bands_num ;
+		band_height = ((band_height+granularity-1)/granularity)*granularity ;
+		bands_num = (height+band_height-1)/band_height ;
+		if( pool->busy || bands_num <= 1 )
+		{ /* pool is busy with another image, or there is nothing to split */
+			pthread_mutex_unlock( &(pool->lock) );
+		}else
+		{
+			pool->busy = True ;
+			pool->func = func ;
+			pool->data = data ;
+			pool->height = height ;
+			pool->band_height = band_height ;
+			pool->bands_num = bands_num ;
+			/* first band is ours : */
+			pool->next_band = 1 ;
+			pool->bands_done = 1 ;
+			++(pool->generation);
+			pthread_cond_broadcast( &(pool->work_ready) );
+			pthread_mutex_unlock( &(pool->lock) );
+
+			func( data, 0, band_height );
+
+			pthread_mutex_lock( &(pool->lock) );
+			run_pending_bands( pool );
+			while( pool->bands_done < pool->bands_num )
+				pthread_cond_wait( &(pool->work_done), &(pool->lock) );
+			pool->busy = False ;
+			pool->func = NULL ;
+			pool->data = NULL ;
+			pthread_mutex_unlock( &(pool->lock) );
+			return bands_num;
+		}
+	}
+#else
+	if( func == NULL || height <= 0 )
+		return 0;
+#endif
+	func( data, 0, height );
+	return 1;
+}
+
+void
+destroy_asimage_thread_pool()
+{
+#ifdef HAVE_PTHREAD
+	ASThreadPool *pool ;
+
+	pthread_mutex_lock( &__as_thread_pool_lock );
+	pool = __as_thread_pool ;
+	__as_thread_pool = NULL ;
+	pthread_mutex_unlock( &__as_thread_pool_lock );
+	if( pool )
+		stop_asimage_thread_pool( pool );
+#endif
+}
@@ -0,0 +1,115 @@
+#ifndef ASTHREAD_H_HEADER_INCLUDED
+#define ASTHREAD_H_HEADER_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****h* libAfterImage/asthread.h
+ * NAME
+ * asthread - Defines pool of worker threads used to split heavy image
+ * transformations into row bands processed in parallel.
+ * DESCRIPTION
+ * Transformations that work on each output scanline independently (or
+ * only need a fixed number of neighbouring source scanlines, like
+ * gaussian blur) can have output image split into several horizontal
+ * bands, each of them processed by separate ASImageDecoder/ASImageOutput
+ * pair. Bands are handed out to the pool of worker threads, with the
+ * calling thread processing its share of bands as well, and call
+ * returns only after all bands are complete.
+ *
+ * Threading is opt-in - by default only single thread is used, and
+ * application must call set_asimage_thread_count() to enable it.
+ * If libAfterImage was built without POSIX threads support - bands are
+ * always processed sequentially by the calling thread.
+ *
+ * SEE ALSO
+ * Functions :
+ *          set_asimage_thread_count(), get_asimage_thread_count(),
+ *          run_asimage_bands(), destroy_asimage_thread_pool()
+ *
+ * Other libAfterImage modules :
+ *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
+ *          import.h transform.h ximage.h
+ * AUTHOR
+ * The AfterStep Team
+ *******/
+
+/* maximum number of threads we'll ever use to process single image : */
+#define ASIMAGE_MAX_THREADS			64
+/* bands smaller then that are not worth the overhead of threading : */
+#define ASIMAGE_MIN_BAND_HEIGHT		16
+
+/****f* libAfterImage/ASBandFunc
+ * SYNOPSIS
+ * typedef void (*ASBandFunc)( void *data, int band_start, int band_end );
+ * FUNCTION
+ * Processes rows in range [band_start, band_end). May be called from
+ * several threads at once with non-overlapping ranges, so it should
+ * only read from data, and allocate any temporary buffers on its own.
+ *********/
+typedef void (*ASBandFunc)( void *data, int band_start, int band_end );
+
+/****f* libAfterImage/set_asimage_thread_count()
+ * NAME
+ * set_asimage_thread_count()
+ * NAME
+ * get_asimage_thread_count()
+ * SYNOPSIS
+ * int  set_asimage_thread_count( int count );
+ * int  get_asimage_thread_count();
+ * INPUTS
+ * count   - total number of threads to use for single transformation,
+ *           including the calling thread. 1 or less disables threading.
+ *           0 selects number of online CPUs.
+ * RETURN VALUE
+ * set_asimage_thread_count() returns previous thread count.
+ * get_asimage_thread_count() returns current thread count.
+ * DESCRIPTION
+ * Changes the number of threads used by transformations, stopping
+ * any existing workers. Workers are started on the next call to
+ * run_asimage_bands(). Must not be called while transformation is in
+ * progress in another thread.
+ *********/
+int  set_asimage_thread_count( int count );
+int  get_asimage_thread_count();
+
+/****f* libAfterImage/run_asimage_bands()
+ * NAME
+ * run_asimage_bands()
+ * SYNOPSIS
+ * int run_asimage_bands( ASBandFunc func, void *data,
+ *                        int height, int granularity );
+ * INPUTS
+ * func        - function to process each band;
+ * data        - pointer passed to func as is;
+ * height      - total number of rows to process;
+ * granularity - each band except for the last one will have number of
+ *               rows multiple of that.
+ * RETURN VALUE
+ * Number of bands processed.
+ * DESCRIPTION
+ * Splits range of rows [0, height) into up to get_asimage_thread_count()
+ * bands and runs func on each of them in parallel. Band starting at row 0
+ * is always processed by the calling thread. If threading is disabled,
+ * image is too small, or pool is already busy with another image -
+ * func is called once for the whole range from the calling thread.
+ *********/
+int  run_asimage_bands( ASBandFunc func, void *data, int height, int granularity );
+
+/****f* libAfterImage/destroy_asimage_thread_pool()
+ * NAME
+ * destroy_asimage_thread_pool()
+ * SYNOPSIS
+ * void destroy_asimage_thread_pool();
+ * DESCRIPTION
+ * Stops and joins all the worker threads. Pool will be recreated on
+ * next call to run_asimage_bands(), if threading is still enabled.
+ *********/
+void destroy_asimage_thread_pool();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ASTHREAD_H_HEADER_INCLUDED */
@@ -24,6 +24,12 @@
 
 #undef LOCAL_DEBUG
 #undef DEBUG_SL2XIMAGE
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
 #include <string.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -42,6 +48,7 @@
 #endif
 #include "asvisual.h"
 #include "scanline.h"
+#include "asimage.h"
 
 #if defined(XSHMIMAGE) && !defined(X_DISPLAY_MISSING)
 # include <sys/ipc.h>
@@ -59,6 +66,7 @@
 #endif
 
 
+static void forget_default_present_buffer( ASVisual *asv );
 
 #ifndef X_DISPLAY_MISSING
 static int  get_shifts (unsigned long mask);
@@ -385,6 +393,7 @@ destroy_asvisual( ASVisual *asv, Bool reusable )
 	{
 		if( get_default_asvisual() == asv )
 			_set_default_asvisual( NULL );
+		forget_default_present_buffer( asv );
 #ifndef X_DISPLAY_MISSING
 	 	if( asv->own_colormap )
 	 	{
@@ -533,11 +542,20 @@ visual_prop2visual( ASVisual *asv, Display *dpy, int screen,
 	return True;
 }
 
+static Bool select_ximage_kernels();
+static void ximage2scanline32_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+static void ximage2scanline16_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+static void ximage2scanline15_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+static void scanline2ximage32_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+static void scanline2ximage16_nodither( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+static void scanline2ximage15_nodither( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data );
+
 Bool
 setup_truecolor_visual( ASVisual *asv )
 {
 #ifndef X_DISPLAY_MISSING
 	XVisualInfo *vi = &(asv->visual_info) ;
+	Bool simd ;
 
 	if( vi->class != TrueColor )
 		return False;
@@ -588,14 +606,15 @@ setup_truecolor_visual( ASVisual *asv )
 	if( asv->true_depth == 16 && ((vi->red_mask|vi->blue_mask)&0x8000) == 0 )
 		asv->true_depth = 15;
 	/* setting up conversion handlers : */
+	simd = select_ximage_kernels();
 	switch( asv->true_depth )
 	{
 		case 24 :
 		case 32 :
 			asv->color2pixel_func     = (asv->BGR_mode)?color2pixel32bgr:color2pixel32rgb ;
 			asv->pixel2color_func     = (asv->BGR_mode)?pixel2color32bgr:pixel2color32rgb ;
-			asv->ximage2scanline_func = ximage2scanline32 ;
-			asv->scanline2ximage_func = scanline2ximage32 ;
+			asv->ximage2scanline_func = simd?ximage2scanline32_simd:ximage2scanline32 ;
+			asv->scanline2ximage_func = simd?scanline2ximage32_simd:scanline2ximage32 ;
 		    break ;
 /*		case 24 :
 			scr->color2pixel_func     = (bgr_mode)?color2pixel24bgr:color2pixel24rgb ;
@@ -606,13 +625,13 @@ setup_truecolor_visual( ASVisual *asv )
   */	case 16 :
 			asv->color2pixel_func     = (asv->BGR_mode)?color2pixel16bgr:color2pixel16rgb ;
 			asv->pixel2color_func     = (asv->BGR_mode)?pixel2color16bgr:pixel2color16rgb ;
-			asv->ximage2scanline_func = ximage2scanline16 ;
+			asv->ximage2scanline_func = simd?ximage2scanline16_simd:ximage2scanline16 ;
 			asv->scanline2ximage_func = scanline2ximage16 ;
 		    break ;
 		case 15 :
 			asv->color2pixel_func     = (asv->BGR_mode)?color2pixel15bgr:color2pixel15rgb ;
 			asv->pixel2color_func     = (asv->BGR_mode)?pixel2color15bgr:pixel2color15rgb ;
-			asv->ximage2scanline_func = ximage2scanline15 ;
+			asv->ximage2scanline_func = simd?ximage2scanline15_simd:ximage2scanline15 ;
 			asv->scanline2ximage_func = scanline2ximage15 ;
 		    break ;
 	}
@@ -620,6 +639,19 @@ setup_truecolor_visual( ASVisual *asv )
 	return (asv->ximage2scanline_func != NULL) ;
 }
 
+void
+set_asvisual_dithering( ASVisual *asv, Bool dither )
+{
+	if( asv == NULL )
+		return;
+	if( asv->scanline2ximage_func == scanline2ximage16 ||
+		asv->scanline2ximage_func == scanline2ximage16_nodither )
+		asv->scanline2ximage_func = dither?scanline2ximage16:scanline2ximage16_nodither ;
+	else if( asv->scanline2ximage_func == scanline2ximage15 ||
+			 asv->scanline2ximage_func == scanline2ximage15_nodither )
+		asv->scanline2ximage_func = dither?scanline2ximage15:scanline2ximage15_nodither ;
+}
+
 ARGB32 *
 make_reverse_colormap( unsigned long *cmap, size_t size, int depth, unsigned short mask, unsigned short shift )
 {
@@ -1220,8 +1252,12 @@ void remove_shm_area( ASShmArea *area, Bool free_resources )
 
 }
 
+static ASPresentBuffer *default_present_buffer = NULL ;
+
 void flush_shm_cache( )
 {
+	if( default_present_buffer )
+		destroy_present_buffer( &default_present_buffer );
 	if( xshmimage_images )
 		destroy_ashash( &xshmimage_images );
 	if( xshmimage_segments )
@@ -1300,8 +1336,27 @@ destroy_xshmimage_segment(ASHashableValue value, void *data)
 	}
 }
 
+/* segments permanently attached by ASPresentBuffers - ShmCompletion only
+ * tells us that the server is done reading it : */
+static ASHashTable	*present_segments = NULL ;
+
+static Bool
+complete_present_segment( ShmSeg shmseg )
+{
+	ASHashData hdata ;
+	if( present_segments == NULL )
+		return False;
+	if( get_hash_item( present_segments, AS_HASHABLE(shmseg), &hdata.vptr ) != ASH_Success )
+		return False;
+	if( *((int*)hdata.vptr) > 0 )
+		--(*((int*)hdata.vptr));
+	return True;
+}
+
 Bool destroy_xshm_segment( ShmSeg shmseg )
 {
+	if( complete_present_segment( shmseg ) )
+		return True;
 	if( xshmimage_segments )
 	{
 		if(remove_hash_item( xshmimage_segments, AS_HASHABLE(shmseg), NULL, True ) == ASH_Success)
@@ -1482,6 +1537,118 @@ XImage *ASGetXImage( ASVisual *asv, Drawable d,
 		xim = XGetImage( asv->dpy, d, x, y, width, height, plane_mask, ZPixmap );
 	return xim ;
 }
+
+static XImage *
+create_present_shm_ximage( ASPresentBuffer *pb, int i )
+{
+	ASVisual *asv = pb->asv ;
+	XShmSegmentInfo *shminfo = safecalloc( 1, sizeof(XShmSegmentInfo));
+	XImage *ximage ;
+
+	ximage = XShmCreateImage (asv->dpy, asv->visual_info.visual, pb->depth,
+							  ZPixmap, NULL, shminfo, pb->width, pb->height);
+	if( ximage != NULL )
+	{
+		shminfo->shmaddr = ximage->data = get_shm_area( ximage->bytes_per_line * ximage->height, &(shminfo->shmid) );
+		if( shminfo->shmid == -1 )
+		{
+			ximage->data = NULL ;
+			XFree( ximage );
+			ximage = NULL ;
+		}
+	}
+	if( ximage == NULL )
+	{
+		free( shminfo );
+		return NULL;
+	}
+	shminfo->readOnly = False;
+	XShmAttach (asv->dpy, shminfo);
+	LOCAL_DEBUG_OUT( "XSHMIMAGE> PRESENT : buffer %p image %d attached to segment %ld", pb, i, shminfo->shmseg );
+	if( present_segments == NULL )
+		present_segments = create_ashash( 0, NULL, NULL, NULL );
+	add_hash_item( present_segments, AS_HASHABLE(shminfo->shmseg), &(pb->pending[i]) );
+	pb->segment[i] = shminfo ;
+	return ximage;
+}
+
+static void
+destroy_present_shm_ximage( ASPresentBuffer *pb, int i )
+{
+	XShmSegmentInfo *shminfo = (XShmSegmentInfo*)pb->segment[i] ;
+	XImage *ximage = pb->ximage[i] ;
+
+	if( present_segments )
+		remove_hash_item( present_segments, AS_HASHABLE(shminfo->shmseg), NULL, False );
+	XShmDetach (pb->asv->dpy, shminfo);
+	/* server may still be reading from the segment - don't let it be reused */
+	if( pb->pending[i] > 0 )
+		really_destroy_shm_area( shminfo->shmaddr, shminfo->shmid );
+	else
+		save_shm_area( shminfo->shmaddr, shminfo->shmid, ximage->bytes_per_line * ximage->height );
+	free( shminfo );
+	pb->segment[i] = NULL ;
+	ximage->data = NULL ;
+}
+
+static Bool
+is_present_completion( Display *dpy, XEvent *event, XPointer arg )
+{
+	ASPresentBuffer *pb = (ASPresentBuffer*)arg ;
+	XShmSegmentInfo *shminfo = (XShmSegmentInfo*)pb->segment[pb->current] ;
+	return ( event->type == pb->completion_type &&
+			 ((XShmCompletionEvent*)event)->shmseg == shminfo->shmseg );
+}
+
+static void
+wait_present_shm_ximage( ASPresentBuffer *pb )
+{
+	XEvent event ;
+	int *pending = &(pb->pending[pb->current]) ;
+
+	while( *pending > 0 && XCheckIfEvent( pb->asv->dpy, &event, is_present_completion, (XPointer)pb ) )
+		--(*pending);
+	if( *pending > 0 )
+	{
+		/* completion may have been swallowed by the app's event loop, so
+		 * we don't block on it - after the round trip server is certainly
+		 * done with the segment */
+		XSync( pb->asv->dpy, False );
+		while( XCheckIfEvent( pb->asv->dpy, &event, is_present_completion, (XPointer)pb ) );
+		*pending = 0 ;
+	}
+}
+
+ASPresentBuffer *
+get_default_present_buffer( ASVisual *asv, unsigned int width, unsigned int height )
+{
+	ASPresentBuffer *pb = default_present_buffer ;
+
+	if( asv == NULL || !_as_use_shm_images || width*height > ASPRESENT_DEFAULT_MAX_AREA )
+		return NULL;
+	if( pb != NULL && (pb->asv != asv || pb->width < width || pb->height < height) )
+	{
+		if( pb->asv == asv &&
+			MAX(pb->width,width)*MAX(pb->height,height) <= ASPRESENT_DEFAULT_MAX_AREA )
+		{
+			width = MAX(pb->width,width);
+			height = MAX(pb->height,height);
+		}
+		destroy_present_buffer( &default_present_buffer );
+	}
+	if( default_present_buffer == NULL )
+		default_present_buffer = create_present_buffer( asv, width, height, 0 );
+	return default_present_buffer;
+}
+
+/* cached buffer must not outlive the visual it was created for, or else 
+ * next call would compare against dangling pointer and use its display : */
+static void
+forget_default_present_buffer( ASVisual *asv )
+{
+	if( default_present_buffer != NULL && default_present_buffer->asv == asv )
+		destroy_present_buffer( &default_present_buffer );
+}
 #else
 
 Bool enable_shmem_images (){return False; }
@@ -1514,6 +1681,13 @@ XImage * ASGetXImage( ASVisual *asv, Drawable d,
 #endif
 }
 
+ASPresentBuffer *
+get_default_present_buffer( ASVisual *asv, unsigned int width, unsigned int height )
+{
+	return NULL ;
+}
+
+static void forget_default_present_buffer( ASVisual *asv ) {}
 #endif                                         /* XSHMIMAGE */
 
 #ifndef X_DISPLAY_MISSING
@@ -1531,13 +1705,39 @@ My_XDestroyImage (XImage *ximage)
 #endif /*ifndef X_DISPLAY_MISSING */
 
 
+#ifndef X_DISPLAY_MISSING
+/* plain XImage with data allocated in our own memory : */
+static XImage*
+create_visual_client_ximage( ASVisual *asv, unsigned int width, unsigned int height, unsigned int depth, int unit )
+{
+	register XImage *ximage ;
+	unsigned long dsize;
+	char         *data;
+
+	ximage = XCreateImage (asv->dpy, asv->visual_info.visual, (depth==0)?asv->visual_info.depth/*true_depth*/:depth, ZPixmap, 0, NULL, MAX(width,(unsigned int)1), MAX(height,(unsigned int)1),
+					   	unit, 0);
+	if (ximage != NULL)
+	{
+		_XInitImageFuncPtrs (ximage);
+		ximage->obdata = NULL;
+		ximage->f.destroy_image = My_XDestroyImage;
+		dsize = ximage->bytes_per_line*ximage->height;
+		if (((data = (char *)safemalloc (dsize)) == NULL) && (dsize > 0))
+		{
+			XFree ((char *)ximage);
+			return (XImage *) NULL;
+		}
+		ximage->data = data;
+	}
+	return ximage;
+}
+#endif /*ifndef X_DISPLAY_MISSING */
+
 XImage*
 create_visual_ximage( ASVisual *asv, unsigned int width, unsigned int height, unsigned int depth )
 {
 #ifndef X_DISPLAY_MISSING
 	register XImage *ximage = NULL;
-	unsigned long dsize;
-	char         *data;
 	int unit ;
 
 	if( asv == NULL )
@@ -1590,23 +1790,7 @@ create_visual_ximage( ASVisual *asv, unsigned int width, unsigned int height, un
 	}
 #endif
 	if( ximage == NULL )
-	{
-		ximage = XCreateImage (asv->dpy, asv->visual_info.visual, (depth==0)?asv->visual_info.depth/*true_depth*/:depth, ZPixmap, 0, NULL, MAX(width,(unsigned int)1), MAX(height,(unsigned int)1),
-						   	unit, 0);
-		if (ximage != NULL)
-		{
-			_XInitImageFuncPtrs (ximage);
-			ximage->obdata = NULL;
-			ximage->f.destroy_image = My_XDestroyImage;
-			dsize = ximage->bytes_per_line*ximage->height;
-	    	if (((data = (char *)safemalloc (dsize)) == NULL) && (dsize > 0))
-			{
-				XFree ((char *)ximage);
-				return (XImage *) NULL;
-			}
-			ximage->data = data;
-		}
-	}
+		ximage = create_visual_client_ximage( asv, width, height, depth, unit );
 	return ximage;
 #else
 	return NULL ;
@@ -1668,7 +1852,117 @@ create_visual_scratch_ximage( ASVisual *asv, unsigned int width, unsigned int he
 #endif /*ifndef X_DISPLAY_MISSING */
 }
 
+/****************************************************************************/
+/* Persistent double buffered XImages for pushing updates to the server :   */
+/****************************************************************************/
+ASPresentBuffer *
+create_present_buffer( ASVisual *asv, unsigned int width, unsigned int height, unsigned int depth )
+{
+#ifndef X_DISPLAY_MISSING
+	ASPresentBuffer *pb ;
+	int unit ;
+
+	if( asv == NULL || width == 0 || height == 0 )
+		return NULL;
 
+	pb = safecalloc( 1, sizeof(ASPresentBuffer));
+	pb->asv = asv ;
+	pb->width = width ;
+	pb->height = height ;
+	pb->depth = (depth == 0)?asv->visual_info.depth:depth ;
+#ifdef XSHMIMAGE
+	if( _as_use_shm_images )
+	{
+		pb->completion_type = XShmGetEventBase( asv->dpy ) + ShmCompletion ;
+		while( pb->count < AS_PRESENT_BUFFERS &&
+			   (pb->ximage[pb->count] = create_present_shm_ximage( pb, pb->count )) != NULL )
+			++(pb->count);
+	}
+#endif
+	/* XPutImage copies data into the request right away, so without shared
+	 * memory there is nothing to overlap and single image is enough : */
+	if( pb->count == 0 )
+	{
+		unit = (pb->depth+7)&0x0038;
+		if( unit == 24 )
+			unit = 32 ;
+		if( (pb->ximage[0] = create_visual_client_ximage( asv, width, height, pb->depth, unit )) == NULL )
+		{
+			free( pb );
+			return NULL;
+		}
+		pb->count = 1 ;
+	}
+	pb->current = pb->count-1 ;
+	return pb;
+#else
+	return NULL ;
+#endif /*ifndef X_DISPLAY_MISSING */
+}
+
+void
+destroy_present_buffer( ASPresentBuffer **ppb )
+{
+#ifndef X_DISPLAY_MISSING
+	if( ppb && *ppb )
+	{
+		ASPresentBuffer *pb = *ppb ;
+		int i ;
+		for( i = 0 ; i < pb->count ; ++i )
+		{
+#ifdef XSHMIMAGE
+			if( pb->segment[i] )
+				destroy_present_shm_ximage( pb, i );
+#endif
+			XDestroyImage( pb->ximage[i] );
+		}
+		free( pb );
+		*ppb = NULL ;
+	}
+#endif /*ifndef X_DISPLAY_MISSING */
+}
+
+XImage *
+get_present_ximage( ASPresentBuffer *pb )
+{
+#ifndef X_DISPLAY_MISSING
+	if( pb == NULL )
+		return NULL;
+	pb->current = (pb->current+1)%pb->count ;
+#ifdef XSHMIMAGE
+	if( pb->segment[pb->current] && pb->pending[pb->current] > 0 )
+		wait_present_shm_ximage( pb );
+#endif
+	return pb->ximage[pb->current];
+#else
+	return NULL ;
+#endif /*ifndef X_DISPLAY_MISSING */
+}
+
+Bool
+present_ximage( ASPresentBuffer *pb, Drawable d, GC gc,
+				int src_x, int src_y, int dest_x, int dest_y,
+				unsigned int width, unsigned int height )
+{
+#ifndef X_DISPLAY_MISSING
+	XImage *xim ;
+	if( pb == NULL || d == None )
+		return False;
+	xim = pb->ximage[pb->current] ;
+#ifdef XSHMIMAGE
+	if( pb->segment[pb->current] )
+		if( XShmPutImage( pb->asv->dpy, d, gc, xim, src_x, src_y, dest_x, dest_y, width, height, True ) )
+		{
+			++(pb->pending[pb->current]);
+			return True;
+		}
+#endif
+	XPutImage( pb->asv->dpy, d, gc, xim, src_x, src_y, dest_x, dest_y, width, height );
+	return True;
+#else
+	return False;
+#endif /*ifndef X_DISPLAY_MISSING */
+}
 
 /****************************************************************************/
 /* Color manipulation functions :                                           */
@@ -2197,6 +2491,422 @@ void scanline2ximage15( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  regi
 	}
 }
 
+/****************************************************************************/
+/* Vectorized converters for common TrueColor layouts. Kernels process     */
+/* as many whole vectors as they can and return number of pixels done,     */
+/* rest is finished by the same scalar code as above.                       */
+/* 15/16bpp packers here do not dither - dithering is done by              */
+/* scanline2ximage15/16 and is used unless disabled with                    */
+/* set_asvisual_dithering().                                                */
+/****************************************************************************/
+typedef struct ASXImageKernels
+{
+	int (*pack32)  ( CARD32 *dst, CARD32 *c0, CARD32 *c1, CARD32 *c2, CARD32 *c3, int len );
+	int (*unpack32)( CARD32 *src, CARD32 *c0, CARD32 *c1, CARD32 *c2, CARD32 *c3, int len );
+	int (*unpack565lsb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*unpack565msb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*unpack555lsb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*unpack555msb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*pack565lsb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*pack565msb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*pack555lsb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+	int (*pack555msb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len );
+}ASXImageKernels;
+
+#define DEFINE_XIMAGE_KERNELS \
+static V_ATTR int V_NAME(pack32)( CARD32 *dst, CARD32 *c0, CARD32 *c1, CARD32 *c2, CARD32 *c3, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+		V_ST(dst+i, V_OR(V_OR(V_SLLI(V_LD(c0+i),24),V_SLLI(V_LD(c1+i),16)), \
+						 V_OR(V_SLLI(V_LD(c2+i),8),V_LD(c3+i)))); \
+	return i; \
+} \
+static V_ATTR int V_NAME(unpack32)( CARD32 *src, CARD32 *c0, CARD32 *c1, CARD32 *c2, CARD32 *c3, int len ) \
+{ \
+	V_T mask = V_SET1(0x0FF); \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T s = V_LD(src+i); \
+		V_ST(c0+i, V_SRLI(s,24)); \
+		V_ST(c1+i, V_AND(V_SRLI(s,16),mask)); \
+		V_ST(c2+i, V_AND(V_SRLI(s,8),mask)); \
+		V_ST(c3+i, V_AND(s,mask)); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(unpack565lsb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T s = V_LD16(src+i); \
+		V_ST(r+i, V_SRLI(V_AND(s,V_SET1(0xF800)),8)); \
+		V_ST(g+i, V_SRLI(V_AND(s,V_SET1(0x07E0)),3)); \
+		V_ST(b+i, V_SLLI(V_AND(s,V_SET1(0x001F)),3)); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(unpack565msb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T s = V_LD16(src+i); \
+		V_ST(r+i, V_AND(s,V_SET1(0x00F8))); \
+		V_ST(g+i, V_OR(V_SLLI(V_AND(s,V_SET1(0x0007)),5),V_SRLI(V_AND(s,V_SET1(0xE000)),11))); \
+		V_ST(b+i, V_SRLI(V_AND(s,V_SET1(0x1F00)),5)); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(unpack555lsb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T s = V_LD16(src+i); \
+		V_ST(r+i, V_SRLI(V_AND(s,V_SET1(0x7C00)),7)); \
+		V_ST(g+i, V_SRLI(V_AND(s,V_SET1(0x03E0)),2)); \
+		V_ST(b+i, V_SLLI(V_AND(s,V_SET1(0x001F)),3)); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(unpack555msb)( CARD16 *src, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T s = V_LD16(src+i); \
+		V_ST(r+i, V_SLLI(V_AND(s,V_SET1(0x007C)),1)); \
+		V_ST(g+i, V_OR(V_SLLI(V_AND(s,V_SET1(0x0003)),6),V_SRLI(V_AND(s,V_SET1(0xE000)),10))); \
+		V_ST(b+i, V_SRLI(V_AND(s,V_SET1(0x1F00)),5)); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(pack565lsb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+		V_ST16(dst+i, V_OR(V_OR(V_AND(V_SLLI(V_LD(r+i),8),V_SET1(0xF800)), \
+								V_AND(V_SLLI(V_LD(g+i),3),V_SET1(0x07E0))), \
+						   V_AND(V_SRLI(V_LD(b+i),3),V_SET1(0x001F)))); \
+	return i; \
+} \
+static V_ATTR int V_NAME(pack565msb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T gv = V_LD(g+i); \
+		V_ST16(dst+i, V_OR(V_OR(V_AND(V_SRLI(gv,5),V_SET1(0x0007)), \
+								V_AND(V_SLLI(gv,11),V_SET1(0xE000))), \
+						   V_OR(V_AND(V_LD(r+i),V_SET1(0x00F8)), \
+								V_AND(V_SLLI(V_LD(b+i),5),V_SET1(0x1F00))))); \
+	} \
+	return i; \
+} \
+static V_ATTR int V_NAME(pack555lsb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+		V_ST16(dst+i, V_OR(V_OR(V_AND(V_SLLI(V_LD(r+i),7),V_SET1(0x7C00)), \
+								V_AND(V_SLLI(V_LD(g+i),2),V_SET1(0x03E0))), \
+						   V_AND(V_SRLI(V_LD(b+i),3),V_SET1(0x001F)))); \
+	return i; \
+} \
+static V_ATTR int V_NAME(pack555msb)( CARD16 *dst, CARD32 *r, CARD32 *g, CARD32 *b, int len ) \
+{ \
+	int i ; \
+	for( i = 0 ; i+V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T gv = V_LD(g+i); \
+		V_ST16(dst+i, V_OR(V_OR(V_AND(V_SRLI(gv,6),V_SET1(0x0003)), \
+								V_AND(V_SLLI(gv,10),V_SET1(0xE000))), \
+						   V_OR(V_AND(V_SRLI(V_LD(r+i),1),V_SET1(0x007C)), \
+								V_AND(V_SLLI(V_LD(b+i),5),V_SET1(0x1F00))))); \
+	} \
+	return i; \
+} \
+static ASXImageKernels V_NAME(ximage_kernels) = \
+{ V_NAME(pack32), V_NAME(unpack32), \
+  V_NAME(unpack565lsb), V_NAME(unpack565msb), V_NAME(unpack555lsb), V_NAME(unpack555msb), \
+  V_NAME(pack565lsb), V_NAME(pack565msb), V_NAME(pack555lsb), V_NAME(pack555msb) };
+
+#ifdef HAVE_SSE2
+/* values fit in 16 bits, but pack is signed saturating - bias it : */
+static inline __attribute__((target("sse2"))) void
+sse2_store16( CARD16 *dst, __m128i v )
+{
+	__m128i bias = _mm_set1_epi32( 0x8000 );
+	v = _mm_sub_epi32( v, bias );
+	v = _mm_packs_epi32( v, v );
+	_mm_storel_epi64( (__m128i*)dst, _mm_xor_si128( v, _mm_set1_epi16( (short)0x8000 ) ) );
+}
+
+#define V_T				__m128i
+#define V_WIDTH			4
+#define V_NAME(n)		n##_sse2
+#define V_ATTR			__attribute__((target("sse2")))
+#define V_LD(p)			_mm_loadu_si128((__m128i*)(p))
+#define V_ST(p,v)		_mm_storeu_si128((__m128i*)(p),(v))
+#define V_LD16(p)		_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)(p)),_mm_setzero_si128())
+#define V_ST16(p,v)		sse2_store16((p),(v))
+#define V_SET1(x)		_mm_set1_epi32((int)(x))
+#define V_AND(a,b)		_mm_and_si128((a),(b))
+#define V_OR(a,b)		_mm_or_si128((a),(b))
+#define V_SLLI(a,n)		_mm_slli_epi32((a),(n))
+#define V_SRLI(a,n)		_mm_srli_epi32((a),(n))
+
+DEFINE_XIMAGE_KERNELS
+
+#undef V_T
+#undef V_WIDTH
+#undef V_NAME
+#undef V_ATTR
+#undef V_LD
+#undef V_ST
+#undef V_LD16
+#undef V_ST16
+#undef V_SET1
+#undef V_AND
+#undef V_OR
+#undef V_SLLI
+#undef V_SRLI
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+static inline __attribute__((target("avx2"))) void
+avx2_store16( CARD16 *dst, __m256i v )
+{
+	__m256i bias = _mm256_set1_epi32( 0x8000 );
+	v = _mm256_sub_epi32( v, bias );
+	/* packs works within 128bit lanes - gather both halves together : */
+	v = _mm256_permute4x64_epi64( _mm256_packs_epi32( v, v ), 0x08 );
+	_mm_storeu_si128( (__m128i*)dst, _mm_xor_si128( _mm256_castsi256_si128( v ), _mm_set1_epi16( (short)0x8000 ) ) );
+}
+
+#define V_T				__m256i
+#define V_WIDTH			8
+#define V_NAME(n)		n##_avx2
+#define V_ATTR			__attribute__((target("avx2")))
+#define V_LD(p)			_mm256_loadu_si256((__m256i*)(p))
+#define V_ST(p,v)		_mm256_storeu_si256((__m256i*)(p),(v))
+#define V_LD16(p)		_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(p)))
+#define V_ST16(p,v)		avx2_store16((p),(v))
+#define V_SET1(x)		_mm256_set1_epi32((int)(x))
+#define V_AND(a,b)		_mm256_and_si256((a),(b))
+#define V_OR(a,b)		_mm256_or_si256((a),(b))
+#define V_SLLI(a,n)		_mm256_slli_epi32((a),(n))
+#define V_SRLI(a,n)		_mm256_srli_epi32((a),(n))
+
+DEFINE_XIMAGE_KERNELS
+
+#undef V_T
+#undef V_WIDTH
+#undef V_NAME
+#undef V_ATTR
+#undef V_LD
+#undef V_ST
+#undef V_LD16
+#undef V_ST16
+#undef V_SET1
+#undef V_AND
+#undef V_OR
+#undef V_SLLI
+#undef V_SRLI
+#endif /* HAVE_AVX2 */
+
+/* picked once by setup_truecolor_visual(), NULL means scalar code only : */
+static ASXImageKernels *ximage_kernels = NULL ;
+
+static Bool
+select_ximage_kernels()
+{
+	ximage_kernels = NULL ;
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+		ximage_kernels = &ximage_kernels_sse2 ;
+#endif
+#ifdef HAVE_AVX2
+	if( asimage_avx2_supported() )
+		ximage_kernels = &ximage_kernels_avx2 ;
+#endif
+	return ( ximage_kernels != NULL );
+}
+
+#ifdef WORDS_BIGENDIAN
+#define SWAPPED_XIMAGE(asv)	(!(asv)->msb_first)
+#else
+#define SWAPPED_XIMAGE(asv)	((asv)->msb_first)
+#endif
+
+static void
+ximage2scanline32_simd(ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register CARD32 *a = sl->alpha+sl->offset_x;
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD32 *src = (CARD32*)xim_data ;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack32( src, b, g, r, a, len );
+		for( ; i < len ; ++i )
+		{
+			b[i] = (src[i]>>24)&0x0ff;
+			g[i] = (src[i]>>16)&0x0ff;
+			r[i] = (src[i]>>8)&0x0ff;
+			a[i] = src[i]&0x0ff;
+		}
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack32( src, a, r, g, b, len );
+		for( ; i < len ; ++i )
+		{
+			a[i] = (src[i]>>24)&0x0ff;
+			r[i] = (src[i]>>16)&0x0ff;
+			g[i] = (src[i]>>8)&0x0ff;
+			b[i] =  src[i]&0x0ff;
+		}
+	}
+}
+
+static void
+ximage2scanline16_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD16 *src = (CARD16*)xim_data ;
+    register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack565msb( src, r, g, b, len );
+		for( ; i < len ; ++i )
+		{
+			r[i] =  (src[i]&0x00F8);
+			g[i] = ((src[i]&0x0007)<<5)|((src[i]&0xE000)>>11);
+			b[i] =  (src[i]&0x1F00)>>5;
+		}
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack565lsb( src, r, g, b, len );
+		for( ; i < len ; ++i )
+		{
+			r[i] =  (src[i]&0xF800)>>8;
+			g[i] =  (src[i]&0x07E0)>>3;
+			b[i] =  (src[i]&0x001F)<<3;
+		}
+	}
+}
+
+static void
+ximage2scanline15_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD16 *src = (CARD16*)xim_data ;
+    register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack555msb( src, r, g, b, len );
+		for( ; i < len ; ++i )
+		{
+			r[i] =  (src[i]&0x007C)<<1;
+			g[i] = ((src[i]&0x0003)<<6)|((src[i]&0xE000)>>10);
+			b[i] =  (src[i]&0x1F00)>>5;
+		}
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->unpack555lsb( src, r, g, b, len );
+		for( ; i < len ; ++i )
+		{
+			r[i] =  (src[i]&0x7C00)>>7;
+			g[i] =  (src[i]&0x03E0)>>2;
+			b[i] =  (src[i]&0x001F)<<3;
+		}
+	}
+}
+
+static void
+scanline2ximage32_simd( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register CARD32 *a = sl->alpha+sl->offset_x;
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD32 *dst = (CARD32*)xim_data;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack32( dst, b, g, r, a, len );
+		for( ; i < len ; ++i )
+			dst[i] = (b[i]<<24)|(g[i]<<16)|(r[i]<<8)|a[i];
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack32( dst, a, r, g, b, len );
+		for( ; i < len ; ++i )
+			dst[i] = (a[i]<<24)|(r[i]<<16)|(g[i]<<8)|b[i];
+	}
+}
+
+static void
+scanline2ximage16_nodither( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD16 *dst = (CARD16*)xim_data ;
+    register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack565msb( dst, r, g, b, len );
+		for( ; i < len ; ++i )
+			dst[i] = ENCODE_MSBF_565(r[i],g[i]>>5,g[i]<<11,b[i]<<5);
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack565lsb( dst, r, g, b, len );
+		for( ; i < len ; ++i )
+			dst[i] = ENCODE_LSBF_565(r[i]<<8,g[i]<<3,b[i]>>3);
+	}
+}
+
+static void
+scanline2ximage15_nodither( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
+{
+	int len = MIN((unsigned int)(xim->width),sl->width-sl->offset_x);
+	register CARD16 *dst = (CARD16*)xim_data ;
+    register CARD32 *r = sl->xc1+sl->offset_x, *g = sl->xc2+sl->offset_x, *b = sl->xc3+sl->offset_x;
+	register int i = 0 ;
+
+	if( SWAPPED_XIMAGE(asv) )
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack555msb( dst, r, g, b, len );
+		for( ; i < len ; ++i )
+			dst[i] = ENCODE_MSBF_555(r[i]>>1,g[i]>>6,g[i]<<10,b[i]<<5);
+	}else
+	{
+		if( ximage_kernels )
+			i = ximage_kernels->pack555lsb( dst, r, g, b, len );
+		for( ; i < len ; ++i )
+			dst[i] = ENCODE_LSBF_555(r[i]<<7,g[i]<<2,b[i]>>3);
+	}
+}
+
 #ifndef X_DISPLAY_MISSING
 void
 scanline2ximage_pseudo3bpp( ASVisual *asv, XImage *xim, ASScanline *sl, int y,  register unsigned char *xim_data )
@@ -362,6 +362,7 @@ void scanline2ximage_pseudo12bpp( ASVisual *asv, XImage *xim, struct ASScanline
  * setup_truecolor_visual()
  * SYNOPSIS
  * Bool setup_truecolor_visual( ASVisual *asv );
+void set_asvisual_dithering( ASVisual *asv, Bool dither );
  * INPUTS
  * asv  		- preallocated ASVisual structure.
  * RETURN VALUE
@@ -370,7 +371,22 @@ void scanline2ximage_pseudo12bpp( ASVisual *asv, XImage *xim, struct ASScanline
  * setup_truecolor_visual() checks if Visual is indeed TrueColor and if
  * so it goes about querying color masks, deducing real XImage
  * colordepth, and whether we work in BGR mode. It then goes about
- * setting up correct hooks to X IO functions.
+ * setting up correct hooks to X IO functions. Where CPU supports SSE2
+ * or AVX2, vectorized converters are selected for 32/24bpp and for
+ * reading 16/15bpp XImages.
+ *********/
+/****f* libAfterImage/set_asvisual_dithering()
+ * NAME
+ * set_asvisual_dithering()
+ * SYNOPSIS
+ * void set_asvisual_dithering( ASVisual *asv, Bool dither );
+ * INPUTS
+ * asv          - TrueColor ASVisual set up by setup_truecolor_visual().
+ * dither       - False to disable error diffusion.
+ * DESCRIPTION
+ * 15 and 16bpp XImages are written with error diffusion by default.
+ * Disabling it lets faster vectorized packers to be used instead.
+ * Has no effect on other colordepths.
  *********/
 /****f* libAfterImage/setup_pseudo_visual()
  * NAME
@@ -671,6 +687,94 @@ XImage * ASGetXImage( ASVisual *asv, Drawable d,
                   int x, int y, unsigned int width, unsigned int height,
 				  unsigned long plane_mask );
 
+/****s* libAfterImage/ASPresentBuffer
+ * NAME
+ * ASPresentBuffer
+ * DESCRIPTION
+ * Persistent XImages of fixed size, used to push image updates to the
+ * X server. When MIT-SHM is enabled, images stay attached to the server
+ * for the whole life of the buffer, so that update costs neither socket
+ * copy nor segment setup. Two images are used in turn, so that the next
+ * update can be rendered while server is still reading previous one.
+ * Image is not reused until server reports ShmCompletion for it, which
+ * is delivered through destroy_xshm_segment() by applications' normal
+ * ShmCompletion handling.
+ * Without shared memory single client side XImage is used.
+ * SOURCE
+ */
+#define AS_PRESENT_BUFFERS			2
+/* largest area of the default buffer used by asimage2drawable() : */
+#define ASPRESENT_DEFAULT_MAX_AREA	(512*512)
+
+typedef struct ASPresentBuffer
+{
+	struct ASVisual *asv ;
+	unsigned int width, height, depth ;
+	int count, current ;
+	int completion_type ;
+	XImage *ximage[AS_PRESENT_BUFFERS] ;
+	void   *segment[AS_PRESENT_BUFFERS] ; /* XShmSegmentInfo when shared */
+	int     pending[AS_PRESENT_BUFFERS] ; /* puts not yet completed */
+}ASPresentBuffer;
+/*************/
+/****f* libAfterImage/create_present_buffer()
+ * NAME
+ * create_present_buffer()
+ * destroy_present_buffer()
+ * SYNOPSIS
+ * ASPresentBuffer *create_present_buffer( ASVisual *asv,
+ *                                         unsigned int width,
+ *                                         unsigned int height,
+ *                                         unsigned int depth );
+ * void destroy_present_buffer( ASPresentBuffer **ppb );
+ * INPUTS
+ * asv            - pointer to the valid ASVisual structure.
+ * width, height  - size of the XImages to create.
+ * depth          - depth of the XImages. If 0 visual's depth is used.
+ * DESCRIPTION
+ * Allocates and frees ASPresentBuffer. Segments that server may still be
+ * reading from are released without being recycled.
+ *********/
+/****f* libAfterImage/get_present_ximage()
+ * NAME
+ * get_present_ximage()
+ * present_ximage()
+ * SYNOPSIS
+ * XImage *get_present_ximage( ASPresentBuffer *pb );
+ * Bool present_ximage( ASPresentBuffer *pb, Drawable d, GC gc,
+ *                      int src_x, int src_y, int dest_x, int dest_y,
+ *                      unsigned int width, unsigned int height );
+ * DESCRIPTION
+ * get_present_ximage() makes next image of the buffer current and
+ * returns it, once server is done with it. If completion has not arrived
+ * yet it makes a round trip rather than block on the event, so that
+ * applications that drop ShmCompletion events do not stall.
+ * present_ximage() sends area of the current image to the drawable.
+ *********/
+/****f* libAfterImage/get_default_present_buffer()
+ * NAME
+ * get_default_present_buffer()
+ * SYNOPSIS
+ * ASPresentBuffer *get_default_present_buffer( ASVisual *asv,
+ *                                              unsigned int width,
+ *                                              unsigned int height );
+ * DESCRIPTION
+ * Returns process wide buffer at least width x height in size, growing
+ * it as needed. Returns NULL when shared memory images are disabled or
+ * the area exceeds ASPRESENT_DEFAULT_MAX_AREA. The buffer is released by
+ * flush_shm_cache().
+ *********/
+ASPresentBuffer *create_present_buffer( ASVisual *asv,
+										unsigned int width, unsigned int height,
+										unsigned int depth );
+void destroy_present_buffer( ASPresentBuffer **ppb );
+XImage *get_present_ximage( ASPresentBuffer *pb );
+Bool present_ximage( ASPresentBuffer *pb, Drawable d, GC gc,
+					 int src_x, int src_y, int dest_x, int dest_y,
+					 unsigned int width, unsigned int height );
+ASPresentBuffer *get_default_present_buffer( ASVisual *asv,
+											 unsigned int width, unsigned int height );
+
 
 #ifdef __cplusplus
 }
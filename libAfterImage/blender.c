@@ -25,8 +25,11 @@
 /*#define LOCAL_DEBUG*/
 /*#define DO_CLOCKING*/
 
-#ifdef HAVE_MMX
-#include <mmintrin.h>
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+#include <immintrin.h>
 #endif
 
 #include <ctype.h>
@@ -37,6 +40,7 @@
 #endif
 #include "asvisual.h"
 #include "scanline.h"
+#include "asimage.h"
 #include "blender.h"
 
 /*********************************************************************************/
@@ -377,11 +381,295 @@ list_scanline_merging(FILE* stream, const char *format)
 	}
 
 
+/*************************************************************************/
+/* SIMD versions of scanline blending :                                  */
+/* Each kernel processes as many pixels as fits in whole vectors and     */
+/* returns the number of pixels done, so that plain C loop of the        */
+/* merge_scanlines function could finish off the tail. Results must be   */
+/* bit-identical to C code - see TEST_BLENDER below.                      */
+/* Vector ops are defined as V_* macros for each instruction set, and    */
+/* kernels are instantiated from the same *_VBODY for each of them.      */
+/*************************************************************************/
+#define BLEND_KERNEL_PARAMS		ba, br, bg, bb, ta, tr, tg, tb
+#define BLEND_KERNEL_NAME2(name,sfx)	name##_##sfx
+#define BLEND_KERNEL_NAME(name,sfx)		BLEND_KERNEL_NAME2(name,sfx)
+
+#define DEFINE_BLEND_KERNEL(name) \
+static int V_ATTR BLEND_KERNEL_NAME(name,V_SFX)( CARD32 *ba, CARD32 *br, CARD32 *bg, CARD32 *bb, \
+							 					  CARD32 *ta, CARD32 *tr, CARD32 *tg, CARD32 *tb, int len ) \
+{ \
+	int i = 0 ; \
+	for( ; i + V_WIDTH <= len ; i += V_WIDTH ) \
+	{ \
+		V_T vba = V_LD(ba+i), vbr = V_LD(br+i), vbg = V_LD(bg+i), vbb = V_LD(bb+i) ; \
+		V_T vta = V_LD(ta+i), vtr = V_LD(tr+i), vtg = V_LD(tg+i), vtb = V_LD(tb+i) ; \
+		name##_VBODY ; \
+		V_ST(ba+i,vba); V_ST(br+i,vbr); V_ST(bg+i,vbg); V_ST(bb+i,vbb); \
+	} \
+	return i; \
+}
+
+/* V_SEL(m,a,b) : m ? a : b */
+#define V_SEL(m,a,b)		V_OR(V_AND((m),(a)),V_ANDNOT((m),(b)))
+#define V_NONZERO(a)		V_ANDNOT(V_CMPEQ((a),V_ZERO),V_SET1(0xFFFFFFFF))
+#define V_CLAMP0(a)			V_ANDNOT(V_SRAI((a),31),(a))
+
+#define alphablend_VBODY \
+	do{	V_T full = V_CMPGT(vta,V_SET1(0x0000FEFF)); \
+		V_T part = V_ANDNOT(full,V_CMPGT(vta,V_SET1(0x000000FF))); \
+		V_T va = V_SRLI(vta,8), vca = V_SUB(V_SET1(255),va); \
+		V_T nba = V_ADD(V_SRLI(V_MULLO(vba,vca),8),vta); \
+		V_T nbr = V_SRLI(V_ADD(V_MULLO(vbr,vca),V_MULLO(vtr,va)),8); \
+		V_T nbg = V_SRLI(V_ADD(V_MULLO(vbg,vca),V_MULLO(vtg,va)),8); \
+		V_T nbb = V_SRLI(V_ADD(V_MULLO(vbb,vca),V_MULLO(vtb,va)),8); \
+		vba = V_SEL(full,V_SET1(0x0000FF00),V_SEL(part,nba,vba)); \
+		vbr = V_SEL(full,vtr,V_SEL(part,nbr,vbr)); \
+		vbg = V_SEL(full,vtg,V_SEL(part,nbg,vbg)); \
+		vbb = V_SEL(full,vtb,V_SEL(part,nbb,vbb)); \
+	}while(0)
+
+#define allanon_VBODY \
+	do{	V_T on = V_NONZERO(vta); \
+		vbr = V_SEL(on,V_SRLI(V_ADD(vbr,vtr),1),vbr); \
+		vbg = V_SEL(on,V_SRLI(V_ADD(vbg,vtg),1),vbg); \
+		vbb = V_SEL(on,V_SRLI(V_ADD(vbb,vtb),1),vbb); \
+		vba = V_SEL(on,V_SRLI(V_ADD(vba,vta),1),vba); \
+	}while(0)
+
+#define tint_VBODY \
+	do{	V_T on = V_NONZERO(vta); \
+		vbr = V_SEL(on,V_SRLI(V_MULLO(vbr,V_SRLI(vtr,1)),15),vbr); \
+		vbg = V_SEL(on,V_SRLI(V_MULLO(vbg,V_SRLI(vtg,1)),15),vbg); \
+		vbb = V_SEL(on,V_SRLI(V_MULLO(vbb,V_SRLI(vtb,1)),15),vbb); \
+	}while(0)
+
+#define add_VBODY \
+	do{	V_T on = V_NONZERO(vta), max16 = V_SET1(0x0000FFFF); \
+		V_T nba = V_MAX_U(vba,vta); \
+		vbr = V_SEL(on,V_MIN_U(V_ADD(vbr,vtr),max16),vbr); \
+		vbg = V_SEL(on,V_MIN_U(V_ADD(vbg,vtg),max16),vbg); \
+		vbb = V_SEL(on,V_MIN_U(V_ADD(vbb,vtb),max16),vbb); \
+		vba = V_SEL(on,V_MIN_U(V_ADD(nba,vta),max16),vba); \
+	}while(0)
+
+#define sub_VBODY \
+	do{	V_T on = V_NONZERO(vta); \
+		vba = V_SEL(on,V_MAX_U(vba,vta),vba); \
+		vbr = V_SEL(on,V_CLAMP0(V_SUB(vbr,vtr)),vbr); \
+		vbg = V_SEL(on,V_CLAMP0(V_SUB(vbg,vtg)),vbg); \
+		vbb = V_SEL(on,V_CLAMP0(V_SUB(vbb,vtb)),vbb); \
+	}while(0)
+
+#define V_ABSDIFF(b,t)	(d = V_SUB((b),(t)), m = V_SRAI(d,31), V_SUB(V_XOR(d,m),m))
+#define diff_VBODY \
+	do{	V_T on = V_NONZERO(vta), d, m; \
+		vbr = V_SEL(on,V_ABSDIFF(vbr,vtr),vbr); \
+		vbg = V_SEL(on,V_ABSDIFF(vbg,vtg),vbg); \
+		vbb = V_SEL(on,V_ABSDIFF(vbb,vtb),vbb); \
+		vba = V_SEL(on,V_MAX_U(vba,vta),vba); \
+	}while(0)
+
+#define darken_VBODY \
+	do{	V_T on = V_NONZERO(vta); \
+		vba = V_SEL(on,V_MIN_U(vba,vta),vba); \
+		vbr = V_SEL(on,V_MIN_U(vbr,vtr),vbr); \
+		vbg = V_SEL(on,V_MIN_U(vbg,vtg),vbg); \
+		vbb = V_SEL(on,V_MIN_U(vbb,vtb),vbb); \
+	}while(0)
+
+#define lighten_VBODY \
+	do{	V_T on = V_NONZERO(vta); \
+		vba = V_SEL(on,V_MAX_U(vba,vta),vba); \
+		vbr = V_SEL(on,V_MAX_U(vbr,vtr),vbr); \
+		vbg = V_SEL(on,V_MAX_U(vbg,vtg),vbg); \
+		vbb = V_SEL(on,V_MAX_U(vbb,vtb),vbb); \
+	}while(0)
+
+/* same signed int math as DO_SCREEN_VALUE */
+#define V_SCREEN(b,t) \
+	V_CLAMP0(V_SUB(max16,V_SRAI(V_MULLO(V_SUB(max16,(b)),V_SUB(max16,(t))),16)))
+#define screen_VBODY \
+	do{	V_T on = V_NONZERO(vta), max16 = V_SET1(0x0000FFFF); \
+		vbr = V_SEL(on,V_SCREEN(vbr,vtr),vbr); \
+		vbg = V_SEL(on,V_SCREEN(vbg,vtg),vbg); \
+		vbb = V_SEL(on,V_SCREEN(vbb,vtb),vbb); \
+		vba = V_SEL(on,V_MAX_U(vba,vta),vba); \
+	}while(0)
+
+/* same math as DO_OVERLAY_VALUE - final shift is unsigned so
+ * result can never be negative */
+#define V_OVERLAY(b,t) \
+	(ib = V_SUB(max16,(b)), \
+	 ts = V_SUB(max16,V_SRAI(V_MULLO(ib,V_SUB(max16,(t))),16)), \
+	 tm = V_SRLI(V_MULLO((b),(t)),16), \
+	 V_SRLI(V_ADD(V_MULLO((b),ts),V_MULLO(ib,tm)),16))
+#define overlay_VBODY \
+	do{	V_T on = V_NONZERO(vta), max16 = V_SET1(0x0000FFFF), ib, ts, tm; \
+		vbr = V_SEL(on,V_OVERLAY(vbr,vtr),vbr); \
+		vbg = V_SEL(on,V_OVERLAY(vbg,vtg),vbg); \
+		vbb = V_SEL(on,V_OVERLAY(vbb,vtb),vbb); \
+		vba = V_SEL(on,V_MAX_U(vba,vta),vba); \
+	}while(0)
+
+#define DEFINE_ALL_BLEND_KERNELS \
+	DEFINE_BLEND_KERNEL(alphablend) \
+	DEFINE_BLEND_KERNEL(allanon) \
+	DEFINE_BLEND_KERNEL(tint) \
+	DEFINE_BLEND_KERNEL(add) \
+	DEFINE_BLEND_KERNEL(sub) \
+	DEFINE_BLEND_KERNEL(diff) \
+	DEFINE_BLEND_KERNEL(darken) \
+	DEFINE_BLEND_KERNEL(lighten) \
+	DEFINE_BLEND_KERNEL(screen) \
+	DEFINE_BLEND_KERNEL(overlay)
+
+#ifdef HAVE_SSE2
+/* SSE2 lacks 32bit multiply and unsigned compares - emulate those : */
+static inline __attribute__((target("sse2"))) __m128i
+sse2_mullo_epi32( __m128i a, __m128i b )
+{
+	__m128i even = _mm_mul_epu32( a, b );
+	__m128i odd  = _mm_mul_epu32( _mm_srli_epi64( a, 32 ), _mm_srli_epi64( b, 32 ) );
+	return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE(0,0,2,0) ),
+							   _mm_shuffle_epi32( odd,  _MM_SHUFFLE(0,0,2,0) ) );
+}
+
+static inline __attribute__((target("sse2"))) __m128i
+sse2_max_epu32( __m128i a, __m128i b )
+{
+	__m128i bias = _mm_set1_epi32( 0x80000000 );
+	__m128i gt = _mm_cmpgt_epi32( _mm_xor_si128( a, bias ), _mm_xor_si128( b, bias ) );
+	return _mm_or_si128( _mm_and_si128( gt, a ), _mm_andnot_si128( gt, b ) );
+}
+
+static inline __attribute__((target("sse2"))) __m128i
+sse2_min_epu32( __m128i a, __m128i b )
+{
+	__m128i bias = _mm_set1_epi32( 0x80000000 );
+	__m128i gt = _mm_cmpgt_epi32( _mm_xor_si128( a, bias ), _mm_xor_si128( b, bias ) );
+	return _mm_or_si128( _mm_and_si128( gt, b ), _mm_andnot_si128( gt, a ) );
+}
+
+#define V_T				__m128i
+#define V_WIDTH			4
+#define V_SFX			sse2
+#define V_ATTR			__attribute__((target("sse2")))
+#define V_LD(p)			_mm_loadu_si128((__m128i*)(p))
+#define V_ST(p,v)		_mm_storeu_si128((__m128i*)(p),(v))
+#define V_ZERO			_mm_setzero_si128()
+#define V_SET1(x)		_mm_set1_epi32((int)(x))
+#define V_ADD(a,b)		_mm_add_epi32((a),(b))
+#define V_SUB(a,b)		_mm_sub_epi32((a),(b))
+#define V_AND(a,b)		_mm_and_si128((a),(b))
+#define V_OR(a,b)		_mm_or_si128((a),(b))
+#define V_XOR(a,b)		_mm_xor_si128((a),(b))
+#define V_ANDNOT(a,b)	_mm_andnot_si128((a),(b))
+#define V_SRLI(a,n)		_mm_srli_epi32((a),(n))
+#define V_SRAI(a,n)		_mm_srai_epi32((a),(n))
+#define V_CMPEQ(a,b)	_mm_cmpeq_epi32((a),(b))
+#define V_CMPGT(a,b)	_mm_cmpgt_epi32((a),(b))
+#define V_MULLO(a,b)	sse2_mullo_epi32((a),(b))
+#define V_MAX_U(a,b)	sse2_max_epu32((a),(b))
+#define V_MIN_U(a,b)	sse2_min_epu32((a),(b))
+
+DEFINE_ALL_BLEND_KERNELS
+
+#undef V_T
+#undef V_WIDTH
+#undef V_SFX
+#undef V_ATTR
+#undef V_LD
+#undef V_ST
+#undef V_ZERO
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_SRLI
+#undef V_SRAI
+#undef V_CMPEQ
+#undef V_CMPGT
+#undef V_MULLO
+#undef V_MAX_U
+#undef V_MIN_U
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+#define V_T				__m256i
+#define V_WIDTH			8
+#define V_SFX			avx2
+#define V_ATTR			__attribute__((target("avx2")))
+#define V_LD(p)			_mm256_loadu_si256((__m256i*)(p))
+#define V_ST(p,v)		_mm256_storeu_si256((__m256i*)(p),(v))
+#define V_ZERO			_mm256_setzero_si256()
+#define V_SET1(x)		_mm256_set1_epi32((int)(x))
+#define V_ADD(a,b)		_mm256_add_epi32((a),(b))
+#define V_SUB(a,b)		_mm256_sub_epi32((a),(b))
+#define V_AND(a,b)		_mm256_and_si256((a),(b))
+#define V_OR(a,b)		_mm256_or_si256((a),(b))
+#define V_XOR(a,b)		_mm256_xor_si256((a),(b))
+#define V_ANDNOT(a,b)	_mm256_andnot_si256((a),(b))
+#define V_SRLI(a,n)		_mm256_srli_epi32((a),(n))
+#define V_SRAI(a,n)		_mm256_srai_epi32((a),(n))
+#define V_CMPEQ(a,b)	_mm256_cmpeq_epi32((a),(b))
+#define V_CMPGT(a,b)	_mm256_cmpgt_epi32((a),(b))
+#define V_MULLO(a,b)	_mm256_mullo_epi32((a),(b))
+#define V_MAX_U(a,b)	_mm256_max_epu32((a),(b))
+#define V_MIN_U(a,b)	_mm256_min_epu32((a),(b))
+
+DEFINE_ALL_BLEND_KERNELS
+
+#undef V_T
+#undef V_WIDTH
+#undef V_SFX
+#undef V_ATTR
+#undef V_LD
+#undef V_ST
+#undef V_ZERO
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_SRLI
+#undef V_SRAI
+#undef V_CMPEQ
+#undef V_CMPGT
+#undef V_MULLO
+#undef V_MAX_U
+#undef V_MIN_U
+#endif /* HAVE_AVX2 */
+
+/* Picks the widest kernel available on this CPU ( that is decided only
+ * once - see asimage_avx2_supported() ), sets i to the last pixel done : */
+#ifdef HAVE_AVX2
+#define BLEND_SCANLINES_AVX2(name) \
+	if( max_i >= 8 && asimage_avx2_supported() ) \
+		i = name##_avx2( BLEND_KERNEL_PARAMS, max_i ) - 1 ; \
+	else
+#else
+#define BLEND_SCANLINES_AVX2(name)
+#endif
+#ifdef HAVE_SSE2
+#define BLEND_SCANLINES_SSE2(name) \
+	if( max_i >= 4 && asimage_sse2_supported() ) \
+		i = name##_sse2( BLEND_KERNEL_PARAMS, max_i ) - 1 ;
+#else
+#define BLEND_SCANLINES_SSE2(name) {}
+#endif
+#define BLEND_SCANLINES_SIMD(name)	BLEND_SCANLINES_AVX2(name) BLEND_SCANLINES_SSE2(name)
+
 
 void
 alphablend_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(alphablend)
 	while( ++i < max_i )
 	{
 		int a = ta[i] ;
@@ -397,34 +685,10 @@ alphablend_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 		{
 			a = (a>>8) ;
 			ca = 255-a;
-#if 0 /*ndef HAVE_MMX*/
-/* MMX implementaion of alpha-blending below turns out to be 
-   30% slower then the original integer math implementation under it 
-   I'm probably stupid or something.  
- */
-			__m64	va  = _mm_set_pi16 (ca, a, ca, a);
-			__m64	vd  = _mm_set_pi16 (br[i],tr[i],ba[i],ta[i]);
-
-			/* b=(b*ca + t*a)>>8 */
-			vd = _mm_srli_pi16( vd, 8 );
-			vd = _mm_madd_pi16( va, vd );
-			ba[i] = _mm_cvtsi64_si32( vd );
-			vd = _mm_srli_si64( vd, 32 );
-			br[i] = _mm_cvtsi64_si32( vd );
-			
-			vd = _mm_set_pi16 (bb[i],tb[i],bg[i],tg[i]);
-			vd = _mm_srli_pi16( vd, 8 );
-			vd = _mm_madd_pi16( va, vd );
-			bg[i] = _mm_cvtsi64_si32( vd );
-			vd = _mm_srli_si64( vd, 32 );
-			bb[i] = _mm_cvtsi64_si32( vd );
-			_mm_empty();
-#else
 			ba[i] = ((ba[i]*ca)>>8)+ta[i] ;
 			br[i] = (br[i]*ca+tr[i]*a)>>8 ;
 			bg[i] = (bg[i]*ca+tg[i]*a)>>8 ;
 			bb[i] = (bb[i]*ca+tb[i]*a)>>8 ;
-#endif	
 		}
 	}
 	
@@ -435,6 +699,7 @@ void    /* this one was first implemented on XImages by allanon :) - mode 131  *
 allanon_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(allanon)
 	while( ++i < max_i )
 	{
 		if( ta[i] != 0 )
@@ -451,6 +716,7 @@ void
 tint_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(tint)
 	while( ++i < max_i )
 	{
 		if( ta[i] != 0 )
@@ -466,6 +732,7 @@ void    /* addition with saturation : */
 add_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(add)
 	while( ++i < max_i )
 		if( ta[i] )
 		{
@@ -490,6 +757,7 @@ void    /* substruction with saturation : */
 sub_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(sub)
 	while( ++i < max_i )
 		if( ta[i] )
 		{
@@ -509,6 +777,7 @@ void    /* absolute pixel value difference : */
 diff_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(diff)
 	while( ++i < max_i )
 	{
 		if( ta[i] )
@@ -530,6 +799,7 @@ void    /* darkest of the two makes it in : */
 darken_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(darken)
 	while( ++i < max_i )
 		if( ta[i] )
 		{
@@ -548,6 +818,7 @@ void    /* lightest of the two makes it in : */
 lighten_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(lighten)
 	while( ++i < max_i )
 		if( ta[i] )
 		{
@@ -566,6 +837,7 @@ void    /* guess what this one does - I could not :) */
 screen_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(screen)
 #define DO_SCREEN_VALUE(b,t) \
 			res1 = 0x0000FFFF - (int)b[i] ; res2 = 0x0000FFFF - (int)t[i] ;\
 			res1 = 0x0000FFFF - ((res1*res2)>>16); b[i] = res1 < 0 ? 0 : res1
@@ -589,6 +861,7 @@ void    /* somehow overlays bottom with top : */
 overlay_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 {
 	BLEND_SCANLINES_HEADER
+	BLEND_SCANLINES_SIMD(overlay)
 #define DO_OVERLAY_VALUE(b,t) \
 				tmp_screen = 0x0000FFFF - (((0x0000FFFF - (int)b[i]) * (0x0000FFFF - (int)t[i])) >> 16); \
 				tmp_mult   = (b[i] * t[i]) >> 16; \
@@ -723,6 +996,119 @@ dissipate_scanlines( ASScanline *bottom, ASScanline *top, int offset )
 	}
 }
 
+/*********************************************************************************/
+/* Test that SSE2/AVX2 blending is bit-identical to plain C :					 */
+/*********************************************************************************/
+#ifdef TEST_BLENDER
+#include "afterimage.h"
+
+#define BLENDER_TEST_WIDTH	1027
+#define BLENDER_TEST_REPS	64
+
+static CARD32 blender_test_seed = 345824357;
+
+static CARD32
+blender_test_value()
+{
+	static CARD32 special[] = { 0, 0x000000FF, 0x00000100, 0x00007FFF,
+								0x0000FEFF, 0x0000FF00, 0x0000FFFF };
+	blender_test_seed = (1664525L*blender_test_seed)+1013904223L ;
+	if( (blender_test_seed>>24) < 64 )
+		return special[(blender_test_seed>>8)%(sizeof(special)/sizeof(CARD32))];
+	return (blender_test_seed>>8)&0x0000FFFF ;
+}
+
+static void
+fill_test_scanline( ASScanline *sl )
+{
+	int i, c ;
+	for( c = 0 ; c < IC_NUM_CHANNELS ; ++c )
+		for( i = 0 ; i < (int)sl->width ; ++i )
+			sl->channels[c][i] = blender_test_value();
+}
+
+static void
+copy_test_scanline( ASScanline *dst, ASScanline *src )
+{
+	int c ;
+	for( c = 0 ; c < IC_NUM_CHANNELS ; ++c )
+		memcpy( dst->channels[c], src->channels[c], src->width*sizeof(CARD32) );
+}
+
+static Bool
+test_scanlines_identical( ASScanline *a, ASScanline *b )
+{
+	int c ;
+	for( c = 0 ; c < IC_NUM_CHANNELS ; ++c )
+		if( memcmp( a->channels[c], b->channels[c], a->width*sizeof(CARD32) ) != 0 )
+			return False;
+	return True;
+}
+
+int main(int argc, char **argv )
+{
+	static char *simd_methods[] = { "alphablend", "allanon", "tint", "add", "sub", "diff",
+									"darken", "lighten", "screen", "overlay", NULL };
+	static int offsets[] = { -5, 0, 3 };
+	ASScanline orig, top, ref, res ;
+	int m, failed = 0 ;
+
+	set_output_threshold( 10 );
+
+	prepare_scanline( BLENDER_TEST_WIDTH, 8, &orig, False );
+	prepare_scanline( BLENDER_TEST_WIDTH, 8, &top, False );
+	prepare_scanline( BLENDER_TEST_WIDTH, 8, &ref, False );
+	prepare_scanline( BLENDER_TEST_WIDTH, 8, &res, False );
+
+	for( m = 0 ; simd_methods[m] != NULL ; ++m )
+	{
+		merge_scanlines_func func = blend_scanlines_name2func( simd_methods[m] );
+		int isa ;
+		for( isa = 0 ; isa < 2 ; ++isa )
+		{
+			int rep, o ;
+			Bool ok = True ;
+			fprintf( stderr, "Testing %s_scanlines with %s ...", simd_methods[m], isa?"AVX2":"SSE2" );
+			asimage_use_sse2 = (isa == 0) ;
+			asimage_use_avx2 = (isa == 1) ;
+			if( (isa == 0 && !asimage_sse2_supported()) || (isa == 1 && !asimage_avx2_supported()) )
+			{
+				fprintf( stderr, "skipped - not supported.\n" );
+				continue;
+			}
+			for( rep = 0 ; rep < BLENDER_TEST_REPS && ok ; ++rep )
+				for( o = 0 ; o < (int)(sizeof(offsets)/sizeof(int)) && ok ; ++o )
+				{
+					fill_test_scanline( &orig );
+					fill_test_scanline( &top );
+					/* random narrower widths to exercise tail processing : */
+					top.width = orig.width = ref.width = res.width =
+						BLENDER_TEST_WIDTH - (blender_test_value()&0x0F);
+
+					copy_test_scanline( &ref, &orig );
+					asimage_use_sse2 = asimage_use_avx2 = False ;
+					func( &ref, &top, offsets[o] );
+
+					copy_test_scanline( &res, &orig );
+					asimage_use_sse2 = (isa == 0) ;
+					asimage_use_avx2 = (isa == 1) ;
+					func( &res, &top, offsets[o] );
+
+					ok = test_scanlines_identical( &ref, &res );
+				}
+			fprintf( stderr, "%s\n", ok?"success":"FAILED" );
+			if( !ok )
+				++failed ;
+		}
+	}
+	free_scanline( &orig, True );
+	free_scanline( &top, True );
+	free_scanline( &ref, True );
+	free_scanline( &res, True );
+	return (failed > 0);
+}
+#endif
+
 /*********************************************************************************/
 /* The end !!!! 																 */
 /*********************************************************************************/
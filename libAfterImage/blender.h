@@ -240,6 +240,10 @@ void hls2rgb (CARD32 hue, CARD32 luminance, CARD32 saturation, CARD32 *red, CARD
  * ASScanline structures with data in 24.8 format. Merging operation is
  * performed on these scanlines and result is stored in bottom
  * ASScanline.
+ * alphablend, allanon, tint, add, sub, diff, darken, lighten, screen
+ * and overlay methods have SSE2 and AVX2 versions that are selected at
+ * runtime when supported by CPU ( see asimage_use_sse2 ). Results are
+ * always identical to the plain C code.
  * The following are merging methods used in each function :
  *
  ****************/
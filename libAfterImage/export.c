@@ -76,6 +76,17 @@
 #endif
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#ifndef _WIN32
+# include <sys/types.h>
+# include <sys/stat.h>
+# ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+# endif
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 /* <setjmp.h> is used for the optional error recovery mechanism */
 
 #ifdef _WIN32
@@ -137,15 +148,11 @@ as_image_writer_func as_image_file_writers[ASIT_Unknown] =
 	NULL
 };
 
-Bool
-ASImage2file( ASImage *im, const char *dir, const char *file,
-			  ASImageFileTypes type, ASImageExportParams *params )
+static char *
+make_export_file_name( const char *dir, const char *file )
 {
 	int   filename_len, dirname_len = 0 ;
 	char *realfilename = NULL ;
-	Bool  res = False ;
-
-	if( im == NULL ) return False;
 
 	if( file )
 	{
@@ -163,6 +170,19 @@ ASImage2file( ASImage *im, const char *dir, const char *file,
 		unix_path2dos_path( realfilename );
 #endif
 	}
+	return realfilename;
+}
+
+Bool
+ASImage2file( ASImage *im, const char *dir, const char *file,
+			  ASImageFileTypes type, ASImageExportParams *params )
+{
+	char *realfilename = NULL ;
+	Bool  res = False ;
+
+	if( im == NULL ) return False;
+
+	realfilename = make_export_file_name( dir, file );
 	if( type >= ASIT_Unknown || type < 0 )
 		show_error( "Hmm, I don't seem to know anything about format you trying to write file \"%s\" in\n.\tPlease check the manual", realfilename );
    	else if( as_image_file_writers[type] )
@@ -192,6 +212,44 @@ open_writeable_image_file( const char *path )
 	return fp ;
 }
 
+/* destination of streamed export - either file descriptor or callback : */
+typedef struct ASImageExportSink
+{
+	int 					fd ;
+	ASImageStreamWriteFunc 	write_func ;
+	void 				   *write_data ;
+	Bool 					failed ;
+}ASImageExportSink;
+
+static void
+write_export_sink( ASImageExportSink *sink, const void *data, size_t length )
+{
+	const CARD8 *ptr = data ;
+
+	if( sink->failed || length == 0 )
+		return;
+	if( sink->write_func )
+	{
+		if( !sink->write_func( sink->write_data, ptr, length ) )
+			sink->failed = True ;
+		return;
+	}
+	while( length > 0 )
+	{
+		ssize_t res = write( sink->fd, ptr, length );
+		if( res < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			show_error( "failed to write image data : %s", strerror(errno) );
+			sink->failed = True ;
+			return;
+		}
+		ptr += res ;
+		length -= res ;
+	}
+}
+
 void
 scanline2raw( register CARD8 *row, ASScanline *buf, CARD8 *gamma_table, unsigned int width, Bool grayscale, Bool do_alpha )
 {
@@ -289,7 +347,8 @@ ASImage2xpm ( ASImage *im, const char *path, ASImageExportParams *params )
 	if ((outfile = open_writeable_image_file( path )) == NULL)
 		return False;
 
-    mapped_im = colormap_asimage( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold );
+    mapped_im = colormap_asimage_ext( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold,
+									  get_flags( params->xpm.flags, EXPORT_FAST_QUANTIZER)?ASCMAP_QUANTIZE_OCTREE:ASCMAP_QUANTIZE_HASH );
 	if( !get_flags( params->xpm.flags, EXPORT_ALPHA) )
 		cmap.has_opaque = False ;
 	else
@@ -367,7 +426,8 @@ ASImage2xpmRawBuff ( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams
       params = &defaults ;
    }
 
-    mapped_im = colormap_asimage( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold );
+    mapped_im = colormap_asimage_ext( im, &cmap, params->xpm.max_colors, params->xpm.dither, params->xpm.opaque_threshold,
+									  get_flags( params->xpm.flags, EXPORT_FAST_QUANTIZER)?ASCMAP_QUANTIZE_OCTREE:ASCMAP_QUANTIZE_HASH );
 	if (mapped_im == NULL)
 		return False;
 	if( !get_flags( params->xpm.flags, EXPORT_ALPHA) )
@@ -707,6 +767,22 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 	return False;
 }
 
+static void
+asim_png_write_sink(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	/* failure is only reported at the end - longjmp-ing out of the middle
+	 * of ASImage2png_int would leak the decoder */
+	write_export_sink( (ASImageExportSink*)png_get_io_ptr(png_ptr), data, length );
+}
+
+static Bool
+ASImage2png_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+ 	if( !ASImage2png_int ( im, sink, (png_rw_ptr)asim_png_write_sink, (png_flush_ptr)asim_png_flush_data, params ) )
+		return False;
+	return !sink->failed;
+}
+
 
 #else 			/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 Bool
@@ -726,6 +802,13 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 	return False;
 }
 
+static Bool
+ASImage2png_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+	SHOW_UNSUPPORTED_NOTE( "PNG", "(stream)" );
+	return False;
+}
+
 
 #endif 			/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 /***********************************************************************************/
@@ -733,16 +816,50 @@ ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *pa
 
 /***********************************************************************************/
 #ifdef HAVE_JPEG     /* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
-Bool
-ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
+/* libjpeg destination manager feeding ASImageExportSink : */
+#define ASIM_JPEG_SINK_BUFFER_SIZE	16384
+typedef struct ASImJpegSinkDest
+{
+	struct jpeg_destination_mgr pub ;
+	ASImageExportSink *sink ;
+	JOCTET buffer[ASIM_JPEG_SINK_BUFFER_SIZE] ;
+}ASImJpegSinkDest;
+
+static void
+asim_jpeg_init_sink( j_compress_ptr cinfo )
+{
+	ASImJpegSinkDest *dest = (ASImJpegSinkDest*)cinfo->dest ;
+	dest->pub.next_output_byte = dest->buffer ;
+	dest->pub.free_in_buffer = ASIM_JPEG_SINK_BUFFER_SIZE ;
+}
+
+static boolean
+asim_jpeg_empty_sink( j_compress_ptr cinfo )
+{
+	ASImJpegSinkDest *dest = (ASImJpegSinkDest*)cinfo->dest ;
+	write_export_sink( dest->sink, dest->buffer, ASIM_JPEG_SINK_BUFFER_SIZE );
+	dest->pub.next_output_byte = dest->buffer ;
+	dest->pub.free_in_buffer = ASIM_JPEG_SINK_BUFFER_SIZE ;
+	return TRUE;
+}
+
+static void
+asim_jpeg_term_sink( j_compress_ptr cinfo )
+{
+	ASImJpegSinkDest *dest = (ASImJpegSinkDest*)cinfo->dest ;
+	write_export_sink( dest->sink, dest->buffer, ASIM_JPEG_SINK_BUFFER_SIZE - dest->pub.free_in_buffer );
+}
+
+/* writes either into outfile or into sink : */
+static Bool
+ASImage2jpeg_int( ASImage *im, FILE *outfile, ASImageExportSink *sink, ASImageExportParams *params )
 {
 	/* This struct contains the JPEG decompression parameters and pointers to
 	 * working space (which is allocated as needed by the JPEG library).
 	 */
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-	/* More stuff */
-	FILE 		 *outfile;		/* target file */
+	ASImJpegSinkDest *sink_dest = NULL ;
     JSAMPROW      row_pointer[1];/* pointer to JSAMPLE row[s] */
 	int 		  y;
 	static const ASJpegExportParams defaultsJpeg = { ASIT_Jpeg, 0, -1 };
@@ -761,16 +878,11 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
            params = &defaults ;
         }
 
-	if ((outfile = open_writeable_image_file( path )) == NULL)
-		return False;
-
 	if((imdec = start_image_decoding( NULL /* default visual */ , im,
 		                              (SCL_DO_GREEN|SCL_DO_BLUE|SCL_DO_RED),
 									  0, 0, im->width, 0, NULL)) == NULL )
 	{
 		LOCAL_DEBUG_OUT( "failed to start image decoding%s", "");
-		if (outfile != stdout)
-			fclose(outfile);
 		return False;
 	}
 
@@ -794,7 +906,16 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 	* VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
 	* requires it in order to write binary files.
 	*/
-	jpeg_stdio_dest(&cinfo, outfile);
+	if( sink )
+	{
+		sink_dest = safemalloc( sizeof(ASImJpegSinkDest) );
+		sink_dest->pub.init_destination = asim_jpeg_init_sink ;
+		sink_dest->pub.empty_output_buffer = asim_jpeg_empty_sink ;
+		sink_dest->pub.term_destination = asim_jpeg_term_sink ;
+		sink_dest->sink = sink ;
+		cinfo.dest = &(sink_dest->pub);
+	}else
+		jpeg_stdio_dest(&cinfo, outfile);
 
 	/* Step 3: set parameters for compression */
 	cinfo.image_width  = im->width; 	/* image width and height, in pixels */
@@ -861,17 +982,43 @@ LOCAL_DEBUG_OUT( "done writing image%s","" );
 
 	/* Step 6: Finish compression and release JPEG compression object*/
 	jpeg_finish_compress(&cinfo);
+	/* jpeg_destroy_compress does not free custom destination managers : */
 	jpeg_destroy_compress(&cinfo);
+	if( sink_dest )
+		free( sink_dest );
 
 	free( row_pointer[0] );
 	
 	stop_image_decoding( &imdec );
-	if (outfile != stdout)
-		fclose(outfile);
 
 	SHOW_TIME("image export",started);
+	return sink?!(sink->failed):True ;
+}
+
+Bool
+ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
+{
+	FILE *outfile;
+	Bool res ;
+
+	if( im == NULL )
+		return False;
+
+	if ((outfile = open_writeable_image_file( path )) == NULL)
+		return False;
+
+	res = ASImage2jpeg_int( im, outfile, NULL, params );
+
+	if (outfile != stdout)
+		fclose(outfile);
 	LOCAL_DEBUG_OUT("done writing JPEG image \"%s\"", path);
-	return True ;
+	return res;
+}
+
+static Bool
+ASImage2jpeg_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+	return ASImage2jpeg_int( im, NULL, sink, params );
 }
 #else 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 
@@ -882,6 +1029,13 @@ ASImage2jpeg( ASImage *im, const char *path,  ASImageExportParams *params )
 	return False;
 }
 
+static Bool
+ASImage2jpeg_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+	SHOW_UNSUPPORTED_NOTE( "JPEG", "(stream)" );
+	return False;
+}
+
 #endif 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 /***********************************************************************************/
 
@@ -968,7 +1122,8 @@ Bool ASImage2gif( ASImage *im, const char *path,  ASImageExportParams *params )
            params = &defaults ;
         }
 
-	mapped_im = colormap_asimage( im, &cmap, 255, params->gif.dither, params->gif.opaque_threshold );
+	mapped_im = colormap_asimage_ext( im, &cmap, 255, params->gif.dither, params->gif.opaque_threshold,
+									 get_flags( params->gif.flags, EXPORT_FAST_QUANTIZER)?ASCMAP_QUANTIZE_OCTREE:ASCMAP_QUANTIZE_HASH );
 
 	if( get_flags( params->gif.flags, EXPORT_ALPHA) &&
 		get_flags( get_asimage_chanmask(im), SCL_DO_ALPHA) )
@@ -1140,10 +1295,9 @@ ASImage2gif( ASImage *im, const char *path, ASImageExportParams *params )
 #endif			/* GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF GIF */
 
 #ifdef HAVE_TIFF/* TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF */
-Bool
-ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params)
+static Bool
+ASImage2tiff_int( ASImage *im, TIFF *out, ASImageExportParams *params)
 {
-	TIFF *out;
 	static const ASTiffExportParams defaultsTiff = { ASIT_Tiff, 0, -1, TIFF_COMPRESSION_NONE, 100, 0 };
         ASImageExportParams defaults;
 	uint16 photometric = PHOTOMETRIC_RGB;
@@ -1162,14 +1316,6 @@ ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params)
            params = &defaults ;
         }
 
-	if( path == NULL )
-	{
-		SHOW_UNSUPPORTED_NOTE("TIFF streamed into stdout",path);
-		return False ;
-	}
-	out = TIFFOpen(path, "w");
-	if (out == NULL)
-		return False;
 	/* I don't really know why by grayscale images in Tiff does not work :(
 	 * still here is the code :*/
 	if( get_flags( params->tiff.flags, EXPORT_GRAYSCALE ) )
@@ -1188,7 +1334,6 @@ ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params)
 									  0, 0, im->width, 0, NULL)) == NULL )
 	{
 		LOCAL_DEBUG_OUT( "failed to start image decoding%s", "");
-		TIFFClose(out);
 		return False;
 	}
 
@@ -1274,10 +1419,55 @@ ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params)
 			break;
 	}
 	stop_image_decoding( &imdec );
-	TIFFClose(out);
 	SHOW_TIME("image export",started);
 	return True;
 }
+
+Bool
+ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params)
+{
+	TIFF *out;
+	Bool res ;
+
+	if( path == NULL )
+	{
+		SHOW_UNSUPPORTED_NOTE("TIFF streamed into stdout",path);
+		return False ;
+	}
+	out = TIFFOpen(path, "w");
+	if (out == NULL)
+		return False;
+	res = ASImage2tiff_int( im, out, params );
+	TIFFClose(out);
+	return res;
+}
+
+/* TIFF directory is written after the strips and then linked from the
+ * header, so it can only go into something we can seek in */
+static Bool
+ASImage2tiff_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+	TIFF *out;
+	int fd ;
+	Bool res ;
+
+	if( sink->write_func != NULL || lseek( sink->fd, 0, SEEK_CUR ) < 0 )
+	{
+		SHOW_UNSUPPORTED_NOTE("TIFF streamed into pipe","(stream)");
+		return False ;
+	}
+	/* TIFFClose closes the descriptor, which still belongs to the caller */
+	if( (fd = dup( sink->fd )) < 0 )
+		return False;
+	if( (out = TIFFFdOpen( fd, "(stream)", "w" )) == NULL )
+	{
+		close( fd );
+		return False;
+	}
+	res = ASImage2tiff_int( im, out, params );
+	TIFFClose(out);
+	return res;
+}
 #else 			/* TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF */
 
 Bool
@@ -1286,4 +1476,330 @@ ASImage2tiff( ASImage *im, const char *path, ASImageExportParams *params )
 	SHOW_UNSUPPORTED_NOTE("TIFF",path);
 	return False ;
 }
+
+static Bool
+ASImage2tiff_sink( ASImage *im, ASImageExportSink *sink, ASImageExportParams *params )
+{
+	SHOW_UNSUPPORTED_NOTE("TIFF","(stream)");
+	return False ;
+}
 #endif			/* TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF TIFF */
+
+/***********************************************************************************/
+/* Streaming and background export :                                               */
+/***********************************************************************************/
+Bool
+ASImage2stream( ASImage *im, ASImageFileTypes type, ASImageExportParams *params,
+				int fd, ASImageStreamWriteFunc write_func, void *write_data )
+{
+	ASImageExportSink sink ;
+
+	if( im == NULL || (fd < 0 && write_func == NULL) )
+		return False;
+
+	memset( &sink, 0x00, sizeof(sink) );
+	sink.fd = fd ;
+	sink.write_func = write_func ;
+	sink.write_data = write_data ;
+	switch( type )
+	{
+		case ASIT_Png :		return ASImage2png_sink( im, &sink, params );
+		case ASIT_Jpeg :	return ASImage2jpeg_sink( im, &sink, params );
+		case ASIT_Tiff :	return ASImage2tiff_sink( im, &sink, params );
+		default :
+			show_error( "streamed export into image format %d is not supported.", type );
+	}
+	return False;
+}
+
+struct ASImageExportJob
+{
+	ASImage 			   *im ;		/* private clone - rows are refcounted, not copied */
+	ASImageFileTypes 		type ;
+	ASImageExportParams 	params ;
+	Bool 					has_params ;
+	int 					fd ;
+	ASImageStreamWriteFunc 	write_func ;
+	void 				   *write_data ;
+	ASFlagType 				flags ;
+	char 				   *path, *tmp_path ;	/* ASImage2file_async() only */
+
+	int 					notify_fds[2] ;	/* read end becomes readable when done */
+	Bool 					done, success ;
+	Bool 					detached ;		/* nobody will finish it - frees itself */
+#ifdef HAVE_PTHREAD
+	pthread_t 				thread ;
+	Bool 					threaded ;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t _as_export_lock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t  _as_export_done = PTHREAD_COND_INITIALIZER ;
+#define LOCK_EXPORTS()		pthread_mutex_lock( &_as_export_lock )
+#define UNLOCK_EXPORTS()	pthread_mutex_unlock( &_as_export_lock )
+#else
+#define LOCK_EXPORTS()		do{}while(0)
+#define UNLOCK_EXPORTS()	do{}while(0)
+#endif
+static int _as_detached_exports = 0 ;
+static unsigned int _as_export_serial = 0 ;
+
+static Bool
+is_streamable_image_type( ASImageFileTypes type )
+{
+	return ( type == ASIT_Png || type == ASIT_Jpeg || type == ASIT_Tiff );
+}
+
+static ASImageExportJob *
+create_asimage_export_job( ASImageFileTypes type, ASImageExportParams *params, ASFlagType flags )
+{
+	ASImageExportJob *job = safecalloc( 1, sizeof(ASImageExportJob) );
+
+	job->type = type ;
+	job->flags = flags ;
+	job->fd = -1 ;
+	job->notify_fds[0] = job->notify_fds[1] = -1 ;
+	if( params )
+	{
+		job->params = *params ;
+		job->has_params = True ;
+	}
+	if( get_flags( flags, ASIMAGE_EXPORT_FAST_ZLIB ) && type == ASIT_Png )
+	{
+		if( !job->has_params )
+		{
+			job->params.png.type = ASIT_Png ;
+			job->params.png.flags = EXPORT_ALPHA ;
+			job->has_params = True ;
+		}
+		job->params.png.compression = 10 ;	/* zlib level 1 */
+	}
+	return job;
+}
+
+static void
+free_asimage_export_job( ASImageExportJob *job )
+{
+	if( job->im )
+		destroy_asimage( &(job->im) );
+	if( job->path )
+		free( job->path );
+	if( job->tmp_path )
+		free( job->tmp_path );
+#ifndef _WIN32
+	if( job->notify_fds[0] >= 0 )
+	{
+		close( job->notify_fds[0] );
+		close( job->notify_fds[1] );
+	}
+#endif
+	free( job );
+}
+
+static void
+run_asimage_export_job( ASImageExportJob *job, ASImage *im )
+{
+	Bool success = ASImage2stream( im, job->type, job->has_params?&(job->params):NULL,
+								   job->fd, job->write_func, job->write_data );
+
+	if( job->im )
+		destroy_asimage( &(job->im) );
+	if( get_flags( job->flags, ASIMAGE_EXPORT_CLOSE_FD ) && job->fd >= 0 )
+	{
+		if( close( job->fd ) != 0 )
+			success = False ;
+		job->fd = -1 ;
+	}
+	if( job->tmp_path )
+	{/* nobody gets to see partially written file : */
+		if( success && rename( job->tmp_path, job->path ) != 0 )
+		{
+			show_error( "failed to rename \"%s\" into \"%s\" : %s", job->tmp_path, job->path, strerror(errno) );
+			success = False ;
+		}
+		if( !success )
+			unlink( job->tmp_path );
+	}
+
+	LOCK_EXPORTS();
+	job->success = success ;
+	job->done = True ;
+	if( job->detached )
+		--_as_detached_exports ;
+#ifndef _WIN32
+	else if( job->notify_fds[1] >= 0 )
+	{
+		char c = 0 ;
+		while( write( job->notify_fds[1], &c, 1 ) < 0 && errno == EINTR );
+	}
+#endif
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast( &_as_export_done );
+#endif
+	UNLOCK_EXPORTS();
+
+	if( job->detached )
+		free_asimage_export_job( job );
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+asimage_export_worker( void *arg )
+{
+	ASImageExportJob *job = (ASImageExportJob*)arg ;
+	run_asimage_export_job( job, job->im );
+	return NULL;
+}
+#endif
+
+static void
+launch_asimage_export_job( ASImageExportJob *job, ASImage *im )
+{
+	if( job->detached )
+	{
+		LOCK_EXPORTS();
+		++_as_detached_exports ;
+		UNLOCK_EXPORTS();
+	}
+	/* image that only lives in its XImage can not be handed to other thread */
+	if( !get_flags( im->flags, ASIM_DATA_NOT_USEFUL ) )
+		job->im = clone_asimage( im, SCL_DO_ALL );
+#ifdef HAVE_PTHREAD
+	if( job->im )
+	{
+		pthread_attr_t attr ;
+		int res ;
+
+		pthread_attr_init( &attr );
+		if( job->detached )
+			pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+		res = pthread_create( &(job->thread), &attr, asimage_export_worker, job );
+		pthread_attr_destroy( &attr );
+		if( res == 0 )
+		{
+			job->threaded = True ;
+			return;
+		}
+		show_warning( "failed to start image export thread - exporting synchronously" );
+	}
+#endif
+	run_asimage_export_job( job, job->im?job->im:im );
+}
+
+ASImageExportJob *
+start_asimage_export( ASImage *im, ASImageFileTypes type, ASImageExportParams *params,
+					  int fd, ASImageStreamWriteFunc write_func, void *write_data, ASFlagType flags )
+{
+	ASImageExportJob *job ;
+
+	if( im == NULL || (fd < 0 && write_func == NULL) )
+		return NULL;
+	if( !is_streamable_image_type( type ) )
+	{
+		show_error( "streamed export into image format %d is not supported.", type );
+		return NULL;
+	}
+
+	job = create_asimage_export_job( type, params, flags );
+	job->fd = fd ;
+	job->write_func = write_func ;
+	job->write_data = write_data ;
+#ifndef _WIN32
+	if( pipe( job->notify_fds ) == 0 )
+	{
+#ifdef HAVE_FCNTL_H
+		fcntl( job->notify_fds[0], F_SETFL, O_NONBLOCK );
+		fcntl( job->notify_fds[1], F_SETFL, O_NONBLOCK );
+		fcntl( job->notify_fds[0], F_SETFD, FD_CLOEXEC );
+		fcntl( job->notify_fds[1], F_SETFD, FD_CLOEXEC );
+#endif
+	}else
+		job->notify_fds[0] = job->notify_fds[1] = -1 ;
+#endif
+	launch_asimage_export_job( job, im );
+	return job;
+}
+
+int
+get_asimage_export_fd( ASImageExportJob *job )
+{
+	return job?job->notify_fds[0]:-1;
+}
+
+Bool
+is_asimage_export_done( ASImageExportJob *job )
+{
+	Bool done = True ;
+	if( job )
+	{
+		LOCK_EXPORTS();
+		done = job->done ;
+		UNLOCK_EXPORTS();
+	}
+	return done;
+}
+
+Bool
+finish_asimage_export( ASImageExportJob **pjob )
+{
+	Bool success = False ;
+
+	if( pjob && *pjob )
+	{
+		ASImageExportJob *job = *pjob ;
+#ifdef HAVE_PTHREAD
+		if( job->threaded )
+			pthread_join( job->thread, NULL );
+#endif
+		success = job->success ;
+		free_asimage_export_job( job );
+		*pjob = NULL ;
+	}
+	return success;
+}
+
+Bool
+ASImage2file_async( ASImage *im, const char *dir, const char *file,
+					ASImageFileTypes type, ASImageExportParams *params, ASFlagType flags )
+{
+#if !defined(_WIN32) && defined(HAVE_FCNTL_H)
+	ASImageExportJob *job ;
+	unsigned int serial ;
+
+	if( im == NULL )
+		return False;
+	if( file == NULL || !is_streamable_image_type( type ) )
+		return ASImage2file( im, dir, file, type, params );
+
+	job = create_asimage_export_job( type, params, flags|ASIMAGE_EXPORT_CLOSE_FD );
+	job->path = make_export_file_name( dir, file );
+	LOCK_EXPORTS();
+	serial = ++_as_export_serial ;
+	UNLOCK_EXPORTS();
+	job->tmp_path = safemalloc( strlen(job->path) + 1 + 32 );
+	sprintf( job->tmp_path, "%s.%d-%u~", job->path, (int)getpid(), serial );
+	if( (job->fd = open( job->tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644 )) < 0 )
+	{
+		show_error("cannot open image file \"%s\" for writing. Please check permissions.", job->tmp_path);
+		free_asimage_export_job( job );
+		return False;
+	}
+	job->detached = True ;
+	launch_asimage_export_job( job, im );
+	return True;
+#else
+	return ASImage2file( im, dir, file, type, params );
+#endif
+}
+
+void
+wait_asimage_exports()
+{
+#ifdef HAVE_PTHREAD
+	LOCK_EXPORTS();
+	while( _as_detached_exports > 0 )
+		pthread_cond_wait( &_as_export_done, &_as_export_lock );
+	UNLOCK_EXPORTS();
+#endif
+}
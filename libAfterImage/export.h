@@ -17,7 +17,8 @@ extern "C" {
  *          ASImageExportParams
  *
  * Functions :
- *  		ASImage2file()
+ *  		ASImage2file(), ASImage2stream(), start_asimage_export(),
+ *  		ASImage2file_async()
  *
  * Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -34,6 +35,9 @@ extern "C" {
  * NAME
  * EXPORT_APPEND - if format allows multiple images - image will be 
  * appended
+ * NAME
+ * EXPORT_FAST_QUANTIZER - use octree quantizer while reducing image to
+ * colormap ( see colormap_asimage_ext() ) - XPM and GIF only.
  * FUNCTION
  * Some common flags that could be used while writing images into
  * different file formats.
@@ -43,6 +47,7 @@ extern "C" {
 #define EXPORT_ALPHA				(0x01<<1)
 #define EXPORT_APPEND				(0x01<<3)  /* adds subimage  */
 #define EXPORT_ANIMATION_REPEATS	(0x01<<4)  /* number of loops to repeat GIF animation */
+#define EXPORT_FAST_QUANTIZER		(0x01<<5)
 /*****/
 
 /****s* libAfterImage/ASXpmExportParams
@@ -184,6 +189,104 @@ ASImage2file( ASImage *im, const char *dir, const char *file,
 			  ASImageFileTypes type, ASImageExportParams *params );
 
 
+/****f* libAfterImage/export/ASImage2stream()
+ * NAME
+ * ASImage2stream()
+ * SYNOPSIS
+ * Bool ASImage2stream( ASImage *im, ASImageFileTypes type,
+ *                      ASImageExportParams *params, int fd,
+ *                      ASImageStreamWriteFunc write_func,
+ *                      void *write_data );
+ * INPUTS
+ * im			- Image to write out.
+ * type         - ASIT_Png, ASIT_Jpeg or ASIT_Tiff.
+ * params       - same as for ASImage2file()
+ * fd           - file descriptor to write into, if write_func is NULL.
+ * write_func   - function to pass each chunk of encoded data to, along
+ *                with write_data. It should return False to abort.
+ * RETURN VALUE
+ * True on success. False - failure.
+ * DESCRIPTION
+ * Encodes image row by row, handing out encoded data as it comes, so
+ * that the complete file never has to be held in memory. TIFF can only
+ * be written into seekable file descriptor.
+ *********/
+typedef Bool (*ASImageStreamWriteFunc)( void *data, const CARD8 *buffer, size_t length );
+
+Bool ASImage2stream( ASImage *im, ASImageFileTypes type, ASImageExportParams *params,
+					 int fd, ASImageStreamWriteFunc write_func, void *write_data );
+
+/****d* libAfterImage/ExportJobFlags
+ * NAME
+ * ASIMAGE_EXPORT_FAST_ZLIB - use fastest zlib level for PNG, overriding
+ * compression in params. Good for cache files and thumbnails.
+ * NAME
+ * ASIMAGE_EXPORT_CLOSE_FD - close fd when export completes.
+ * SOURCE
+ */
+#define ASIMAGE_EXPORT_FAST_ZLIB	(0x01<<0)
+#define ASIMAGE_EXPORT_CLOSE_FD		(0x01<<1)
+/*****/
+
+/****f* libAfterImage/export/start_asimage_export()
+ * NAME
+ * start_asimage_export()
+ * get_asimage_export_fd()
+ * is_asimage_export_done()
+ * finish_asimage_export()
+ * SYNOPSIS
+ * ASImageExportJob *start_asimage_export( ASImage *im,
+ *                      ASImageFileTypes type, ASImageExportParams *params,
+ *                      int fd, ASImageStreamWriteFunc write_func,
+ *                      void *write_data, ASFlagType flags );
+ * int  get_asimage_export_fd( ASImageExportJob *job );
+ * Bool is_asimage_export_done( ASImageExportJob *job );
+ * Bool finish_asimage_export( ASImageExportJob **pjob );
+ * DESCRIPTION
+ * start_asimage_export() does what ASImage2stream() does, but on a
+ * separate thread. Image is cloned first (that does not copy pixel
+ * data), so it can be modified or destroyed right away. write_func is
+ * called from the export thread.
+ * File descriptor returned by get_asimage_export_fd() becomes readable
+ * once export completes, so it can be added to the select() loop.
+ * finish_asimage_export() waits for export to complete, frees the job
+ * and returns True if image has been successfully written.
+ * Without thread support export completes before start_asimage_export()
+ * returns.
+ *********/
+typedef struct ASImageExportJob ASImageExportJob;
+
+ASImageExportJob *start_asimage_export( ASImage *im, ASImageFileTypes type, ASImageExportParams *params,
+										int fd, ASImageStreamWriteFunc write_func, void *write_data,
+										ASFlagType flags );
+int  get_asimage_export_fd( ASImageExportJob *job );
+Bool is_asimage_export_done( ASImageExportJob *job );
+Bool finish_asimage_export( ASImageExportJob **pjob );
+
+/****f* libAfterImage/export/ASImage2file_async()
+ * NAME
+ * ASImage2file_async()
+ * wait_asimage_exports()
+ * SYNOPSIS
+ * Bool ASImage2file_async( ASImage *im, const char *dir, const char *file,
+ *                          ASImageFileTypes type,
+ *                          ASImageExportParams *params, ASFlagType flags );
+ * void wait_asimage_exports();
+ * DESCRIPTION
+ * ASImage2file_async() writes the file in the background. Data goes into
+ * temporary file next to the destination, that is renamed into it once
+ * complete, so that partially written file is never seen under its
+ * name. Formats that can not be streamed are written synchronously,
+ * same as with ASImage2file().
+ * RETURN VALUE
+ * False if the file could not be created, True otherwise.
+ * wait_asimage_exports() waits for all background writes to complete,
+ * and should be called before exiting.
+ *********/
+Bool ASImage2file_async( ASImage *im, const char *dir, const char *file,
+						 ASImageFileTypes type, ASImageExportParams *params, ASFlagType flags );
+void wait_asimage_exports();
+
 Bool
 ASImage2PNGBuff( ASImage *im, CARD8 **buffer, int *size, ASImageExportParams *params );
 Bool
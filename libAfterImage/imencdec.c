@@ -752,16 +752,12 @@ decode_asscanline_native( ASImageDecoder *imdec, unsigned int skip, int y )
 		if( get_flags(imdec->filter, 0x01<<i) )
 		{
 			register CARD32 *chan = scl->channels[i]+skip;
+			/* shift is applied while data is copied out of the storage, and
+			 * raw (uncompressed) lines are copied straight from their slots : */
 			if( imdec->im )
-				count = fetch_data32( NULL, imdec->im->channels[i][y], chan, imdec->offset_x, width, 0, NULL);
+				count = fetch_data32_shifted( NULL, imdec->im->channels[i][y], chan, imdec->offset_x, width, 0, scl->shift, NULL);
 			else
 				count = 0 ;
-			if( scl->shift )
-			{
-				register int k  = 0;
-				for(; k < count ; k++ )
-					chan[k] = chan[k]<<8;
-			}
 			if( count < width )
 				set_component( chan, ARGB32_CHAN8(imdec->back_color, i)<<scl->shift, count, width );
 		}
@@ -81,6 +81,22 @@
 #endif
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#ifndef _WIN32
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <utime.h>
+# include <signal.h>
+# ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+# endif
+# ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+# endif
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 /* <setjmp.h> is used for the optional error recovery mechanism */
 
 #ifdef const
@@ -122,7 +138,9 @@
 #include "ungif.h"
 #include "import.h"
 #include "asimagexml.h"
+#include "export.h"
 #include "transform.h"
+#include "asthread.h"
 
 
 /***********************************************************************************/
@@ -244,6 +262,438 @@ char *locate_image_file_in_path( const char *file, ASImageImportParams *iparams
 		realfilename = mystrdup(file);
 	return realfilename ;
 }
+/***********************************************************************************/
+/* Persistent cache of decoded images :											   */
+/* Each image is kept in its own file, named after the hash of the key, which 	   */
+/* consists of the real filename, its mtime and size, and all the import params   */
+/* that affect the result. File holds header, the key itself, table of rows of    */
+/* each channel, and compressed data of the rows exactly as it is kept in 		   */
+/* ASStorage, with identical rows stored only once.								   */
+/***********************************************************************************/
+#define ASIMAGE_CACHE_MAGIC			0x43495341	/* "ASIC" */
+#define ASIMAGE_CACHE_VERSION		1
+#define ASIMAGE_CACHE_DEFAULT_SIZE	(64*1024*1024)
+#define ASIMAGE_CACHE_SUFFIX		".asic"
+#define ASIMAGE_CACHE_TMP_SUFFIX	".tmp"		/* <cache file>.<pid>.tmp while being written */
+#define ASIMAGE_CACHE_TMP_MAX_AGE	(60*60)		/* seconds */
+#define ASIMAGE_CACHE_EMPTY_ROW		0xFFFFFFFF
+#define ASIMAGE_CACHE_ROW_FLAGS		(ASStorage_CompressionType|ASStorage_NotTileable|ASStorage_Bitmap| \
+									 ASStorage_32Bit|ASStorage_BitShift|ASStorage_Masked)
+
+typedef struct ASImageCacheHeader
+{
+	CARD32 magic, version ;
+	CARD32 key_size ;				/* key follows, padded to 4 bytes */
+	CARD32 width, height ;
+	CARD32 back_color ;
+	CARD32 flags ;					/* ASIM_*_IS_BITMAP flags of the image */
+	CARD32 data_size ;				/* rows data follows the rows table */
+	CARD32 checksum ;				/* of everything after the header */
+}ASImageCacheHeader;
+
+typedef struct ASImageCacheRow
+{
+	CARD32 offset ;					/* in rows data */
+	CARD32 size, uncompressed_size ;
+	CARD32 flags ;					/* ASStorage flags */
+}ASImageCacheRow;
+
+static char *decode_cache_dir = NULL ;
+static ASImageDecodeCacheStats decode_cache_stats = {0} ;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t decode_cache_lock = PTHREAD_MUTEX_INITIALIZER ;
+#define LOCK_DECODE_CACHE()		pthread_mutex_lock( &decode_cache_lock )
+#define UNLOCK_DECODE_CACHE()	pthread_mutex_unlock( &decode_cache_lock )
+#else
+#define LOCK_DECODE_CACHE()		do{}while(0)
+#define UNLOCK_DECODE_CACHE()	do{}while(0)
+#endif
+
+static CARD32
+decode_cache_checksum( CARD8 *data, size_t size, CARD32 h )
+{
+	register size_t i ;
+	for( i = 0 ; i < size ; ++i ) 
+		h = (h^data[i])*0x01000193 ;
+	return h;
+}
+
+#ifndef _WIN32
+/* returns NULL if image should not be cached */
+static char *
+make_decode_cache_key( const char *realfilename, ASImageFileTypes file_type, ASImageImportParams *iparams, char **pcache_file )
+{
+	struct stat st ;
+	char *key, *cache_file ;
+	CARD32 h1, h2 ;
+	int key_len ;
+	
+	if( decode_cache_dir == NULL || file_type == ASIT_XMLScript || file_type == ASIT_Gif || 
+		iparams->gamma_table != NULL || iparams->format != ASA_ASImage ) 
+		return NULL;
+	if( stat( realfilename, &st ) != 0 || !S_ISREG(st.st_mode) ) 
+		return NULL;
+	key = safemalloc( strlen(realfilename) + 256 );
+	key_len = sprintf( key, "%s\n%lu %lu\n%d %d %lX %lX %.6f %d %u", realfilename, 
+					   (unsigned long)st.st_mtime, (unsigned long)st.st_size, 
+					   iparams->width, iparams->height, 
+					   (unsigned long)get_flags( iparams->flags, AS_IMPORT_RESIZED|AS_IMPORT_SCALED_BOTH|AS_IMPORT_FAST ), 
+					   (unsigned long)iparams->filter, iparams->gamma, iparams->subimage, iparams->compression );
+	h1 = decode_cache_checksum( (CARD8*)key, key_len, 0x811C9DC5 );
+	h2 = decode_cache_checksum( (CARD8*)key, key_len, h1^0x5BD1E995 );
+	cache_file = safemalloc( strlen(decode_cache_dir) + 1 + 16 + sizeof(ASIMAGE_CACHE_SUFFIX) );
+	sprintf( cache_file, "%s/%8.8lX%8.8lX" ASIMAGE_CACHE_SUFFIX, decode_cache_dir, (unsigned long)h1, (unsigned long)h2 );
+	*pcache_file = cache_file ;
+	return key;
+}
+
+static ASImage *
+load_decode_cache_data( CARD8 *data, size_t size, const char *key, ASImageImportParams *iparams )
+{
+	ASImageCacheHeader *hdr = (ASImageCacheHeader*)data ;
+	ASImageCacheRow *rows ;
+	CARD8 *rows_data ;
+	ASImage *im = NULL ;
+	ASHashTable *ids = NULL ;
+	size_t rows_offset, rows_num, key_len = strlen(key) ;
+	int y, chan ;
+
+	if( size < sizeof(ASImageCacheHeader) || hdr->magic != ASIMAGE_CACHE_MAGIC || 
+		hdr->version != ASIMAGE_CACHE_VERSION || hdr->key_size != key_len ||
+		hdr->width == 0 || hdr->width > MAX_IMPORT_IMAGE_SIZE || 
+		hdr->height == 0 || hdr->height > MAX_IMPORT_IMAGE_SIZE )
+		return NULL;
+	rows_offset = sizeof(ASImageCacheHeader) + ((key_len+3)&(~0x03)) ;
+	rows_num = hdr->height*IC_NUM_CHANNELS ;
+	if( rows_offset + rows_num*sizeof(ASImageCacheRow) + hdr->data_size != size || 
+		memcmp( data+sizeof(ASImageCacheHeader), key, key_len ) != 0 ||
+		decode_cache_checksum( data+sizeof(ASImageCacheHeader), size-sizeof(ASImageCacheHeader), 0x811C9DC5 ) != hdr->checksum )
+		return NULL;
+	rows = (ASImageCacheRow*)(data+rows_offset);
+	rows_data = data + rows_offset + rows_num*sizeof(ASImageCacheRow) ;
+
+	im = create_asimage( hdr->width, hdr->height, iparams->compression );
+	im->back_color = hdr->back_color ;
+	set_flags( im->flags, hdr->flags&(ASIM_ALPHA_IS_BITMAP|ASIM_RGB_IS_BITMAP) );
+	ids = create_ashash( 0, NULL, NULL, NULL );
+	/* once any row fails, image is destroyed along with all the rows
+	 * imported so far, and we stop right there : */
+	for( chan = 0 ; chan < IC_NUM_CHANNELS && im != NULL ; ++chan ) 
+		for( y = 0 ; y < (int)hdr->height && im != NULL ; ++y ) 
+		{
+			ASImageCacheRow *row = &(rows[chan*hdr->height+y]);
+			ASHashData hdata = {0} ;
+			ASStorageID id = 0 ;
+			if( row->offset == ASIMAGE_CACHE_EMPTY_ROW ) 
+				continue;
+			if( get_hash_item( ids, AS_HASHABLE(row->offset), &hdata.vptr ) == ASH_Success ) 
+				id = dup_data( NULL, (ASStorageID)hdata.c32 );
+			else if( row->offset < hdr->data_size && row->size <= hdr->data_size - row->offset && 
+					 (row->flags&(~ASIMAGE_CACHE_ROW_FLAGS)) == 0 && row->uncompressed_size <= hdr->width*4 ) 
+			{
+				id = import_compressed_data( NULL, rows_data+row->offset, row->size, row->uncompressed_size, row->flags );
+				if( id ) 
+				{
+					hdata.c32 = id ;
+					add_hash_item( ids, AS_HASHABLE(row->offset), hdata.vptr );
+				}
+			}
+			if( id == 0 ) 
+				destroy_asimage( &im );
+			else
+				im->channels[chan][y] = id ;
+		}
+	destroy_ashash( &ids );
+	return im;
+}
+
+static ASImage *
+load_decode_cache( const char *cache_file, const char *key, ASImageImportParams *iparams )
+{
+	ASImage *im = NULL ;
+	struct stat st ;
+	CARD8 *data = NULL ;
+	int fd ;
+
+	if( (fd = open( cache_file, O_RDONLY )) < 0 ) 
+		return NULL;
+	if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(ASImageCacheHeader) ) 
+	{
+#ifdef HAVE_SYS_MMAN_H
+		data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( data != MAP_FAILED ) 
+		{
+			im = load_decode_cache_data( data, st.st_size, key, iparams );
+			munmap( data, st.st_size );
+		}
+#else
+		data = safemalloc( st.st_size );
+		if( read( fd, data, st.st_size ) == st.st_size ) 
+			im = load_decode_cache_data( data, st.st_size, key, iparams );
+		free( data );
+#endif
+	}
+	close( fd );
+	if( im ) 
+		utime( cache_file, NULL );	/* most recently used */
+	else
+		unlink( cache_file );		/* stale or broken */
+	return im;
+}
+
+typedef struct ASDecodeCacheFile
+{
+	char  *filename ;
+	time_t mtime ;
+	off_t  size ;
+}ASDecodeCacheFile;
+
+typedef struct ASDecodeCacheScan
+{
+	ASDecodeCacheFile *files ;
+	int 			   files_num, files_allocated ;
+	size_t			   total_size ;
+}ASDecodeCacheScan;
+
+static Bool
+has_suffix( const char *name, int len, const char *suffix, int suffix_len ) 
+{
+	return ( len > suffix_len && strcmp( name+len-suffix_len, suffix ) == 0 );
+}
+
+/* returns pid of the writer if it is temporary file, 0 otherwise */
+static long
+decode_cache_tmp_file_pid( const char *d_name ) 
+{
+	int len = strlen(d_name);
+	const char *pid_str = strstr( d_name, ASIMAGE_CACHE_SUFFIX "." );
+
+	if( pid_str == NULL || 
+		!has_suffix( d_name, len, ASIMAGE_CACHE_TMP_SUFFIX, sizeof(ASIMAGE_CACHE_TMP_SUFFIX)-1 ) )
+		return 0;
+	return atol( pid_str + sizeof(ASIMAGE_CACHE_SUFFIX) );
+}
+
+static int
+decode_cache_filter( const char *d_name ) 
+{
+	return ( has_suffix( d_name, strlen(d_name), ASIMAGE_CACHE_SUFFIX, sizeof(ASIMAGE_CACHE_SUFFIX)-1 ) ||
+			 decode_cache_tmp_file_pid( d_name ) > 0 );
+}
+
+static Bool
+decode_cache_direntry( const char *fname, const char *fullname, struct stat *stat_info, void *aux_data)
+{
+	ASDecodeCacheScan *scan = (ASDecodeCacheScan*)aux_data ;
+	long pid ;
+
+	if( !S_ISREG(stat_info->st_mode) ) 
+		return False;
+	if( (pid = decode_cache_tmp_file_pid( fname )) > 0 ) 
+	{	/* left over by writer that got interrupted - either it is gone, 
+		 * or it had plenty of time to finish (pid could have been reused) : */
+		if( (kill( (pid_t)pid, 0 ) != 0 && errno == ESRCH) || 
+			stat_info->st_mtime + ASIMAGE_CACHE_TMP_MAX_AGE < time(NULL) ) 
+			unlink( fullname );
+		return False;
+	}
+	if( scan->files_num >= scan->files_allocated ) 
+	{
+		scan->files_allocated = scan->files_allocated*2 + 64 ;
+		scan->files = realloc( scan->files, scan->files_allocated*sizeof(ASDecodeCacheFile) );
+	}
+	scan->files[scan->files_num].filename = mystrdup( fullname );
+	scan->files[scan->files_num].mtime = stat_info->st_mtime ;
+	scan->files[scan->files_num].size = stat_info->st_size ;
+	++(scan->files_num);
+	scan->total_size += stat_info->st_size ;
+	return True;
+}
+
+static int
+compare_decode_cache_files( const void *a, const void *b )
+{
+	time_t ta = ((ASDecodeCacheFile*)a)->mtime, tb = ((ASDecodeCacheFile*)b)->mtime ;
+	return (ta < tb)? -1 : ((ta > tb)? 1 : 0) ;
+}
+
+/* must be called with cache locked. File just stored is never evicted, 
+ * since mtime has too coarse resolution to tell it from the older ones : */
+static void
+trim_decode_cache( const char *keep_file )
+{
+	ASDecodeCacheScan scan = {NULL, 0, 0, 0} ;
+	int i ;
+	my_scandir_ext( decode_cache_dir, decode_cache_filter, decode_cache_direntry, &scan );
+	if( scan.total_size > decode_cache_stats.max_size ) 
+	{	/* trim it down some more, so we don't have to do that after every image : */
+		size_t target = decode_cache_stats.max_size - decode_cache_stats.max_size/4 ;
+		qsort( scan.files, scan.files_num, sizeof(ASDecodeCacheFile), compare_decode_cache_files );
+		for( i = 0 ; i < scan.files_num && scan.total_size > target ; ++i ) 
+			if( (keep_file == NULL || strcmp( scan.files[i].filename, keep_file ) != 0) && 
+				unlink( scan.files[i].filename ) == 0 ) 
+			{
+				scan.total_size -= scan.files[i].size ;
+				++(decode_cache_stats.evicted);
+			}
+	}
+	for( i = 0 ; i < scan.files_num ; ++i ) 
+		free( scan.files[i].filename );
+	if( scan.files ) 
+		free( scan.files );
+	decode_cache_stats.size = scan.total_size ;
+}
+
+static void
+store_decode_cache( const char *cache_file, const char *key, ASImage *im )
+{
+	ASImageCacheHeader hdr ;
+	ASImageCacheRow *rows ;
+	CARD8 *data = NULL ;
+	size_t data_size = 0, data_allocated = 0 ;
+	size_t key_size = strlen(key), rows_offset, rows_num = im->height*IC_NUM_CHANNELS, file_size ;
+	ASHashTable *offsets = create_ashash( 0, NULL, NULL, NULL );
+	CARD8 *file_data ;
+	char *tmp_file ;
+	int chan, y, fd ;
+	Bool success = False ;
+	
+	rows = safecalloc( rows_num, sizeof(ASImageCacheRow));
+	for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan ) 
+		for( y = 0 ; y < (int)im->height ; ++y ) 
+		{
+			ASImageCacheRow *row = &(rows[chan*im->height+y]);
+			ASStorageSlot slot ;
+			ASHashData hdata = {0} ;
+			CARD32 h ;
+			int size ;
+
+			row->offset = ASIMAGE_CACHE_EMPTY_ROW ;
+			if( im->channels[chan][y] == 0 || 
+				(size = fetch_compressed_data( NULL, im->channels[chan][y], NULL, 0, &slot )) <= 0 ) 
+				continue;
+			if( data_size + size > data_allocated ) 
+			{
+				data_allocated = (data_size + size)*2 + 4096 ;
+				data = realloc( data, data_allocated );
+			}
+			fetch_compressed_data( NULL, im->channels[chan][y], data+data_size, size, NULL );
+			row->size = size ;
+			row->uncompressed_size = slot.uncompressed_size ;
+			row->flags = slot.flags&ASIMAGE_CACHE_ROW_FLAGS ;
+			/* identical rows are only stored once : */
+			h = decode_cache_checksum( data+data_size, size, 0x811C9DC5^row->flags );
+			if( get_hash_item( offsets, AS_HASHABLE(h), &hdata.vptr ) == ASH_Success ) 
+			{
+				ASImageCacheRow *same = &(rows[hdata.c32]);
+				if( same->size == row->size && same->flags == row->flags && 
+					same->uncompressed_size == row->uncompressed_size &&
+					memcmp( data+same->offset, data+data_size, size ) == 0 ) 
+				{
+					row->offset = same->offset ;
+					continue;
+				}
+			}else
+			{
+				hdata.c32 = chan*im->height+y ;
+				add_hash_item( offsets, AS_HASHABLE(h), hdata.vptr );
+			}
+			row->offset = data_size ;
+			data_size += (size+3)&(~0x03) ;
+		}
+	destroy_ashash( &offsets );
+
+	rows_offset = sizeof(ASImageCacheHeader) + ((key_size+3)&(~0x03)) ;
+	file_size = rows_offset + rows_num*sizeof(ASImageCacheRow) + data_size ;
+	file_data = safecalloc( 1, file_size );
+	memcpy( file_data+sizeof(ASImageCacheHeader), key, key_size );
+	memcpy( file_data+rows_offset, rows, rows_num*sizeof(ASImageCacheRow) );
+	if( data_size > 0 ) 
+		memcpy( file_data+rows_offset+rows_num*sizeof(ASImageCacheRow), data, data_size );
+	memset( &hdr, 0x00, sizeof(hdr));
+	hdr.magic = ASIMAGE_CACHE_MAGIC ;
+	hdr.version = ASIMAGE_CACHE_VERSION ;
+	hdr.key_size = key_size ;
+	hdr.width = im->width ;
+	hdr.height = im->height ;
+	hdr.back_color = im->back_color ;
+	hdr.flags = get_flags( im->flags, ASIM_ALPHA_IS_BITMAP|ASIM_RGB_IS_BITMAP );
+	hdr.data_size = data_size ;
+	hdr.checksum = decode_cache_checksum( file_data+sizeof(ASImageCacheHeader), file_size-sizeof(ASImageCacheHeader), 0x811C9DC5 );
+	memcpy( file_data, &hdr, sizeof(hdr));
+	free( rows );
+	if( data ) 
+		free( data );
+
+	/* other processes may be reading it - so we write new file and rename it : */
+	tmp_file = safemalloc( strlen(cache_file) + 32 );
+	sprintf( tmp_file, "%s.%ld.tmp", cache_file, (long)getpid() );
+	if( (fd = open( tmp_file, O_WRONLY|O_CREAT|O_TRUNC, 0600 )) >= 0 ) 
+	{
+		success = ( write( fd, file_data, file_size ) == (ssize_t)file_size );
+		if( close( fd ) != 0 ) 
+			success = False ;
+		if( success ) 
+			success = ( rename( tmp_file, cache_file ) == 0 );
+		if( !success ) 
+			unlink( tmp_file );
+	}
+	free( tmp_file );
+	free( file_data );
+	
+	if( success ) 
+	{
+		LOCK_DECODE_CACHE();
+		++(decode_cache_stats.stored);
+		decode_cache_stats.size += file_size ;
+		if( decode_cache_stats.size > decode_cache_stats.max_size && decode_cache_dir ) 
+			trim_decode_cache( cache_file );
+		UNLOCK_DECODE_CACHE();
+	}
+}
+#endif
+
+Bool 
+set_asimage_decode_cache( const char *dir, size_t max_size )
+{
+	Bool success = False ;
+	LOCK_DECODE_CACHE();
+	if( decode_cache_dir ) 
+	{
+		free( decode_cache_dir );
+		decode_cache_dir = NULL ;
+	}
+#ifndef _WIN32
+	if( dir ) 
+	{
+		struct stat st ;
+		if( stat( dir, &st ) == 0 && S_ISDIR(st.st_mode) ) 
+		{
+			int len = strlen( dir );
+			while( len > 1 && dir[len-1] == '/' ) 
+				--len ;
+			decode_cache_dir = mystrndup( dir, len );
+			decode_cache_stats.max_size = (max_size > 0)? max_size : ASIMAGE_CACHE_DEFAULT_SIZE ;
+			trim_decode_cache( NULL );
+			success = True ;
+		}
+	}
+#endif
+	UNLOCK_DECODE_CACHE();
+	return success;
+}
+
+void 
+get_asimage_decode_cache_stats( ASImageDecodeCacheStats *stats )
+{
+	if( stats ) 
+	{
+		LOCK_DECODE_CACHE();
+		*stats = decode_cache_stats ;
+		UNLOCK_DECODE_CACHE();
+	}
+}
+
 ASImage *
 file2ASImage_extra( const char *file, ASImageImportParams *iparams )
 {
@@ -265,9 +715,38 @@ file2ASImage_extra( const char *file, ASImageImportParams *iparams )
 		else if( as_image_file_loaders[file_type] )
 		{
 			char *g_var = getenv( "SCREEN_GAMMA" );
+			char *cache_key = NULL, *cache_file = NULL ;
 			if( g_var != NULL )
 				iparams->gamma = atof(g_var);
-			im = as_image_file_loaders[file_type](realfilename, iparams);
+#ifndef _WIN32
+			LOCK_DECODE_CACHE();
+			cache_key = make_decode_cache_key( realfilename, file_type, iparams, &cache_file );
+			UNLOCK_DECODE_CACHE();
+			if( cache_key ) 
+			{
+				im = load_decode_cache( cache_file, cache_key, iparams );
+				LOCK_DECODE_CACHE();
+				if( im ) 
+					++(decode_cache_stats.hits);
+				else
+					++(decode_cache_stats.misses);
+				UNLOCK_DECODE_CACHE();
+			}
+#endif
+			if( im == NULL ) 
+			{
+				im = as_image_file_loaders[file_type](realfilename, iparams);
+#ifndef _WIN32
+				if( im != NULL && cache_key != NULL && im->imageman == NULL && 
+					im->width <= MAX_IMPORT_IMAGE_SIZE && im->height <= MAX_IMPORT_IMAGE_SIZE ) 
+					store_decode_cache( cache_file, cache_key, im );
+#endif
+			}
+			if( cache_key ) 
+			{
+				free( cache_key );
+				free( cache_file );
+			}
 		}else
 			show_error( "Support for the format of image file \"%s\" has not been implemented yet.", realfilename );
 		/* returned image must not be tracked by any ImageManager yet !!! */
@@ -695,14 +1174,8 @@ get_thumbnail_asimage( ASImageManager* imageman, const char *file, int thumb_wid
 				if (save_thumbnail && thumbfile)
 				{
 					LOCAL_DEBUG_OUT("Saving thumbnail to file %s", thumbfile);
-					save_asimage_to_file(thumbfile,
-							     im,
-							     "png",
-							     NULL,
-							     NULL,
-							     0,
-							     1
-							     );
+					/* thumbnail is only a cache - don't make caller wait on zlib */
+					ASImage2file_async( im, NULL, thumbfile, ASIT_Png, NULL, ASIMAGE_EXPORT_FAST_ZLIB );
 				}
 			}
 
@@ -839,11 +1312,66 @@ void destroy_asimage_list_entry_buffer( ASImageListEntryBuffer **pbuffer )
 	}
 }	 
 
+static ASImage *
+make_asimage_list_entry_preview( ASVisual *asv, ASImageListEntry *entry, 
+								 ASFlagType preview_type, double gamma,
+								 unsigned int preview_width, unsigned int preview_height,
+								 unsigned int preview_compression )
+{
+	ASImageImportParams iparams = {0} ;
+	ASImage *im ;
+
+	iparams.gamma = gamma ;
+	im = as_image_file_loaders[entry->type](entry->fullfilename, &iparams);
+	if( im )
+	{
+		int scale_width = im->width ;
+		int scale_height = im->height ;
+		int tile_width = im->width ;
+		int tile_height = im->height ;
+
+		if( preview_width > 0 )
+		{
+			if( get_flags( preview_type, SCALE_PREVIEW_H ) )
+				scale_width = preview_width ;
+			else
+				tile_width = preview_width ;
+		}
+		if( preview_height > 0 )
+		{
+			if( get_flags( preview_type, SCALE_PREVIEW_V ) )
+				scale_height = preview_height ;
+			else
+				tile_height = preview_height ;
+		}
+		if( scale_width != im->width || scale_height != im->height )
+		{
+			ASImage *tmp = scale_asimage( asv, im, scale_width, scale_height, ASA_ASImage, preview_compression, ASIMAGE_QUALITY_DEFAULT );
+			if( tmp != NULL )
+			{
+				destroy_asimage( &im );
+				im = tmp ;
+			}
+		}
+		if( tile_width != im->width || tile_height != im->height )
+		{
+			ASImage *tmp = tile_asimage( asv, im, 0, 0, tile_width, tile_height, TINT_NONE, ASA_ASImage, preview_compression, ASIMAGE_QUALITY_DEFAULT );
+			if( tmp != NULL )
+			{
+				destroy_asimage( &im );
+				im = tmp ;
+			}
+		}
+	}
+	return im;
+}
+
 struct ASImageListAuxData
 {
 	ASImageListEntry **pcurr;
 	ASImageListEntry *last ;
 	ASFlagType preview_type ;
+	double gamma ;
 	unsigned int preview_width ;
 	unsigned int preview_height ;
 	unsigned int preview_compression ;
@@ -882,52 +1410,9 @@ direntry2ASImageListEntry( const char *fname, const char *fullname,
 	curr->d_size  = stat_info->st_size;
 
 	if( curr->type != ASIT_Unknown && data->preview_type != 0 )
-	{
-		ASImageImportParams iparams = {0} ;
-		ASImage *im = as_image_file_loaders[file_type](fullname, &iparams);
-		if( im )
-		{
-			int scale_width = im->width ;
-			int scale_height = im->height ;
-			int tile_width = im->width ;
-			int tile_height = im->height ;
-
-			if( data->preview_width > 0 )
-			{
-				if( get_flags( data->preview_type, SCALE_PREVIEW_H ) )
-					scale_width = data->preview_width ;
-				else
-					tile_width = data->preview_width ;
-			}
-			if( data->preview_height > 0 )
-			{
-				if( get_flags( data->preview_type, SCALE_PREVIEW_V ) )
-					scale_height = data->preview_height ;
-				else
-					tile_height = data->preview_height ;
-			}
-			if( scale_width != im->width || scale_height != im->height )
-			{
-				ASImage *tmp = scale_asimage( data->asv, im, scale_width, scale_height, ASA_ASImage, data->preview_compression, ASIMAGE_QUALITY_DEFAULT );
-				if( tmp != NULL )
-				{
-					destroy_asimage( &im );
-					im = tmp ;
-				}
-			}
-			if( tile_width != im->width || tile_height != im->height )
-			{
-				ASImage *tmp = tile_asimage( data->asv, im, 0, 0, tile_width, tile_height, TINT_NONE, ASA_ASImage, data->preview_compression, ASIMAGE_QUALITY_DEFAULT );
-				if( tmp != NULL )
-				{
-					destroy_asimage( &im );
-					im = tmp ;
-				}
-			}
-		}
-
-		curr->preview = im ;
-	}
+		curr->preview = make_asimage_list_entry_preview( data->asv, curr, data->preview_type, data->gamma,
+														   data->preview_width, data->preview_height, 
+														   data->preview_compression );
 	return True;
 }
 #endif
@@ -948,6 +1433,7 @@ get_asimage_list( ASVisual *asv, const char *dir,
 	aux_data.pcurr = &im_list;
 	aux_data.last = NULL;
 	aux_data.preview_type = preview_type;
+	aux_data.gamma = gamma;
 	aux_data.preview_width = preview_width;
 	aux_data.preview_height = preview_height;
 	aux_data.preview_compression  = preview_compression;
@@ -957,14 +1443,485 @@ get_asimage_list( ASVisual *asv, const char *dir,
 	if( asv == NULL || dir == NULL )
 		return NULL ;
 
+	/* with threads enabled previews are loaded in parallel, once the 
+	 * directory is scanned : */
+	if( preview_type != 0 && get_asimage_thread_count() > 1 )
+		aux_data.preview_type = 0 ;
+
 	count = my_scandir_ext ((char*)dir, select, direntry2ASImageListEntry, &aux_data);
 
+	if( preview_type != 0 && aux_data.preview_type == 0 && im_list != NULL )
+	{
+		ASImageListLoader *loader = create_asimage_list_loader( asv, preview_type, gamma, preview_width, preview_height, 
+																preview_compression, get_asimage_thread_count()-1 );
+		ASImageListEntry *curr ;
+		for( curr = im_list ; curr != NULL ; curr = curr->next )
+			queue_asimage_list_preview( loader, curr, 0 );
+		wait_asimage_list_previews( loader, NULL, NULL );
+		destroy_asimage_list_loader( &loader );
+	}
+
 	if( count_ret )
 		*count_ret = count ;
 #endif
 	return im_list;
 }
 
+/***********************************************************************************/
+/* Asynchronous loading of image list previews :                                   */
+/***********************************************************************************/
+typedef struct ASImageListLoadJob
+{
+	ASImageListEntry *entry ;		/* only ever (un)referenced by the owner thread */
+	ASImage 		 *preview ;
+	int 			  priority ;
+	unsigned long 	  seq ;			/* order of queuing, to break priority ties */
+	Bool 			  cancelled ;
+	struct ASImageListLoadJob *next ;
+}ASImageListLoadJob;
+
+struct ASImageListLoader
+{
+	ASVisual 	*asv ;
+	ASFlagType 	 preview_type ;
+	double 		 gamma ;
+	unsigned int preview_width, preview_height ;
+	unsigned int preview_compression ;
+
+	ASImageListLoadJob **pending ;	/* not ordered - we pick highest priority */
+	int 		 pending_num, pending_allocated ;
+	ASImageListLoadJob **running ;	/* one slot per thread, plus owner's one */
+	ASImageListLoadJob *done, *done_tail ;
+	unsigned long seq ;
+
+	int 		 notify_fds[2] ;	/* read end is readable while there is
+									 * something for collect to do */
+	Bool 		 notified ;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock ;
+	pthread_cond_t  work_ready, job_done ;
+	pthread_t      *threads ;
+#endif
+	int 		 threads_num ;
+	Bool 		 quit ;
+};
+
+#ifdef HAVE_PTHREAD
+#define LOCK_LIST_LOADER(l)		pthread_mutex_lock( &((l)->lock) )
+#define UNLOCK_LIST_LOADER(l)	pthread_mutex_unlock( &((l)->lock) )
+#else
+#define LOCK_LIST_LOADER(l)		do{}while(0)
+#define UNLOCK_LIST_LOADER(l)	do{}while(0)
+#endif
+
+#define LIST_JOB_THREADED		(0x01<<0)
+#define LIST_JOB_OWNER			(0x01<<1)
+
+/* Loaders that keep static state (XPM color names, GIF error code, XML 
+ * image and font managers, librsvg) are only ever run by the owner thread */
+static Bool
+is_threadsafe_image_loader( ASImageFileTypes type )
+{
+	switch( type )
+	{
+		case ASIT_Png :
+		case ASIT_Jpeg :
+		case ASIT_Xcf :
+		case ASIT_Ppm :
+		case ASIT_Pnm :
+		case ASIT_Bmp :
+		case ASIT_Ico :
+		case ASIT_Cur :
+		case ASIT_Tiff :
+		case ASIT_Targa :
+			return True ;
+		default :
+			return False ;
+	}
+}
+
+static void
+notify_asimage_list_loader( ASImageListLoader *loader )
+{
+	if( !loader->notified )
+	{
+		loader->notified = True ;
+		if( loader->notify_fds[1] >= 0 )
+		{
+			char c = 0 ;
+			while( write( loader->notify_fds[1], &c, 1 ) < 0 && errno == EINTR );
+		}
+	}
+}
+
+/* must be called with loader locked */
+static ASImageListLoadJob *
+pick_asimage_list_job( ASImageListLoader *loader, ASFlagType which )
+{
+	ASImageListLoadJob *job = NULL ;
+	int i, best = -1 ;
+
+	if( loader->threads_num == 0 )
+		which |= LIST_JOB_THREADED|LIST_JOB_OWNER ;
+	for( i = 0 ; i < loader->pending_num ; ++i )
+	{
+		ASImageListLoadJob *curr = loader->pending[i] ;
+		if( !get_flags( which, is_threadsafe_image_loader( curr->entry->type )?LIST_JOB_THREADED:LIST_JOB_OWNER ) )
+			continue;
+		if( best < 0 || curr->priority > loader->pending[best]->priority ||
+			(curr->priority == loader->pending[best]->priority && curr->seq < loader->pending[best]->seq) )
+			best = i ;
+	}
+	if( best >= 0 )
+	{
+		job = loader->pending[best] ;
+		loader->pending[best] = loader->pending[--(loader->pending_num)] ;
+	}
+	return job;
+}
+
+/* must be called with loader locked. Lock is released while image loads */
+static void
+run_asimage_list_job( ASImageListLoader *loader, ASImageListLoadJob *job, int slot )
+{
+	loader->running[slot] = job ;
+	UNLOCK_LIST_LOADER(loader);
+	job->preview = make_asimage_list_entry_preview( loader->asv, job->entry, loader->preview_type, loader->gamma,
+													loader->preview_width, loader->preview_height,
+													loader->preview_compression );
+	LOCK_LIST_LOADER(loader);
+	loader->running[slot] = NULL ;
+	job->next = NULL ;
+	if( loader->done_tail )
+		loader->done_tail->next = job ;
+	else
+		loader->done = job ;
+	loader->done_tail = job ;
+	notify_asimage_list_loader( loader );
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast( &(loader->job_done) );
+#endif
+}
+
+static void
+free_asimage_list_job( ASImageListLoadJob *job )
+{
+	if( job->preview )
+		destroy_asimage( &(job->preview) );
+	unref_asimage_list_entry( job->entry );
+	free( job );
+}
+
+#ifdef HAVE_PTHREAD
+typedef struct ASImageListWorker
+{
+	ASImageListLoader *loader ;
+	int slot ;
+}ASImageListWorker;
+
+static void *
+asimage_list_worker( void *arg )
+{
+	ASImageListLoader *loader = ((ASImageListWorker*)arg)->loader ;
+	int slot = ((ASImageListWorker*)arg)->slot ;
+
+	free( arg );
+	LOCK_LIST_LOADER(loader);
+	while( !loader->quit )
+	{
+		ASImageListLoadJob *job = pick_asimage_list_job( loader, LIST_JOB_THREADED );
+		if( job == NULL )
+			pthread_cond_wait( &(loader->work_ready), &(loader->lock) );
+		else
+			run_asimage_list_job( loader, job, slot );
+	}
+	UNLOCK_LIST_LOADER(loader);
+	return NULL;
+}
+#endif
+
+ASImageListLoader *
+create_asimage_list_loader( ASVisual *asv, ASFlagType preview_type, double gamma,
+							unsigned int preview_width, unsigned int preview_height,
+							unsigned int preview_compression, int threads_num )
+{
+	ASImageListLoader *loader ;
+
+	if( asv == NULL )
+		return NULL;
+
+	loader = safecalloc( 1, sizeof(ASImageListLoader));
+	loader->asv = asv ;
+	loader->preview_type = preview_type ;
+	loader->gamma = gamma ;
+	loader->preview_width = preview_width ;
+	loader->preview_height = preview_height ;
+	loader->preview_compression = preview_compression ;
+	loader->notify_fds[0] = loader->notify_fds[1] = -1 ;
+#ifndef _WIN32
+	if( pipe( loader->notify_fds ) == 0 )
+	{
+#ifdef HAVE_FCNTL_H
+		fcntl( loader->notify_fds[0], F_SETFL, O_NONBLOCK );
+		fcntl( loader->notify_fds[1], F_SETFL, O_NONBLOCK );
+		fcntl( loader->notify_fds[0], F_SETFD, FD_CLOEXEC );
+		fcntl( loader->notify_fds[1], F_SETFD, FD_CLOEXEC );
+#endif
+	}else
+		loader->notify_fds[0] = loader->notify_fds[1] = -1 ;
+#endif
+
+#ifdef HAVE_PTHREAD
+	if( threads_num <= 0 )
+	{
+		threads_num = 1 ;
+#ifdef _SC_NPROCESSORS_ONLN
+		threads_num = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+	}
+	if( threads_num > ASIMAGE_MAX_THREADS )
+		threads_num = ASIMAGE_MAX_THREADS ;
+	pthread_mutex_init( &(loader->lock), NULL );
+	pthread_cond_init( &(loader->work_ready), NULL );
+	pthread_cond_init( &(loader->job_done), NULL );
+	loader->threads = safecalloc( threads_num, sizeof(pthread_t));
+	loader->running = safecalloc( threads_num+1, sizeof(ASImageListLoadJob*));
+	for( ; loader->threads_num < threads_num ; ++(loader->threads_num) )
+	{
+		ASImageListWorker *worker = safemalloc( sizeof(ASImageListWorker));
+		worker->loader = loader ;
+		worker->slot = loader->threads_num+1 ;
+		if( pthread_create( &(loader->threads[loader->threads_num]), NULL, asimage_list_worker, worker ) != 0 )
+		{
+			show_warning( "failed to start image loading thread %d of %d", loader->threads_num+1, threads_num );
+			free( worker );
+			break;
+		}
+	}
+#else
+	loader->running = safecalloc( 1, sizeof(ASImageListLoadJob*));
+#endif
+	return loader;
+}
+
+void
+destroy_asimage_list_loader( ASImageListLoader **ploader )
+{
+	ASImageListLoader *loader ;
+	int i ;
+
+	if( ploader == NULL || (loader = *ploader) == NULL )
+		return ;
+#ifdef HAVE_PTHREAD
+	LOCK_LIST_LOADER(loader);
+	loader->quit = True ;
+	pthread_cond_broadcast( &(loader->work_ready) );
+	UNLOCK_LIST_LOADER(loader);
+	for( i = 0 ; i < loader->threads_num ; ++i )
+		pthread_join( loader->threads[i], NULL );
+	pthread_cond_destroy( &(loader->job_done) );
+	pthread_cond_destroy( &(loader->work_ready) );
+	pthread_mutex_destroy( &(loader->lock) );
+	free( loader->threads );
+#endif
+	for( i = 0 ; i < loader->pending_num ; ++i )
+		free_asimage_list_job( loader->pending[i] );
+	while( loader->done )
+	{
+		ASImageListLoadJob *job = loader->done ;
+		loader->done = job->next ;
+		free_asimage_list_job( job );
+	}
+	if( loader->pending )
+		free( loader->pending );
+	free( loader->running );
+#ifndef _WIN32
+	if( loader->notify_fds[0] >= 0 )
+	{
+		close( loader->notify_fds[0] );
+		close( loader->notify_fds[1] );
+	}
+#endif
+	free( loader );
+	*ploader = NULL ;
+}
+
+Bool
+queue_asimage_list_preview( ASImageListLoader *loader, ASImageListEntry *entry, int priority )
+{
+	ASImageListLoadJob *job = NULL ;
+	Bool found = False ;
+	int i ;
+
+	if( loader == NULL || !IS_ASIMAGE_LIST_ENTRY(entry) || entry->preview != NULL || 
+		entry->type >= ASIT_Unknown || as_image_file_loaders[entry->type] == NULL )
+		return False;
+
+	LOCK_LIST_LOADER(loader);
+	for( i = 0 ; i < loader->pending_num ; ++i )
+		if( loader->pending[i]->entry == entry )
+		{ /* already queued - only its priority changes : */
+			loader->pending[i]->priority = priority ;
+			UNLOCK_LIST_LOADER(loader);
+			return True;
+		}
+	for( i = 0 ; i <= loader->threads_num && !found ; ++i )
+		if( loader->running[i] && loader->running[i]->entry == entry )
+			found = !loader->running[i]->cancelled ;
+	for( job = loader->done ; job != NULL && !found ; job = job->next )
+		if( job->entry == entry )
+			found = !job->cancelled ;
+	if( found )
+	{ /* being loaded or already loaded */
+		UNLOCK_LIST_LOADER(loader);
+		return True;
+	}
+
+	job = safecalloc( 1, sizeof(ASImageListLoadJob));
+	job->entry = ref_asimage_list_entry( entry );
+	job->priority = priority ;
+	job->seq = ++(loader->seq) ;
+	if( loader->pending_num >= loader->pending_allocated )
+	{
+		loader->pending_allocated = loader->pending_allocated*2 + 64 ;
+		loader->pending = realloc( loader->pending, loader->pending_allocated*sizeof(ASImageListLoadJob*));
+	}
+	loader->pending[loader->pending_num++] = job ;
+	if( loader->threads_num == 0 || !is_threadsafe_image_loader( entry->type ) )
+		notify_asimage_list_loader( loader );
+#ifdef HAVE_PTHREAD
+	else
+		pthread_cond_signal( &(loader->work_ready) );
+#endif
+	UNLOCK_LIST_LOADER(loader);
+	return True;
+}
+
+int
+cancel_asimage_list_previews( ASImageListLoader *loader, ASImageListEntry *entry )
+{
+	ASImageListLoadJob *job, *cancelled = NULL ;
+	int i, count = 0 ;
+
+	if( loader == NULL )
+		return 0;
+
+	LOCK_LIST_LOADER(loader);
+	for( i = loader->pending_num-1 ; i >= 0 ; --i )
+		if( entry == NULL || loader->pending[i]->entry == entry )
+		{
+			job = loader->pending[i] ;
+			loader->pending[i] = loader->pending[--(loader->pending_num)] ;
+			job->next = cancelled ;
+			cancelled = job ;
+			++count ;
+		}
+	/* those being loaded right now will be discarded by collect : */
+	for( i = 0 ; i <= loader->threads_num ; ++i )
+		if( loader->running[i] && (entry == NULL || loader->running[i]->entry == entry) )
+		{
+			loader->running[i]->cancelled = True ;
+			++count ;
+		}
+	for( job = loader->done ; job != NULL ; job = job->next )
+		if( entry == NULL || job->entry == entry )
+			job->cancelled = True ;
+	UNLOCK_LIST_LOADER(loader);
+
+	while( cancelled )
+	{
+		job = cancelled ;
+		cancelled = job->next ;
+		free_asimage_list_job( job );
+	}
+	return count;
+}
+
+int
+get_asimage_list_loader_fd( ASImageListLoader *loader )
+{
+	return loader?loader->notify_fds[0]:-1;
+}
+
+int
+collect_asimage_list_previews( ASImageListLoader *loader, ASImageListPreviewFunc func, void *data )
+{
+	ASImageListLoadJob *job, *done ;
+	int i, count = 0 ;
+
+	if( loader == NULL )
+		return 0;
+
+	LOCK_LIST_LOADER(loader);
+	/* at most one image per call is loaded here, to keep event loop 
+	 * responsive. If there are more - we'll get notified again : */
+	if( (job = pick_asimage_list_job( loader, LIST_JOB_OWNER )) != NULL )
+		run_asimage_list_job( loader, job, 0 );
+	done = loader->done ;
+	loader->done = loader->done_tail = NULL ;
+#ifndef _WIN32
+	if( loader->notify_fds[0] >= 0 )
+	{
+		char buf[64] ;
+		while( read( loader->notify_fds[0], &buf[0], sizeof(buf) ) > 0 );
+	}
+#endif
+	loader->notified = False ;
+	for( i = 0 ; i < loader->pending_num ; ++i )
+		if( loader->threads_num == 0 || !is_threadsafe_image_loader( loader->pending[i]->entry->type ) )
+		{
+			notify_asimage_list_loader( loader );
+			break;
+		}
+	UNLOCK_LIST_LOADER(loader);
+
+	while( done )
+	{
+		job = done ;
+		done = job->next ;
+		if( !job->cancelled && job->preview && job->entry->preview == NULL )
+		{
+			job->entry->preview = job->preview ;
+			job->preview = NULL ;
+			if( func )
+				func( job->entry, data );
+			++count ;
+		}
+		free_asimage_list_job( job );
+	}
+	return count;
+}
+
+int
+wait_asimage_list_previews( ASImageListLoader *loader, ASImageListPreviewFunc func, void *data )
+{
+	if( loader == NULL )
+		return 0;
+
+	LOCK_LIST_LOADER(loader);
+	while( True )
+	{
+		ASImageListLoadJob *job = pick_asimage_list_job( loader, LIST_JOB_THREADED|LIST_JOB_OWNER );
+		int i ;
+		if( job )
+		{
+			run_asimage_list_job( loader, job, 0 );
+			continue;
+		}
+		for( i = 1 ; i <= loader->threads_num ; ++i )
+			if( loader->running[i] )
+				break;
+		if( i > loader->threads_num )
+			break;
+#ifdef HAVE_PTHREAD
+		pthread_cond_wait( &(loader->job_done), &(loader->lock) );
+#endif
+	}
+	UNLOCK_LIST_LOADER(loader);
+	return collect_asimage_list_previews( loader, func, data );
+}
+
 char *format_asimage_list_entry_details( ASImageListEntry *entry, Bool vertical )
 {
 	char *details_text ;
@@ -1359,6 +2316,69 @@ apply_gamma( register CARD8* raw, register CARD8 *gamma_table, unsigned int widt
 	}
 }
 
+/***********************************************************************************/
+/* Progressive loading - data is pushed into format specific decoder as it arrives,*/
+/* and rows are written out into the image as soon as they are complete :          */
+typedef int  (*progressive_feed_func)( ASImageProgressiveLoader *loader, const CARD8 *data, size_t size );
+typedef void (*progressive_free_func)( ASImageProgressiveLoader *loader );
+
+struct ASImageProgressiveLoader
+{
+	ASImageFileTypes 	type ;
+	ASImageImportParams params ;
+	ASImage 		   *im ;
+	ASImageOutput 	   *imout ;
+	ASScanline 			buf ;
+	unsigned int 		rows_done ;
+	Bool 				complete, failed ;
+	FILE 			   *fp ;                /* only when loading from file */
+
+	progressive_feed_func feed ;
+	progressive_free_func free_data ;
+	void 			   *data ;              /* format specific decoder state */
+};
+
+static Bool
+start_progressive_output( ASImageProgressiveLoader *loader, unsigned int width, unsigned int height )
+{
+	if( width == 0 || height == 0 )
+		return False;
+	loader->im = create_asimage( width, height, loader->params.compression );
+	if( (loader->imout = start_image_output( NULL, loader->im, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT )) == NULL )
+	{
+		destroy_asimage( &(loader->im) );
+		return False;
+	}
+	prepare_scanline( width, 0, &(loader->buf), False );
+	return True;
+}
+
+/* row must have 8 bit per channel, gray or RGB, with optional alpha : */
+static void
+output_progressive_row( ASImageProgressiveLoader *loader, CARD8 *row, Bool grayscale, Bool do_alpha )
+{
+	ASScanline *buf = &(loader->buf);
+	raw2scanline( row, buf, loader->params.gamma_table, buf->width, grayscale, do_alpha );
+	if( grayscale )
+	{
+		memcpy( buf->green, buf->red, buf->width*sizeof(CARD32));
+		memcpy( buf->blue, buf->red, buf->width*sizeof(CARD32));
+	}
+	buf->flags = SCL_DO_COLOR ;
+	if( do_alpha )
+	{/* same as regular loaders - alpha is only stored if it is not all opaque */
+		register unsigned int i ;
+		for( i = 0 ; i < buf->width ; ++i )
+			if( buf->alpha[i] != 0x00FF )
+			{
+				set_flags( buf->flags, SCL_DO_ALPHA );
+				break;
+			}
+	}
+	loader->imout->output_image_scanline( loader->imout, buf, 1 );
+	++(loader->rows_done);
+}
+
 /***********************************************************************************/
 #ifdef HAVE_PNG		/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 ASImage *
@@ -1377,7 +2397,9 @@ png2ASImage_int( void *data, png_rw_ptr read_fn, ASImageImportParams *params )
 	png_bytep     *row_pointers, row;
 	unsigned int  y;
 	size_t		  row_bytes, offset ;
-	static ASImage 	 *im = NULL ;
+	/* not static - images are loaded from several threads at once 
+	 * (see ASImageListLoader), volatile keeps it valid after longjmp : */
+	ASImage *volatile im = NULL ;
 	int old_storage_block_size;
 	START_TIME(started);
 
@@ -1621,7 +2643,7 @@ static void asim_png_read_data(png_structp png_ptr, png_bytep data, png_size_t l
 ASImage *
 PNGBuff2ASimage(CARD8 *buffer, ASImageImportParams *params)
 {
-   static ASImage *im = NULL;
+   ASImage *im = NULL;
    ASImPNGReadBuffer buf;
    buf.buffer = buffer;
    im = png2ASImage_int((void*)&buf,(png_rw_ptr)asim_png_read_data, params);
@@ -1633,7 +2655,7 @@ ASImage *
 png2ASImage( const char * path, ASImageImportParams *params )
 {
    FILE *fp ;
-	static ASImage *im = NULL ;
+	ASImage *im = NULL ;
 
 	if ((fp = open_image_file(path)) == NULL)
 		return NULL;
@@ -1643,6 +2665,148 @@ png2ASImage( const char * path, ASImageImportParams *params )
 	fclose(fp);
 	return im;
 }
+
+/* progressive loading : */
+typedef struct ASPNGProgressiveData
+{
+	png_structp   png_ptr;
+	png_infop     info_ptr;
+	Bool 	      do_alpha, grayscale ;
+	int 		  passes ;
+	size_t		  row_bytes ;
+	png_bytep     rows ;                /* whole image, for interlaced files only */
+}ASPNGProgressiveData;
+
+static void
+png_progressive_info( png_structp png_ptr, png_infop info_ptr )
+{
+	ASImageProgressiveLoader *loader = (ASImageProgressiveLoader*)png_get_progressive_ptr( png_ptr );
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+	double        image_gamma = DEFAULT_PNG_IMAGE_GAMMA;
+	png_uint_32   width, height;
+	int           bit_depth, color_type, interlace_type;
+	int           intent;
+
+	png_get_IHDR (png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+	/* same transformations as png2ASImage_int() does, except that rows are 
+	 * always expanded to 8 bit per channel : */
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8 (png_ptr);
+	else if (bit_depth == 16)
+		png_set_strip_16 (png_ptr);
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+	{
+		png_set_expand (png_ptr);
+		color_type = PNG_COLOR_TYPE_RGB;
+	}
+	if( color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY )
+	{
+		if( png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+			png_set_expand(png_ptr);
+	}
+	if (png_get_sRGB (png_ptr, info_ptr, &intent))
+		png_set_gamma (png_ptr, loader->params.gamma, DEFAULT_PNG_IMAGE_GAMMA);
+	else if (png_get_gAMA (png_ptr, info_ptr, &image_gamma) && bit_depth >= 8)
+		png_set_gamma (png_ptr, loader->params.gamma, image_gamma);
+	else
+		png_set_gamma (png_ptr, loader->params.gamma, DEFAULT_PNG_IMAGE_GAMMA);
+
+	png->passes = png_set_interlace_handling (png_ptr);
+	png_read_update_info (png_ptr, info_ptr);
+	png_get_IHDR (png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+
+	png->do_alpha = ((color_type & PNG_COLOR_MASK_ALPHA) != 0 );
+	png->grayscale = ( color_type == PNG_COLOR_TYPE_GRAY_ALPHA ||
+					   color_type == PNG_COLOR_TYPE_GRAY) ;
+	png->row_bytes = png_get_rowbytes (png_ptr, info_ptr);
+	if( !start_progressive_output( loader, width, height ) )
+		png_error( png_ptr, "invalid image size" );
+	if( png->passes > 1 )
+		png->rows = safecalloc( height, png->row_bytes );
+}
+
+static void
+flush_png_progressive_rows( ASImageProgressiveLoader *loader, unsigned int rows )
+{
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+	if( rows > loader->im->height )
+		rows = loader->im->height ;
+	while( loader->rows_done < rows )
+		output_progressive_row( loader, png->rows+loader->rows_done*png->row_bytes, png->grayscale, png->do_alpha );
+}
+
+static void
+png_progressive_row( png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass )
+{
+	ASImageProgressiveLoader *loader = (ASImageProgressiveLoader*)png_get_progressive_ptr( png_ptr );
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+
+	if( png->passes <= 1 )
+	{
+		if( new_row )
+			output_progressive_row( loader, new_row, png->grayscale, png->do_alpha );
+	}else
+	{
+		if( new_row )
+			png_progressive_combine_row( png_ptr, png->rows+row_num*png->row_bytes, new_row );
+		/* during the last pass - rows up to this one are not going to change : */
+		if( pass == png->passes-1 )
+			flush_png_progressive_rows( loader, row_num+1 );
+	}
+}
+
+static void
+png_progressive_end( png_structp png_ptr, png_infop info_ptr )
+{
+	ASImageProgressiveLoader *loader = (ASImageProgressiveLoader*)png_get_progressive_ptr( png_ptr );
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+	if( png->passes > 1 )
+		flush_png_progressive_rows( loader, loader->im->height );
+	loader->complete = True ;
+}
+
+static int
+feed_png_progressive( ASImageProgressiveLoader *loader, const CARD8 *data, size_t size )
+{
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+	if( setjmp (png_jmpbuf(png->png_ptr)) )
+	{
+		loader->failed = True ;
+		return -1;
+	}
+	png_process_data( png->png_ptr, png->info_ptr, (png_bytep)data, size );
+	return loader->rows_done ;
+}
+
+static void
+free_png_progressive( ASImageProgressiveLoader *loader )
+{
+	ASPNGProgressiveData *png = (ASPNGProgressiveData*)loader->data ;
+	png_destroy_read_struct (&(png->png_ptr), &(png->info_ptr), (png_infopp) NULL);
+	if( png->rows )
+		free( png->rows );
+	free( png );
+}
+
+static Bool
+start_png_progressive( ASImageProgressiveLoader *loader )
+{
+	ASPNGProgressiveData *png = safecalloc( 1, sizeof(ASPNGProgressiveData));
+	if((png->png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) != NULL )
+	{
+		if( (png->info_ptr = png_create_info_struct (png->png_ptr)) != NULL )
+		{
+			png_set_progressive_read_fn( png->png_ptr, loader, png_progressive_info, png_progressive_row, png_progressive_end );
+			loader->data = png ;
+			loader->feed = feed_png_progressive ;
+			loader->free_data = free_png_progressive ;
+			return True;
+		}
+		png_destroy_read_struct (&(png->png_ptr), NULL, NULL);
+	}
+	free( png );
+	return False;
+}
 #else 			/* PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG PNG */
 ASImage *
 png2ASImage( const char * path, ASImageImportParams *params )
@@ -1682,6 +2846,58 @@ my_error_exit (j_common_ptr cinfo)
 	longjmp (myerr->setjmp_buffer, 1);
 }
 
+static void
+set_jpeg_decompress_params( struct jpeg_decompress_struct *cinfo, ASImageImportParams *params )
+{
+	/* Adjust default decompression parameters */
+	cinfo->quantize_colors = FALSE;		       /* we don't want no stinking colormaps ! */
+	cinfo->output_gamma = params->gamma;
+	
+	if( get_flags( params->flags, AS_IMPORT_SCALED_BOTH ) == AS_IMPORT_SCALED_BOTH )
+	{
+		int w = params->width ; 
+		int h = params->height ;
+		int ratio ; 
+
+		if( w == 0 )
+		{
+			if( h == 0 ) 
+			{
+				w = cinfo->image_width ; 
+				h = cinfo->image_height ; 
+			}else
+				w = (cinfo->image_width * h)/cinfo->image_height ;
+		}else if( h == 0 )
+			h = (cinfo->image_height * w)/cinfo->image_width ;
+		
+		ratio = cinfo->image_height/h ; 
+		if( ratio > (int)cinfo->image_width/w )
+			ratio = cinfo->image_width/w ; 
+		
+		cinfo->scale_num = 1 ; 
+		/* only supported values are 1, 2, 4, and 8 */
+		cinfo->scale_denom = 1 ; 
+		if( ratio >= 2 ) 
+		{
+			if( ratio >= 4 ) 
+			{
+				if( ratio >= 8 ) 
+					cinfo->scale_denom = 8 ; 
+				else
+					cinfo->scale_denom = 4 ; 
+			}else
+				cinfo->scale_denom = 2 ; 
+		}
+	}
+	
+	if( get_flags( params->flags, AS_IMPORT_FAST ) )
+	{/* this does not really makes much of a difference */
+		cinfo->do_fancy_upsampling = FALSE ; 
+		cinfo->do_block_smoothing = FALSE ; 
+		cinfo->dct_method = JDCT_IFAST ; 
+	}
+}
+
 ASImage *
 jpeg2ASImage( const char * path, ASImageImportParams *params )
 {
@@ -1740,54 +2956,8 @@ jpeg2ASImage( const char * path, ASImageImportParams *params )
 	 */
 
 	/* Step 4: set parameters for decompression */
-	/* Adjust default decompression parameters */
-	cinfo.quantize_colors = FALSE;		       /* we don't want no stinking colormaps ! */
-	cinfo.output_gamma = params->gamma;
-	
-	if( get_flags( params->flags, AS_IMPORT_SCALED_BOTH ) == AS_IMPORT_SCALED_BOTH )
-	{
-		int w = params->width ; 
-		int h = params->height ;
-		int ratio ; 
+	set_jpeg_decompress_params( &cinfo, params );
 
-		if( w == 0 )
-		{
-			if( h == 0 ) 
-			{
-				w = cinfo.image_width ; 
-				h = cinfo.image_height ; 
-			}else
-				w = (cinfo.image_width * h)/cinfo.image_height ;
-		}else if( h == 0 )
-			h = (cinfo.image_height * w)/cinfo.image_width ;
-		
-		ratio = cinfo.image_height/h ; 
-		if( ratio > (int)cinfo.image_width/w )
-			ratio = cinfo.image_width/w ; 
-		
-		cinfo.scale_num = 1 ; 
-		/* only supported values are 1, 2, 4, and 8 */
-		cinfo.scale_denom = 1 ; 
-		if( ratio >= 2 ) 
-		{
-			if( ratio >= 4 ) 
-			{
-				if( ratio >= 8 ) 
-					cinfo.scale_denom = 8 ; 
-				else
-					cinfo.scale_denom = 4 ; 
-			}else
-				cinfo.scale_denom = 2 ; 
-		}
-	}
-	
-	if( get_flags( params->flags, AS_IMPORT_FAST ) )
-	{/* this does not really makes much of a difference */
-		cinfo.do_fancy_upsampling = FALSE ; 
-		cinfo.do_block_smoothing = FALSE ; 
-		cinfo.dct_method = JDCT_IFAST ; 
-	}
-	
 	/* Step 5: Start decompressor */
 	(void)jpeg_start_decompress (&cinfo);
 	LOCAL_DEBUG_OUT("stored image size %dx%d", cinfo.output_width,  cinfo.output_height);
@@ -1869,6 +3039,168 @@ jpeg2ASImage( const char * path, ASImageImportParams *params )
 	LOCAL_DEBUG_OUT("done loading JPEG image \"%s\"", path);
 	return im ;
 }
+
+/* progressive loading - libjpeg supports it via suspending data source : */
+#define JPEG_PROGRESSIVE_HEADER		0
+#define JPEG_PROGRESSIVE_START		1
+#define JPEG_PROGRESSIVE_ROWS		2
+#define JPEG_PROGRESSIVE_FINISH		3
+
+typedef struct ASJPEGProgressiveData
+{
+	struct jpeg_decompress_struct cinfo;
+	struct my_error_mgr jerr;
+	struct jpeg_source_mgr src;
+	CARD8 		 *buffer ;                  /* data fed in, but not consumed yet */
+	size_t 		  buffer_size ;
+	size_t 		  skip ;                    /* bytes to skip as soon as they arrive */
+	JSAMPARRAY    row;
+	int 		  state ;
+}ASJPEGProgressiveData;
+
+METHODDEF (void)
+jpeg_progressive_init_source (j_decompress_ptr cinfo)
+{
+}
+
+METHODDEF (boolean)
+jpeg_progressive_fill_input_buffer (j_decompress_ptr cinfo)
+{
+	return FALSE ;                             /* suspend until more data is fed in */
+}
+
+METHODDEF (void)
+jpeg_progressive_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+	ASJPEGProgressiveData *jpeg = (ASJPEGProgressiveData*)cinfo->client_data ;
+	if( num_bytes <= 0 )
+		return;
+	if( (size_t)num_bytes > jpeg->src.bytes_in_buffer )
+	{
+		jpeg->skip += num_bytes - jpeg->src.bytes_in_buffer ;
+		jpeg->src.next_input_byte += jpeg->src.bytes_in_buffer ;
+		jpeg->src.bytes_in_buffer = 0 ;
+	}else
+	{
+		jpeg->src.next_input_byte += num_bytes ;
+		jpeg->src.bytes_in_buffer -= num_bytes ;
+	}
+}
+
+METHODDEF (void)
+jpeg_progressive_term_source (j_decompress_ptr cinfo)
+{
+}
+
+static int
+feed_jpeg_progressive( ASImageProgressiveLoader *loader, const CARD8 *data, size_t size )
+{
+	ASJPEGProgressiveData *jpeg = (ASJPEGProgressiveData*)loader->data ;
+	struct jpeg_decompress_struct *cinfo = &(jpeg->cinfo);
+	size_t left = jpeg->src.bytes_in_buffer ;
+
+	if( jpeg->skip > 0 )
+	{
+		size_t skip = MIN(jpeg->skip,size);
+		data += skip ;
+		size -= skip ;
+		jpeg->skip -= skip ;
+	}
+	/* libjpeg backs up to the start of whatever it failed to read completely, 
+	 * so unconsumed data has to be kept in front of new data : */
+	if( left > 0 && jpeg->src.next_input_byte != jpeg->buffer )
+		memmove( jpeg->buffer, jpeg->src.next_input_byte, left );
+	if( left+size > jpeg->buffer_size )
+	{
+		jpeg->buffer_size = left+size ;
+		jpeg->buffer = realloc( jpeg->buffer, jpeg->buffer_size );
+	}
+	if( size > 0 )
+		memcpy( jpeg->buffer+left, data, size );
+	jpeg->src.next_input_byte = jpeg->buffer ;
+	jpeg->src.bytes_in_buffer = left+size ;
+
+	if (setjmp (jpeg->jerr.setjmp_buffer))
+	{
+		loader->failed = True ;
+		return -1;
+	}
+	switch( jpeg->state )
+	{
+		case JPEG_PROGRESSIVE_HEADER :
+			if( jpeg_read_header (cinfo, TRUE) == JPEG_SUSPENDED )
+				break;
+			set_jpeg_decompress_params( cinfo, &(loader->params) );
+			jpeg->state = JPEG_PROGRESSIVE_START ;
+			/* fall through */
+		case JPEG_PROGRESSIVE_START :
+			if( !jpeg_start_decompress (cinfo) )
+				break;
+			LOCAL_DEBUG_OUT("stored image size %dx%d", cinfo->output_width,  cinfo->output_height);
+			if( !start_progressive_output( loader, cinfo->output_width, cinfo->output_height ) )
+			{
+				loader->failed = True ;
+				return -1;
+			}
+			jpeg->row = cinfo->mem->alloc_sarray((j_common_ptr) cinfo, JPOOL_IMAGE,
+												 cinfo->output_width * cinfo->output_components, 1);
+			jpeg->state = JPEG_PROGRESSIVE_ROWS ;
+			/* fall through */
+		case JPEG_PROGRESSIVE_ROWS :
+			while( cinfo->output_scanline < cinfo->output_height )
+			{
+				if( jpeg_read_scanlines (cinfo, jpeg->row, 1) != 1 )
+					return loader->rows_done;
+				output_progressive_row( loader, (CARD8*)jpeg->row[0], (cinfo->output_components==1), False );
+			}
+			jpeg->state = JPEG_PROGRESSIVE_FINISH ;
+			/* fall through */
+		case JPEG_PROGRESSIVE_FINISH :
+			if( !jpeg_finish_decompress (cinfo) )
+				break;
+			loader->complete = True ;
+			break;
+	}
+	return loader->rows_done;
+}
+
+static void
+free_jpeg_progressive( ASImageProgressiveLoader *loader )
+{
+	ASJPEGProgressiveData *jpeg = (ASJPEGProgressiveData*)loader->data ;
+	jpeg_destroy_decompress (&(jpeg->cinfo));
+	if( jpeg->buffer )
+		free( jpeg->buffer );
+	free( jpeg );
+}
+
+static Bool
+start_jpeg_progressive( ASImageProgressiveLoader *loader )
+{
+	ASJPEGProgressiveData *jpeg = safecalloc( 1, sizeof(ASJPEGProgressiveData));
+
+	jpeg->cinfo.err = jpeg_std_error (&(jpeg->jerr.pub));
+	jpeg->jerr.pub.error_exit = my_error_exit;
+	if (setjmp (jpeg->jerr.setjmp_buffer))
+	{
+		jpeg_destroy_decompress (&(jpeg->cinfo));
+		free( jpeg );
+		return False;
+	}
+	jpeg_create_decompress (&(jpeg->cinfo));
+	jpeg->cinfo.client_data = jpeg ;
+	jpeg->src.init_source = jpeg_progressive_init_source;
+	jpeg->src.fill_input_buffer = jpeg_progressive_fill_input_buffer;
+	jpeg->src.skip_input_data = jpeg_progressive_skip_input_data;
+	jpeg->src.resync_to_restart = jpeg_resync_to_restart;
+	jpeg->src.term_source = jpeg_progressive_term_source;
+	jpeg->cinfo.src = &(jpeg->src);
+
+	loader->data = jpeg ;
+	loader->feed = feed_jpeg_progressive ;
+	loader->free_data = free_jpeg_progressive ;
+	return True;
+}
 #else 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 ASImage *
 jpeg2ASImage( const char * path, ASImageImportParams *params )
@@ -1880,6 +3212,151 @@ jpeg2ASImage( const char * path, ASImageImportParams *params )
 #endif 			/* JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG JPEG */
 /***********************************************************************************/
 
+/***********************************************************************************/
+/* Progressive loading interface :                                                 */
+ASImageProgressiveLoader *
+start_progressive_image_loading( ASImageFileTypes type, ASImageImportParams *params )
+{
+	ASImageProgressiveLoader *loader = safecalloc( 1, sizeof(ASImageProgressiveLoader));
+	Bool success = False ;
+
+	if( params )
+		loader->params = *params ;
+	else
+		init_asimage_import_params( &(loader->params) );
+	loader->params.search_path = NULL ;
+	if( loader->params.gamma == 0. )
+		loader->params.gamma = SCREEN_GAMMA ;
+	loader->type = type ;
+
+	switch( type )
+	{
+#ifdef HAVE_PNG
+		case ASIT_Png :
+			success = start_png_progressive( loader );
+			break;
+#endif
+#ifdef HAVE_JPEG
+		case ASIT_Jpeg :
+			success = start_jpeg_progressive( loader );
+			break;
+#endif
+		default:
+			break;
+	}
+	if( !success )
+	{
+		free( loader );
+		loader = NULL ;
+	}
+	return loader;
+}
+
+int
+feed_progressive_image_loader( ASImageProgressiveLoader *loader, const void *data, size_t size )
+{
+	if( loader == NULL || loader->failed )
+		return -1;
+	if( loader->complete || size == 0 || data == NULL )
+		return loader->rows_done;
+	return loader->feed( loader, (const CARD8*)data, size );
+}
+
+ASImage *
+get_progressive_image( ASImageProgressiveLoader *loader, unsigned int *rows_done )
+{
+	if( rows_done )
+		*rows_done = loader?loader->rows_done:0 ;
+	return loader?loader->im:NULL ;
+}
+
+Bool
+is_progressive_image_complete( ASImageProgressiveLoader *loader )
+{
+	return (loader != NULL && loader->complete && !loader->failed);
+}
+
+ASImage *
+finish_progressive_image_loading( ASImageProgressiveLoader **ploader )
+{
+	ASImageProgressiveLoader *loader ;
+	ASImage *im = NULL ;
+
+	if( ploader == NULL || (loader = *ploader) == NULL )
+		return NULL;
+
+	if( loader->imout )
+	{
+		stop_image_output( &(loader->imout) );
+		free_scanline( &(loader->buf), True );
+	}
+	if( loader->free_data )
+		loader->free_data( loader );
+	im = loader->im ;
+	if( im != NULL && (!loader->complete || loader->failed) )
+		destroy_asimage( &im );
+	if( loader->fp )
+		fclose( loader->fp );
+	free( loader );
+	*ploader = NULL ;
+	return im;
+}
+
+ASImageProgressiveLoader *
+open_progressive_image_file( const char *file, ASImageImportParams *params )
+{
+	ASImageProgressiveLoader *loader = NULL ;
+	ASImageImportParams dummy_iparams = {0};
+	char *realfilename ;
+
+	if( params == NULL )
+		params = &dummy_iparams ;
+
+	if( (realfilename = locate_image_file_in_path( file, params )) != NULL )
+	{
+		ASImageFileTypes file_type = check_image_type( realfilename );
+		FILE *fp ;
+		char *g_var = getenv( "SCREEN_GAMMA" );
+		if( g_var != NULL )
+			params->gamma = atof(g_var);
+
+		if( (loader = start_progressive_image_loading( file_type, params )) != NULL )
+		{
+			if( (fp = open_image_file( realfilename )) == NULL )
+				finish_progressive_image_loading( &loader );
+			else
+				loader->fp = fp ;
+		}
+		free( realfilename );
+	}
+	return loader;
+}
+
+int
+continue_progressive_image_file( ASImageProgressiveLoader *loader, size_t max_bytes )
+{
+	CARD8 buffer[16*1024] ;
+	size_t total = 0 ;
+	int res ;
+
+	if( loader == NULL || loader->fp == NULL )
+		return -1;
+	res = loader->rows_done ;
+	while( total < max_bytes && !loader->complete )
+	{
+		size_t bytes = fread( buffer, 1, MIN(sizeof(buffer),max_bytes-total), loader->fp );
+		if( bytes == 0 )
+		{/* truncated file */
+			loader->failed = True ;
+			return -1;
+		}
+		total += bytes ;
+		if( (res = feed_progressive_image_loader( loader, buffer, bytes )) < 0 )
+			break;
+	}
+	return res;
+}
+
 /***********************************************************************************/
 /* XCF - GIMP's native file format : 											   */
 
@@ -2201,7 +3678,7 @@ tiff2ASImage( const char * path, ASImageImportParams *params )
 {
 	TIFF 		 *tif ;
 
-	static ASImage 	 *im = NULL ;
+	ASImage 	 *im = NULL ;
 	CARD32 *data;
 	int data_size;
 	CARD32 width = 1, height = 1;
@@ -2919,3 +4396,214 @@ argb2ASImage( const char *path, ASImageImportParams *params )
 	return im ;
 }
 
+
+#ifdef TEST_IMPORT
+/* Progressive loaders must produce exactly the same image as the regular 
+ * ones, no matter how data is split into pieces. Test files are written 
+ * out with libjpeg/libpng directly, since export code does not produce 
+ * progressive JPEG or interlaced PNG : */
+#define IMPORT_TEST_WIDTH	97
+#define IMPORT_TEST_HEIGHT	61
+
+static CARD8
+import_test_value( int x, int y, int c )
+{
+	/* smooth gradients with some sharp edges thrown in : */
+	return (CARD8)((((x/9+y/7)&1)? 255-x*2 : x+y*3) + c*70) ;
+}
+
+static Bool
+test_images_identical( ASImage *a, ASImage *b )
+{
+	ASImageDecoder *da, *db ;
+	Bool same = True ;
+	int y, c ;
+
+	if( a == NULL || b == NULL )
+		return False;
+	if( a->width != b->width || a->height != b->height )
+		return False;
+	da = start_image_decoding( NULL, a, SCL_DO_ALL, 0, 0, a->width, a->height, NULL );
+	db = start_image_decoding( NULL, b, SCL_DO_ALL, 0, 0, b->width, b->height, NULL );
+	for( y = 0 ; y < (int)a->height && same ; ++y )
+	{
+		da->decode_image_scanline( da );
+		db->decode_image_scanline( db );
+		for( c = 0 ; c < IC_NUM_CHANNELS && same ; ++c )
+			same = (memcmp( da->buffer.channels[c], db->buffer.channels[c], a->width*sizeof(CARD32) ) == 0) ;
+	}
+	stop_image_decoding( &da );
+	stop_image_decoding( &db );
+	return same;
+}
+
+#ifdef HAVE_JPEG
+static Bool
+write_progressive_jpeg( const char *path )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	JSAMPLE row[IMPORT_TEST_WIDTH*3] ;
+	JSAMPROW rows[1] = { &row[0] };
+	FILE *fp ;
+	int x, y ;
+
+	if( (fp = fopen( path, "wb" )) == NULL )
+		return False;
+	cinfo.err = jpeg_std_error (&jerr);
+	jpeg_create_compress (&cinfo);
+	jpeg_stdio_dest (&cinfo, fp);
+	cinfo.image_width = IMPORT_TEST_WIDTH ;
+	cinfo.image_height = IMPORT_TEST_HEIGHT ;
+	cinfo.input_components = 3 ;
+	cinfo.in_color_space = JCS_RGB ;
+	jpeg_set_defaults (&cinfo);
+	jpeg_set_quality (&cinfo, 90, TRUE);
+	jpeg_simple_progression (&cinfo);
+	jpeg_start_compress (&cinfo, TRUE);
+	for( y = 0 ; y < IMPORT_TEST_HEIGHT ; ++y )
+	{
+		for( x = 0 ; x < IMPORT_TEST_WIDTH*3 ; ++x )
+			row[x] = import_test_value( x/3, y, x%3 );
+		jpeg_write_scanlines (&cinfo, rows, 1);
+	}
+	jpeg_finish_compress (&cinfo);
+	jpeg_destroy_compress (&cinfo);
+	fclose( fp );
+	return True;
+}
+#endif
+
+#ifdef HAVE_PNG
+static Bool
+write_interlaced_png( const char *path )
+{
+	png_structp png_ptr ;
+	png_infop info_ptr ;
+	png_byte row[IMPORT_TEST_WIDTH*4] ;
+	FILE *fp ;
+	int x, y, pass, passes ;
+
+	if( (fp = fopen( path, "wb" )) == NULL )
+		return False;
+	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct (png_ptr);
+	if( setjmp (png_jmpbuf (png_ptr)) )
+	{
+		png_destroy_write_struct (&png_ptr, &info_ptr);
+		fclose( fp );
+		return False;
+	}
+	png_init_io (png_ptr, fp);
+	png_set_IHDR (png_ptr, info_ptr, IMPORT_TEST_WIDTH, IMPORT_TEST_HEIGHT, 8,
+				  PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_ADAM7, 
+				  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info (png_ptr, info_ptr);
+	passes = png_set_interlace_handling (png_ptr);
+	for( pass = 0 ; pass < passes ; ++pass )
+		for( y = 0 ; y < IMPORT_TEST_HEIGHT ; ++y )
+		{
+			for( x = 0 ; x < IMPORT_TEST_WIDTH*4 ; ++x )
+				row[x] = import_test_value( x/4, y, x%4 );
+			png_write_row (png_ptr, row);
+		}
+	png_write_end (png_ptr, info_ptr);
+	png_destroy_write_struct (&png_ptr, &info_ptr);
+	fclose( fp );
+	return True;
+}
+#endif
+
+/* feeds whole file in pieces of chunk_size bytes, and checks that rows 
+ * only ever get added, and that result matches regular loader : */
+static Bool
+test_progressive_loading( ASImageFileTypes type, const char *path, ASImage *ref, size_t chunk_size )
+{
+	ASImageProgressiveLoader *loader ;
+	ASImage *im ;
+	char *data ;
+	long size = -1, offset = 0 ;
+	int rows = 0, res ;
+	Bool ok = True ;
+
+	if( (data = load_binary_file( path, &size )) == NULL )
+		return False;
+	if( (loader = start_progressive_image_loading( type, NULL )) == NULL )
+	{
+		free( data );
+		return False;
+	}
+	while( offset < size && ok )
+	{
+		size_t bytes = MIN( chunk_size, (size_t)(size-offset) );
+		res = feed_progressive_image_loader( loader, data+offset, bytes );
+		ok = (res >= rows && res <= (int)ref->height) ;
+		rows = res ;
+		offset += bytes ;
+	}
+	ok = ok && is_progressive_image_complete( loader ) && rows == (int)ref->height ;
+	im = finish_progressive_image_loading( &loader );
+	ok = ok && test_images_identical( ref, im );
+	if( im )
+		destroy_asimage( &im );
+	free( data );
+	return ok;
+}
+
+int main(int argc, char **argv )
+{
+	static struct
+	{
+		ASImageFileTypes type ;
+		char *name, *path ;
+		Bool (*write_file)( const char *path );
+		ASImage *(*load_file)( const char *path, ASImageImportParams *params );
+	}tests[] = 
+	{
+#ifdef HAVE_JPEG
+		{ ASIT_Jpeg, "progressive JPEG", "test_import.jpg", write_progressive_jpeg, jpeg2ASImage },
+#endif
+#ifdef HAVE_PNG
+		{ ASIT_Png, "interlaced PNG", "test_import.png", write_interlaced_png, png2ASImage },
+#endif
+		{ ASIT_Unknown, NULL, NULL, NULL, NULL }
+	};
+	static size_t chunk_sizes[] = { 1, 7, 100, 4096, 1024*1024, 0 };
+	ASImageImportParams params ;
+	int t, c, failed = 0 ;
+
+	set_output_threshold( 10 );
+	init_asimage_import_params( &params );
+	params.gamma = SCREEN_GAMMA ;
+
+	for( t = 0 ; tests[t].name != NULL ; ++t )
+	{
+		ASImage *ref = NULL ;
+
+		fprintf( stderr, "Testing %s regular loading ...", tests[t].name );
+		if( tests[t].write_file( tests[t].path ) )
+			ref = tests[t].load_file( tests[t].path, &params );
+		fprintf( stderr, "%s\n", (ref != NULL)?"success":"FAILED" );
+		if( ref == NULL )
+		{
+			++failed ;
+			unlink( tests[t].path );
+			continue;
+		}
+		for( c = 0 ; chunk_sizes[c] > 0 ; ++c )
+		{
+			Bool ok ;
+			fprintf( stderr, "Testing %s progressive loading in %d byte pieces ...", tests[t].name, (int)chunk_sizes[c] );
+			ok = test_progressive_loading( tests[t].type, tests[t].path, ref, chunk_sizes[c] );
+			fprintf( stderr, "%s\n", ok?"success":"FAILED" );
+			if( !ok )
+				++failed ;
+		}
+		destroy_asimage( &ref );
+		unlink( tests[t].path );
+	}
+	if( failed )
+		fprintf( stderr, "%d tests FAILED\n", failed );
+	return (failed > 0)?1:0;
+}
+#endif
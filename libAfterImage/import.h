@@ -138,6 +138,8 @@ typedef struct ASImageImportParams
 	int 			return_animation_repeats ;
 }ASImageImportParams;
 
+void init_asimage_import_params( ASImageImportParams *iparams );
+
 typedef ASImage* (*as_image_loader_func)( const char * path, ASImageImportParams *params );
 extern as_image_loader_func as_image_file_loaders[ASIT_Unknown];
 
@@ -232,6 +234,52 @@ ASImage *get_thumbnail_asimage( ASImageManager* imageman, const char *file, int
 
 ASImageFileTypes check_asimage_file_type( const char *realfilename );
 
+/****s* libAfterImage/import/ASImageDecodeCacheStats
+ * NAME
+ * ASImageDecodeCacheStats
+ * DESCRIPTION
+ * Counters of decoded images cache usage in this process, along with 
+ * the size of the cache on disk as of the last time we looked at it.
+ * SOURCE
+ */
+typedef struct ASImageDecodeCacheStats
+{
+	unsigned long hits, misses ;	/* images looked up in the cache */
+	unsigned long stored, evicted ;	/* images written to/removed from it */
+	size_t 		  size, max_size ;	/* bytes used on disk and the limit */
+}ASImageDecodeCacheStats;
+/*************/
+
+/****f* libAfterImage/import/set_asimage_decode_cache()
+ * NAME
+ * set_asimage_decode_cache() - enable persistent cache of decoded images.
+ * get_asimage_decode_cache_stats()
+ * SYNOPSIS
+ * Bool set_asimage_decode_cache( const char *dir, size_t max_size );
+ * void get_asimage_decode_cache_stats( ASImageDecodeCacheStats *stats );
+ * INPUTS
+ * dir          - existing directory to keep cached images in. NULL
+ *                disables the cache.
+ * max_size     - size in bytes the cache is trimmed to, when it grows
+ *                beyond it. 0 means default of 64Mb.
+ * stats        - pointer to the structure to fill with usage counters.
+ * RETURN VALUE
+ * set_asimage_decode_cache() returns True if dir could be used.
+ * DESCRIPTION
+ * Once enabled, every image loaded by file2ASImage_extra() and functions 
+ * using it, is saved into dir exactly as it is kept in memory - RLE 
+ * compressed. Next time the same file is requested with the same size, 
+ * gamma, channels and compression - even from other process - cached data
+ * is mapped into memory and copied into new ASImage, without decoding 
+ * original file. Cached images are keyed by real filename, its mtime and 
+ * size, so changed files are decoded again. Least recently used cached 
+ * images are removed when total size exceeds max_size.
+ * XML scripts and GIF files are never cached, nor are images loaded 
+ * with explicit gamma_table, or into any format other then ASA_ASImage.
+ *********/
+Bool set_asimage_decode_cache( const char *dir, size_t max_size );
+void get_asimage_decode_cache_stats( ASImageDecodeCacheStats *stats );
+
 
 Bool reload_asimage_manager( ASImageManager *imman );
 
@@ -255,6 +303,183 @@ void destroy_asimage_list( ASImageListEntry **plist );
 char *format_asimage_list_entry_details( ASImageListEntry *entry, Bool vertical );
 Bool load_asimage_list_entry_data( ASImageListEntry *entry, size_t max_bytes );
 
+/****f* libAfterImage/import/create_asimage_list_loader()
+ * NAME
+ * create_asimage_list_loader() - start pool of threads loading previews 
+ * for image list entries in the background.
+ * destroy_asimage_list_loader()
+ * SYNOPSIS
+ * ASImageListLoader *create_asimage_list_loader( struct ASVisual *asv, 
+ *                                   ASFlagType preview_type, double gamma,
+ *                                   unsigned int preview_width, 
+ *                                   unsigned int preview_height,
+ *                                   unsigned int preview_compression,
+ *                                   int threads_num );
+ * void destroy_asimage_list_loader( ASImageListLoader **ploader );
+ * INPUTS
+ * asv          - pointer to valid ASVisual structure.
+ * preview_type, gamma, preview_width, preview_height, preview_compression 
+ *              - define preview size, same as for get_asimage_list().
+ * threads_num  - number of worker threads to start. 0 or less selects
+ *                number of online CPUs.
+ * DESCRIPTION
+ * Loader decodes images of entries queued with 
+ * queue_asimage_list_preview(), highest priority first, on its worker 
+ * threads. Formats which decoders are not thread-safe (XPM, GIF, XML,
+ * SVG) are loaded from collect_asimage_list_previews() instead, one at a 
+ * time. Loaded previews are only attached to entries from 
+ * collect_asimage_list_previews(), so entries are never modified by 
+ * worker threads. Queued entries are referenced, so it is safe to 
+ * destroy image list while loading is still in progress.
+ * If libAfterImage was built without POSIX threads support - all the 
+ * images are loaded from collect_asimage_list_previews().
+ * destroy_asimage_list_loader() stops all the threads, discarding 
+ * anything still pending.
+ *********/
+/****f* libAfterImage/import/queue_asimage_list_preview()
+ * NAME
+ * queue_asimage_list_preview()
+ * cancel_asimage_list_previews()
+ * SYNOPSIS
+ * Bool queue_asimage_list_preview( ASImageListLoader *loader, 
+ *                                  ASImageListEntry *entry, int priority );
+ * int  cancel_asimage_list_previews( ASImageListLoader *loader, 
+ *                                    ASImageListEntry *entry );
+ * INPUTS
+ * entry        - entry to load preview for. For cancel - NULL means all.
+ * priority     - entries with higher priority are loaded first. Entries
+ *                with the same priority are loaded in order of queuing.
+ * RETURN VALUE
+ * queue_asimage_list_preview() returns False if entry already has 
+ * preview, or its file type cannot be loaded.
+ * cancel_asimage_list_previews() returns number of cancelled entries.
+ * DESCRIPTION
+ * Queuing entry that is already queued changes its priority, so 
+ * application can bump priority of entries that scrolled into view. 
+ * Cancelled entries that are being loaded right now, are discarded once
+ * loading completes.
+ *********/
+/****f* libAfterImage/import/collect_asimage_list_previews()
+ * NAME
+ * collect_asimage_list_previews()
+ * get_asimage_list_loader_fd()
+ * wait_asimage_list_previews()
+ * SYNOPSIS
+ * int collect_asimage_list_previews( ASImageListLoader *loader, 
+ *                                    ASImageListPreviewFunc func, 
+ *                                    void *data );
+ * int get_asimage_list_loader_fd( ASImageListLoader *loader );
+ * int wait_asimage_list_previews( ASImageListLoader *loader, 
+ *                                 ASImageListPreviewFunc func, 
+ *                                 void *data );
+ * INPUTS
+ * func         - function to call for each entry that got its preview.
+ *                May be NULL.
+ * data         - pointer passed to func as is.
+ * RETURN VALUE
+ * Number of entries that got their previews.
+ * get_asimage_list_loader_fd() returns file descriptor that becomes 
+ * readable when collect_asimage_list_previews() has something to do, 
+ * or -1 if not available.
+ * DESCRIPTION
+ * Must be called from the thread that created the loader, to set 
+ * preview of all loaded entries. Meant to be called from the event 
+ * loop whenever file descriptor returned by 
+ * get_asimage_list_loader_fd() is readable. 
+ * wait_asimage_list_previews() loads all the queued images, using 
+ * calling thread as well, and waits for completion before collecting.
+ *********/
+typedef struct ASImageListLoader ASImageListLoader;
+typedef void (*ASImageListPreviewFunc)( ASImageListEntry *entry, void *data );
+
+ASImageListLoader *create_asimage_list_loader( struct ASVisual *asv, ASFlagType preview_type, double gamma,
+											   unsigned int preview_width, unsigned int preview_height,
+											   unsigned int preview_compression, int threads_num );
+void destroy_asimage_list_loader( ASImageListLoader **ploader );
+Bool queue_asimage_list_preview( ASImageListLoader *loader, ASImageListEntry *entry, int priority );
+int  cancel_asimage_list_previews( ASImageListLoader *loader, ASImageListEntry *entry );
+int  get_asimage_list_loader_fd( ASImageListLoader *loader );
+int  collect_asimage_list_previews( ASImageListLoader *loader, ASImageListPreviewFunc func, void *data );
+int  wait_asimage_list_previews( ASImageListLoader *loader, ASImageListPreviewFunc func, void *data );
+
+
+/****f* libAfterImage/import/start_progressive_image_loading()
+ * NAME
+ * start_progressive_image_loading() - create resumable decoder, that 
+ * accepts image data piece by piece.
+ * feed_progressive_image_loader()
+ * get_progressive_image()
+ * finish_progressive_image_loading()
+ * SYNOPSIS
+ * ASImageProgressiveLoader *start_progressive_image_loading( 
+ *                                     ASImageFileTypes type, 
+ *                                     ASImageImportParams *params );
+ * int  feed_progressive_image_loader( ASImageProgressiveLoader *loader, 
+ *                                     const void *data, size_t size );
+ * ASImage *get_progressive_image( ASImageProgressiveLoader *loader, 
+ *                                 unsigned int *rows_done );
+ * Bool is_progressive_image_complete( ASImageProgressiveLoader *loader );
+ * ASImage *finish_progressive_image_loading( 
+ *                                 ASImageProgressiveLoader **ploader );
+ * INPUTS
+ * type         - format of the data. Only ASIT_Png and ASIT_Jpeg are 
+ *                supported.
+ * params       - same as for file2ASImage_extra(). May be NULL. 
+ * data, size   - next piece of the file, of any size.
+ * RETURN VALUE
+ * start_progressive_image_loading() returns NULL if format does not 
+ * support progressive loading.
+ * feed_progressive_image_loader() returns number of image rows decoded 
+ * so far, or -1 if data is corrupted.
+ * get_progressive_image() returns NULL until image header is decoded,
+ * and image being decoded afterwards. Rows below *rows_done are not 
+ * decoded yet, and are empty. Image remains owned by the loader.
+ * finish_progressive_image_loading() returns decoded image, or NULL if
+ * it was not complete, in which case partially decoded image is 
+ * destroyed.
+ * DESCRIPTION
+ * Decoder state is kept in the loader, so that application can feed 
+ * data in as it arrives, for example from the event loop, and show 
+ * rows that have been decoded so far. Rows are written out in order, 
+ * using the same ASImageOutput as everything else. Interlaced PNG rows 
+ * are only written out after the last pass; progressive JPEG 
+ * has to be received in full before first row is available.
+ * GIF decoder cannot be suspended, and so is not supported.
+ *********/
+/****f* libAfterImage/import/open_progressive_image_file()
+ * NAME
+ * open_progressive_image_file()
+ * continue_progressive_image_file()
+ * SYNOPSIS
+ * ASImageProgressiveLoader *open_progressive_image_file( 
+ *                                     const char *file, 
+ *                                     ASImageImportParams *params );
+ * int continue_progressive_image_file( ASImageProgressiveLoader *loader,
+ *                                      size_t max_bytes );
+ * INPUTS
+ * file         - image file name, located same way file2ASImage_extra()
+ *                does it.
+ * max_bytes    - how much of the file to decode this time.
+ * RETURN VALUE
+ * open_progressive_image_file() returns NULL if file could not be found, 
+ * or its format does not support progressive loading.
+ * continue_progressive_image_file() returns number of image rows 
+ * decoded so far, or -1 if file is corrupted or truncated.
+ * DESCRIPTION
+ * Convenience functions to load file in small steps, such as one step 
+ * per event loop iteration. Loader must be destroyed with 
+ * finish_progressive_image_loading() as usual, which closes the file. 
+ *********/
+typedef struct ASImageProgressiveLoader ASImageProgressiveLoader;
+
+ASImageProgressiveLoader *start_progressive_image_loading( ASImageFileTypes type, ASImageImportParams *params );
+int  feed_progressive_image_loader( ASImageProgressiveLoader *loader, const void *data, size_t size );
+ASImage *get_progressive_image( ASImageProgressiveLoader *loader, unsigned int *rows_done );
+Bool is_progressive_image_complete( ASImageProgressiveLoader *loader );
+ASImage *finish_progressive_image_loading( ASImageProgressiveLoader **ploader );
+ASImageProgressiveLoader *open_progressive_image_file( const char *file, ASImageImportParams *params );
+int  continue_progressive_image_file( ASImageProgressiveLoader *loader, size_t max_bytes );
+
 
 /****f* libAfterImage/import/file2pixmap()
  * NAME
@@ -434,6 +434,10 @@ SOURCE=.\asstorage.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\asthread.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\asvisual.c
 # End Source File
 # Begin Source File
@@ -136,6 +136,7 @@ LIB32_OBJS= \
 	"$(INTDIR)\asfont.obj" \
 	"$(INTDIR)\asimage.obj" \
 	"$(INTDIR)\asstorage.obj" \
+	"$(INTDIR)\asthread.obj" \
 	"$(INTDIR)\asimagexml.obj" \
 	"$(INTDIR)\asvisual.obj" \
 	"$(INTDIR)\blender.obj" \
@@ -269,6 +270,7 @@ LIB32_OBJS= \
 	"$(INTDIR)\asfont.obj" \
 	"$(INTDIR)\asimage.obj" \
 	"$(INTDIR)\asstorage.obj" \
+	"$(INTDIR)\asthread.obj" \
 	"$(INTDIR)\asimagexml.obj" \
 	"$(INTDIR)\asvisual.obj" \
 	"$(INTDIR)\blender.obj" \
@@ -825,6 +827,10 @@ SOURCE=.\asstorage.c
 
 "$(INTDIR)\asstorage.obj" : $(SOURCE) "$(INTDIR)"
 
+SOURCE=.\asthread.c
+
+"$(INTDIR)\asthread.obj" : $(SOURCE) "$(INTDIR)"
+
 SOURCE=.\asimagexml.c
 
 "$(INTDIR)\asimagexml.obj" : $(SOURCE) "$(INTDIR)"
@@ -53,10 +53,19 @@
 #endif
 #include <math.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_MMX
 #include <mmintrin.h>
 #endif
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 #ifdef _WIN32
 # include "win32/afterbase.h"
@@ -68,6 +77,7 @@
 #include "asimage.h"
 #include "imencdec.h"
 #include "transform.h"
+#include "asthread.h"
 
 ASVisual __transform_fake_asv = {0};
 
@@ -110,6 +120,128 @@ ASVisual __transform_fake_asv = {0};
 #define AVERAGE_COLOR2(c1,c2)				(((c1)+(c2))<<(QUANT_ERR_BITS-1))
 #define AVERAGE_COLORN(T,N)					(((T)<<QUANT_ERR_BITS)/N)
 
+/* ******************************************************************************/
+/* SSE2/AVX2 helpers for scaling kernels below. Everything must produce exactly */
+/* the same results as plain C code, including unsigned wraparound in 			*/
+/* interpolation formulas, so divisions are done in double precision, which is */
+/* exact for the ranges we have here :											*/
+/* ******************************************************************************/
+#ifdef HAVE_SSE2
+#define SSE2_FUNC	__attribute__((target("sse2")))
+
+static inline SSE2_FUNC __m128i
+sse2_mullo_epi32( __m128i a, __m128i b )
+{
+	__m128i even = _mm_mul_epu32( a, b );
+	__m128i odd  = _mm_mul_epu32( _mm_srli_epi64( a, 32 ), _mm_srli_epi64( b, 32 ) );
+	return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE(0,0,2,0) ),
+							   _mm_shuffle_epi32( odd,  _MM_SHUFFLE(0,0,2,0) ) );
+}
+
+static inline SSE2_FUNC __m128d
+sse2_cvtepu32_pd( __m128i v )
+{
+	__m128d d = _mm_cvtepi32_pd( v );
+	return _mm_add_pd( d, _mm_and_pd( _mm_cmplt_pd( d, _mm_setzero_pd() ), _mm_set1_pd( 4294967296.0 ) ) );
+}
+
+/* result must fit into signed int - it always does since divisor >= 6 */
+static inline SSE2_FUNC __m128i
+sse2_div_epi32( __m128i num, __m128d divisor, Bool is_unsigned )
+{
+	__m128i hi_i = _mm_shuffle_epi32( num, _MM_SHUFFLE(1,0,3,2) );
+	__m128d lo = is_unsigned?sse2_cvtepu32_pd( num ):_mm_cvtepi32_pd( num );
+	__m128d hi = is_unsigned?sse2_cvtepu32_pd( hi_i ):_mm_cvtepi32_pd( hi_i );
+	return _mm_unpacklo_epi64( _mm_cvttpd_epi32( _mm_div_pd( lo, divisor ) ),
+							   _mm_cvttpd_epi32( _mm_div_pd( hi, divisor ) ) );
+}
+#endif
+
+#ifdef HAVE_AVX2
+#define AVX2_FUNC	__attribute__((target("avx2")))
+
+static inline AVX2_FUNC __m256d
+avx2_cvtepu32_pd( __m128i v )
+{
+	__m256d d = _mm256_cvtepi32_pd( v );
+	return _mm256_add_pd( d, _mm256_and_pd( _mm256_cmp_pd( d, _mm256_setzero_pd(), _CMP_LT_OQ ),
+											 _mm256_set1_pd( 4294967296.0 ) ) );
+}
+
+static inline AVX2_FUNC __m256i
+avx2_div_epi32( __m256i num, __m256d divisor, Bool is_unsigned )
+{
+	__m128i lo_i = _mm256_castsi256_si128( num );
+	__m128i hi_i = _mm256_extracti128_si256( num, 1 );
+	__m256d lo = is_unsigned?avx2_cvtepu32_pd( lo_i ):_mm256_cvtepi32_pd( lo_i );
+	__m256d hi = is_unsigned?avx2_cvtepu32_pd( hi_i ):_mm256_cvtepi32_pd( hi_i );
+	lo_i = _mm256_cvttpd_epi32( _mm256_div_pd( lo, divisor ) );
+	hi_i = _mm256_cvttpd_epi32( _mm256_div_pd( hi, divisor ) );
+	return _mm256_inserti128_si256( _mm256_castsi128_si256( lo_i ), hi_i, 1 );
+}
+#endif
+
+#ifdef HAVE_SSE2
+static SSE2_FUNC int
+enlarge_span_sse2( CARD32 *dst, int T, int step, int S )
+{
+	__m128i vT = _mm_add_epi32( _mm_set1_epi32( T ), sse2_mullo_epi32( _mm_set_epi32( 3, 2, 1, 0 ), _mm_set1_epi32( step ) ) );
+	__m128i vstep = _mm_set1_epi32( step<<2 );
+	__m128i ovf_mask = _mm_set1_epi32( 0x7F000000 );
+	__m128d vS = _mm_set1_pd( (double)S );
+	int n = 0 ;
+	for( ; n+4 <= S ; n += 4 )
+	{
+		__m128i ovf = _mm_cmpeq_epi32( _mm_and_si128( vT, ovf_mask ), _mm_setzero_si128() );
+		__m128i c = sse2_div_epi32( _mm_slli_epi32( vT, QUANT_ERR_BITS-1 ), vS, False );
+		_mm_storeu_si128( (__m128i*)(dst+n), _mm_and_si128( c, ovf ) );
+		vT = _mm_add_epi32( vT, vstep );
+	}
+	return n;
+}
+#endif
+#ifdef HAVE_AVX2
+static AVX2_FUNC int
+enlarge_span_avx2( CARD32 *dst, int T, int step, int S )
+{
+	__m256i vT = _mm256_add_epi32( _mm256_set1_epi32( T ), _mm256_mullo_epi32( _mm256_set_epi32( 7, 6, 5, 4, 3, 2, 1, 0 ), _mm256_set1_epi32( step ) ) );
+	__m256i vstep = _mm256_set1_epi32( step<<3 );
+	__m256i ovf_mask = _mm256_set1_epi32( 0x7F000000 );
+	__m256d vS = _mm256_set1_pd( (double)S );
+	int n = 0 ;
+	for( ; n+8 <= S ; n += 8 )
+	{
+		__m256i ovf = _mm256_cmpeq_epi32( _mm256_and_si256( vT, ovf_mask ), _mm256_setzero_si256() );
+		__m256i c = avx2_div_epi32( _mm256_slli_epi32( vT, QUANT_ERR_BITS-1 ), vS, False );
+		_mm256_storeu_si256( (__m256i*)(dst+n), _mm256_and_si256( c, ovf ) );
+		vT = _mm256_add_epi32( vT, vstep );
+	}
+	return n;
+}
+#endif
+
+/* computes span of S pixels of enlarge_component() :
+ * dst[n] = INTERPOLATE_N_COLOR(T+n*step,S) with overflow check, returns
+ * number of pixels done */
+static inline int
+enlarge_span_simd( CARD32 *dst, int T, int step, int S )
+{
+	int n = 0 ;
+#ifdef HAVE_AVX2
+	if( S >= 8 && asimage_avx2_supported() )
+	{
+		n = enlarge_span_avx2( dst, T, step, S );
+	}else
+#endif
+#ifdef HAVE_SSE2
+	if( S >= 4 && asimage_sse2_supported() )
+	{
+		n = enlarge_span_sse2( dst, T, step, S );
+	}
+#endif
+	return n;
+}
+
 static inline void
 enlarge_component12( register CARD32 *src, register CARD32 *dst, int *scales, int len )
 {/* expected len >= 2  */
@@ -233,7 +365,14 @@ enlarge_component( register CARD32 *src, register CARD32 *dst, int *scales, int
 /*		LOCAL_DEBUG_OUT( "pixel %d, S = %d, step = %d", i, S, step );*/
 		if( step )
 		{
-			register int n = 0 ;
+			register int n = enlarge_span_simd( dst, T, step, S ) ;
+			if( n >= S )
+			{
+				dst += n ;
+				c1 = src[i];
+				continue;
+			}
+			T = (int)T + (int)step*n;
 			do
 			{
 				dst[n] = (T&0x7F000000)?0:INTERPOLATE_N_COLOR(T,S);
@@ -301,11 +440,41 @@ shrink_component( register CARD32 *src, register CARD32 *dst, int *scales, int l
 		}
 	}
 }
+#ifdef HAVE_SSE2
+static SSE2_FUNC int
+shrink_component11_sse2( CARD32 *src, CARD32 *dst, int len )
+{
+	int i = 0 ;
+	for( ; i+4 <= len ; i += 4 )
+		_mm_storeu_si128( (__m128i*)(dst+i), _mm_slli_epi32( _mm_loadu_si128( (__m128i*)(src+i) ), QUANT_ERR_BITS ) );
+	return i;
+}
+#endif
+#ifdef HAVE_AVX2
+static AVX2_FUNC int
+shrink_component11_avx2( CARD32 *src, CARD32 *dst, int len )
+{
+	int i = 0 ;
+	for( ; i+8 <= len ; i += 8 )
+		_mm256_storeu_si256( (__m256i*)(dst+i), _mm256_slli_epi32( _mm256_loadu_si256( (__m256i*)(src+i) ), QUANT_ERR_BITS ) );
+	return i;
+}
+#endif
+
 static inline void
 shrink_component11( register CARD32 *src, register CARD32 *dst, int *scales, int len )
 {
-	register int i ;
-	for( i = 0 ; i < len ; ++i )
+	register int i = 0 ;
+#ifdef HAVE_AVX2
+	if( asimage_avx2_supported() )
+		i = shrink_component11_avx2( src, dst, len );
+	else
+#endif
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+		i = shrink_component11_sse2( src, dst, len );
+#endif
+	for( ; i < len ; ++i )
 		dst[i] = AVERAGE_COLOR1(src[i]);
 }
 
@@ -321,10 +490,49 @@ reverse_component( register CARD32 *src, register CARD32 *dst, int *unused, int
 	}while(++i < len );
 }
 
+#ifdef HAVE_SSE2
+static SSE2_FUNC int
+add_component_sse2( CARD32 *src, CARD32 *incr, int len )
+{
+	int i = 0 ;
+	for( ; i+4 <= len ; i += 4 )
+		_mm_storeu_si128( (__m128i*)(src+i), _mm_add_epi32( _mm_loadu_si128( (__m128i*)(src+i) ),
+															 _mm_loadu_si128( (__m128i*)(incr+i) ) ) );
+	return i;
+}
+#endif
+#ifdef HAVE_AVX2
+static AVX2_FUNC int
+add_component_avx2( CARD32 *src, CARD32 *incr, int len )
+{
+	int i = 0 ;
+	for( ; i+8 <= len ; i += 8 )
+		_mm256_storeu_si256( (__m256i*)(src+i), _mm256_add_epi32( _mm256_loadu_si256( (__m256i*)(src+i) ),
+																   _mm256_loadu_si256( (__m256i*)(incr+i) ) ) );
+	return i;
+}
+#endif
+
 static inline void
 add_component( CARD32 *src, CARD32 *incr, int *scales, int len )
 {
 	len += len&0x01;
+#if defined(HAVE_AVX2) || defined(HAVE_SSE2)
+	if( asimage_avx2_supported() || asimage_sse2_supported() )
+	{
+		int i = 0 ;
+#ifdef HAVE_AVX2
+		if( asimage_avx2_supported() )
+			i = add_component_avx2( src, incr, len );
+		else
+#endif
+#ifdef HAVE_SSE2
+			i = add_component_sse2( src, incr, len );
+#endif
+		for( ; i < len ; ++i )
+			src[i] = (int)src[i] + (int)incr[i] ;
+	}else
+#endif
 #ifdef HAVE_MMX   
 #if 1
 	if( asimage_use_mmx )
@@ -380,11 +588,63 @@ rbitshift_component( register CARD32 *src, register CARD32 *dst, int shift, int
 }
 #endif
 
+/* Note that c1 and c4 are unsigned in the formulas below, which makes
+ * whole expressions unsigned - SIMD versions have to follow that : */
+#ifdef HAVE_SSE2
+static SSE2_FUNC int
+start_component_interpolation_sse2( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, CARD32 *T, CARD32 *step, int S, int len)
+{
+	__m128i vS21 = _mm_set1_epi32( (S<<1)+1 );
+	__m128d vS2 = _mm_set1_pd( (double)(S<<1) );
+	int i = 0 ;
+	for( ; i+4 <= len ; i += 4 )
+	{
+		__m128i vc2 = _mm_loadu_si128( (__m128i*)(c2+i) ), vc3 = _mm_loadu_si128( (__m128i*)(c3+i) );
+		__m128i total = _mm_sub_epi32( _mm_sub_epi32( _mm_add_epi32( sse2_mullo_epi32( vS21, vc2 ), vc3 ),
+													  _mm_loadu_si128( (__m128i*)(c1+i) ) ),
+									   _mm_loadu_si128( (__m128i*)(c4+i) ) );
+		__m128i vstep = _mm_sub_epi32( _mm_slli_epi32( vc3, 1 ), _mm_slli_epi32( vc2, 1 ) );
+		_mm_storeu_si128( (__m128i*)(T+i), sse2_div_epi32( total, vS2, True ) );
+		_mm_storeu_si128( (__m128i*)(step+i), sse2_div_epi32( vstep, vS2, False ) );
+	}
+	return i;
+}
+#endif
+#ifdef HAVE_AVX2
+static AVX2_FUNC int
+start_component_interpolation_avx2( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, CARD32 *T, CARD32 *step, int S, int len)
+{
+	__m256i vS21 = _mm256_set1_epi32( (S<<1)+1 );
+	__m256d vS2 = _mm256_set1_pd( (double)(S<<1) );
+	int i = 0 ;
+	for( ; i+8 <= len ; i += 8 )
+	{
+		__m256i vc2 = _mm256_loadu_si256( (__m256i*)(c2+i) ), vc3 = _mm256_loadu_si256( (__m256i*)(c3+i) );
+		__m256i total = _mm256_sub_epi32( _mm256_sub_epi32( _mm256_add_epi32( _mm256_mullo_epi32( vS21, vc2 ), vc3 ),
+															_mm256_loadu_si256( (__m256i*)(c1+i) ) ),
+										  _mm256_loadu_si256( (__m256i*)(c4+i) ) );
+		__m256i vstep = _mm256_sub_epi32( _mm256_slli_epi32( vc3, 1 ), _mm256_slli_epi32( vc2, 1 ) );
+		_mm256_storeu_si256( (__m256i*)(T+i), avx2_div_epi32( total, vS2, True ) );
+		_mm256_storeu_si256( (__m256i*)(step+i), avx2_div_epi32( vstep, vS2, False ) );
+	}
+	return i;
+}
+#endif
+
 static inline void
 start_component_interpolation( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, register CARD32 *T, register CARD32 *step, int S, int len)
 {
-	register int i;
-	for( i = 0 ; i < len ; i++ )
+	register int i = 0;
+#ifdef HAVE_AVX2
+	if( asimage_avx2_supported() )
+		i = start_component_interpolation_avx2( c1, c2, c3, c4, T, step, S, len );
+	else
+#endif
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+		i = start_component_interpolation_sse2( c1, c2, c3, c4, T, step, S, len );
+#endif
+	for( ; i < len ; i++ )
 	{
 		register int rc2 = c2[i], rc3 = c3[i] ;
 		T[i] = INTERPOLATION_TOTAL_START(c1[i],rc2,rc3,c4[i],S)/(S<<1);
@@ -392,13 +652,89 @@ start_component_interpolation( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, r
 	}
 }
 
+#ifdef HAVE_SSE2
+static SSE2_FUNC int
+component_interpolation_hardcoded_sse2( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, CARD32 *T, CARD16 kind, int len)
+{
+	__m128d v6 = _mm_set1_pd( 6.0 );
+	int i = 0 ;
+	for( ; i+4 <= len ; i += 4 )
+	{
+		__m128i vc2 = _mm_loadu_si128( (__m128i*)(c2+i) ), vc3 = _mm_loadu_si128( (__m128i*)(c3+i) );
+		__m128i res ;
+		if( kind == 1 )
+			res = _mm_srli_epi32( _mm_add_epi32( vc2, vc3 ), 1 );
+		else
+		{
+			__m128i c5, c3x ;
+			if( kind == 2 )
+			{
+				c5 = _mm_add_epi32( _mm_slli_epi32( vc2, 2 ), vc2 );
+				c3x = _mm_add_epi32( _mm_slli_epi32( vc3, 1 ), vc3 );
+			}else
+			{
+				c3x = _mm_add_epi32( _mm_slli_epi32( vc2, 1 ), vc2 );
+				c5 = _mm_add_epi32( _mm_slli_epi32( vc3, 2 ), vc3 );
+			}
+			res = _mm_sub_epi32( _mm_sub_epi32( _mm_add_epi32( c5, c3x ), _mm_loadu_si128( (__m128i*)(c1+i) ) ),
+								 _mm_loadu_si128( (__m128i*)(c4+i) ) );
+			res = sse2_div_epi32( res, v6, True );
+		}
+		_mm_storeu_si128( (__m128i*)(T+i), res );
+	}
+	return i;
+}
+#endif
+#ifdef HAVE_AVX2
+static AVX2_FUNC int
+component_interpolation_hardcoded_avx2( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, CARD32 *T, CARD16 kind, int len)
+{
+	__m256d v6 = _mm256_set1_pd( 6.0 );
+	int i = 0 ;
+	for( ; i+8 <= len ; i += 8 )
+	{
+		__m256i vc2 = _mm256_loadu_si256( (__m256i*)(c2+i) ), vc3 = _mm256_loadu_si256( (__m256i*)(c3+i) );
+		__m256i res ;
+		if( kind == 1 )
+			res = _mm256_srli_epi32( _mm256_add_epi32( vc2, vc3 ), 1 );
+		else
+		{
+			__m256i c5, c3x ;
+			if( kind == 2 )
+			{
+				c5 = _mm256_add_epi32( _mm256_slli_epi32( vc2, 2 ), vc2 );
+				c3x = _mm256_add_epi32( _mm256_slli_epi32( vc3, 1 ), vc3 );
+			}else
+			{
+				c3x = _mm256_add_epi32( _mm256_slli_epi32( vc2, 1 ), vc2 );
+				c5 = _mm256_add_epi32( _mm256_slli_epi32( vc3, 2 ), vc3 );
+			}
+			res = _mm256_sub_epi32( _mm256_sub_epi32( _mm256_add_epi32( c5, c3x ), _mm256_loadu_si256( (__m256i*)(c1+i) ) ),
+									_mm256_loadu_si256( (__m256i*)(c4+i) ) );
+			res = avx2_div_epi32( res, v6, True );
+		}
+		_mm256_storeu_si256( (__m256i*)(T+i), res );
+	}
+	return i;
+}
+#endif
+
 static void
 component_interpolation_hardcoded( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c4, register CARD32 *T, CARD32 *unused, CARD16 kind, int len)
 {
-	register int i;
+	register int i = 0;
+#ifdef HAVE_AVX2
+	if( asimage_avx2_supported() )
+		i = component_interpolation_hardcoded_avx2( c1, c2, c3, c4, T, kind, len );
+	else
+#endif
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+		i = component_interpolation_hardcoded_sse2( c1, c2, c3, c4, T, kind, len );
+#endif
 	if( kind == 1 )
 	{
-		for( i = 0 ; i < len ; i++ )
+		for( ; i < len ; i++ )
 		{
 			/* its seems that this simple formula is completely sufficient
 			   and even better than more complicated one : */
@@ -406,13 +742,13 @@ component_interpolation_hardcoded( CARD32 *c1, CARD32 *c2, CARD32 *c3, CARD32 *c
 		}
 	}else if( kind == 2 )
 	{
-		for( i = 0 ; i < len ; i++ )
+		for( ; i < len ; i++ )
 		{
     		register int rc1 = c1[i], rc2 = c2[i], rc3 = c3[i] ;
 			T[i] = INTERPOLATE_A_COLOR3_V(rc1,rc2,rc3,c4[i]);
 		}
 	}else
-		for( i = 0 ; i < len ; i++ )
+		for( ; i < len ; i++ )
 		{
     		register int rc1 = c1[i], rc2 = c2[i], rc3 = c3[i] ;
 			T[i] = INTERPOLATE_B_COLOR3_V(rc1,rc2,rc3,c4[i]);
@@ -712,6 +1048,110 @@ make_scales( int from_size, int to_size, int tail )
 	return scales;
 }
 
+/* *******************************************************************/
+/* Scale plans cache : make_scales() results are kept in small LRU 	*/
+/* cache keyed by (from_size, to_size, tail), since same icons and 	*/
+/* backgrounds tend to get scaled to the same sizes over and over.	*/
+/* *******************************************************************/
+typedef struct ASScalePlan
+{
+	int from_size, to_size, tail ;
+	int *scales ;
+	int ref_count ;
+	unsigned long last_used ;
+}ASScalePlan;
+
+#define SCALE_PLAN_CACHE_SIZE	32
+
+static ASScalePlan __as_scale_plans[SCALE_PLAN_CACHE_SIZE] ;
+static unsigned long __as_scale_plans_clock = 0 ;
+/* scaling may run on several threads at once : */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t __as_scale_plans_lock = PTHREAD_MUTEX_INITIALIZER ;
+#define LOCK_SCALE_PLANS()		pthread_mutex_lock( &__as_scale_plans_lock )
+#define UNLOCK_SCALE_PLANS()	pthread_mutex_unlock( &__as_scale_plans_lock )
+#else
+#define LOCK_SCALE_PLANS()		do{}while(0)
+#define UNLOCK_SCALE_PLANS()	do{}while(0)
+#endif
+
+static int *
+get_scales( int from_size, int to_size, int tail )
+{
+	ASScalePlan *plan, *victim = NULL ;
+	int *scales ;
+	int i ;
+
+	LOCK_SCALE_PLANS();
+	for( i = 0 ; i < SCALE_PLAN_CACHE_SIZE ; ++i )
+	{
+		plan = &(__as_scale_plans[i]);
+		if( plan->scales != NULL && plan->from_size == from_size &&
+			plan->to_size == to_size && plan->tail == tail )
+		{
+			++(plan->ref_count);
+			plan->last_used = ++__as_scale_plans_clock ;
+			UNLOCK_SCALE_PLANS();
+			return plan->scales;
+		}
+		if( plan->ref_count == 0 )
+		{   /* empty slots first, then least recently used : */
+			if( plan->scales == NULL )
+			{
+				if( victim == NULL || victim->scales != NULL )
+					victim = plan ;
+			}else if( victim == NULL || (victim->scales != NULL && plan->last_used < victim->last_used) )
+				victim = plan ;
+		}
+	}
+	if( victim == NULL )   /* all plans are in use - should not really happen */
+		scales = make_scales( from_size, to_size, tail );
+	else
+	{
+		if( victim->scales )
+			free( victim->scales );
+		victim->from_size = from_size ;
+		victim->to_size = to_size ;
+		victim->tail = tail ;
+		victim->scales = scales = make_scales( from_size, to_size, tail );
+		victim->ref_count = 1 ;
+		victim->last_used = ++__as_scale_plans_clock ;
+	}
+	UNLOCK_SCALE_PLANS();
+	return scales;
+}
+
+static void
+release_scales( int *scales )
+{
+	int i ;
+	LOCK_SCALE_PLANS();
+	for( i = 0 ; i < SCALE_PLAN_CACHE_SIZE ; ++i )
+		if( __as_scale_plans[i].scales == scales )
+		{
+			if( __as_scale_plans[i].ref_count > 0 )
+				--(__as_scale_plans[i].ref_count);
+			UNLOCK_SCALE_PLANS();
+			return;
+		}
+	UNLOCK_SCALE_PLANS();
+	free( scales );  /* was not cached */
+}
+
+void
+flush_scale_plan_cache()
+{
+	int i ;
+	LOCK_SCALE_PLANS();
+	for( i = 0 ; i < SCALE_PLAN_CACHE_SIZE ; ++i )
+		if( __as_scale_plans[i].scales != NULL && __as_scale_plans[i].ref_count == 0 )
+		{
+			free( __as_scale_plans[i].scales );
+			__as_scale_plans[i].scales = NULL ;
+		}
+	UNLOCK_SCALE_PLANS();
+}
+
 /* *******************************************************************/
 void
 scale_image_down( ASImageDecoder *imdec, ASImageOutput *imout, int h_ratio, int *scales_h, int* scales_v)
@@ -910,8 +1350,8 @@ scale_asimage( ASVisual *asv, ASImage *src, int to_width, int to_height,
 			h_ratio = to_width ;
 		++h_ratio ;
 	}
-	scales_h = make_scales( src->width, to_width, ( quality == ASIMAGE_QUALITY_POOR )?0:1 );
-	scales_v = make_scales( src->height, to_height, ( quality == ASIMAGE_QUALITY_POOR  || src->height <= 3)?0:1 );
+	scales_h = get_scales( src->width, to_width, ( quality == ASIMAGE_QUALITY_POOR )?0:1 );
+	scales_v = get_scales( src->height, to_height, ( quality == ASIMAGE_QUALITY_POOR  || src->height <= 3)?0:1 );
 #if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)
 	{
 	  register int i ;
@@ -936,8 +1376,8 @@ scale_asimage( ASVisual *asv, ASImage *src, int to_width, int to_height,
 			scale_image_up( imdec, imout, h_ratio, scales_h, scales_v );
 		stop_image_output( &imout );
 	}
-	free( scales_h );
-	free( scales_v );
+	release_scales( scales_h );
+	release_scales( scales_v );
 	stop_image_decoding( &imdec );
 	SHOW_TIME("", started);
 	return dst;
@@ -990,8 +1430,8 @@ scale_asimage2( ASVisual *asv, ASImage *src,
 			h_ratio = to_width ;
 		++h_ratio ;
 	}
-	scales_h = make_scales( clip_width, to_width, ( quality == ASIMAGE_QUALITY_POOR )?0:1 );
-	scales_v = make_scales( clip_height, to_height, ( quality == ASIMAGE_QUALITY_POOR  || clip_height <= 3)?0:1 );
+	scales_h = get_scales( clip_width, to_width, ( quality == ASIMAGE_QUALITY_POOR )?0:1 );
+	scales_v = get_scales( clip_height, to_height, ( quality == ASIMAGE_QUALITY_POOR  || clip_height <= 3)?0:1 );
 #if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)
 	{
 	  register int i ;
@@ -1016,8 +1456,8 @@ scale_asimage2( ASVisual *asv, ASImage *src,
 			scale_image_up( imdec, imout, h_ratio, scales_h, scales_v );
 		stop_image_output( &imout );
 	}
-	free( scales_h );
-	free( scales_v );
+	release_scales( scales_h );
+	release_scales( scales_v );
 	stop_image_decoding( &imdec );
 	SHOW_TIME("", started);
 	return dst;
@@ -1085,35 +1525,16 @@ LOCAL_DEBUG_OUT("tiling actually...%s", "");
 	return dst;
 }
 
-ASImage *
-merge_layers( ASVisual *asv,
-				ASImageLayer *layers, int count,
-			  	int dst_width,
-			  	int dst_height,
-			  	ASAltImFormats out_format, unsigned int compression_out, int quality )
+/* creates decoders for all the layers that need to be rendered, and 
+ * updates *pcount if the list of layers is cut short : */
+static ASImageDecoder **
+start_layers_decoding( ASVisual *asv, ASImageLayer *layers, int *pcount, int dst_width )
 {
-	ASImage *dst = NULL ;
-	ASImageDecoder **imdecs ;
-	ASImageOutput  *imout ;
+	ASImageDecoder **imdecs = safecalloc( *pcount+20, sizeof(ASImageDecoder*));
 	ASImageLayer *pcurr = layers;
 	int i ;
-	ASScanline dst_line ;
-	START_TIME(started);
-
-LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height );
-	
-	dst = create_destination_image( dst_width, dst_height, out_format, compression_out, ARGB32_DEFAULT_BACK_COLOR );
-	if( dst == NULL )
-		return NULL;
-
-	if( asv == NULL ) 	asv = &__transform_fake_asv ;
-
-	prepare_scanline( dst_width, QUANT_ERR_BITS, &dst_line, asv->BGR_mode );
-	dst_line.flags = SCL_DO_ALL ;
 
-	imdecs = safecalloc( count+20, sizeof(ASImageDecoder*));
-
-	for( i = 0 ; i < count ; i++ )
+	for( i = 0 ; i < *pcount ; i++ )
 	{
 		/* all laayers but first must have valid image or solid_color ! */
 		if( (pcurr->im != NULL || pcurr->solid_color != 0 || i == 0) &&
@@ -1137,43 +1558,134 @@ LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height
 		else
 			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
 	}
-	if( i < count )
-		count = i+1 ;
+	if( i < *pcount )
+		*pcount = i+1 ;
+	return imdecs;
+}
 
-	if(imdecs[0] == NULL || (imout = start_image_output( asv, dst, out_format, QUANT_ERR_BITS, quality)) == NULL )
+static void
+stop_layers_decoding( ASImageDecoder **imdecs, int count )
+{
+	int i ;
+	for( i = 0 ; i < count ; i++ )
+		if( imdecs[i] != NULL )
+			stop_image_decoding( &(imdecs[i]) );
+	free( imdecs );
+}
+
+/* range of rows [*pmin_y, *pmax_y) covered by layers : */
+static void
+get_layers_rows_range( ASImageLayer *layers, ASImageDecoder **imdecs, int count, int dst_height, 
+					   int *pmin_y, int *pmax_y )
+{
+	ASImageLayer *pcurr = layers;
+	int i, max_y = 0, min_y = dst_height ;
+
+	for( i = 0 ; i < count ; i++ )
 	{
-		for( i = 0 ; i < count ; i++ )
-			if( imdecs[i] )
-				stop_image_decoding( &(imdecs[i]) );
+		if( imdecs[i] )
+		{
+			int layer_bottom = pcurr->dst_y+pcurr->clip_height ;
+			if( pcurr->dst_y < min_y )
+				min_y = pcurr->dst_y;
+			layer_bottom += imdecs[i]->bevel_v_addon ;
+			if( (int)layer_bottom > max_y )
+				max_y = layer_bottom;
+		}
+		pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+	}
+	if( min_y < 0 )
+		min_y = 0 ;
+	else if( min_y >= (int)dst_height )
+		min_y = dst_height ;
+	*pmin_y = min_y ;
+	*pmax_y = max_y ;
+}
+
+/* Composes row y of the layers into dst_line, that holds destination 
+ * pixels starting from x_origin. Layers that do not overlap dst_line are 
+ * not decoded at all. Rows could be composed in any order. */
+static void
+merge_layers_row( ASImageLayer *layers, ASImageDecoder **imdecs, int count, int y,
+				  int bg_bottom, int bg_tint, ASScanline *dst_line, int x_origin )
+{
+	ASImageLayer *pcurr ;
+	int i ;
+
+	if( layers[0].dst_y <= y && bg_bottom > y )
+	{
+		imdecs[0]->next_line = imdecs[0]->offset_y + (y - layers[0].dst_y) ;
+		imdecs[0]->decode_image_scanline( imdecs[0] );
+	}else
+	{
+		imdecs[0]->buffer.back_color = imdecs[0]->back_color ;
+		imdecs[0]->buffer.flags = 0 ;
+	}
+	copytintpad_scanline( &(imdecs[0]->buffer), dst_line, layers[0].dst_x-x_origin, bg_tint );
+	pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
+	for( i = 1 ; i < count ; i++ )
+	{
+		if( imdecs[i] && pcurr->dst_y <= y &&
+			pcurr->dst_y+(int)pcurr->clip_height+(int)imdecs[i]->bevel_v_addon > y )
+		{
+			register ASScanline *b = &(imdecs[i]->buffer);
+			int offset = pcurr->dst_x-x_origin ;
+			
+			if( offset < (int)dst_line->width && offset+(int)b->width > 0 )
+			{
+				CARD32 tint = pcurr->tint ;
+				imdecs[i]->next_line = imdecs[i]->offset_y + (y - pcurr->dst_y) ;
+				imdecs[i]->decode_image_scanline( imdecs[i] );
+				if( tint != 0 )
+				{
+					tint_component_mod( b->red,   (CARD16)(ARGB32_RED8(tint)<<1),   b->width );
+					tint_component_mod( b->green, (CARD16)(ARGB32_GREEN8(tint)<<1), b->width );
+  				   	tint_component_mod( b->blue,  (CARD16)(ARGB32_BLUE8(tint)<<1),  b->width );
+				  	tint_component_mod( b->alpha, (CARD16)(ARGB32_ALPHA8(tint)<<1), b->width );
+				}
+				pcurr->merge_scanlines( dst_line, b, offset );
+			}
+		}
+		pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
+	}
+}
+
+ASImage *
+merge_layers( ASVisual *asv,
+				ASImageLayer *layers, int count,
+			  	int dst_width,
+			  	int dst_height,
+			  	ASAltImFormats out_format, unsigned int compression_out, int quality )
+{
+	ASImage *dst = NULL ;
+	ASImageDecoder **imdecs ;
+	ASImageOutput  *imout ;
+	ASScanline dst_line ;
+	START_TIME(started);
+
+LOCAL_DEBUG_CALLER_OUT( "dst_width = %d, dst_height = %d", dst_width, dst_height );
+	
+	dst = create_destination_image( dst_width, dst_height, out_format, compression_out, ARGB32_DEFAULT_BACK_COLOR );
+	if( dst == NULL )
+		return NULL;
+
+	if( asv == NULL ) 	asv = &__transform_fake_asv ;
+
+	prepare_scanline( dst_width, QUANT_ERR_BITS, &dst_line, asv->BGR_mode );
+	dst_line.flags = SCL_DO_ALL ;
+
+	imdecs = start_layers_decoding( asv, layers, &count, dst_width );
 
+	if(imdecs[0] == NULL || (imout = start_image_output( asv, dst, out_format, QUANT_ERR_BITS, quality)) == NULL )
+	{
         destroy_asimage( &dst );
-		free_scanline( &dst_line, True );
     }else
 	{
-		int y, max_y = 0;
-		int min_y = dst_height;
+		int y, max_y, min_y ;
 		int bg_tint = (layers[0].tint==0)?0x7F7F7F7F:layers[0].tint ;
 		int bg_bottom = layers[0].dst_y+layers[0].clip_height+imdecs[0]->bevel_v_addon ;
 LOCAL_DEBUG_OUT("blending actually...%s", "");
-		pcurr = layers ;
-		for( i = 0 ; i < count ; i++ )
-		{
-			if( imdecs[i] )
-			{
-				int layer_bottom = pcurr->dst_y+pcurr->clip_height ;
-				if( pcurr->dst_y < min_y )
-					min_y = pcurr->dst_y;
-				layer_bottom += imdecs[i]->bevel_v_addon ;
-				if( (int)layer_bottom > max_y )
-					max_y = layer_bottom;
-			}
-			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
-		}
-		if( min_y < 0 )
-			min_y = 0 ;
-		else if( min_y >= (int)dst_height )
-			min_y = dst_height ;
-			
+		get_layers_rows_range( layers, imdecs, count, dst_height, &min_y, &max_y );
 		if( max_y >= (int)dst_height )
 			max_y = dst_height ;
 		else
@@ -1185,43 +1697,9 @@ LOCAL_DEBUG_OUT( "min_y = %d, max_y = %d", min_y, max_y );
 		for( y = 0 ; y < min_y ; ++y  )
 			imout->output_image_scanline( imout, &dst_line, 1);
 		dst_line.flags = SCL_DO_ALL ;
-		pcurr = layers ;
-		for( i = 0 ; i < count ; ++i )
-		{
-			if( imdecs[i] && pcurr->dst_y < min_y  )
-				imdecs[i]->next_line = min_y - pcurr->dst_y ;
-			pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
-		}
 		for( ; y < max_y ; ++y  )
 		{
-			if( layers[0].dst_y <= y && bg_bottom > y )
-				imdecs[0]->decode_image_scanline( imdecs[0] );
-			else
-			{
-				imdecs[0]->buffer.back_color = imdecs[0]->back_color ;
-				imdecs[0]->buffer.flags = 0 ;
-			}
-			copytintpad_scanline( &(imdecs[0]->buffer), &dst_line, layers[0].dst_x, bg_tint );
-			pcurr = layers[0].next?layers[0].next:&(layers[1]) ;
-			for( i = 1 ; i < count ; i++ )
-			{
-				if( imdecs[i] && pcurr->dst_y <= y &&
-					pcurr->dst_y+(int)pcurr->clip_height+(int)imdecs[i]->bevel_v_addon > y )
-				{
-					register ASScanline *b = &(imdecs[i]->buffer);
-					CARD32 tint = pcurr->tint ;
-					imdecs[i]->decode_image_scanline( imdecs[i] );
-					if( tint != 0 )
-					{
-						tint_component_mod( b->red,   (CARD16)(ARGB32_RED8(tint)<<1),   b->width );
-						tint_component_mod( b->green, (CARD16)(ARGB32_GREEN8(tint)<<1), b->width );
-  					   	tint_component_mod( b->blue,  (CARD16)(ARGB32_BLUE8(tint)<<1),  b->width );
-					  	tint_component_mod( b->alpha, (CARD16)(ARGB32_ALPHA8(tint)<<1), b->width );
-					}
-					pcurr->merge_scanlines( &dst_line, b, pcurr->dst_x );
-				}
-				pcurr = (pcurr->next!=NULL)?pcurr->next:pcurr+1 ;
-			}
+			merge_layers_row( layers, imdecs, count, y, bg_bottom, bg_tint, &dst_line, 0 );
 			imout->output_image_scanline( imout, &dst_line, 1);
 		}
 		dst_line.back_color = imdecs[0]->back_color ;
@@ -1230,17 +1708,117 @@ LOCAL_DEBUG_OUT( "min_y = %d, max_y = %d", min_y, max_y );
 			imout->output_image_scanline( imout, &dst_line, 1);
 		stop_image_output( &imout );
 	}
-	for( i = 0 ; i < count ; i++ )
-		if( imdecs[i] != NULL )
-		{
-			stop_image_decoding( &(imdecs[i]) );
-		}
-	free( imdecs );
+	stop_layers_decoding( imdecs, count );
 	free_scanline( &dst_line, True );
 	SHOW_TIME("", started);
 	return dst;
 }
 
+Bool
+merge_layers_damaged( ASVisual *asv, ASImageLayer *layers, int count,
+					  ASImage *dst, XRectangle *damage, int damage_count, int quality )
+{
+	ASImageDecoder **imdecs ;
+	ASImageDecoder *prev_dec ;
+	ASImageOutput  *imout = NULL ;
+	int *span_start, *span_end ;
+	int i, y, width, height ;
+	int min_y = 0, max_y = 0 ;
+	Bool success = False ;
+	START_TIME(started);
+
+	if( AS_ASSERT(dst) || layers == NULL || count <= 0 || damage == NULL || damage_count <= 0 )
+		return False;
+	if( dst->magic != MAGIC_ASIMAGE || get_flags( dst->flags, ASIM_DATA_NOT_USEFUL ) )
+		return False;
+	
+	if( asv == NULL ) 	asv = &__transform_fake_asv ;
+	width = dst->width ;
+	height = dst->height ;
+
+	/* bounding span of damage for each row : */
+	span_start = safemalloc( height*2*sizeof(int) );
+	span_end = span_start+height ;
+	for( y = 0 ; y < height ; ++y ) 
+	{
+		span_start[y] = width ;
+		span_end[y] = 0 ;
+	}
+	for( i = 0 ; i < damage_count ; ++i ) 
+	{
+		int x0 = MAX((int)damage[i].x,0), x1 = MIN((int)damage[i].x+(int)damage[i].width,width) ;
+		int y0 = MAX((int)damage[i].y,0), y1 = MIN((int)damage[i].y+(int)damage[i].height,height) ;
+		if( x0 >= x1 ) 
+			continue;
+		for( y = y0 ; y < y1 ; ++y ) 
+		{
+			if( span_start[y] > x0 ) span_start[y] = x0 ;
+			if( span_end[y] < x1 ) span_end[y] = x1 ;
+		}
+	}
+
+	imdecs = start_layers_decoding( asv, layers, &count, width );
+	if( imdecs[0] != NULL ) 
+		get_layers_rows_range( layers, imdecs, count, height, &min_y, &max_y );
+	/* layers not covering entire image are rendered with rows tiling 
+	 * by merge_layers() - we don't want to deal with that here */
+	if( imdecs[0] != NULL && min_y == 0 && max_y >= height )
+	{
+		/* rows are going to be written out of order, so we can't have 
+		 * error diffusion between rows : */
+		if( quality >= ASIMAGE_QUALITY_TOP || quality < ASIMAGE_QUALITY_POOR )
+			quality = ASIMAGE_QUALITY_GOOD ;
+		imout = start_image_output( asv, dst, ASA_ASImage, QUANT_ERR_BITS, quality);
+	}
+	if( imout ) 
+	{
+		prev_dec = start_image_decoding( asv, dst, SCL_DO_ALL, 0, 0, width, height, NULL );
+		if( prev_dec ) 
+		{
+			int bg_tint = (layers[0].tint==0)?0x7F7F7F7F:layers[0].tint ;
+			int bg_bottom = layers[0].dst_y+layers[0].clip_height+imdecs[0]->bevel_v_addon ;
+			
+			set_decoder_shift( prev_dec, 8 );
+			flush_asimage_cache( dst );
+			if( dst->alt.argb32 )
+			{
+				free( dst->alt.argb32 );
+				dst->alt.argb32 = NULL ;
+			}
+			for( y = 0 ; y < height ; ++y ) 
+				if( span_start[y] < span_end[y] ) 
+				{
+					/* previous contents of the row, with damaged span recomposed : */
+					ASScanline *row = &(prev_dec->buffer);
+					ASScanline span = *row ;
+					int c ;
+
+					prev_dec->next_line = y ;
+					prev_dec->decode_image_scanline( prev_dec );
+					for( c = 0 ; c < IC_NUM_CHANNELS ; ++c ) 
+						span.channels[c] += span_start[y] ;
+					span.blue = span.channels[IC_BLUE];
+					span.green = span.channels[IC_GREEN];
+					span.red = span.channels[IC_RED];
+					span.alpha = span.channels[IC_ALPHA];
+					span.width = span_end[y]-span_start[y] ;
+					span.back_color = imdecs[0]->back_color ;
+					merge_layers_row( layers, imdecs, count, y, bg_bottom, bg_tint, &span, span_start[y] );
+					row->flags |= span.flags ;
+					imout->next_line = y ;
+					imout->output_image_scanline( imout, row, 1);
+				}
+			stop_image_decoding( &prev_dec );
+			success = True ;
+		}
+		stop_image_output( &imout );
+	}
+	stop_layers_decoding( imdecs, count );
+	free( span_start );
+	SHOW_TIME("", started);
+	return success;
+}
+
 /* **************************************************************************************/
 /* GRADIENT drawing : 																   */
 /* **************************************************************************************/
@@ -1425,6 +2003,260 @@ make_gradient_diag_height( ASImageOutput *imout, ASScanline *dither_lines, int d
 	free_scanline( &result, True );
 }
 
+/* ***************************************************************************/
+/* Radial and conic gradients are computed analytically for every pixel,	*/
+/* and then looked up in the table of colors, rendered same way linear		*/
+/* gradients are :															*/
+/* ***************************************************************************/
+#define GRADIENT_LUT_SIZE	2048
+
+/* fast atan2() approximation, good to about 1e-5 radians. We want it the
+ * same in C and SSE2 code, so all the math is done in floats : */
+static inline float
+gradient_atan2( float y, float x )
+{
+	float ax = fabsf(x), ay = fabsf(y) ;
+	float mx = (ax > ay)?ax:ay ;
+	float mn = (ax > ay)?ay:ax ;
+	float a, s, r ;
+	if( mx < 1e-20f )
+		mx = 1e-20f ;
+	a = mn/mx ;
+	s = a*a ;
+	r = ((-0.0464964749f*s + 0.15931422f)*s - 0.327622764f)*s*a + a ;
+	if( ay > ax )
+		r = 1.57079637f - r ;
+	if( x < 0.0f )
+		r = 3.14159274f - r ;
+	if( y < 0.0f )
+		r = 6.28318548f - r ;
+	return r;
+}
+
+/* fills idx with positions in color table for pixels x0 ... x0+count-1
+ * of the row, dx is horizontal distance from the center to the first
+ * one, dy - vertical distance from the center to the row : */
+static void
+gradient_span_indexes( int type, float dx, float dy, float scale, int *idx, int count )
+{
+	int x ;
+	if( get_flags( type, GRADIENT_TYPE_CONIC ) )
+	{
+		for( x = 0 ; x < count ; ++x, dx += 1.0f )
+			idx[x] = (int)(gradient_atan2( dy, dx )*scale + 0.5f) ;
+	}else
+	{
+		float dy2 = dy*dy ;
+		for( x = 0 ; x < count ; ++x, dx += 1.0f )
+			idx[x] = (int)(sqrtf( dx*dx + dy2 )*scale + 0.5f) ;
+	}
+}
+
+#ifdef HAVE_SSE2
+static inline SSE2_FUNC __m128
+sse2_gradient_atan2( __m128 y, __m128 x )
+{
+	__m128 sign_mask = _mm_set1_ps( -0.0f );
+	__m128 ax = _mm_andnot_ps( sign_mask, x );
+	__m128 ay = _mm_andnot_ps( sign_mask, y );
+	__m128 y_gt_x = _mm_cmpgt_ps( ay, ax );
+	__m128 mx = _mm_max_ps( _mm_or_ps( _mm_and_ps( y_gt_x, ay ), _mm_andnot_ps( y_gt_x, ax ) ), _mm_set1_ps( 1e-20f ) );
+	__m128 mn = _mm_or_ps( _mm_and_ps( y_gt_x, ax ), _mm_andnot_ps( y_gt_x, ay ) );
+	__m128 a = _mm_div_ps( mn, mx );
+	__m128 s = _mm_mul_ps( a, a );
+	__m128 r = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( _mm_sub_ps( _mm_mul_ps( _mm_add_ps( _mm_mul_ps( _mm_set1_ps( -0.0464964749f ), s ),
+																					 _mm_set1_ps( 0.15931422f ) ), s ),
+																_mm_set1_ps( 0.327622764f ) ), s ), a ), a );
+	__m128 m ;
+	r = _mm_or_ps( _mm_and_ps( y_gt_x, _mm_sub_ps( _mm_set1_ps( 1.57079637f ), r ) ), _mm_andnot_ps( y_gt_x, r ) );
+	m = _mm_cmplt_ps( x, _mm_setzero_ps() );
+	r = _mm_or_ps( _mm_and_ps( m, _mm_sub_ps( _mm_set1_ps( 3.14159274f ), r ) ), _mm_andnot_ps( m, r ) );
+	m = _mm_cmplt_ps( y, _mm_setzero_ps() );
+	r = _mm_or_ps( _mm_and_ps( m, _mm_sub_ps( _mm_set1_ps( 6.28318548f ), r ) ), _mm_andnot_ps( m, r ) );
+	return r;
+}
+
+static SSE2_FUNC int
+gradient_span_indexes_sse2( int type, float dx, float dy, float scale, int *idx, int count )
+{
+	__m128 vdx = _mm_add_ps( _mm_set1_ps( dx ), _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f ) );
+	__m128 vdy = _mm_set1_ps( dy );
+	__m128 vscale = _mm_set1_ps( scale );
+	__m128 half = _mm_set1_ps( 0.5f );
+	__m128 four = _mm_set1_ps( 4.0f );
+	int x = 0 ;
+	if( get_flags( type, GRADIENT_TYPE_CONIC ) )
+	{
+		for( ; x+4 <= count ; x += 4, vdx = _mm_add_ps( vdx, four ) )
+			_mm_storeu_si128( (__m128i*)(idx+x), _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( sse2_gradient_atan2( vdy, vdx ), vscale ), half ) ) );
+	}else
+	{
+		__m128 dy2 = _mm_mul_ps( vdy, vdy );
+		for( ; x+4 <= count ; x += 4, vdx = _mm_add_ps( vdx, four ) )
+			_mm_storeu_si128( (__m128i*)(idx+x), _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( vdx, vdx ), dy2 ) ), vscale ), half ) ) );
+	}
+	return x;
+}
+#endif
+
+static void
+make_gradient_analytic( ASImageOutput *imout, ASScanline *lut, ASFlagType filter, int type )
+{
+	ASScanline result ;
+	int width = imout->im->width, height = imout->im->height ;
+	int *idx = safemalloc( (width+4)*sizeof(int) );
+	float cx = width*0.5f, cy = height*0.5f ;
+	float scale ;
+	int x, y, chan ;
+
+	if( get_flags( type, GRADIENT_TYPE_CONIC ) )
+		scale = (GRADIENT_LUT_SIZE-1)/6.28318548f ;
+	else /* offset of 1. is at the corners : */
+		scale = (GRADIENT_LUT_SIZE-1)/sqrtf( cx*cx + cy*cy );
+
+	prepare_scanline( width, QUANT_ERR_BITS, &result, imout->asv->BGR_mode );
+	result.flags = filter ;
+	for( y = 0 ; y < height ; ++y )
+	{
+		float dx = 0.5f - cx, dy = y + 0.5f - cy ;
+		int done = 0 ;
+#ifdef HAVE_SSE2
+		if( asimage_sse2_supported() )
+			done = gradient_span_indexes_sse2( type, dx, dy, scale, idx, width );
+#endif
+		gradient_span_indexes( type, dx+done, dy, scale, idx+done, width-done );
+		for( x = 0 ; x < width ; ++x )
+			if( idx[x] >= GRADIENT_LUT_SIZE )
+				idx[x] = GRADIENT_LUT_SIZE-1 ;
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+			if( get_flags( filter, 0x01<<chan ) )
+			{
+				register CARD32 *dst = result.channels[chan] ;
+				register CARD32 *src = lut->channels[chan] ;
+				for( x = 0 ; x < width ; ++x )
+					dst[x] = src[idx[x]] ;
+			}
+		imout->output_image_scanline( imout, &result, 1);
+	}
+	free_scanline( &result, True );
+	free( idx );
+}
+
+/* *******************************************************************/
+/* Gradients cache : same gradients get rendered at the same sizes	*/
+/* over and over again, every time styled window gets resized or 	*/
+/* redrawn. Rendered images are kept in small LRU cache, and copies */
+/* are handed out, sharing same storage.							*/
+/* *******************************************************************/
+typedef struct ASGradientCacheEntry
+{
+	ASGradient grad ;
+	int width, height ;
+	ASFlagType filter ;
+	int quality ;
+	ASImage *im ;
+	unsigned long last_used ;
+}ASGradientCacheEntry;
+
+#define GRADIENT_CACHE_SIZE		16
+
+static ASGradientCacheEntry __as_gradient_cache[GRADIENT_CACHE_SIZE] ;
+static unsigned long __as_gradient_cache_clock = 0 ;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t __as_gradient_cache_lock = PTHREAD_MUTEX_INITIALIZER ;
+#define LOCK_GRADIENT_CACHE()		pthread_mutex_lock( &__as_gradient_cache_lock )
+#define UNLOCK_GRADIENT_CACHE()		pthread_mutex_unlock( &__as_gradient_cache_lock )
+#else
+#define LOCK_GRADIENT_CACHE()		do{}while(0)
+#define UNLOCK_GRADIENT_CACHE()		do{}while(0)
+#endif
+
+static Bool
+gradient_cache_entry_matches( ASGradientCacheEntry *e, ASGradient *grad, int width, int height, ASFlagType filter, int quality )
+{
+	int i ;
+	if( e->im == NULL || e->width != width || e->height != height ||
+		e->filter != filter || e->quality != quality ||
+		e->grad.type != grad->type || e->grad.npoints != grad->npoints )
+		return False;
+	for( i = 0 ; i < grad->npoints ; ++i )
+		if( e->grad.color[i] != grad->color[i] || e->grad.offset[i] != grad->offset[i] )
+			return False;
+	return True;
+}
+
+static void
+clear_gradient_cache_entry( ASGradientCacheEntry *e )
+{
+	if( e->im )
+		destroy_asimage( &(e->im) );
+	if( e->grad.color )
+		free( e->grad.color );
+	if( e->grad.offset )
+		free( e->grad.offset );
+	memset( e, 0x00, sizeof(ASGradientCacheEntry) );
+}
+
+static ASImage *
+lookup_gradient_cache( ASGradient *grad, int width, int height, ASFlagType filter, int quality )
+{
+	ASImage *im = NULL ;
+	int i ;
+	LOCK_GRADIENT_CACHE();
+	for( i = 0 ; i < GRADIENT_CACHE_SIZE ; ++i )
+		if( gradient_cache_entry_matches( &(__as_gradient_cache[i]), grad, width, height, filter, quality ) )
+		{
+			__as_gradient_cache[i].last_used = ++__as_gradient_cache_clock ;
+			im = clone_asimage( __as_gradient_cache[i].im, SCL_DO_ALL );
+			break;
+		}
+	UNLOCK_GRADIENT_CACHE();
+	return im;
+}
+
+static void
+add_gradient_cache( ASGradient *grad, int width, int height, ASFlagType filter, int quality, ASImage *im )
+{
+	ASGradientCacheEntry *victim = NULL ;
+	int i ;
+	LOCK_GRADIENT_CACHE();
+	for( i = 0 ; i < GRADIENT_CACHE_SIZE ; ++i )
+	{
+		ASGradientCacheEntry *e = &(__as_gradient_cache[i]);
+		if( e->im == NULL )
+		{
+			victim = e ;
+			break;
+		}
+		if( victim == NULL || e->last_used < victim->last_used )
+			victim = e ;
+	}
+	clear_gradient_cache_entry( victim );
+	victim->grad.type = grad->type ;
+	victim->grad.npoints = grad->npoints ;
+	victim->grad.color = safemalloc( grad->npoints*sizeof(ARGB32) );
+	victim->grad.offset = safemalloc( grad->npoints*sizeof(double) );
+	memcpy( victim->grad.color, grad->color, grad->npoints*sizeof(ARGB32) );
+	memcpy( victim->grad.offset, grad->offset, grad->npoints*sizeof(double) );
+	victim->width = width ;
+	victim->height = height ;
+	victim->filter = filter ;
+	victim->quality = quality ;
+	victim->im = clone_asimage( im, SCL_DO_ALL );
+	victim->last_used = ++__as_gradient_cache_clock ;
+	UNLOCK_GRADIENT_CACHE();
+}
+
+void
+flush_gradient_cache()
+{
+	int i ;
+	LOCK_GRADIENT_CACHE();
+	for( i = 0 ; i < GRADIENT_CACHE_SIZE ; ++i )
+		clear_gradient_cache_entry( &(__as_gradient_cache[i]) );
+	UNLOCK_GRADIENT_CACHE();
+}
+
 static ARGB32
 get_best_grad_back_color( ASGradient *grad )
 {
@@ -1476,6 +2308,13 @@ LOCAL_DEBUG_CALLER_OUT( "type = 0x%X, width=%d, height = %d, filter = 0x%lX", gr
  	if( height == 0 )
 		height = 2;
 
+	if( out_format == ASA_ASImage && grad->npoints > 0 )
+		if( (im = lookup_gradient_cache( grad, width, height, filter, quality )) != NULL )
+		{
+			SHOW_TIME("cached", started);
+			return im;
+		}
+
 	im = create_destination_image( width, height, out_format, compression_out, get_best_grad_back_color( grad ) );
 
 	if( get_flags(grad->type,GRADIENT_TYPE_ORIENTATION) )
@@ -1485,7 +2324,15 @@ LOCAL_DEBUG_CALLER_OUT( "type = 0x%X, width=%d, height = %d, filter = 0x%lX", gr
 	if((imout = start_image_output( asv, im, out_format, QUANT_ERR_BITS, quality)) == NULL )
 	{
         destroy_asimage( &im );
-    }else
+    }else if( get_flags(grad->type, GRADIENT_TYPE_RADIAL|GRADIENT_TYPE_CONIC) )
+	{
+		ASScanline lut ;
+		prepare_scanline( GRADIENT_LUT_SIZE, QUANT_ERR_BITS, &lut, asv->BGR_mode );
+		make_gradient_scanline( &lut, grad, filter, 0 );
+		make_gradient_analytic( imout, &lut, filter, grad->type );
+		stop_image_output( &imout );
+		free_scanline( &lut, True );
+	}else
 	{
 		int dither_lines = MIN(imout->quality+1, MAX_GRADIENT_DITHER_LINES) ;
 		ASScanline *lines;
@@ -1526,6 +2373,8 @@ LOCAL_DEBUG_CALLER_OUT( "type = 0x%X, width=%d, height = %d, filter = 0x%lX", gr
 			free_scanline( &(lines[line]), True );
 		free( lines );
 	}
+	if( im != NULL && out_format == ASA_ASImage && grad->npoints > 0 )
+		add_gradient_cache( grad, width, height, filter, quality, im );
 	SHOW_TIME("", started);
 	return im;
 }
@@ -2325,6 +3174,312 @@ load_gauss_scanline(ASScanline *result, ASImageDecoder *imdec, int horz, GAUSS_C
 }
 
 
+/***********************************************************************
+ * Row band processing - see asthread.h
+ **********************************************************************/
+/* Band starting at row 0 gets to use decoder and output set up by the 
+ * caller. Every other band gets a copy of its own, positioned to the 
+ * first line it needs : */
+static Bool
+start_band_pipeline( ASImageDecoder *imdec, ASImageOutput *imout, 
+					 int decode_start, int output_start, 
+					 ASImageDecoder **pband_imdec, ASImageOutput **pband_imout )
+{
+	if( output_start == 0 ) 
+	{
+		*pband_imdec = imdec ;
+		*pband_imout = imout ;
+		return True;
+	}
+	*pband_imdec = start_image_decoding( imdec->asv, imdec->im, imdec->filter, 
+										 imdec->offset_x, imdec->offset_y, 
+										 imdec->out_width, imdec->out_height, NULL );
+	if( *pband_imdec == NULL ) 
+		return False;
+	set_decoder_shift( *pband_imdec, imdec->buffer.shift );
+	set_decoder_back_color( *pband_imdec, imdec->back_color );
+	(*pband_imdec)->next_line = imdec->offset_y + decode_start ;
+
+	*pband_imout = start_image_output( imout->asv, imout->im, imout->out_format, 
+									   imout->buffer_shift, imout->quality );
+	if( *pband_imout == NULL ) 
+	{
+		stop_image_decoding( pband_imdec );
+		return False;
+	}
+	(*pband_imout)->tiling_step = imout->tiling_step ;
+	(*pband_imout)->tiling_range = imout->tiling_range ;
+	(*pband_imout)->next_line = output_start ;
+	return True;
+}
+
+static void
+stop_band_pipeline( ASImageDecoder *imdec, ASImageOutput *imout, 
+					ASImageDecoder **pband_imdec, ASImageOutput **pband_imout )
+{
+	if( *pband_imdec != imdec ) 
+		stop_image_decoding( pband_imdec );
+	if( *pband_imout != imout ) 
+		stop_image_output( pband_imout );
+}
+
+static int
+run_transform_bands( ASImageOutput *imout, ASBandFunc func, void *data, int height, int granularity )
+{
+	/* Only ASImage can be written out of order, and top quality output 
+	 * carries error diffusion from one line to the next : */
+	if( imout->out_format != ASA_ASImage || 
+		(imout->buffer_shift > 0 && imout->quality == ASIMAGE_QUALITY_TOP) )
+	{
+		func( data, 0, height );
+		return 1;
+	}
+	return run_asimage_bands( func, data, height, granularity );
+}
+
+/***********************************************************************
+ * Gaussian blur : 
+ **********************************************************************/
+typedef struct ASGaussBlurBands
+{
+	ASImageDecoder 	 *imdec ;
+	ASImageOutput  	 *imout ;
+	Bool 			  BGR_mode ;
+	int 			  width, height ;
+	int 			  horz, vert ;
+	GAUSS_COEFF_TYPE *horz_gauss, *horz_gauss_sums ;
+	GAUSS_COEFF_TYPE *vert_gauss, *vert_gauss_sums ;
+	ASFlagType 		  filter ;
+}ASGaussBlurBands;
+
+/* lines[] is indexed by the absolute line number, and must have lines
+ * in range [y-vert+1, y+vert-1] loaded, clipped by image boundaries */
+static inline void
+gauss_vertical_scanline( ASScanline *result, ASScanline **lines, int y, ASGaussBlurBands *bb )
+{
+	int x, chan ;
+	int width = bb->width, height = bb->height, vert = bb->vert ;
+	GAUSS_COEFF_TYPE *vert_gauss = bb->vert_gauss ;
+	GAUSS_COEFF_TYPE *vert_gauss_sums = bb->vert_gauss_sums ;
+	ASFlagType filter = bb->filter ;
+
+	if( y < vert-1 )
+	{ /* top band  [0, vert-2] */
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		{
+			CARD32 *res_chan = result->channels[chan];
+			if( !get_flags(filter, 0x01<<chan) )
+				copy_component( lines[y]->channels[chan], res_chan, 0, width);
+			else
+			{	
+				register ASScanline **ysrc = &lines[y];
+				int j = 0;
+				GAUSS_COEFF_TYPE g = vert_gauss[0];
+				CARD32 *src_chan1 = ysrc[0]->channels[chan];
+				for( x = 0 ; x < width ; ++x ) 
+					res_chan[x] = src_chan1[x]*g;
+				while( ++j <= y )
+				{
+					CARD32 *src_chan2 = ysrc[j]->channels[chan];
+					g = vert_gauss[j];
+					src_chan1 = ysrc[-j]->channels[chan];
+					for( x = 0 ; x < width ; ++x ) 
+						res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
+				}	
+				for( ; j < vert ; ++j ) 
+				{
+					g = vert_gauss[j];
+					src_chan1 = ysrc[j]->channels[chan];
+					for( x = 0 ; x < width ; ++x ) 
+						res_chan[x] += src_chan1[x]*g;
+				}
+				g = vert_gauss_sums[y];
+				for( x = 0 ; x < width ; ++x ) 
+				{
+					gauss_var_t v = res_chan[x]/g;
+					res_chan[x] = (v&0x03Fc0000)?255:v>>10;
+				}
+			}
+		}
+	}else if( y <= height - vert ) 
+	{ /* middle band [vert-1, height-vert] */
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		{
+			CARD32 *res_chan = result->channels[chan];
+			if( !get_flags(filter, 0x01<<chan) )
+				copy_component( lines[y]->channels[chan], res_chan, 0, result->width);
+			else
+			{	
+				register ASScanline **ysrc = &lines[y];
+/* surprisingly, having x loops inside y loop yields 30% to 80% better performance */
+				int j = 0;
+				CARD32 *src_chan1 = ysrc[0]->channels[chan];
+				memset( res_chan, 0x00, width*4 );
+/*				for( x = 0 ; x < width ; ++x ) 
+					res_chan[x] = src_chan1[x]*vert_gauss[0];
+ */							
+				while( ++j < vert ) 
+				{
+					CARD32 *src_chan2 = ysrc[j]->channels[chan];
+					GAUSS_COEFF_TYPE g = vert_gauss[j];
+					src_chan1 = ysrc[-j]->channels[chan];
+					switch( g ) 
+					{
+						case 1 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += src_chan1[x]+src_chan2[x];
+							break;
+						case 2 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])<<1;
+							break;
+#if 1
+						case 4 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])<<2;
+							break;
+						case 8 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])<<3;
+							break;
+						case 16 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])<<4;
+							break;
+						case 32 :
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])<<5;
+							break;
+#endif		
+						default : 									
+							for( x = 0 ; x < width ; ++x ) 
+								res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
+					}
+				}
+ 				src_chan1 = ysrc[0]->channels[chan];
+				for( x = 0 ; x < width ; ++x ) 
+				{
+					gauss_var_t v = src_chan1[x]*vert_gauss[0] + res_chan[x];
+					res_chan[x] = (v&0xF0000000)?255:v>>20;
+				} 
+			}
+		}
+	}else
+	{ /* bottom band */
+		int tail = height - y ; 
+		for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+		{
+			CARD32 *res_chan = result->channels[chan];
+			if( !get_flags(filter, 0x01<<chan) )
+				copy_component( lines[y]->channels[chan], res_chan, 0, result->width);
+			else
+			{	
+				register ASScanline **ysrc = &lines[y];
+				int j = 0;
+				GAUSS_COEFF_TYPE g ;
+				CARD32 *src_chan1 = ysrc[0]->channels[chan];
+				for( x = 0 ; x < width ; ++x ) 
+					res_chan[x] = src_chan1[x]*vert_gauss[0];
+				for( j = 1 ; j < tail ; ++j ) 
+				{
+					CARD32 *src_chan2 = ysrc[j]->channels[chan];
+					g = vert_gauss[j];
+					src_chan1 = ysrc[-j]->channels[chan];
+					for( x = 0 ; x < width ; ++x ) 
+						res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
+				}
+				for( ; j < vert ; ++j )
+				{
+					g = vert_gauss[j];
+					src_chan1 = ysrc[-j]->channels[chan];
+					for( x = 0 ; x < width ; ++x ) 
+						res_chan[x] += src_chan1[x]*g;
+				}
+				g = vert_gauss_sums[tail];
+				for( x = 0 ; x < width ; ++x ) 
+				{
+					gauss_var_t v = res_chan[x]/g;
+					res_chan[x] = (v&0x03Fc0000)?255:v>>10;
+				}
+			}
+		}
+	}
+}
+
+static void 
+blur_gauss_band( void *data, int band_start, int band_end )
+{
+	ASGaussBlurBands *bb = (ASGaussBlurBands*)data ;
+	ASImageDecoder *imdec ;
+	ASImageOutput *imout ;
+	int y, x, chan ;
+	int width = bb->width ;
+	/* vertical blur needs vert-1 lines of halo on both sides of the band : */
+	int first_line = max( 0, band_start - (bb->vert-1) );
+
+	if( !start_band_pipeline( bb->imdec, bb->imout, first_line, band_start, &imdec, &imout ) )
+		return;
+
+	if( bb->vert == 1 && bb->horz == 1 ) 
+	{
+	    for (y = band_start ; y < band_end ; y++)
+		{
+			imdec->decode_image_scanline(imdec);
+	        imout->output_image_scanline(imout, &(imdec->buffer), 1);
+		}
+	}else
+	{
+		ASScanline result;
+		
+		prepare_scanline(width, 0, &result, bb->BGR_mode);
+		if( bb->vert == 1 ) 
+		{
+		    for (y = band_start ; y < band_end ; y++)
+		    {
+				load_gauss_scanline(&result, imdec, bb->horz, bb->horz_gauss, bb->horz_gauss_sums, bb->filter );
+				for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
+					if( get_flags( bb->filter, 0x01<<chan ) )
+					{
+						CARD32 *res_chan = result.channels[chan];
+						for( x = 0 ; x < width ; ++x ) 
+							res_chan[x] = (res_chan[x]&0x03Fc0000)?255:res_chan[x]>>10;
+					}
+		        imout->output_image_scanline(imout, &result, 1);
+			}
+		}else
+		{ 
+			int lines_count = bb->vert*2-1;
+			int next_line = first_line ;
+			ASScanline *lines_mem = safecalloc( lines_count, sizeof(ASScanline));
+			ASScanline **lines = safecalloc( bb->height, sizeof(ASScanline*));
+
+			for( y = 0 ; y < lines_count ; ++y ) 
+				prepare_scanline(width, 0, &lines_mem[y], bb->BGR_mode);
+
+			result.flags = 0xFFFFFFFF;
+    		for (y = band_start ; y < band_end ; y++)
+    		{
+				int last_line = min( bb->height-1, y + bb->vert-1 );
+				/* lines that are no longer needed get reused in round-robin fashion : */
+				for( ; next_line <= last_line ; ++next_line ) 
+				{
+					lines[next_line] = &lines_mem[next_line%lines_count] ;
+					load_gauss_scanline(lines[next_line], imdec, bb->horz, bb->horz_gauss, bb->horz_gauss_sums, bb->filter );
+				}
+				gauss_vertical_scanline( &result, lines, y, bb );
+        		imout->output_image_scanline(imout, &result, 1);
+			}
+			/* cleanup */
+			for( y = 0 ; y < lines_count ; ++y ) 
+				free_scanline(&lines_mem[y], True);
+			free( lines_mem );
+			free( lines );
+		}
+		free_scanline(&result, True);
+	}
+	stop_band_pipeline( bb->imdec, bb->imout, &imdec, &imout );
+}
+
 ASImage* blur_asimage_gauss(ASVisual* asv, ASImage* src, double dhorz, double dvert,
                             ASFlagType filter,
 							ASAltImFormats out_format, unsigned int compression_out, int quality)
@@ -2332,10 +3487,10 @@ ASImage* blur_asimage_gauss(ASVisual* asv, ASImage* src, double dhorz, double dv
 	ASImage *dst = NULL;
 	ASImageOutput *imout;
 	ASImageDecoder *imdec;
-	int y, x, chan;
 	int horz = (int)dhorz;
 	int vert = (int)dvert;
 	int width, height ; 
+	ASGaussBlurBands bb ;
 #if 0
 	struct timeval stv;
 	gettimeofday (&stv,NULL);
@@ -2380,237 +3535,41 @@ ASImage* blur_asimage_gauss(ASVisual* asv, ASImage* src, double dhorz, double dv
 	else if( vert < 1 ) 
 		vert = 1 ;
 
-	if( vert == 1 && horz == 1 ) 
+	memset( &bb, 0x00, sizeof(bb));
+	bb.imdec = imdec ;
+	bb.imout = imout ;
+	bb.BGR_mode = asv->BGR_mode ;
+	bb.width = width ;
+	bb.height = height ;
+	bb.horz = horz ;
+	bb.vert = vert ;
+	bb.filter = filter ;
+	if( horz > 1 )
 	{
-	    for (y = 0 ; y < dst->height ; y++)
-		{
-			imdec->decode_image_scanline(imdec);
-	        imout->output_image_scanline(imout, &(imdec->buffer), 1);
-		}
-	}else
+		PRINT_BACKGROUND_OP_TIME;
+		bb.horz_gauss = safecalloc(horz+1, sizeof(GAUSS_COEFF_TYPE));
+		bb.horz_gauss_sums = safecalloc(horz+1, sizeof(GAUSS_COEFF_TYPE));
+		calc_gauss_int(horz, bb.horz_gauss, bb.horz_gauss_sums);
+		PRINT_BACKGROUND_OP_TIME;
+	}
+	if( vert > 1 ) 
 	{
-		ASScanline result;
-		GAUSS_COEFF_TYPE *horz_gauss = NULL;
-		GAUSS_COEFF_TYPE *horz_gauss_sums = NULL;
+		bb.vert_gauss = safecalloc(vert+1, sizeof(GAUSS_COEFF_TYPE));
+		bb.vert_gauss_sums = safecalloc(vert+1, sizeof(GAUSS_COEFF_TYPE));
+		calc_gauss_int(vert, bb.vert_gauss, bb.vert_gauss_sums);
+		PRINT_BACKGROUND_OP_TIME;
+	}
 
-		if( horz > 1 )
-		{
-			PRINT_BACKGROUND_OP_TIME;
-			horz_gauss = safecalloc(horz+1, sizeof(GAUSS_COEFF_TYPE));
-			horz_gauss_sums = safecalloc(horz+1, sizeof(GAUSS_COEFF_TYPE));
-			calc_gauss_int(horz, horz_gauss, horz_gauss_sums);
-			PRINT_BACKGROUND_OP_TIME;
-		}
-		prepare_scanline(width, 0, &result, asv->BGR_mode);
-		if( vert == 1 ) 
-		{
-		    for (y = 0 ; y < height ; y++)
-		    {
-				load_gauss_scanline(&result, imdec, horz, horz_gauss, horz_gauss_sums, filter );
-				for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
-					if( get_flags( filter, 0x01<<chan ) )
-					{
-						CARD32 *res_chan = result.channels[chan];
-						for( x = 0 ; x < width ; ++x ) 
-							res_chan[x] = (res_chan[x]&0x03Fc0000)?255:res_chan[x]>>10;
-					}
-		        imout->output_image_scanline(imout, &result, 1);
-			}
-		}else
-		{ /* new code : */
-			GAUSS_COEFF_TYPE *vert_gauss = safecalloc(vert+1, sizeof(GAUSS_COEFF_TYPE));
-			GAUSS_COEFF_TYPE *vert_gauss_sums = safecalloc(vert+1, sizeof(GAUSS_COEFF_TYPE));
-			int lines_count = vert*2-1;
-			int first_line = 0, last_line = lines_count-1;
-			ASScanline *lines_mem = safecalloc( lines_count, sizeof(ASScanline));
-			ASScanline **lines = safecalloc( dst->height+1, sizeof(ASScanline*));
-
-			/* init */
-			calc_gauss_int(vert, vert_gauss, vert_gauss_sums);
-			PRINT_BACKGROUND_OP_TIME;
-
-			for( y = 0 ; y < lines_count ; ++y ) 
-			{
-				lines[y] = &lines_mem[y] ;
-				prepare_scanline(width, 0, lines[y], asv->BGR_mode);
-				load_gauss_scanline(lines[y], imdec, horz, horz_gauss, horz_gauss_sums, filter );
-			}
-
-			PRINT_BACKGROUND_OP_TIME;
-			result.flags = 0xFFFFFFFF;
-			/* top band  [0, vert-2] */
-    		for (y = 0 ; y < vert-1 ; y++)
-    		{
-				for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
-				{
-					CARD32 *res_chan = result.channels[chan];
-					if( !get_flags(filter, 0x01<<chan) )
-		        		copy_component( lines[y]->channels[chan], res_chan, 0, width);
-					else
-					{	
-						register ASScanline **ysrc = &lines[y];
-						int j = 0;
-						GAUSS_COEFF_TYPE g = vert_gauss[0];
-						CARD32 *src_chan1 = ysrc[0]->channels[chan];
-						for( x = 0 ; x < width ; ++x ) 
-							res_chan[x] = src_chan1[x]*g;
-						while( ++j <= y )
-						{
-							CARD32 *src_chan2 = ysrc[j]->channels[chan];
-							g = vert_gauss[j];
-							src_chan1 = ysrc[-j]->channels[chan];
-							for( x = 0 ; x < width ; ++x ) 
-								res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
-						}	
-						for( ; j < vert ; ++j ) 
-						{
-							g = vert_gauss[j];
-							src_chan1 = ysrc[j]->channels[chan];
-							for( x = 0 ; x < width ; ++x ) 
-								res_chan[x] += src_chan1[x]*g;
-						}
-						g = vert_gauss_sums[y];
-						for( x = 0 ; x < width ; ++x ) 
-						{
-							gauss_var_t v = res_chan[x]/g;
-							res_chan[x] = (v&0x03Fc0000)?255:v>>10;
-						}
-					}
-				}
-        		imout->output_image_scanline(imout, &result, 1);
-			}
-			PRINT_BACKGROUND_OP_TIME;
-			/* middle band [vert-1, height-vert] */
-			for( ; y <= height - vert; ++y)
-			{
-				for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
-				{
-					CARD32 *res_chan = result.channels[chan];
-					if( !get_flags(filter, 0x01<<chan) )
-		        		copy_component( lines[y]->channels[chan], res_chan, 0, result.width);
-					else
-					{	
-						register ASScanline **ysrc = &lines[y];
-/* surprisingly, having x loops inside y loop yields 30% to 80% better performance */
-						int j = 0;
-						CARD32 *src_chan1 = ysrc[0]->channels[chan];
-						memset( res_chan, 0x00, width*4 );
-/*						for( x = 0 ; x < width ; ++x ) 
-							res_chan[x] = src_chan1[x]*vert_gauss[0];
- */							
-						while( ++j < vert ) 
-						{
-							CARD32 *src_chan2 = ysrc[j]->channels[chan];
-							GAUSS_COEFF_TYPE g = vert_gauss[j];
-							src_chan1 = ysrc[-j]->channels[chan];
-							switch( g ) 
-							{
-								case 1 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += src_chan1[x]+src_chan2[x];
-									break;
-								case 2 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])<<1;
-									break;
-#if 1
-								case 4 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])<<2;
-									break;
-								case 8 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])<<3;
-									break;
-								case 16 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])<<4;
-									break;
-								case 32 :
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])<<5;
-									break;
-#endif		
-								default : 									
-									for( x = 0 ; x < width ; ++x ) 
-										res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
-							}
-						}
- 						src_chan1 = ysrc[0]->channels[chan];
-						for( x = 0 ; x < width ; ++x ) 
-						{
-							gauss_var_t v = src_chan1[x]*vert_gauss[0] + res_chan[x];
-							res_chan[x] = (v&0xF0000000)?255:v>>20;
-						} 
-					}
-				}
+	run_transform_bands( imout, blur_gauss_band, &bb, height, 1 );
 
-        		imout->output_image_scanline(imout, &result, 1);
-				++last_line;
-				/* fprintf( stderr, "last_line = %d, first_line = %d, height = %d, vert = %d, y = %d\n", last_line, first_line, dst->height, vert, y ); */
-				lines[last_line] = lines[first_line] ; 
-				++first_line;
-				load_gauss_scanline(lines[last_line], imdec, horz, horz_gauss, horz_gauss_sums, filter );
-			}
-			PRINT_BACKGROUND_OP_TIME;
-			/* bottom band */
-			for( ; y < height; ++y)
-			{
-				int tail = height - y ; 
-				for( chan = 0 ; chan < IC_NUM_CHANNELS ; ++chan )
-				{
-					CARD32 *res_chan = result.channels[chan];
-					if( !get_flags(filter, 0x01<<chan) )
-		        		copy_component( lines[y]->channels[chan], res_chan, 0, result.width);
-					else
-					{	
-						register ASScanline **ysrc = &lines[y];
-						int j = 0;
-						GAUSS_COEFF_TYPE g ;
-						CARD32 *src_chan1 = ysrc[0]->channels[chan];
-						for( x = 0 ; x < width ; ++x ) 
-							res_chan[x] = src_chan1[x]*vert_gauss[0];
-						for( j = 1 ; j < tail ; ++j ) 
-						{
-							CARD32 *src_chan2 = ysrc[j]->channels[chan];
-							g = vert_gauss[j];
-							src_chan1 = ysrc[-j]->channels[chan];
-							for( x = 0 ; x < width ; ++x ) 
-								res_chan[x] += (src_chan1[x]+src_chan2[x])*g;
-						}
-						for( ; j < vert ; ++j )
-						{
-							g = vert_gauss[j];
-							src_chan1 = ysrc[-j]->channels[chan];
-							for( x = 0 ; x < width ; ++x ) 
-								res_chan[x] += src_chan1[x]*g;
-						}
-						g = vert_gauss_sums[tail];
-						for( x = 0 ; x < width ; ++x ) 
-						{
-							gauss_var_t v = res_chan[x]/g;
-							res_chan[x] = (v&0x03Fc0000)?255:v>>10;
-						}
-					}
-				}
-
-        		imout->output_image_scanline(imout, &result, 1);
-			}
-			/* cleanup */
-			for( y = 0 ; y < lines_count ; ++y ) 
-				free_scanline(&lines_mem[y], True);
-			free( lines_mem );
-			free( lines );
-			free(vert_gauss_sums);
-			free(vert_gauss);
-
-		}
-		free_scanline(&result, True);
-		if( horz_gauss_sums )
-			free(horz_gauss_sums);
-		if( horz_gauss )
-			free(horz_gauss);
-	}
+	if( bb.vert_gauss_sums )
+		free(bb.vert_gauss_sums);
+	if( bb.vert_gauss )
+		free(bb.vert_gauss);
+	if( bb.horz_gauss_sums )
+		free(bb.horz_gauss_sums);
+	if( bb.horz_gauss )
+		free(bb.horz_gauss);
 PRINT_BACKGROUND_OP_TIME;
 
 	stop_image_decoding(&imdec);
@@ -2781,6 +3740,88 @@ static void calc_gauss_int(int radius, GAUSS_COEFF_TYPE* gauss, GAUSS_COEFF_TYPE
 /***********************************************************************
  * Hue,saturation and lightness adjustments.
  **********************************************************************/
+typedef struct ASHSVAdjustBands
+{
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	CARD32 from_hue1, from_hue2, to_hue1, to_hue2 ;
+	int affected_radius ;
+	int hue_offset, saturation_offset, value_offset ;
+	Bool do_greyscale ;
+}ASHSVAdjustBands;
+
+static void
+adjust_hsv_band( void *data, int band_start, int band_end )
+{
+	ASHSVAdjustBands *hb = (ASHSVAdjustBands*)data ;
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	CARD32 from_hue1 = hb->from_hue1, from_hue2 = hb->from_hue2 ;
+	CARD32 to_hue1 = hb->to_hue1, to_hue2 = hb->to_hue2 ;
+	int affected_radius = hb->affected_radius ;
+	int hue_offset = hb->hue_offset ;
+	int saturation_offset = hb->saturation_offset ;
+	int value_offset = hb->value_offset ;
+	Bool do_greyscale = hb->do_greyscale ;
+	int y ;
+
+	if( !start_band_pipeline( hb->imdec, hb->imout, band_start, band_start, &imdec, &imout ) )
+		return;
+
+	for( y = band_start ; y < band_end ; y++  )
+	{
+		register int x = imdec->buffer.width;
+		CARD32 *r = imdec->buffer.red;
+		CARD32 *g = imdec->buffer.green;
+		CARD32 *b = imdec->buffer.blue ;
+		long h, s, v ;
+		imdec->decode_image_scanline( imdec );
+		while( --x >= 0 )
+		{
+			if( (h = rgb2hue( r[x], g[x], b[x] )) != 0 )
+			{
+#ifdef DEBUG_HSV_ADJUSTMENT
+				fprintf( stderr, "IN  %d: rgb = #%4.4lX.%4.4lX.%4.4lX hue = %ld(%d)        range is (%ld - %ld, %ld - %ld), dh = %d\n", __LINE__, r[x], g[x], b[x], h, ((h>>8)*360)>>8, from_hue1, to_hue1, from_hue2, to_hue2, hue_offset );
+#endif
+
+				if( affected_radius >= 180 ||
+					(h >= (int)from_hue1 && h <= (int)to_hue1 ) ||
+					(h >= (int)from_hue2 && h <= (int)to_hue2 ) )
+
+				{
+					s = rgb2saturation( r[x], g[x], b[x] ) + saturation_offset;
+					v = rgb2value( r[x], g[x], b[x] )+value_offset;
+					h += hue_offset ;
+					if( h > MAX_HUE16 )
+						h -= MAX_HUE16 ;
+					else if( h == 0 )
+						h =  MIN_HUE16 ;
+					else if( h < 0 )
+						h += MAX_HUE16 ;
+					if( v < 0 ) v = 0 ;
+					else if( v > 0x00FFFF ) v = 0x00FFFF ;
+
+					if( s < 0 ) s = 0 ;
+					else if( s > 0x00FFFF ) s = 0x00FFFF ;
+
+					hsv2rgb ( (CARD32)h, (CARD32)s, (CARD32)v, &r[x], &g[x], &b[x]);
+
+#ifdef DEBUG_HSV_ADJUSTMENT
+					fprintf( stderr, "OUT %d: rgb = #%4.4lX.%4.4lX.%4.4lX hue = %ld(%ld)     sat = %ld val = %ld\n", __LINE__, r[x], g[x], b[x], h, ((h>>8)*360)>>8, s, v );
+#endif
+				}
+			}else if( do_greyscale ) 
+			{
+				int tmp = (int)r[x] + value_offset ; 
+				g[x] = b[x] = r[x] = (tmp < 0)?0:((tmp>0x00FFFF)?0x00FFff:tmp);
+			}
+		}
+		imdec->buffer.flags = 0xFFFFFFFF ;
+		imout->output_image_scanline( imout, &(imdec->buffer), 1);
+	}
+	stop_band_pipeline( hb->imdec, hb->imout, &imdec, &imout );
+}
+
 ASImage*
 adjust_asimage_hsv( ASVisual *asv, ASImage *src,
 				    int offset_x, int offset_y,
@@ -2810,91 +3851,44 @@ LOCAL_DEBUG_CALLER_OUT( "offset_x = %d, offset_y = %d, to_width = %d, to_height
         destroy_asimage( &dst );
     }else
 	{
-	    CARD32 from_hue1 = 0, from_hue2 = 0, to_hue1 = 0, to_hue2 = 0 ;
-		int y, max_y = to_height;
-		Bool do_greyscale = False ; 
+		ASHSVAdjustBands hb ;
+		int max_y = to_height;
 
+		memset( &hb, 0x00, sizeof(hb));
+		hb.imdec = imdec ;
+		hb.imout = imout ;
 		affected_hue = normalize_degrees_val( affected_hue );
 		affected_radius = normalize_degrees_val( affected_radius );
 		if( value_offset != 0 )
-			do_greyscale = (affected_hue+affected_radius >= 360 || affected_hue-affected_radius <= 0 );
+			hb.do_greyscale = (affected_hue+affected_radius >= 360 || affected_hue-affected_radius <= 0 );
 		if( affected_hue > affected_radius )
 		{
-			from_hue1 = degrees2hue16(affected_hue-affected_radius);
+			hb.from_hue1 = degrees2hue16(affected_hue-affected_radius);
 			if( affected_hue+affected_radius >= 360 )
 			{
-				to_hue1 = MAX_HUE16 ;
-				from_hue2 = MIN_HUE16 ;
-				to_hue2 = degrees2hue16(affected_hue+affected_radius-360);
+				hb.to_hue1 = MAX_HUE16 ;
+				hb.from_hue2 = MIN_HUE16 ;
+				hb.to_hue2 = degrees2hue16(affected_hue+affected_radius-360);
 			}else
-				to_hue1 = degrees2hue16(affected_hue+affected_radius);
+				hb.to_hue1 = degrees2hue16(affected_hue+affected_radius);
 		}else
 		{
-			from_hue1 = degrees2hue16(affected_hue+360-affected_radius);
-			to_hue1 = MAX_HUE16 ;
-			from_hue2 = MIN_HUE16 ;
-			to_hue2 = degrees2hue16(affected_hue+affected_radius);
+			hb.from_hue1 = degrees2hue16(affected_hue+360-affected_radius);
+			hb.to_hue1 = MAX_HUE16 ;
+			hb.from_hue2 = MIN_HUE16 ;
+			hb.to_hue2 = degrees2hue16(affected_hue+affected_radius);
 		}
-		hue_offset = degrees2hue16(hue_offset);
-		saturation_offset = (saturation_offset<<16) / 100;
-		value_offset = (value_offset<<16)/100 ;
+		hb.affected_radius = affected_radius ;
+		hb.hue_offset = degrees2hue16(hue_offset);
+		hb.saturation_offset = (saturation_offset<<16) / 100;
+		hb.value_offset = (value_offset<<16)/100 ;
 LOCAL_DEBUG_OUT("adjusting actually...%s", "");
 		if( to_height > src->height )
 		{
 			imout->tiling_step = src->height ;
 			max_y = src->height ;
 		}
-		for( y = 0 ; y < max_y ; y++  )
-		{
-			register int x = imdec->buffer.width;
-			CARD32 *r = imdec->buffer.red;
-			CARD32 *g = imdec->buffer.green;
-			CARD32 *b = imdec->buffer.blue ;
-			long h, s, v ;
-			imdec->decode_image_scanline( imdec );
-			while( --x >= 0 )
-			{
-				if( (h = rgb2hue( r[x], g[x], b[x] )) != 0 )
-				{
-#ifdef DEBUG_HSV_ADJUSTMENT
-					fprintf( stderr, "IN  %d: rgb = #%4.4lX.%4.4lX.%4.4lX hue = %ld(%d)        range is (%ld - %ld, %ld - %ld), dh = %d\n", __LINE__, r[x], g[x], b[x], h, ((h>>8)*360)>>8, from_hue1, to_hue1, from_hue2, to_hue2, hue_offset );
-#endif
-
-					if( affected_radius >= 180 ||
-						(h >= (int)from_hue1 && h <= (int)to_hue1 ) ||
-						(h >= (int)from_hue2 && h <= (int)to_hue2 ) )
-
-					{
-						s = rgb2saturation( r[x], g[x], b[x] ) + saturation_offset;
-						v = rgb2value( r[x], g[x], b[x] )+value_offset;
-						h += hue_offset ;
-						if( h > MAX_HUE16 )
-							h -= MAX_HUE16 ;
-						else if( h == 0 )
-							h =  MIN_HUE16 ;
-						else if( h < 0 )
-							h += MAX_HUE16 ;
-						if( v < 0 ) v = 0 ;
-						else if( v > 0x00FFFF ) v = 0x00FFFF ;
-
-						if( s < 0 ) s = 0 ;
-						else if( s > 0x00FFFF ) s = 0x00FFFF ;
-
-						hsv2rgb ( (CARD32)h, (CARD32)s, (CARD32)v, &r[x], &g[x], &b[x]);
-
-#ifdef DEBUG_HSV_ADJUSTMENT
-						fprintf( stderr, "OUT %d: rgb = #%4.4lX.%4.4lX.%4.4lX hue = %ld(%ld)     sat = %ld val = %ld\n", __LINE__, r[x], g[x], b[x], h, ((h>>8)*360)>>8, s, v );
-#endif
-					}
-				}else if( do_greyscale ) 
-				{
-					int tmp = (int)r[x] + value_offset ; 
-					g[x] = b[x] = r[x] = (tmp < 0)?0:((tmp>0x00FFFF)?0x00FFff:tmp);
-				}
-			}
-			imdec->buffer.flags = 0xFFFFFFFF ;
-			imout->output_image_scanline( imout, &(imdec->buffer), 1);
-		}
+		run_transform_bands( imout, adjust_hsv_band, &hb, max_y, 1 );
 		stop_image_output( &imout );
 	}
 	stop_image_decoding( &imdec );
@@ -3192,6 +4186,106 @@ slice_asimage( ASVisual *asv, ASImage *src,
 }
 
 
+typedef struct ASPixelizeBands
+{
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	Bool BGR_mode ;
+	int clip_width, max_y ;
+	int pixel_width, pixel_height ;
+}ASPixelizeBands;
+
+/* bands are aligned on pixel_height, so that no block is ever split */
+static void
+pixelize_band( void *data, int band_start, int band_end )
+{
+	ASPixelizeBands *pb = (ASPixelizeBands*)data ;
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	int clip_width = pb->clip_width, max_y = pb->max_y ;
+	int pixel_width = pb->pixel_width, pixel_height = pb->pixel_height ;
+	int y ;
+
+	if( !start_band_pipeline( pb->imdec, pb->imout, band_start, band_start, &imdec, &imout ) )
+		return;
+
+	if( pixel_width > 1 || pixel_height > 1 )
+	{
+		int pixel_h_count = (clip_width+pixel_width-1)/pixel_width;
+		ASScanline *pixels = prepare_scanline( pixel_h_count, 0, NULL, pb->BGR_mode );
+		ASScanline *out_buf = prepare_scanline( clip_width, 0, NULL, pb->BGR_mode );
+		int lines_count = 0;
+
+		out_buf->flags = SCL_DO_ALL;
+		
+		for( y = band_start ; y < band_end ; y++  )
+		{
+			int pixel_x = 0, x ;
+			imdec->decode_image_scanline( imdec );
+			for (x = 0; x < clip_width; x += pixel_width)
+			{
+				int xx = x+pixel_width;
+				ASScanline *srcsl = &(imdec->buffer);
+				
+				if (xx > clip_width)
+					xx = clip_width;
+				
+				while ( --xx >= x)
+				{
+					pixels->red[pixel_x] += srcsl->red[xx];
+					pixels->green[pixel_x] += srcsl->green[xx];
+					pixels->blue[pixel_x] += srcsl->blue[xx];
+					pixels->alpha[pixel_x] += srcsl->alpha[xx];
+				}
+				++pixel_x;
+			}
+			if (++lines_count >= pixel_height || y == max_y-1)
+			{
+				pixel_x = 0;
+				
+				for (x = 0; x < clip_width; x += pixel_width)
+				{
+					int xx = (x + pixel_width> clip_width) ? clip_width : x + pixel_width;
+					int count = (xx - x) * lines_count;
+					CARD32 r = pixels->red [pixel_x] / count;
+					CARD32 g = pixels->green [pixel_x] / count;
+					CARD32 b = pixels->blue [pixel_x] / count;
+					CARD32 a = pixels->alpha [pixel_x] / count;
+					
+					pixels->red [pixel_x] = 0;
+					pixels->green [pixel_x] = 0;
+					pixels->blue [pixel_x] = 0;
+					pixels->alpha [pixel_x] = 0;
+
+					if (xx > clip_width)
+						xx = clip_width;
+
+					while ( --xx >= x)
+					{
+						out_buf->red[xx] 	= r;
+						out_buf->green[xx]  = g;
+						out_buf->blue[xx] 	= b;
+						out_buf->alpha[xx]  = a;
+					}
+
+					++pixel_x;
+				}
+				while (lines_count--)
+					imout->output_image_scanline( imout, out_buf, 1);
+				lines_count = 0;
+			}
+		}
+		free_scanline( out_buf, False );
+		free_scanline( pixels, False );
+	}else
+		for( y = band_start ; y < band_end ; y++  )
+		{
+			imdec->decode_image_scanline( imdec );
+			imout->output_image_scanline( imout, &(imdec->buffer), 1);
+		}
+	stop_band_pipeline( pb->imdec, pb->imout, &imdec, &imout );
+}
+
 ASImage *
 pixelize_asimage( ASVisual *asv, ASImage *src,
 			      int clip_x, int clip_y, int clip_width, int clip_height,
@@ -3238,83 +4332,21 @@ LOCAL_DEBUG_CALLER_OUT( "src = %p, offset_x = %d, offset_y = %d, to_width = %d,
         destroy_asimage( &dst );
     }else
 	{
-		int y, max_y = clip_height;
+		ASPixelizeBands pb ;
 LOCAL_DEBUG_OUT("pixelizing actually...%s", "");
-
-		if( pixel_width > 1 || pixel_height > 1 )
-		{
-			int pixel_h_count = (clip_width+pixel_width-1)/pixel_width;
-			ASScanline *pixels = prepare_scanline( pixel_h_count, 0, NULL, asv->BGR_mode );
-			ASScanline *out_buf = prepare_scanline( clip_width, 0, NULL, asv->BGR_mode );
-			int lines_count = 0;
-
-			out_buf->flags = SCL_DO_ALL;
-			
-			for( y = 0 ; y < max_y ; y++  )
-			{
-				int pixel_x = 0, x ;
-				imdec->decode_image_scanline( imdec );
-				for (x = 0; x < clip_width; x += pixel_width)
-				{
-					int xx = x+pixel_width;
-					ASScanline *srcsl = &(imdec->buffer);
-					
-					if (xx > clip_width)
-						xx = clip_width;
-					
-					while ( --xx >= x)
-					{
-						pixels->red[pixel_x] += srcsl->red[xx];
-						pixels->green[pixel_x] += srcsl->green[xx];
-						pixels->blue[pixel_x] += srcsl->blue[xx];
-						pixels->alpha[pixel_x] += srcsl->alpha[xx];
-					}
-					++pixel_x;
-				}
-				if (++lines_count >= pixel_height || y == max_y-1)
-				{
-					pixel_x = 0;
-					
-					for (x = 0; x < clip_width; x += pixel_width)
-					{
-						int xx = (x + pixel_width> clip_width) ? clip_width : x + pixel_width;
-						int count = (xx - x) * lines_count;
-						CARD32 r = pixels->red [pixel_x] / count;
-						CARD32 g = pixels->green [pixel_x] / count;
-						CARD32 b = pixels->blue [pixel_x] / count;
-						CARD32 a = pixels->alpha [pixel_x] / count;
-						
-						pixels->red [pixel_x] = 0;
-						pixels->green [pixel_x] = 0;
-						pixels->blue [pixel_x] = 0;
-						pixels->alpha [pixel_x] = 0;
-
-						if (xx > clip_width)
-							xx = clip_width;
-
-						while ( --xx >= x)
-						{
-							out_buf->red[xx] 	= r;
-							out_buf->green[xx]  = g;
-							out_buf->blue[xx] 	= b;
-							out_buf->alpha[xx]  = a;
-						}
-
-						++pixel_x;
-					}
-					while (lines_count--)
-						imout->output_image_scanline( imout, out_buf, 1);
-					lines_count = 0;
-				}
-			}
-			free_scanline( out_buf, False );
-			free_scanline( pixels, False );
-		}else
-			for( y = 0 ; y < max_y ; y++  )
-			{
-				imdec->decode_image_scanline( imdec );
-				imout->output_image_scanline( imout, &(imdec->buffer), 1);
-			}
+		pb.imdec = imdec ;
+		pb.imout = imout ;
+		pb.BGR_mode = asv->BGR_mode ;
+		pb.clip_width = clip_width ;
+		pb.max_y = clip_height ;
+		pb.pixel_width = pixel_width ;
+		pb.pixel_height = pixel_height ;
+		/* past the bottom of the source, decoder keeps returning the last
+		 * line it had, so bands must not start there : */
+		if( clip_height <= (int)src->height ) 
+			run_transform_bands( imout, pixelize_band, &pb, clip_height, pixel_height );
+		else
+			pixelize_band( &pb, 0, clip_height );
 		stop_image_output( &imout );
 	}
 	stop_image_decoding( &imdec );
@@ -3323,6 +4355,87 @@ LOCAL_DEBUG_OUT("pixelizing actually...%s", "");
 	return dst;
 }
 
+typedef struct ASColor2AlphaBands
+{
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	CARD32 cr, cg, cb ;
+}ASColor2AlphaBands;
+
+static void
+color2alpha_band( void *data, int band_start, int band_end )
+{
+	ASColor2AlphaBands *c2a = (ASColor2AlphaBands*)data ;
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	CARD32 cr = c2a->cr ;
+	CARD32 cg = c2a->cg ;
+	CARD32 cb = c2a->cb ;
+	int y ;
+
+	if( !start_band_pipeline( c2a->imdec, c2a->imout, band_start, band_start, &imdec, &imout ) )
+		return;
+
+	for( y = band_start ; y < band_end ; y++  )
+	{
+		int x ;
+		ASScanline *srcsl = &(imdec->buffer);
+		imdec->decode_image_scanline( imdec );
+		for (x = 0; x < imdec->buffer.width; ++x)
+		{
+			CARD32 r = srcsl->red[x];
+			CARD32 g = srcsl->green[x];
+			CARD32 b = srcsl->blue[x];
+			CARD32 a = srcsl->alpha[x];
+			/* the following logic is stolen from gimp and altered for our color format and beauty*/
+			{
+				CARD32 aa = a, ar, ag, ab;
+				
+#define AS_MIN_CHAN_VAL 	2			/* GIMP uses 0.0001 */
+#define AS_MAX_CHAN_VAL 	255			/* GIMP uses 1.0 */
+#define MAKE_CHAN_ALPHA_FROM_COL(chan) \
+				((c##chan < AS_MIN_CHAN_VAL)? (chan)<<4 : \
+					((chan > c##chan)? ((chan - c##chan)<<12) / (AS_MAX_CHAN_VAL - c##chan) : \
+						((c##chan - chan)<<12) / c##chan))
+
+				ar = MAKE_CHAN_ALPHA_FROM_COL(r);
+				ag = MAKE_CHAN_ALPHA_FROM_COL(g);
+				ab = MAKE_CHAN_ALPHA_FROM_COL(b);
+#undef 	MAKE_CHAN_ALPHA_FROM_COL
+		
+#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
+fprintf (stderr, "color2alpha():%d: src(argb): %8.8X %8.8X %8.8X %8.8X; ", __LINE__, a, r, g, b);
+#endif
+  					a = (ar > ag) ? max(ar, ab) : max(ag,ab);
+#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
+fprintf (stderr, "alpha: (%8.8X %8.8X %8.8X)->%8.8X; ", ar, ag, ab, a);
+#endif
+
+				if (a == 0) a = 1;
+#if defined(USE_STUPID_GIMP_WAY_DESTROYING_COLORS)
+#define APPLY_ALPHA_TO_CHAN(chan)  ({int __s = chan; int __c = c##chan; __c += (( __s - __c)*4096)/(int)a;(__c<=0)?0:((__c>=255)?255:__c);})
+#else
+#define APPLY_ALPHA_TO_CHAN(chan)	chan	
+#endif
+  				srcsl->red[x] 	= APPLY_ALPHA_TO_CHAN(r);
+				srcsl->green[x] 	= APPLY_ALPHA_TO_CHAN(g);
+	  			srcsl->blue[x] 	= APPLY_ALPHA_TO_CHAN(b);
+#undef APPLY_ALPHA_TO_CHAN
+				a = a*aa>>12;
+  				srcsl->alpha[x] = (a>255)?255:a;
+
+#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
+fprintf (stderr, "result: %8.8X %8.8X %8.8X %8.8X.\n", srcsl->alpha[x], srcsl->red[x], srcsl->green[x], srcsl->blue[x]);
+#endif
+
+			}
+			/* end of gimp code */
+		}
+		imout->output_image_scanline( imout, srcsl, 1);
+	}
+	stop_band_pipeline( c2a->imdec, c2a->imout, &imdec, &imout );
+}
+
 ASImage *
 color2alpha_asimage( ASVisual *asv, ASImage *src,
 			         int clip_x, int clip_y, int clip_width, int clip_height,
@@ -3360,7 +4473,8 @@ LOCAL_DEBUG_CALLER_OUT( "src = %p, offset_x = %d, offset_y = %d, to_width = %d,
         destroy_asimage( &dst );
     }else
 	{
-		int y, max_y = min(clip_height,(int)src->height);
+		ASColor2AlphaBands c2a ;
+		int max_y = min(clip_height,(int)src->height);
 		CARD32 cr = ARGB32_RED8(color);
 		CARD32 cg = ARGB32_GREEN8(color);
 		CARD32 cb = ARGB32_BLUE8(color);
@@ -3368,63 +4482,354 @@ LOCAL_DEBUG_CALLER_OUT( "src = %p, offset_x = %d, offset_y = %d, to_width = %d,
 fprintf (stderr, "color2alpha():%d: color: red = 0x%8.8X green = 0x%8.8X blue = 0x%8.8X\n", __LINE__, cr, cg, cb);
 #endif
 
-		for( y = 0 ; y < max_y ; y++  )
+		c2a.imdec = imdec ;
+		c2a.imout = imout ;
+		c2a.cr = cr ;
+		c2a.cg = cg ;
+		c2a.cb = cb ;
+		run_transform_bands( imout, color2alpha_band, &c2a, max_y, 1 );
+		stop_image_output( &imout );
+	}
+	stop_image_decoding( &imdec );
+
+	SHOW_TIME("", started);
+	return dst;
+}
+
+/* ***************************************************************************/
+/* Affine transformations : rotation by arbitrary angle, skew, etc.			*/
+/* ***************************************************************************/
+/* Source rows are kept in a ring of packed ARGB32 rows, padded with 2 pixels
+ * on each side and with 2 virtual rows above and below the image. Padding
+ * has the color of the nearest edge pixel and zero alpha, so that filters
+ * never have to check for boundaries and edges come out antialiased : */
+#define AFFINE_BORDER	2
+
+typedef struct ASAffineBands
+{
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	int 		src_width, src_height ;
+	int 		to_width ;
+	int 		filter ;
+	int 		ring_size ;
+	/* source position of the center of the output pixel (0,0) and
+	 * its increments along x and y axis of the output : */
+	double 		sx0, sy0 ;
+	double 		dxx, dyx, dxy, dyy ;
+}ASAffineBands;
+
+typedef struct ASAffineRing
+{
+	CARD32 **rows ;
+	int 	*row_y ;
+	int 	 size ;
+}ASAffineRing;
+
+static void
+load_affine_row( ASAffineBands *ab, ASImageDecoder *imdec, CARD32 *dst, int y )
+{
+	ASScanline *sl = &(imdec->buffer);
+	int width = ab->src_width ;
+	int x ;
+	CARD32 alpha_mask = 0xFFFFFFFF;
+	CARD32 *a = sl->alpha, *r = sl->red, *g = sl->green, *b = sl->blue ;
+
+	if( y < 0 || y >= ab->src_height )
+	{
+		alpha_mask = 0x00FFFFFF ;
+		y = (y < 0)?0:ab->src_height-1 ;
+	}
+	imdec->next_line = imdec->offset_y + y ;
+	imdec->decode_image_scanline( imdec );
+
+	dst += AFFINE_BORDER ;
+	for( x = 0 ; x < width ; ++x )
+		dst[x] = MAKE_ARGB32(a[x],r[x],g[x],b[x])&alpha_mask ;
+	for( x = 1 ; x <= AFFINE_BORDER ; ++x )
+	{
+		dst[-x] = dst[0]&0x00FFFFFF ;
+		dst[width-1+x] = dst[width-1]&0x00FFFFFF ;
+	}
+}
+
+/* Keys cubic convolution kernel with a = -0.5 */
+static inline void
+bicubic_weights( float t, float *w )
+{
+	float t2 = t*t, t3 = t2*t ;
+	w[0] = -0.5f*t3 + t2 - 0.5f*t ;
+	w[1] = 1.5f*t3 - 2.5f*t2 + 1.0f ;
+	w[2] = -1.5f*t3 + 2.0f*t2 + 0.5f*t ;
+	w[3] = 0.5f*t3 - 0.5f*t2 ;
+}
+
+static inline CARD32
+affine_clamp_channel( float v )
+{
+	if( v <= 0.0f )
+		return 0;
+	if( v >= 255.0f )
+		return 255 ;
+	return (CARD32)(v+0.5f);
+}
+
+/* taps is 2 for bilinear and 4 for bicubic filter, rows point to the first
+ * pixel of each of the taps rows, that needs to be used : */
+static CARD32
+affine_pixel( CARD32 **rows, int taps, float *wx, float *wy )
+{
+	float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	int i, j, chan ;
+	for( j = 0 ; j < taps ; ++j )
+	{
+		CARD32 *p = rows[j] ;
+		for( chan = 0 ; chan < 4 ; ++chan )
 		{
-			int x ;
-			ASScanline *srcsl = &(imdec->buffer);
-			imdec->decode_image_scanline( imdec );
-			for (x = 0; x < imdec->buffer.width; ++x)
-			{
-				CARD32 r = srcsl->red[x];
-				CARD32 g = srcsl->green[x];
-				CARD32 b = srcsl->blue[x];
-				CARD32 a = srcsl->alpha[x];
-				/* the following logic is stolen from gimp and altered for our color format and beauty*/
-				{
-					CARD32 aa = a, ar, ag, ab;
-					
-#define AS_MIN_CHAN_VAL 	2			/* GIMP uses 0.0001 */
-#define AS_MAX_CHAN_VAL 	255			/* GIMP uses 1.0 */
-#define MAKE_CHAN_ALPHA_FROM_COL(chan) \
-					((c##chan < AS_MIN_CHAN_VAL)? (chan)<<4 : \
-						((chan > c##chan)? ((chan - c##chan)<<12) / (AS_MAX_CHAN_VAL - c##chan) : \
-							((c##chan - chan)<<12) / c##chan))
+			int shift = chan*8 ;
+			float row = wx[0]*(float)((p[0]>>shift)&0x00FF) ;
+			for( i = 1 ; i < taps ; ++i )
+				row = row + wx[i]*(float)((p[i]>>shift)&0x00FF) ;
+			acc[chan] = acc[chan] + wy[j]*row ;
+		}
+	}
+	return  (affine_clamp_channel(acc[3])<<24)|(affine_clamp_channel(acc[2])<<16)|
+			(affine_clamp_channel(acc[1])<<8)|affine_clamp_channel(acc[0]);
+}
 
-					ar = MAKE_CHAN_ALPHA_FROM_COL(r);
-					ag = MAKE_CHAN_ALPHA_FROM_COL(g);
-					ab = MAKE_CHAN_ALPHA_FROM_COL(b);
-#undef 	MAKE_CHAN_ALPHA_FROM_COL
-			
-#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
-fprintf (stderr, "color2alpha():%d: src(argb): %8.8X %8.8X %8.8X %8.8X; ", __LINE__, a, r, g, b);
-#endif
-  					a = (ar > ag) ? max(ar, ab) : max(ag,ab);
-#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
-fprintf (stderr, "alpha: (%8.8X %8.8X %8.8X)->%8.8X; ", ar, ag, ab, a);
-#endif
+#ifdef HAVE_SSE2
+static inline SSE2_FUNC __m128
+sse2_argb32_to_ps( __m128i p )
+{
+	return _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( p, _mm_setzero_si128() ), _mm_setzero_si128() ) );
+}
 
-					if (a == 0) a = 1;
-#if defined(USE_STUPID_GIMP_WAY_DESTROYING_COLORS)
-#define APPLY_ALPHA_TO_CHAN(chan)  ({int __s = chan; int __c = c##chan; __c += (( __s - __c)*4096)/(int)a;(__c<=0)?0:((__c>=255)?255:__c);})
-#else
-#define APPLY_ALPHA_TO_CHAN(chan)	chan	
+/* same math as in affine_pixel() above, with all 4 channels at once : */
+static SSE2_FUNC CARD32
+affine_pixel_sse2( CARD32 **rows, int taps, float *wx, float *wy )
+{
+	__m128 acc = _mm_setzero_ps();
+	int i, j ;
+	for( j = 0 ; j < taps ; ++j )
+	{
+		CARD32 *p = rows[j] ;
+		__m128 row = _mm_mul_ps( _mm_set1_ps( wx[0] ), sse2_argb32_to_ps( _mm_cvtsi32_si128( p[0] ) ) );
+		for( i = 1 ; i < taps ; ++i )
+			row = _mm_add_ps( row, _mm_mul_ps( _mm_set1_ps( wx[i] ), sse2_argb32_to_ps( _mm_cvtsi32_si128( p[i] ) ) ) );
+		acc = _mm_add_ps( acc, _mm_mul_ps( _mm_set1_ps( wy[j] ), row ) );
+	}
+	acc = _mm_min_ps( _mm_max_ps( acc, _mm_setzero_ps() ), _mm_set1_ps( 255.0f ) );
+	{
+		__m128i v = _mm_cvttps_epi32( _mm_add_ps( acc, _mm_set1_ps( 0.5f ) ) );
+		/* 255 + 0.5 truncates back to 255, and 0 stays 0, so that matches
+		 * affine_clamp_channel() */
+		v = _mm_packs_epi32( v, v );
+		return _mm_cvtsi128_si32( _mm_packus_epi16( v, v ) );
+	}
+}
 #endif
-	  				srcsl->red[x] 	= APPLY_ALPHA_TO_CHAN(r);
-					srcsl->green[x] 	= APPLY_ALPHA_TO_CHAN(g);
-		  			srcsl->blue[x] 	= APPLY_ALPHA_TO_CHAN(b);
-#undef APPLY_ALPHA_TO_CHAN
-					a = a*aa>>12;
-	  				srcsl->alpha[x] = (a>255)?255:a;
 
-#if defined(LOCAL_DEBUG) && !defined(NO_DEBUG_OUTPUT)					
-fprintf (stderr, "result: %8.8X %8.8X %8.8X %8.8X.\n", src->alpha[x], src->red[x], src->green[x], src->blue[x]);
+typedef CARD32 (*ASAffinePixelFunc)( CARD32 **rows, int taps, float *wx, float *wy );
+
+static void
+affine_band( void *data, int band_start, int band_end )
+{
+	ASAffineBands *ab = (ASAffineBands*)data ;
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	ASAffineRing ring ;
+	ASScanline result ;
+	ASAffinePixelFunc pixel_func = affine_pixel ;
+	CARD32 *packed ;
+	int taps = (ab->filter == TRANSFORM_FILTER_BICUBIC)?4:2 ;
+	int tap_offset = (taps == 4)?1:0 ;
+	int row_len = ab->src_width + AFFINE_BORDER*2 ;
+	int to_width = ab->to_width ;
+	int x, y, i ;
+
+	if( !start_band_pipeline( ab->imdec, ab->imout, band_start, band_start, &imdec, &imout ) )
+		return;
+#ifdef HAVE_SSE2
+	if( asimage_sse2_supported() )
+		pixel_func = affine_pixel_sse2 ;
 #endif
+	ring.size = ab->ring_size ;
+	ring.rows = safemalloc( ring.size*sizeof(CARD32*) );
+	ring.row_y = safemalloc( ring.size*sizeof(int) );
+	ring.rows[0] = safemalloc( ring.size*row_len*sizeof(CARD32) );
+	for( i = 0 ; i < ring.size ; ++i )
+	{
+		ring.rows[i] = ring.rows[0] + i*row_len ;
+		ring.row_y[i] = -AFFINE_BORDER-1 ;
+	}
+	packed = safemalloc( to_width*sizeof(CARD32) );
+	prepare_scanline( to_width, 0, &result, imdec->asv->BGR_mode );
+	result.flags = SCL_DO_ALL ;
+	result.back_color = 0x00000000 ;
 
-				}
-				/* end of gimp code */
+	for( y = band_start ; y < band_end ; ++y )
+	{
+		double sx = ab->sx0 + ab->dxy*y ;
+		double sy = ab->sy0 + ab->dyy*y ;
+		double sy_end = sy + ab->dyx*(to_width-1);
+		int first = (int)floor( min(sy,sy_end) ) - tap_offset ;
+		int last = (int)floor( max(sy,sy_end) ) + taps - tap_offset - 1 ;
+
+		if( first < -AFFINE_BORDER )
+			first = -AFFINE_BORDER ;
+		if( last > ab->src_height-1+AFFINE_BORDER )
+			last = ab->src_height-1+AFFINE_BORDER ;
+		for( i = first ; i <= last ; ++i )
+		{
+			int slot = (i+AFFINE_BORDER)%ring.size ;
+			if( ring.row_y[slot] != i )
+			{
+				load_affine_row( ab, imdec, ring.rows[slot], i );
+				ring.row_y[slot] = i ;
+			}
+		}
+
+		for( x = 0 ; x < to_width ; ++x, sx += ab->dxx, sy += ab->dyx )
+		{
+			/* offset keeps truncation same as floor() for coordinates we care about */
+			int ix = (int)(sx+(double)(AFFINE_BORDER+1)) - (AFFINE_BORDER+1) ;
+			int iy = (int)(sy+(double)(AFFINE_BORDER+1)) - (AFFINE_BORDER+1) ;
+			CARD32 *rows[4] ;
+			float wx[4], wy[4] ;
+
+			if( ix < -1 || ix >= ab->src_width || iy < -1 || iy >= ab->src_height )
+			{
+				packed[x] = 0 ;
+				continue;
+			}
+			if( taps == 2 )
+			{
+				wx[1] = (float)(sx - ix) ;
+				wx[0] = 1.0f - wx[1] ;
+				wy[1] = (float)(sy - iy) ;
+				wy[0] = 1.0f - wy[1] ;
+			}else
+			{
+				bicubic_weights( (float)(sx - ix), wx );
+				bicubic_weights( (float)(sy - iy), wy );
+			}
+			for( i = 0 ; i < taps ; ++i )
+			{
+				int row = iy + i - tap_offset ;
+				rows[i] = ring.rows[(row+AFFINE_BORDER)%ring.size] + AFFINE_BORDER + ix - tap_offset ;
 			}
-			imout->output_image_scanline( imout, srcsl, 1);
+			packed[x] = pixel_func( rows, taps, wx, wy );
+		}
+		for( x = 0 ; x < to_width ; ++x )
+		{
+			CARD32 c = packed[x] ;
+			result.alpha[x] = ARGB32_ALPHA8(c);
+			result.red[x]   = ARGB32_RED8(c);
+			result.green[x] = ARGB32_GREEN8(c);
+			result.blue[x]  = ARGB32_BLUE8(c);
+		}
+		imout->output_image_scanline( imout, &result, 1 );
+	}
+
+	free_scanline( &result, True );
+	free( packed );
+	free( ring.rows[0] );
+	free( ring.rows );
+	free( ring.row_y );
+	stop_band_pipeline( ab->imdec, ab->imout, &imdec, &imout );
+}
+
+ASImage *
+transform_asimage( ASVisual *asv, ASImage *src,
+				   const ASAffineTransform *matrix,
+				   int to_width, int to_height, int filter,
+				   ASAltImFormats out_format, unsigned int compression_out, int quality )
+{
+	ASImage *dst = NULL ;
+	ASImageDecoder *imdec ;
+	ASImageOutput  *imout ;
+	ASAffineTransform m ;
+	double det ;
+	START_TIME(started);
+
+	if( src == NULL || matrix == NULL )
+		return NULL;
+	if( asv == NULL ) 	asv = &__transform_fake_asv ;
+
+	m = *matrix ;
+	det = m.xx*m.yy - m.xy*m.yx ;
+	if( fabs(det) < 1e-9 )
+		return NULL;
+
+	if( to_width <= 0 || to_height <= 0 )
+	{/* fit bounding box of the transformed image : */
+		double cx[4], cy[4], min_x, max_x, min_y, max_y ;
+		int i ;
+		for( i = 0 ; i < 4 ; ++i )
+		{
+			double x = (i&0x01)?src->width:0 ;
+			double y = (i&0x02)?src->height:0 ;
+			cx[i] = m.xx*x + m.xy*y ;
+			cy[i] = m.yx*x + m.yy*y ;
+		}
+		min_x = max_x = cx[0] ;
+		min_y = max_y = cy[0] ;
+		for( i = 1 ; i < 4 ; ++i )
+		{
+			min_x = min(min_x, cx[i]);
+			max_x = max(max_x, cx[i]);
+			min_y = min(min_y, cy[i]);
+			max_y = max(max_y, cy[i]);
+		}
+		/* tolerate rounding errors, so that 90 degrees rotation is not off by a pixel : */
+		min_x = floor( min_x + 1e-6 );
+		min_y = floor( min_y + 1e-6 );
+		if( to_width <= 0 )
+		{
+			to_width = (int)ceil( max_x - 1e-6 - min_x );
+			m.x0 = -min_x ;
+		}
+		if( to_height <= 0 )
+		{
+			to_height = (int)ceil( max_y - 1e-6 - min_y );
+			m.y0 = -min_y ;
 		}
+	}
+	if( to_width <= 0 || to_height <= 0 )
+		return NULL;
+
+LOCAL_DEBUG_CALLER_OUT( "src = %p, matrix = (%f,%f,%f,%f,%f,%f), to_width = %d, to_height = %d", src, m.xx, m.xy, m.yx, m.yy, m.x0, m.y0, to_width, to_height );
+	if( (imdec = start_image_decoding(asv, src, SCL_DO_ALL, 0, 0, src->width, 0, NULL)) == NULL )
+		return NULL;
+
+	dst = create_destination_image( to_width, to_height, out_format, compression_out, src->back_color&0x00FFFFFF );
+	if((imout = start_image_output( asv, dst, out_format, 0, quality)) == NULL )
+	{
+        destroy_asimage( &dst );
+    }else
+	{
+		ASAffineBands ab ;
+		double span ;
+
+		ab.imdec = imdec ;
+		ab.imout = imout ;
+		ab.src_width = src->width ;
+		ab.src_height = src->height ;
+		ab.to_width = to_width ;
+		ab.filter = filter ;
+		/* inverse transformation, mapping centers of destination pixels
+		 * onto source pixel grid : */
+		ab.dxx =  m.yy/det ;
+		ab.dyx = -m.yx/det ;
+		ab.dxy = -m.xy/det ;
+		ab.dyy =  m.xx/det ;
+		ab.sx0 = ab.dxx*(0.5-m.x0) + ab.dxy*(0.5-m.y0) - 0.5 ;
+		ab.sy0 = ab.dyx*(0.5-m.x0) + ab.dyy*(0.5-m.y0) - 0.5 ;
+		/* number of source rows single destination row touches : */
+		span = ceil( fabs(ab.dyx)*(to_width-1) ) + 5 ;
+		ab.ring_size = (span < (double)(src->height + AFFINE_BORDER*2))?(int)span:(int)src->height + AFFINE_BORDER*2 ;
+
+		run_transform_bands( imout, affine_band, &ab, to_height, 1 );
 		stop_image_output( &imout );
 	}
 	stop_image_decoding( &imdec );
@@ -3433,6 +4838,288 @@ fprintf (stderr, "result: %8.8X %8.8X %8.8X %8.8X.\n", src->alpha[x], src->red[x
 	return dst;
 }
 
+ASImage *
+rotate_asimage( ASVisual *asv, ASImage *src, double angle,
+				int to_width, int to_height, int filter,
+				ASAltImFormats out_format, unsigned int compression_out, int quality )
+{
+	ASAffineTransform m ;
+	double a, s, c ;
+
+	if( src == NULL )
+		return NULL;
+
+	angle = fmod( angle, 360.0 );
+	if( angle < 0 )
+		angle += 360.0 ;
+	if( fmod( angle, 90.0 ) == 0.0 && to_width <= 0 && to_height <= 0 )
+	{/* that we can do exactly and faster : */
+		int flip = (int)(angle/90.0) ;
+		int width = (flip&0x01)?src->height:src->width ;
+		int height = (flip&0x01)?src->width:src->height ;
+		if( flip == 0 )
+			return tile_asimage( asv, src, 0, 0, width, height, TINT_LEAVE_SAME, out_format, compression_out, quality );
+		return flip_asimage( asv, src, 0, 0, width, height, flip, out_format, compression_out, quality );
+	}
+
+	a = angle*(3.14159265358979323846/180.0) ;
+	s = sin(a);
+	c = cos(a);
+	/* counterclockwise, same as flip_asimage() with FLIP_VERTICAL : */
+	m.xx = c ;  m.xy = s ;
+	m.yx = -s ; m.yy = c ;
+	/* rotating around the center of the image, and placing it in the
+	 * center of the destination : */
+	m.x0 = (to_width > 0)?to_width*0.5 - (c*src->width*0.5 + s*src->height*0.5):0 ;
+	m.y0 = (to_height > 0)?to_height*0.5 - (c*src->height*0.5 - s*src->width*0.5):0 ;
+	return transform_asimage( asv, src, &m, to_width, to_height, filter, out_format, compression_out, quality );
+}
+
+
+/*********************************************************************************/
+/* Test that transformations produce the same images however they are run :     */
+/*********************************************************************************/
+#ifdef TEST_TRANSFORM
+#include "afterimage.h"
+
+#define TRANSFORM_TEST_WIDTH	211
+#define TRANSFORM_TEST_HEIGHT	301
+#define TRANSFORM_TEST_THREADS	4
+
+static CARD32 transform_test_seed = 345824357;
+
+static CARD32
+transform_test_value()
+{
+	transform_test_seed = (1664525L*transform_test_seed)+1013904223L ;
+	return transform_test_seed>>8 ;
+}
+
+static ASImage *
+make_test_image( int width, int height )
+{
+	ASImage *im = create_asimage( width, height, 0 );
+	ASImageOutput *imout = start_image_output( NULL, im, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT );
+	ASScanline sl ;
+	int x, y, c ;
+
+	prepare_scanline( width, 0, &sl, False );
+	sl.flags = SCL_DO_ALL ;
+	for( y = 0 ; y < height ; ++y )
+	{
+		/* some smooth areas and some noise, so that RLE has something to do : */
+		for( c = 0 ; c < IC_NUM_CHANNELS ; ++c )
+			for( x = 0 ; x < width ; ++x )
+				sl.channels[c][x] = ((x/7+y/5)&1)?(transform_test_value()&0x00FF):((c*60+x+y)&0x00FF);
+		imout->output_image_scanline( imout, &sl, 1 );
+	}
+	stop_image_output( &imout );
+	free_scanline( &sl, True );
+	return im;
+}
+
+static Bool
+test_images_identical( ASImage *a, ASImage *b )
+{
+	ASImageDecoder *da, *db ;
+	Bool same = True ;
+	int y, c ;
+
+	if( a == NULL || b == NULL )
+		return False;
+	if( a->width != b->width || a->height != b->height )
+		return False;
+	da = start_image_decoding( NULL, a, SCL_DO_ALL, 0, 0, a->width, a->height, NULL );
+	db = start_image_decoding( NULL, b, SCL_DO_ALL, 0, 0, b->width, b->height, NULL );
+	for( y = 0 ; y < (int)a->height && same ; ++y )
+	{
+		da->decode_image_scanline( da );
+		db->decode_image_scanline( db );
+		for( c = 0 ; c < IC_NUM_CHANNELS && same ; ++c )
+			same = (memcmp( da->buffer.channels[c], db->buffer.channels[c], a->width*sizeof(CARD32) ) == 0) ;
+	}
+	stop_image_decoding( &da );
+	stop_image_decoding( &db );
+	return same;
+}
+
+static ASImage *
+run_banded_test( int test, ASImage *src )
+{
+	switch( test )
+	{
+		case 0 : return blur_asimage_gauss( NULL, src, 5.0, 3.0, SCL_DO_ALL, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT );
+		case 1 : return adjust_asimage_hsv( NULL, src, 0, 0, src->width, src->height, 0, 360, 40, 20, 10, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT );
+		case 2 : return pixelize_asimage( NULL, src, 3, 7, src->width-10, src->height-20, 6, 9, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT );
+		case 3 : return color2alpha_asimage( NULL, src, 5, 3, src->width-5, src->height-3, 0xFF3C7890, ASA_ASImage, 0, ASIMAGE_QUALITY_DEFAULT );
+	}
+	return NULL;
+}
+
+#define MERGE_TEST_REPS		100
+#define MERGE_TEST_LAYERS	4
+
+/* random layer, with clip rectangle inside its image : */
+static void
+make_test_layer( ASImageLayer *layer, ASImage *im, int dst_width, int dst_height )
+{
+	init_image_layers( layer, 1 );
+	layer->im = im ;
+	layer->clip_width = 1+transform_test_value()%im->width ;
+	layer->clip_height = 1+transform_test_value()%im->height ;
+	layer->clip_x = transform_test_value()%(im->width-layer->clip_width+1) ;
+	layer->clip_y = transform_test_value()%(im->height-layer->clip_height+1) ;
+	layer->dst_x = (int)(transform_test_value()%(dst_width+20))-10 ;
+	layer->dst_y = (int)(transform_test_value()%(dst_height+20))-10 ;
+	layer->merge_scanlines = (transform_test_value()&1)?alphablend_scanlines:allanon_scanlines ;
+}
+
+/* same layers, with images cropped to their clip rectangles beforehand : */
+static void
+crop_test_layers( ASImageLayer *layers, ASImageLayer *cropped, int count )
+{
+	int l ;
+	for( l = 0 ; l < count ; ++l )
+	{
+		cropped[l] = layers[l] ;
+		cropped[l].im = tile_asimage( NULL, layers[l].im, layers[l].clip_x, layers[l].clip_y,
+									  layers[l].clip_width, layers[l].clip_height, 0,
+									  ASA_ASImage, 0, ASIMAGE_QUALITY_GOOD );
+		cropped[l].clip_x = cropped[l].clip_y = 0 ;
+	}
+}
+
+static void
+destroy_cropped_layers( ASImageLayer *cropped, int count )
+{
+	int l ;
+	for( l = 0 ; l < count ; ++l )
+		if( cropped[l].im )
+			destroy_asimage( &(cropped[l].im) );
+}
+
+static Bool
+test_merge_layers_clipped( ASImage **srcs, int srcs_num, int width, int height )
+{
+	ASImageLayer layers[MERGE_TEST_LAYERS], cropped[MERGE_TEST_LAYERS] ;
+	ASImage *ref, *res ;
+	int l ;
+	Bool ok ;
+
+	for( l = 0 ; l < MERGE_TEST_LAYERS ; ++l )
+		make_test_layer( &layers[l], srcs[transform_test_value()%srcs_num], width, height );
+	/* background has to cover the whole image : */
+	layers[0].dst_x = layers[0].dst_y = 0 ;
+	layers[0].clip_width = width ;
+	layers[0].clip_height = height ;
+	layers[0].clip_x = transform_test_value()%(layers[0].im->width-width+1) ;
+	layers[0].clip_y = 1+transform_test_value()%(layers[0].im->height-height) ;
+
+	crop_test_layers( layers, cropped, MERGE_TEST_LAYERS );
+	ref = merge_layers( NULL, cropped, MERGE_TEST_LAYERS, width, height, ASA_ASImage, 0, ASIMAGE_QUALITY_GOOD );
+	res = merge_layers( NULL, layers, MERGE_TEST_LAYERS, width, height, ASA_ASImage, 0, ASIMAGE_QUALITY_GOOD );
+	ok = test_images_identical( ref, res );
+	destroy_cropped_layers( cropped, MERGE_TEST_LAYERS );
+	if( ref ) destroy_asimage( &ref );
+	if( res ) destroy_asimage( &res );
+	return ok;
+}
+
+/* Error diffusion along the row carries over from pixels that were not 
+ * recomposed, so only FAST quality is expected to match full merge exactly : */
+static Bool
+test_merge_layers_damaged( ASImage **srcs, int srcs_num, int width, int height )
+{
+	ASImageLayer layers[MERGE_TEST_LAYERS] ;
+	XRectangle damage[2] ;
+	ASImage *ref, *res ;
+	int l, changed ;
+	Bool ok ;
+
+	for( l = 0 ; l < MERGE_TEST_LAYERS ; ++l )
+		make_test_layer( &layers[l], srcs[transform_test_value()%srcs_num], width, height );
+	layers[0].dst_x = layers[0].dst_y = 0 ;
+	layers[0].clip_width = width ;
+	layers[0].clip_height = height ;
+	layers[0].clip_x = transform_test_value()%(layers[0].im->width-width+1) ;
+	layers[0].clip_y = 1+transform_test_value()%(layers[0].im->height-height) ;
+
+	res = merge_layers( NULL, layers, MERGE_TEST_LAYERS, width, height, ASA_ASImage, 0, ASIMAGE_QUALITY_FAST );
+	/* move one of the layers and show different part of its image : */
+	changed = 1+transform_test_value()%(MERGE_TEST_LAYERS-1) ;
+	damage[0].x = layers[changed].dst_x ;
+	damage[0].y = layers[changed].dst_y ;
+	damage[0].width = layers[changed].clip_width ;
+	damage[0].height = layers[changed].clip_height ;
+	make_test_layer( &layers[changed], srcs[transform_test_value()%srcs_num], width, height );
+	damage[1].x = layers[changed].dst_x ;
+	damage[1].y = layers[changed].dst_y ;
+	damage[1].width = layers[changed].clip_width ;
+	damage[1].height = layers[changed].clip_height ;
+
+	ref = merge_layers( NULL, layers, MERGE_TEST_LAYERS, width, height, ASA_ASImage, 0, ASIMAGE_QUALITY_FAST );
+	ok = (res != NULL && merge_layers_damaged( NULL, layers, MERGE_TEST_LAYERS, res, &damage[0], 2, ASIMAGE_QUALITY_FAST ));
+	ok = ok && test_images_identical( ref, res );
+	if( ref ) destroy_asimage( &ref );
+	if( res ) destroy_asimage( &res );
+	return ok;
+}
+
+int main(int argc, char **argv )
+{
+	static char *banded_tests[] = { "blur_asimage_gauss", "adjust_asimage_hsv", "pixelize_asimage", "color2alpha_asimage", NULL };
+	ASImage *src ;
+	int t, failed = 0 ;
+
+	set_output_threshold( 10 );
+
+	src = make_test_image( TRANSFORM_TEST_WIDTH, TRANSFORM_TEST_HEIGHT );
+	for( t = 0 ; banded_tests[t] != NULL ; ++t )
+	{
+		ASImage *ref, *res ;
+		Bool ok ;
+
+		fprintf( stderr, "Testing %s with %d threads ...", banded_tests[t], TRANSFORM_TEST_THREADS );
+		set_asimage_thread_count( 1 );
+		ref = run_banded_test( t, src );
+		set_asimage_thread_count( TRANSFORM_TEST_THREADS );
+		res = run_banded_test( t, src );
+		ok = test_images_identical( ref, res );
+		fprintf( stderr, "%s\n", ok?"success":"FAILED" );
+		if( !ok )
+			++failed ;
+		if( ref ) destroy_asimage( &ref );
+		if( res ) destroy_asimage( &res );
+	}
+	set_asimage_thread_count( 1 );
+
+	{
+		ASImage *srcs[3] ;
+		int rep, damaged_failed = 0, clipped_failed = 0 ;
+
+		srcs[0] = src ;
+		srcs[1] = make_test_image( 97, 131 );
+		srcs[2] = make_test_image( 240, 60 );
+		fprintf( stderr, "Testing merge_layers with clipped layers ..." );
+		for( rep = 0 ; rep < MERGE_TEST_REPS ; ++rep )
+			if( !test_merge_layers_clipped( srcs, 3, 50+transform_test_value()%40, 20+transform_test_value()%30 ) )
+				++clipped_failed ;
+		fprintf( stderr, "%s\n", clipped_failed?"FAILED":"success" );
+		fprintf( stderr, "Testing merge_layers_damaged ..." );
+		for( rep = 0 ; rep < MERGE_TEST_REPS ; ++rep )
+			if( !test_merge_layers_damaged( srcs, 3, 50+transform_test_value()%40, 20+transform_test_value()%30 ) )
+				++damaged_failed ;
+		fprintf( stderr, "%s\n", damaged_failed?"FAILED":"success" );
+		if( clipped_failed || damaged_failed )
+			++failed ;
+		destroy_asimage( &srcs[1] );
+		destroy_asimage( &srcs[2] );
+	}
+	destroy_asimage_thread_pool();
+	destroy_asimage( &src );
+	return (failed > 0);
+}
+#endif
 
 /* ********************************************************************************/
 /* The end !!!! 																 */
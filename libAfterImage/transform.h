@@ -36,9 +36,10 @@ extern "C" {
  * SEE ALSO
  *  Transformations :
  *          scale_asimage(), tile_asimage(), merge_layers(), 
+ *          merge_layers_damaged(),
  * 			make_gradient(), flip_asimage(), mirror_asimage(), 
  * 			pad_asimage(), blur_asimage_gauss(), fill_asimage(), 
- * 			adjust_asimage_hsv()
+ * 			adjust_asimage_hsv(), transform_asimage(), rotate_asimage()
  *
  *  Other libAfterImage modules :
  *          ascmap.h asfont.h asimage.h asvisual.h blender.h export.h
@@ -145,6 +146,39 @@ extern "C" {
  * layer will be padded to fit width of the destination image with all 0
  * effectively making it transparent.
  *********/
+/****f* libAfterImage/transform/merge_layers_damaged()
+ * NAME
+ * merge_layers_damaged() - recomposes only damaged parts of the image
+ * SYNOPSIS
+ * Bool merge_layers_damaged( struct ASVisual *asv,
+ *                            ASImageLayer *layers, int count,
+ *                            ASImage *dst,
+ *                            XRectangle *damage, int damage_count,
+ *                            int quality );
+ * INPUTS
+ * asv          - pointer to valid ASVisual structure
+ * layers       - array of ASImageLayer structures, same as for
+ *                merge_layers().
+ * dst          - image previously produced by merge_layers() from
+ *                similar set of layers.
+ * damage       - array of rectangles in dst coordinates that need to be
+ *                recomposed.
+ * damage_count - number of elements in damage array.
+ * quality      - output quality. ASIMAGE_QUALITY_TOP is downgraded to
+ *                ASIMAGE_QUALITY_GOOD, since rows are written out of order.
+ * RETURN VALUE
+ * True on success. False if dst could not be updated in place, in which
+ * case caller should fall back to merge_layers().
+ * DESCRIPTION
+ * merge_layers_damaged() updates dst in place, recomposing only those
+ * pixels that fall inside damage rectangles. For each affected row
+ * bounding span of damage rectangles is recomposed, and layers that do
+ * not intersect that span are not decoded at all. Rest of the row is
+ * kept intact. Cached XImage and ARGB32 forms of dst are discarded.
+ * Layers must cover entire dst vertically (as it always the case when
+ * bottommost layer is as big as destination image), otherwise False is
+ * returned, since merge_layers() tiles such images vertically.
+ *********/
 /****f* libAfterImage/transform/make_gradient()
  * NAME
  * make_gradient() - renders linear gradient into new ASImage
@@ -174,7 +208,11 @@ extern "C" {
  * make_gradient() will create new image of requested size and it will
  * fill it with gradient, described in structure pointed to by grad.
  * Different dithering techniques will be applied to produce nicer
- * looking gradients.
+ * looking gradients. Radial and conic gradients are computed for each
+ * pixel separately, using SSE2 when available.
+ * Several most recently rendered ASImage gradients are kept in cache,
+ * so that rendering same gradient at the same size again only costs a
+ * copy of the image. flush_gradient_cache() frees up the cache.
  *********/
 /****f* libAfterImage/transform/flip_asimage()
  * NAME
@@ -375,6 +413,10 @@ ASImage *scale_asimage2( ASVisual *asv, ASImage *src,
 						int to_width, int to_height,
 			   			ASAltImFormats out_format, unsigned int compression_out, int quality );
 
+/* scale_asimage() keeps tables of scale factors for recently used
+ * sizes - this frees up all of them that are not currently in use : */
+void flush_scale_plan_cache();
+
 ASImage *tile_asimage ( struct ASVisual *asv, ASImage *src,
 						int offset_x, int offset_y,
   					    int to_width,  int to_height, ARGB32 tint,
@@ -384,10 +426,16 @@ ASImage *merge_layers ( struct ASVisual *asv, ASImageLayer *layers, int count,
 			  		    int dst_width, int dst_height,
 			  		    ASAltImFormats out_format,
 						unsigned int compression_out, int quality );
+Bool merge_layers_damaged( struct ASVisual *asv, ASImageLayer *layers, int count,
+						   ASImage *dst, XRectangle *damage, int damage_count, 
+						   int quality );
 ASImage *make_gradient( struct ASVisual *asv, struct ASGradient *grad,
                			int width, int height, ASFlagType filter,
   			   			ASAltImFormats out_format,
 						unsigned int compression_out, int quality  );
+/* make_gradient() keeps recently rendered gradients, and hands out
+ * copies sharing the same storage - this frees up all of them : */
+void flush_gradient_cache();
 ASImage *flip_asimage( struct ASVisual *asv, ASImage *src,
 		 		       int offset_x, int offset_y,
 			  		   int to_width, int to_height,
@@ -556,6 +604,76 @@ color2alpha_asimage (ASVisual *asv, ASImage *src,
 				     ARGB32 color,
 				     ASAltImFormats out_format, unsigned int compression_out, int quality);
 
+/****s* libAfterImage/ASAffineTransform
+ * NAME
+ * ASAffineTransform - affine transformation matrix.
+ * DESCRIPTION
+ * Maps point (x,y) of the source image onto point
+ * ( xx*x + xy*y + x0, yx*x + yy*y + y0 ) of the destination image.
+ * Coordinates are in pixels, with y axis going down.
+ * SOURCE
+ */
+typedef struct ASAffineTransform
+{
+	double xx, xy ;
+	double yx, yy ;
+	double x0, y0 ;
+}ASAffineTransform;
+
+#define TRANSFORM_FILTER_BILINEAR	0
+#define TRANSFORM_FILTER_BICUBIC	1
+/*******/
+/****f* libAfterImage/transform/transform_asimage()
+ * NAME
+ * transform_asimage() - applies arbitrary affine transformation to
+ * the image.
+ * rotate_asimage() - rotates image by arbitrary angle.
+ * SYNOPSIS
+ * ASImage *transform_asimage( ASVisual *asv, ASImage *src,
+ *                             const ASAffineTransform *matrix,
+ *                             int to_width, int to_height, int filter,
+ *                             ASAltImFormats out_format,
+ *                             unsigned int compression_out, int quality );
+ * ASImage *rotate_asimage( ASVisual *asv, ASImage *src, double angle,
+ *                          int to_width, int to_height, int filter,
+ *                          ASAltImFormats out_format,
+ *                          unsigned int compression_out, int quality );
+ * INPUTS
+ * asv          - pointer to valid ASVisual structure
+ * src          - source ASImage
+ * matrix       - transformation from source to destination coordinates
+ * angle        - counterclockwise rotation angle in degrees
+ * to_width,
+ * to_height    - size of the destination image. If either is 0 - then
+ *                the size along that axis is set to fit transformed
+ *                image, and translation along that axis is ignored.
+ * filter       - TRANSFORM_FILTER_BILINEAR or TRANSFORM_FILTER_BICUBIC
+ * out_format   - optionally describes alternative ASImage format that
+ *                should be produced as the result - XImage, ARGB32, etc.
+ * compression_out- compression level of resulting image in range 0-100.
+ * quality      - output quality
+ * RETURN VALUE
+ * returns newly created and encoded ASImage on success, NULL of failure.
+ * DESCRIPTION
+ * Each destination pixel is resampled from the source image, using
+ * either bilinear or bicubic filter. Areas outside of the source image
+ * come out transparent, and edges of the image are antialiased.
+ * Source image is decoded one line at a time, and only lines
+ * needed for current destination line are kept in memory.
+ * rotate_asimage() rotates image around its center, and places it into
+ * the center of the destination. Multiples of 90 degrees with no
+ * destination size given are done exactly using flip_asimage().
+ *********/
+ASImage *transform_asimage( ASVisual *asv, ASImage *src,
+							const ASAffineTransform *matrix,
+							int to_width, int to_height, int filter,
+							ASAltImFormats out_format,
+							unsigned int compression_out, int quality );
+ASImage *rotate_asimage( ASVisual *asv, ASImage *src, double angle,
+						 int to_width, int to_height, int filter,
+						 ASAltImFormats out_format,
+						 unsigned int compression_out, int quality );
+
 #ifdef __cplusplus
 }
 #endif
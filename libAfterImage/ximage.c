@@ -653,6 +653,89 @@ asimage2drawable_gl(	ASVisual *asv, Drawable d, ASImage *im,
 	return False;
 }
 
+Bool
+present_asimage( ASPresentBuffer *pb, Drawable d, GC gc, ASImage *im,
+				 int src_x, int src_y, int dest_x, int dest_y,
+				 unsigned int width, unsigned int height )
+{
+#ifndef X_DISPLAY_MISSING
+	XImage *xim, sub_xim ;
+	ASImage *scratch_im ;
+	ASImageOutput *imout ;
+	ASImageDecoder *imdec ;
+	GC my_gc = gc ;
+	Bool done = False ;
+	int w = width, h = height ;
+	int i ;
+
+	if( pb == NULL || im == NULL || d == None )
+		return False;
+	if( src_x < 0 )
+	{
+		w += src_x ;
+		dest_x -= src_x ;
+		src_x = 0 ;
+	}
+	if( src_y < 0 )
+	{
+		h += src_y ;
+		dest_y -= src_y ;
+		src_y = 0 ;
+	}
+	if( w > (int)im->width - src_x )
+		w = (int)im->width - src_x ;
+	if( h > (int)im->height - src_y )
+		h = (int)im->height - src_y ;
+	if( w > (int)pb->width )
+		w = pb->width ;
+	if( h > (int)pb->height )
+		h = pb->height ;
+	if( w <= 0 || h <= 0 )
+		return False;
+
+	if( (xim = get_present_ximage( pb )) == NULL )
+		return False;
+	/* encoder fills rows of ximage->width pixels, spaced by bytes_per_line,
+	 * so it gets a view of the top-left corner of the buffer : */
+	sub_xim = *xim ;
+	sub_xim.width = w ;
+	sub_xim.height = h ;
+	scratch_im = create_asimage( w, h, 0 );
+	scratch_im->alt.ximage = &sub_xim ;
+	if( (imout = start_image_output( pb->asv, scratch_im, ASA_ScratchXImage, 0, ASIMAGE_QUALITY_DEFAULT )) != NULL )
+	{
+		if( (imdec = start_image_decoding( pb->asv, im, (xim->depth >= 24)?SCL_DO_ALL:SCL_DO_COLOR,
+										   src_x, src_y, w, h, NULL)) != NULL )
+		{
+			for( i = 0 ; i < h ; ++i )
+			{
+				imdec->decode_image_scanline( imdec );
+				imout->output_image_scanline( imout, &(imdec->buffer), 1);
+			}
+			stop_image_decoding( &imdec );
+			done = True ;
+		}
+		stop_image_output( &imout );
+	}
+	scratch_im->alt.ximage = NULL ;
+	destroy_asimage( &scratch_im );
+	if( !done )
+		return False;
+
+	if( my_gc == NULL )
+	{
+		XGCValues gcv ;
+		my_gc = XCreateGC( pb->asv->dpy, d, 0, &gcv );
+	}
+	present_ximage( pb, d, my_gc, 0, 0, dest_x, dest_y, w, h );
+	if( my_gc != gc )
+		XFreeGC( pb->asv->dpy, my_gc );
+	return True;
+#else
+	return False ;
+#endif
+}
+
 Bool
 asimage2drawable( ASVisual *asv, Drawable d, ASImage *im, GC gc,
                   int src_x, int src_y, int dest_x, int dest_y,
@@ -667,6 +750,11 @@ asimage2drawable( ASVisual *asv, Drawable d, ASImage *im, GC gc,
 		Bool res = False;
 		if ( !use_cached || im->alt.ximage == NULL )
 		{
+			/* only encode requested area, straight into persistent
+			 * shared memory : */
+			ASPresentBuffer *pb = get_default_present_buffer( asv, MIN(width,im->width), MIN(height,im->height) );
+			if( pb != NULL )
+				return present_asimage( pb, d, gc, im, src_x, src_y, dest_x, dest_y, width, height );
             if( (xim = asimage2ximage_ext( asv, im, False )) == NULL )
 			{
 				show_error("cannot export image into XImage.");
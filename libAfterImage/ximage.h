@@ -270,12 +270,37 @@ ASImage *pixmap2asimage (struct ASVisual *asv, Pixmap p, int x, int y,
  * It then supplied gc or DefaultGC of the screen to transfer
  * XImage to the server.
  * Missing scanlines get filled with black color.
+ * When shared memory images are enabled and the area is not too big,
+ * only requested portion is encoded, straight into the default
+ * ASPresentBuffer, via present_asimage().
  * SEE ALSO
  * asimage2ximage()
  * asimage2pixmap()
  * create_visual_pixmap()
  *********/
 
+/****f* libAfterImage/present_asimage()
+ * NAME
+ * present_asimage()
+ * SYNOPSIS
+ * Bool present_asimage( ASPresentBuffer *pb, Drawable d, GC gc,
+ *                       ASImage *im,
+ *                       int src_x, int src_y, int dest_x, int dest_y,
+ *                       unsigned int width, unsigned int height );
+ * INPUTS
+ * pb           - buffer to render into, see create_present_buffer().
+ * other arguments are the same as for asimage2drawable().
+ * RETURN VALUE
+ * On success returns True.
+ * DESCRIPTION
+ * present_asimage() decodes portion of ASImage and encodes it directly
+ * into the next free XImage of the ASPresentBuffer, and then sends it
+ * to the drawable. Portion is clipped to the size of the buffer.
+ * SEE ALSO
+ * asimage2drawable()
+ * get_present_ximage()
+ *********/
+
 /****f* libAfterImage/asimage2pixmap()
  * NAME
  * asimage2pixmap()
@@ -340,6 +365,9 @@ Bool     put_ximage( ASVisual *asv, XImage *xim, Drawable d, GC gc,
 
 XImage  *asimage2alpha_ximage (ASVisual *asv, ASImage *im, Bool bitmap );
 XImage  *asimage2mask_ximage (struct ASVisual *asv, ASImage *im);
+Bool	 present_asimage( struct ASPresentBuffer *pb, Drawable d, GC gc, ASImage *im,
+                          int src_x, int src_y, int dest_x, int dest_y,
+                          unsigned int width, unsigned int height );
 Bool	 asimage2drawable( struct ASVisual *asv, Drawable d, ASImage *im, GC gc,
          			       int src_x, int src_y, int dest_x, int dest_y,
         		  		   unsigned int width, unsigned int height,
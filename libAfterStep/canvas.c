@@ -361,6 +361,44 @@ Bool draw_canvas_image (ASCanvas * pc, ASImage * im, int x, int y)
 	return done;
 }
 
+/* same as above, only draws parts of the image covered by areas,
+ * leaving the rest of the canvas intact : */
+Bool
+draw_canvas_image_areas (ASCanvas * pc, ASImage * im, int x, int y,
+												 XRectangle * areas, int areas_count)
+{
+	Bool done = False;
+	int i;
+	ASAltImFormats fmt = ASA_XImage;
+
+	if (im == NULL || pc == NULL || areas == NULL)
+		return False;
+	if (get_flags (ASDefaultVisual->glx_support, ASGLX_UseForImageTx))
+		fmt = ASA_ASImage;
+
+	for (i = 0; i < areas_count; ++i) {
+		int ax = MAX ((int)areas[i].x, 0);
+		int ay = MAX ((int)areas[i].y, 0);
+		int aw = MIN ((int)areas[i].x + (int)areas[i].width, (int)im->width) - ax;
+		int ah = MIN ((int)areas[i].y + (int)areas[i].height, (int)im->height) - ay;
+		ASImage *part;
+
+		if (aw <= 0 || ah <= 0)
+			continue;
+		if (aw == im->width && ah == im->height)
+			return draw_canvas_image (pc, im, x, y);
+
+		part = tile_asimage (ASDefaultVisual, im, ax, ay, aw, ah,
+												 TINT_LEAVE_SAME, fmt, 0, ASIMAGE_QUALITY_DEFAULT);
+		if (part) {
+			if (draw_canvas_image (pc, part, x + ax, y + ay))
+				done = True;
+			destroy_asimage (&part);
+		}
+	}
+	return done;
+}
+
 void
 fill_canvas_mask (ASCanvas * pc, int win_x, int win_y, int width,
 									int height)
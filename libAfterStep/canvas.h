@@ -91,6 +91,7 @@ Bool get_current_canvas_geometry( ASCanvas * pc, int *px, int *py, unsigned int
 Pixmap get_canvas_canvas( ASCanvas *pc );
 Pixmap get_canvas_mask( ASCanvas *pc );
 Bool draw_canvas_image( ASCanvas *pc, struct ASImage *im, int x, int y );
+Bool draw_canvas_image_areas( ASCanvas *pc, struct ASImage *im, int x, int y, XRectangle *areas, int areas_count );
 void fill_canvas_mask (ASCanvas * pc, int win_x, int win_y, int width, int height);
 Bool draw_canvas_mask (ASCanvas * pc, ASImage * im, int x, int y);
 
@@ -582,10 +582,151 @@ ASTBarData *create_astbar ()
 	return tbar;
 }
 
+/********************************************************************/
+/* Render cache :                                                   */
+/********************************************************************/
+/* Layers the last render_astbar() composed the bar from. If next time
+ * only some tiles have changed, we recompose and redraw only the areas
+ * those tiles cover. That needs the composed image kept in ASImage format,
+ * which is slower to produce than scratch XImage, so we only keep it once
+ * bar has been rerendered with some tiles changed, and only for one state
+ * at a time : */
+typedef struct ASTBarRenderCache {
+	ASImage *merged;							/* NULL until tiles got changed */
+	unsigned short width, height;
+	ASImage *back;								/* can only compare pointers - see flush_tbar_state_backs */
+	ASImageBevel bevel;
+	merge_scanlines_func merge_func;
+	ASImageLayer *layers;					/* only geometry and tint of layers is valid */
+	int *layer_tiles;							/* tile index each layer was created from */
+	int layers_num;
+	/* where merged image was drawn : */
+	Pixmap canvas;
+	short win_x, win_y;
+} ASTBarRenderCache;
+
+static void destroy_tbar_render_cache (ASTBarData * tbar, int state)
+{
+	ASTBarRenderCache *cache = tbar->render_cache[state];
+
+	if (cache) {
+		if (cache->merged)
+			destroy_asimage (&(cache->merged));
+		if (cache->layers)
+			free (cache->layers);
+		if (cache->layer_tiles)
+			free (cache->layer_tiles);
+		free (cache);
+		tbar->render_cache[state] = NULL;
+	}
+}
+
+static inline void
+add_tbar_damage_rect (XRectangle * damage, int *count, ASImageLayer * layer)
+{
+	if (layer->clip_width > 0 && layer->clip_height > 0) {
+		damage[*count].x = layer->dst_x;
+		damage[*count].y = layer->dst_y;
+		damage[*count].width = layer->clip_width;
+		damage[*count].height = layer->clip_height;
+		++(*count);
+	}
+}
+
+/* Returns count of rectangles that need to be recomposed, or -1 if cached
+ * image cannot be reused at all : */
+static int
+get_tbar_render_damage (ASTBarData * tbar, ASTBarRenderCache * cache,
+												ASImage * back, ASImageBevel * bevel,
+												merge_scanlines_func merge_func,
+												ASImageLayer * layers, int *layer_tiles,
+												int layers_num, XRectangle ** pdamage)
+{
+	XRectangle *damage;
+	int count = 0;
+	int l;
+
+	if (cache->width != tbar->width || cache->height != tbar->height
+			|| cache->back != back
+			|| cache->merge_func != merge_func
+			|| cache->layers_num != layers_num
+			|| memcmp (&(cache->bevel), bevel, sizeof (ASImageBevel)) != 0)
+		return -1;
+
+	damage = safecalloc (layers_num * 2, sizeof (XRectangle));
+	for (l = 1; l < layers_num; ++l) {
+		ASImageLayer *old = &(cache->layers[l]);
+		ASImageLayer *new = &(layers[l]);
+
+		if (layer_tiles[l] != cache->layer_tiles[l] || new->bevel != NULL) {
+			free (damage);
+			return -1;
+		}
+		if (get_flags (tbar->tiles[layer_tiles[l]].flags, AS_TileDamaged)
+				|| old->dst_x != new->dst_x || old->dst_y != new->dst_y
+				|| old->clip_x != new->clip_x || old->clip_y != new->clip_y
+				|| old->clip_width != new->clip_width
+				|| old->clip_height != new->clip_height
+				|| old->tint != new->tint) {
+			add_tbar_damage_rect (damage, &count, old);
+			if (old->dst_x != new->dst_x || old->dst_y != new->dst_y
+					|| old->clip_width != new->clip_width
+					|| old->clip_height != new->clip_height)
+				add_tbar_damage_rect (damage, &count, new);
+		}
+	}
+	*pdamage = damage;
+	return count;
+}
+
+static void
+update_tbar_render_cache (ASTBarData * tbar, int state, ASImage * merged,
+													ASImage * back, ASImageBevel * bevel,
+													merge_scanlines_func merge_func,
+													ASImageLayer * layers, int *layer_tiles,
+													int layers_num, ASCanvas * pc)
+{
+	ASTBarRenderCache *cache = tbar->render_cache[state];
+
+	if (cache == NULL)
+		cache = tbar->render_cache[state] =
+				safecalloc (1, sizeof (ASTBarRenderCache));
+	if (cache->merged != merged) {
+		if (cache->merged)
+			destroy_asimage (&(cache->merged));
+		cache->merged = merged;
+	}
+	if (merged) {
+		ASTBarRenderCache *other =
+				tbar->render_cache[(~state) & BAR_STATE_FOCUS_MASK];
+		if (other && other->merged)
+			destroy_asimage (&(other->merged));
+	}
+	cache->width = tbar->width;
+	cache->height = tbar->height;
+	cache->back = back;
+	cache->bevel = *bevel;
+	cache->merge_func = merge_func;
+	if (cache->layers_num != layers_num) {
+		cache->layers =
+				realloc (cache->layers, layers_num * sizeof (ASImageLayer));
+		cache->layer_tiles =
+				realloc (cache->layer_tiles, layers_num * sizeof (int));
+		cache->layers_num = layers_num;
+	}
+	memcpy (cache->layers, layers, layers_num * sizeof (ASImageLayer));
+	memcpy (cache->layer_tiles, layer_tiles, layers_num * sizeof (int));
+	cache->canvas = pc->canvas;
+	cache->win_x = tbar->win_x;
+	cache->win_y = tbar->win_y;
+}
+
 static inline void flush_tbar_backs (ASTBarData * tbar)
 {
 	register int i;
 
+	for (i = 0; i < BAR_STATE_NUM; ++i)
+		destroy_tbar_render_cache (tbar, i);
 	for (i = 0; i < BAR_STATE_NUM; ++i)
 		if (tbar->back[i]) {
 			LOCAL_DEBUG_OUT ("tbar %p destroy back %d, %p", tbar, i,
@@ -600,6 +741,8 @@ static inline void flush_tbar_state_backs (ASTBarData * tbar, int state)
 	if (state < 0 || state > BAR_STATE_NUM)
 		flush_tbar_backs (tbar);
 	else {
+		if (state < BAR_STATE_NUM)
+			destroy_tbar_render_cache (tbar, state);
 		if (tbar->back[state])
 			destroy_asimage (&(tbar->back[state]));
 		set_flags (tbar->state, BAR_FLAGS_REND_PENDING);
@@ -993,7 +1136,7 @@ add_astbar_tile (ASTBarData * tbar, int type, unsigned char col,
 			((col << AS_TileColOffset) & AS_TileColMask) |
 			((row << AS_TileRowOffset) & AS_TileRowMask) |
 			((flip << AS_TileFlipOffset) & AS_TileFlipMask) |
-			((align_flags << AS_TileFloatingOffset));
+			((align_flags << AS_TileFloatingOffset)) | AS_TileDamaged;
 	set_flags (tbar->state, BAR_FLAGS_REND_PENDING);
 	return new_idx;
 }
@@ -1014,6 +1157,7 @@ Bool delete_astbar_tile (ASTBarData * tbar, int idx)
 					memset (&(tbar->tiles[i]), 0x00, sizeof (ASTile));
 					tbar->tiles[i].flags = AS_TileFreed;
 				}
+				set_flags (tbar->tiles[i].flags, AS_TileDamaged);
 			}
 		set_flags (tbar->state, BAR_FLAGS_REND_PENDING);
 		return True;
@@ -1180,6 +1324,7 @@ change_astbar_label (ASTBarData * tbar, int index, const char *label,
 		lbl->encoding = encoding;
 		if (changed) {
 			set_astile_styles (tbar, &(tbar->tiles[index]), -1);
+			set_flags (tbar->tiles[index].flags, AS_TileDamaged);
 			set_flags (tbar->state, BAR_FLAGS_REND_PENDING);
 		}
 	}
@@ -1302,8 +1447,10 @@ Bool set_astbar_btn_pressed (ASTBarData * tbar, int context)
 
 		for (i = 0; i < tbar->tiles_num; ++i)
 			if (ASTileType (tbar->tiles[i]) == AS_TileBtnBlock)
-				if (set_tbtn_pressed (&(tbar->tiles[i].data.bblock), context))
+				if (set_tbtn_pressed (&(tbar->tiles[i].data.bblock), context)) {
+					set_flags (tbar->tiles[i].flags, AS_TileDamaged);
 					changed = True;
+				}
 		if (changed)
 			set_flags (tbar->state, BAR_FLAGS_REND_PENDING);
 		return changed;
@@ -1398,7 +1545,10 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 	ASImageBevel bevel;
 	ASImageLayer *layers;
 	ASImage **scrap_images = NULL;
+	int *layer_tiles;
 	ASImage *merged_im = NULL;
+	XRectangle *damage = NULL;
+	int damage_count = -1;
 	int state;
 	ASAltImFormats fmt = ASA_ScratchXImageAndAlpha;
 	int l;
@@ -1666,6 +1816,8 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 
 	layers = create_image_layers (good_layers + 1);
 	scrap_images = safecalloc (good_layers + 1, sizeof (ASImage *));
+	layer_tiles = safecalloc (good_layers + 1, sizeof (int));
+	layer_tiles[0] = -1;
 	layers[0].im = back;
 	layers[0].bevel = &bevel;
 	if (tbar->width > h_bevel_size)
@@ -1687,6 +1839,7 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 			int row = ASTileRow (tbar->tiles[l]);
 			int col = ASTileCol (tbar->tiles[l]);
 			int pad_x = 0, pad_y = 0;
+			int first_layer = good_layers;
 
 			if (!ASTileHResizeable (tbar->tiles[l]))
 				pad_x =
@@ -1715,6 +1868,8 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 																											pad_x,
 																											row_height[row] -
 																											pad_y);
+			while (first_layer < good_layers)
+				layer_tiles[first_layer++] = l;
 		}
 	}
 	merge_func =
@@ -1756,6 +1911,7 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 				merge_layers (ASDefaultVisual, &layers[0], good_layers,
 											tbar->width, tbar->height, ASA_ASImage, 0,
 											ASIMAGE_QUALITY_DEFAULT);
+		destroy_tbar_render_cache (tbar, state);
 		if (tmp_im) {
 			merged_im = adjust_asimage_hsv (ASDefaultVisual, tmp_im,
 																			0, 0,
@@ -1768,28 +1924,88 @@ render_astbar_int (ASTBarData * tbar, ASCanvas * pc, ASImage ** pcache,
 																			ASIMAGE_QUALITY_DEFAULT);
 			destroy_asimage (&tmp_im);
 		}
-	} else
-		merged_im =
-				merge_layers (ASDefaultVisual, &layers[0], good_layers,
-											tbar->width, tbar->height, fmt, 0,
-											ASIMAGE_QUALITY_DEFAULT);
+	} else {
+		ASTBarRenderCache *cache = tbar->render_cache[state];
+		Bool keep_merged = False;
+
+		/* try and recompose only the tiles that changed since last time : */
+		if (cache != NULL)
+			damage_count =
+					get_tbar_render_damage (tbar, cache, back, &bevel, merge_func,
+																	layers, layer_tiles, good_layers, &damage);
+		if (damage_count > 0 && cache->merged != NULL
+				&& !merge_layers_damaged (ASDefaultVisual, &layers[0], good_layers,
+																	cache->merged, damage, damage_count,
+																	ASIMAGE_QUALITY_DEFAULT))
+			damage_count = -1;
+		if (damage_count >= 0 && cache->merged != NULL) {
+			merged_im = cache->merged;
+			keep_merged = True;
+			LOCAL_DEBUG_OUT ("reusing cached image with %d damaged areas",
+											 damage_count);
+		} else {
+			/* tiles of this bar do change - worth keeping composed image so
+			 * that next time we only have to recompose what changed : */
+			if (damage_count > 0)
+				keep_merged = True;
+			damage_count = -1;
+			merged_im =
+					merge_layers (ASDefaultVisual, &layers[0], good_layers,
+												tbar->width, tbar->height,
+												keep_merged ? ASA_ASImage : fmt, 0,
+												ASIMAGE_QUALITY_DEFAULT);
+		}
+		if (merged_im) {
+			/* partially updated canvas only if it still has previous image in the same spot : */
+			if (damage_count >= 0) {
+				if (render_mask || cache->canvas != pc->canvas
+						|| cache->win_x != tbar->win_x
+						|| cache->win_y != tbar->win_y)
+					damage_count = -1;
+			}
+			update_tbar_render_cache (tbar, state,
+																keep_merged ? merged_im : NULL, back,
+																&bevel, merge_func, layers, layer_tiles,
+																good_layers, pc);
+		} else
+			destroy_tbar_render_cache (tbar, state);
+	}
 	for (l = 0; l < good_layers; ++l)
 		if (scrap_images[l])
 			safe_asimage_destroy (scrap_images[l]);
 	free (scrap_images);
 	free (layers);
 
+	/* the other state's cache may still refer to old contents of tiles : */
+	for (l = 0; l < tbar->tiles_num; ++l)
+		if (get_flags (tbar->tiles[l].flags, AS_TileDamaged)) {
+			destroy_tbar_render_cache (tbar, (~state) & BAR_STATE_FOCUS_MASK);
+			break;
+		}
+	for (l = 0; l < tbar->tiles_num; ++l)
+		clear_flags (tbar->tiles[l].flags, AS_TileDamaged);
+	free (layer_tiles);
+
 	if (merged_im) {
-		res = draw_canvas_image (pc, merged_im, tbar->win_x, tbar->win_y);
+		if (damage_count > 0)
+			res =
+					draw_canvas_image_areas (pc, merged_im, tbar->win_x, tbar->win_y,
+																	 damage, damage_count);
+		else
+			res = draw_canvas_image (pc, merged_im, tbar->win_x, tbar->win_y);
 
 #ifdef SHAPE
 		if (render_mask)
 			draw_canvas_mask (pc, merged_im, tbar->win_x, tbar->win_y);
 #endif
-		destroy_asimage (&merged_im);
+		if (tbar->render_cache[state] == NULL
+				|| tbar->render_cache[state]->merged != merged_im)
+			destroy_asimage (&merged_im);
 		if (res)
 			clear_flags (tbar->state, BAR_FLAGS_REND_PENDING);
 	}
+	if (damage)
+		free (damage);
 	SHOW_TIME ("rendering", started);
 	return res;
 }
@@ -2002,3 +2218,35 @@ set_astbar_balloon (ASTBarData * tbar, int context, const char *text,
 	if (tbar != NULL)
 		set_astbar_balloon2 (tbar, NULL, context, text, encoding);
 }
+
+#ifdef TEST_DECOR
+/* damage tracking must not affect layout of the bar */
+int main (int argc, char **argv)
+{
+	ASTBarData *tbar = create_astbar ();
+	unsigned int damaged_width, clean_width;
+	int i, errors = 0;
+
+	add_astbar_spacer (tbar, 0, 0, 0, NO_ALIGN, 10, 10);
+	add_astbar_spacer (tbar, 1, 0, 0, NO_ALIGN, 20, 10);
+	/* this one should be ignored whether damaged or not */
+	add_astbar_spacer (tbar, 2, 0, 0, FIT_LABEL_WIDTH, 40, 10);
+	for (i = 0; i < tbar->tiles_num; ++i)
+		if (!get_flags (tbar->tiles[i].flags, AS_TileDamaged))
+			++errors;
+	damaged_width = calculate_astbar_width (tbar);
+	if (damaged_width != 30 + tbar->h_spacing + (tbar->h_border << 1) +
+			tbar->left_bevel + tbar->right_bevel)
+		++errors;
+	/* that is what render does once tiles are rendered : */
+	for (i = 0; i < tbar->tiles_num; ++i)
+		clear_flags (tbar->tiles[i].flags, AS_TileDamaged);
+	clean_width = calculate_astbar_width (tbar);
+	if (clean_width != damaged_width || !ASTileIgnoreWidth (tbar->tiles[2]))
+		++errors;
+	printf ("bar width %u damaged, %u rendered : %d errors\n", damaged_width,
+					clean_width, errors);
+	destroy_astbar (&tbar);
+	return (errors == 0) ? 0 : 1;
+}
+#endif
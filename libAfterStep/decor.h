@@ -68,6 +68,8 @@ typedef struct ASTile {
 #define ASTileType(t)      ((t).flags&AS_TileTypeMask)
 #define ASSetTileType(tl,ty)  ((tl)->flags=((tl)->flags&(~AS_TileTypeMask))|(ty))
 #define ASGetTileType(tl)   (((tl)->flags)&AS_TileTypeMask)
+/* bit 3 is not used by type - bits from 20 up are taken by alignment */
+#define AS_TileDamaged      (0x01<<3)  /* contents changed since bar was last rendered */
 
 #define AS_TileColOffset    4
 #define AS_TileColumns      8
@@ -129,6 +131,7 @@ typedef struct ASTile {
 #define ASTileVFloating(t)      ((t).flags&(AS_TileVResize|AS_TileVPadMask))
 #define ASTileVPad(t)           ((t).flags&(AS_TileVPadMask))
 
+
 	ASFlagType flags;
 	short x, y;
 	short width, height;
@@ -189,6 +192,8 @@ typedef struct ASTBarData {
 	/* 62 bytes */
 	short hue[2], sat[2] ;
 	/* 70 bytes */
+	/* result of the last rendering, so that we only recompose changed tiles : */
+	struct ASTBarRenderCache *render_cache[2] ;
 }ASTBarData ;
 
 ASTBtnData *create_astbtn();
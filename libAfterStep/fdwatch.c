@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2026 The AfterStep Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+#undef LOCAL_DEBUG
+
+#include "../configure.h"
+#include "asapp.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#if TIME_WITH_SYS_TIME
+#include <sys/time.h>
+#include <time.h>
+#else
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "fdwatch.h"
+
+typedef struct ASFdWatchSlot
+{
+	ASFlagType events ;
+	void *data ;
+	int list_idx ;			/* position in the dense list of registered fds */
+}ASFdWatchSlot;
+
+struct ASFdWatcher
+{
+	int epoll_fd ;			/* -1 if we use select() */
+
+	ASFdWatchSlot *slots ;	/* indexed by fd */
+	int slots_num ;
+
+	int *fds ;				/* dense list of registered fds */
+	int fds_num, fds_allocated ;
+
+	/* select() backend : */
+	fd_set in_fdset, out_fdset ;
+	int max_fd ;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event *epoll_events ;
+	int epoll_events_allocated ;
+#endif
+};
+
+ASFdWatcher *create_fd_watcher ()
+{
+	ASFdWatcher *w = safecalloc (1, sizeof (ASFdWatcher));
+
+	w->epoll_fd = -1;
+	w->max_fd = -1;
+	FD_ZERO (&(w->in_fdset));
+	FD_ZERO (&(w->out_fdset));
+#ifdef HAVE_SYS_EPOLL_H
+	if ((w->epoll_fd = epoll_create (64)) >= 0)
+		fcntl (w->epoll_fd, F_SETFD, FD_CLOEXEC);
+	else
+		show_system_error ("epoll is not available - falling back to select()");
+#endif
+	LOCAL_DEBUG_OUT ("watcher %p uses %s", w, fd_watcher_backend (w));
+	return w;
+}
+
+void destroy_fd_watcher (ASFdWatcher ** pwatcher)
+{
+	if (pwatcher && *pwatcher) {
+		ASFdWatcher *w = *pwatcher;
+
+		if (w->epoll_fd >= 0)
+			close (w->epoll_fd);
+		if (w->slots)
+			free (w->slots);
+		if (w->fds)
+			free (w->fds);
+#ifdef HAVE_SYS_EPOLL_H
+		if (w->epoll_events)
+			free (w->epoll_events);
+#endif
+		free (w);
+		*pwatcher = NULL;
+	}
+}
+
+const char *fd_watcher_backend (ASFdWatcher * watcher)
+{
+	return (watcher && watcher->epoll_fd >= 0) ? "epoll" : "select";
+}
+
+ASFlagType fd_watcher_get (ASFdWatcher * watcher, int fd)
+{
+	if (watcher == NULL || fd < 0 || fd >= watcher->slots_num)
+		return 0;
+	return watcher->slots[fd].events;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static inline unsigned int fd_events2epoll (ASFlagType events)
+{
+	unsigned int ee = 0;
+
+	if (get_flags (events, ASFD_READ))
+		ee |= EPOLLIN;
+	if (get_flags (events, ASFD_WRITE))
+		ee |= EPOLLOUT;
+	return ee;
+}
+#endif
+
+static void update_select_max_fd (ASFdWatcher * w)
+{
+	int i;
+
+	w->max_fd = -1;
+	for (i = 0; i < w->fds_num; ++i)
+		if (w->fds[i] > w->max_fd)
+			w->max_fd = w->fds[i];
+}
+
+Bool
+fd_watcher_set (ASFdWatcher * watcher, int fd, ASFlagType events,
+								void *data)
+{
+	ASFdWatchSlot *slot;
+	ASFlagType old_events;
+
+	if (watcher == NULL || fd < 0)
+		return False;
+
+	events &= (ASFD_READ | ASFD_WRITE);
+	if (fd >= watcher->slots_num) {
+		int old_num = watcher->slots_num;
+
+		if (events == 0)
+			return True;
+		if (watcher->epoll_fd < 0 && fd >= FD_SETSIZE) {
+			show_error ("fd %d is too large to be watched with select()", fd);
+			return False;
+		}
+		watcher->slots_num = ((fd / 64) + 1) * 64;
+		watcher->slots =
+				realloc (watcher->slots,
+								 watcher->slots_num * sizeof (ASFdWatchSlot));
+		memset (&(watcher->slots[old_num]), 0x00,
+						(watcher->slots_num - old_num) * sizeof (ASFdWatchSlot));
+	}
+	slot = &(watcher->slots[fd]);
+	old_events = slot->events;
+	slot->data = data;
+	if (old_events == events)
+		return True;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (watcher->epoll_fd >= 0) {
+		struct epoll_event ev;
+		int op =
+				(old_events == 0) ? EPOLL_CTL_ADD : ((events ==
+																							0) ? EPOLL_CTL_DEL :
+																						 EPOLL_CTL_MOD);
+
+		memset (&ev, 0x00, sizeof (ev));
+		ev.events = fd_events2epoll (events);
+		ev.data.fd = fd;
+		if (epoll_ctl (watcher->epoll_fd, op, fd, &ev) < 0) {
+			/* fd got closed without telling us - kernel has already forgotten it */
+			if (!(op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT))) {
+				LOCAL_DEBUG_OUT ("epoll_ctl(%d, fd = %d) failed, errno = %d",
+												 op, fd, errno);
+				if (op == EPOLL_CTL_ADD)
+					return False;
+			}
+		}
+	} else
+#endif
+	{
+		if (get_flags (events, ASFD_READ))
+			FD_SET (fd, &(watcher->in_fdset));
+		else
+			FD_CLR (fd, &(watcher->in_fdset));
+		if (get_flags (events, ASFD_WRITE))
+			FD_SET (fd, &(watcher->out_fdset));
+		else
+			FD_CLR (fd, &(watcher->out_fdset));
+	}
+
+	if (old_events == 0) {				/* adding to the dense list */
+		if (watcher->fds_num >= watcher->fds_allocated) {
+			watcher->fds_allocated += 32;
+			watcher->fds =
+					realloc (watcher->fds, watcher->fds_allocated * sizeof (int));
+		}
+		slot->list_idx = watcher->fds_num;
+		watcher->fds[watcher->fds_num++] = fd;
+		if (fd > watcher->max_fd)
+			watcher->max_fd = fd;
+	} else if (events == 0) {			/* moving last one into the vacated place */
+		int last = watcher->fds[--(watcher->fds_num)];
+
+		watcher->fds[slot->list_idx] = last;
+		watcher->slots[last].list_idx = slot->list_idx;
+		slot->data = NULL;
+		if (fd == watcher->max_fd)
+			update_select_max_fd (watcher);
+	}
+	slot->events = events;
+	return True;
+}
+
+int
+fd_watcher_wait (ASFdWatcher * watcher, struct timeval *timeout,
+								 ASFdEvent * events, int max_events)
+{
+	int count = 0;
+	int retval;
+
+	if (watcher == NULL || events == NULL || max_events <= 0)
+		return -1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (watcher->epoll_fd >= 0) {
+		int msec = -1;
+		int i;
+
+		if (timeout)
+			msec = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+		if (watcher->epoll_events_allocated < max_events) {
+			watcher->epoll_events_allocated = max_events;
+			watcher->epoll_events =
+					realloc (watcher->epoll_events,
+									 max_events * sizeof (struct epoll_event));
+		}
+		retval =
+				epoll_wait (watcher->epoll_fd, watcher->epoll_events, max_events,
+										msec);
+		if (retval <= 0)
+			return retval;
+		for (i = 0; i < retval; ++i) {
+			struct epoll_event *ee = &(watcher->epoll_events[i]);
+			int fd = ee->data.fd;
+			ASFlagType wanted = fd_watcher_get (watcher, fd);
+			ASFlagType ready = 0;
+
+			if (get_flags (ee->events, EPOLLIN))
+				ready |= ASFD_READ;
+			if (get_flags (ee->events, EPOLLOUT))
+				ready |= ASFD_WRITE;
+			/* hangup has to be seen by readers so that they get their EOF */
+			if (get_flags (ee->events, EPOLLERR | EPOLLHUP))
+				ready |= ASFD_ERROR | (wanted & ASFD_READ);
+			ready &= wanted | ASFD_ERROR;
+			if (ready) {
+				events[count].fd = fd;
+				events[count].events = ready;
+				events[count].data = watcher->slots[fd].data;
+				++count;
+			}
+		}
+	} else
+#endif
+	{
+		fd_set in_fdset = watcher->in_fdset;
+		fd_set out_fdset = watcher->out_fdset;
+		int i;
+
+		retval =
+				PORTABLE_SELECT (watcher->max_fd + 1, &in_fdset, &out_fdset, NULL,
+												 timeout);
+		if (retval <= 0)
+			return retval;
+		for (i = 0; i < watcher->fds_num && count < max_events; ++i) {
+			int fd = watcher->fds[i];
+			ASFlagType ready = 0;
+
+			if (FD_ISSET (fd, &in_fdset))
+				ready |= ASFD_READ;
+			if (FD_ISSET (fd, &out_fdset))
+				ready |= ASFD_WRITE;
+			if (ready) {
+				events[count].fd = fd;
+				events[count].events = ready;
+				events[count].data = watcher->slots[fd].data;
+				++count;
+			}
+		}
+	}
+	return count;
+}
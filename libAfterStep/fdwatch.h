@@ -0,0 +1,84 @@
+#ifndef FDWATCH_H_HEADER_INCLUDED
+#define FDWATCH_H_HEADER_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct timeval;
+
+/****h* libAfterStep/fdwatch.h
+ * NAME
+ * fdwatch - persistent set of file descriptors to wait on.
+ * DESCRIPTION
+ * File descriptors are registered once along with the kind of readiness
+ * we are interested in, and interest is only changed when the state of
+ * the descriptor changes - when it gets output queued for it, when it
+ * gets closed, etc. Waiting does not rebuild anything and only
+ * reports descriptors that are actually ready.
+ * On Linux it is backed by epoll, elsewhere ( or if epoll could not be
+ * initialized ) - by select() with persistent fd_sets and a dense list
+ * of registered descriptors, so that only those get scanned after wait.
+ * Notification is level-triggered - descriptor that still has unread
+ * data will be reported again on the next wait.
+ ******/
+
+#define ASFD_READ			(0x01<<0)
+#define ASFD_WRITE			(0x01<<1)
+#define ASFD_ERROR			(0x01<<2)		/* only ever reported, never requested */
+
+typedef struct ASFdEvent
+{
+	int fd;
+	ASFlagType events ;
+	void *data ;			/* whatever was passed when fd was registered */
+}ASFdEvent;
+
+typedef struct ASFdWatcher ASFdWatcher;
+
+/****f* libAfterStep/fdwatch/create_fd_watcher()
+ * SYNOPSIS
+ * ASFdWatcher *create_fd_watcher();
+ * void destroy_fd_watcher( ASFdWatcher **pwatcher );
+ * DESCRIPTION
+ * Epoll descriptor, if any, is created close-on-exec, so that spawned
+ * children do not inherit it.
+ *********/
+ASFdWatcher *create_fd_watcher();
+void destroy_fd_watcher( ASFdWatcher **pwatcher );
+
+/****f* libAfterStep/fdwatch/fd_watcher_set()
+ * SYNOPSIS
+ * Bool fd_watcher_set( ASFdWatcher *watcher, int fd, ASFlagType events, void *data );
+ * ASFlagType fd_watcher_get( ASFdWatcher *watcher, int fd );
+ * DESCRIPTION
+ * fd_watcher_set() registers fd, changes its interest mask, or, when
+ * events is 0, unregisters it. Setting the same mask again is a no-op.
+ * Descriptors must be unregistered before they are closed.
+ * Returns False if descriptor could not be watched.
+ * fd_watcher_get() returns current interest mask of the fd.
+ *********/
+Bool fd_watcher_set( ASFdWatcher *watcher, int fd, ASFlagType events, void *data );
+ASFlagType fd_watcher_get( ASFdWatcher *watcher, int fd );
+
+/****f* libAfterStep/fdwatch/fd_watcher_wait()
+ * SYNOPSIS
+ * int fd_watcher_wait( ASFdWatcher *watcher, struct timeval *timeout,
+ *                      ASFdEvent *events, int max_events );
+ * DESCRIPTION
+ * Waits for any of the registered descriptors to become ready, or for
+ * timeout to expire ( NULL means indefinitely ). Up to max_events ready
+ * descriptors get stored in events array.
+ * RETURN VALUE
+ * Number of stored events, 0 on timeout, -1 on error ( including EINTR ).
+ *********/
+int fd_watcher_wait( ASFdWatcher *watcher, struct timeval *timeout, ASFdEvent *events, int max_events );
+
+/* "epoll" or "select" */
+const char *fd_watcher_backend( ASFdWatcher *watcher );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FDWATCH_H_HEADER_INCLUDED */
@@ -44,6 +44,7 @@
 #include "session.h"
 #include "colorscheme.h"
 #include "myicon.h"
+#include "fdwatch.h"
 
 #define  ASSocketWriteInt32(sb,d,i)  socket_buffered_write( (sb), (d), (i)*sizeof(CARD32))
 #define  ASSocketWriteInt16(sb,d,i)  socket_buffered_write( (sb), (d), (i)*sizeof(CARD16))
@@ -84,6 +85,23 @@ static ASProtocolItem as_module_msg_items[AS_MODULE_MSG_PROTO_PARTS];
 static ASProtocolState as_module_msg_state =
 		{ &as_module_msg_proto, &(as_module_msg_items[0]), 0, 0, 0 };
 
+/* x_fd and AfterStep connection are registered once, and re-registered
+ * only when either one changes ( see module_wait_pipes_input() ) : */
+static ASFdWatcher *as_module_watcher = NULL;
+static int as_module_watched_x_fd = -1;
+static int as_module_watched_as_fd = -1;
+
+static inline void module_watch_fd (int *watched_fd, int fd)
+{
+	if (*watched_fd != fd) {
+		if (*watched_fd >= 0)
+			fd_watcher_set (as_module_watcher, *watched_fd, 0, NULL);
+		if (fd >= 0)
+			fd_watcher_set (as_module_watcher, fd, ASFD_READ, NULL);
+		*watched_fd = fd;
+	}
+}
+
 void set_module_out_fd (int fd)
 {
 	as_module_out_buffer.fd = fd;
@@ -92,6 +110,9 @@ void set_module_out_fd (int fd)
 
 void set_module_in_fd (int fd)
 {
+	/* descriptor might get reused for a new connection after close() */
+	if (as_module_watcher)
+		module_watch_fd (&as_module_watched_as_fd, -1);
 	as_module_msg_state.fd = fd;
 	socket_read_proto_reset (&as_module_msg_state);
 }
@@ -339,43 +360,31 @@ void module_wait_pipes_input (void (*as_msg_handler)
 															 (send_data_type type,
 																send_data_type * body))
 {
-	fd_set in_fdset, out_fdset;
-	int retval;
+	ASFdEvent events[2];
+	int retval, i;
 	struct timeval tv;
 	struct timeval *t = NULL;
-	int max_fd = 0;
 	ASMessage msg;
 	int as_fd = get_module_in_fd ();
 
-	FD_ZERO (&in_fdset);
-	FD_ZERO (&out_fdset);
-
-	FD_SET (x_fd, &in_fdset);
-	max_fd = x_fd;
-
-	if (as_fd >= 0) {
-		FD_SET (as_fd, &in_fdset);
-		if (max_fd < as_fd)
-			max_fd = as_fd;
-	}
+	if (as_module_watcher == NULL)
+		as_module_watcher = create_fd_watcher ();
+	module_watch_fd (&as_module_watched_x_fd, x_fd);
+	module_watch_fd (&as_module_watched_as_fd, as_fd);
 
 	if (timer_delay_till_next_alarm
 			((time_t *) & tv.tv_sec, (time_t *) & tv.tv_usec))
 		t = &tv;
 
-	retval =
-			PORTABLE_SELECT (min (max_fd + 1, fd_width), &in_fdset, &out_fdset,
-											 NULL, t);
-
-	if (retval > 0) {
-		/* check for incoming module connections */
-		if (as_fd >= 0)
-			if (FD_ISSET (as_fd, &in_fdset))
-				if (ReadASPacket (as_fd, msg.header, &(msg.body)) > 0) {
-					as_msg_handler (msg.header[1], msg.body);
-					free (msg.body);
-				}
-	}
+	retval = fd_watcher_wait (as_module_watcher, t, &events[0], 2);
+
+	/* check for incoming messages from AfterStep */
+	for (i = 0; i < retval; ++i)
+		if (events[i].fd == as_fd && as_fd >= 0)
+			if (ReadASPacket (as_fd, msg.header, &(msg.body)) > 0) {
+				as_msg_handler (msg.header[1], msg.body);
+				free (msg.body);
+			}
 
 	/* handle timeout events */
 	timer_handle ();
@@ -207,6 +207,10 @@ int mystyle_translate_grad_type (int type)
 		return GRADIENT_Top2Bottom;
 	case TEXTURE_GRADIENT_L2R:
 		return GRADIENT_Left2Right;
+	case TEXTURE_GRADIENT_RADIAL:
+		return GRADIENT_Radial;
+	case TEXTURE_GRADIENT_CONIC:
+		return GRADIENT_Conic;
 	default:
 		return -1;
 	}
@@ -542,6 +546,8 @@ static ASImage *mystyle_make_image_int (MyStyle * style, int root_x,
 	case TEXTURE_GRADIENT_BL2TR:
 	case TEXTURE_GRADIENT_T2B:
 	case TEXTURE_GRADIENT_L2R:
+	case TEXTURE_GRADIENT_RADIAL:
+	case TEXTURE_GRADIENT_CONIC:
 		{
 			ASGradient *grad = flip_gradient (&(style->gradient), flip);
 
@@ -102,7 +102,9 @@ enum				/* texture types */
 	TEXTURE_GRADIENT_BL2TR,
 	TEXTURE_GRADIENT_T2B,
 	TEXTURE_GRADIENT_L2R,  /* 9 */
-	TEXTURE_GRADIENT_END = TEXTURE_GRADIENT_L2R,
+	TEXTURE_GRADIENT_RADIAL,
+	TEXTURE_GRADIENT_CONIC, /* 11 */
+	TEXTURE_GRADIENT_END = TEXTURE_GRADIENT_CONIC,
 
 	TEXTURE_TEXTURED_START = 125,
 	TEXTURE_SHAPED_SCALED_PIXMAP = TEXTURE_TEXTURED_START,
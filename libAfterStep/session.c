@@ -28,6 +28,7 @@
 #include "screen.h"
 #include "functions.h"
 #include "session.h"
+#include "../libAfterImage/import.h"
 
 static inline ASDeskSession *create_desk_session ()
 {
@@ -789,6 +790,12 @@ void check_AfterStep_dirtree (char *ashome, Bool create_non_conf)
 
 	set_asimage_thumbnails_cache_dir (cachefilename);
 	free (cachefilename);
+
+	/* decoded backgrounds and icons, so that restarts don't have to decode them again : */
+	cachefilename = make_file_name (ashome, DECODED_IMAGES_DIR);
+	CheckOrCreate (cachefilename);
+	set_asimage_decode_cache (cachefilename, 0);
+	free (cachefilename);
 }
 
 static const char *get_desk_file (ASDeskSession * d, int function)
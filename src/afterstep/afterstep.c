@@ -930,6 +930,8 @@ void Done (Bool restart, char *command)
 #ifdef XSHMIMAGE
 	flush_shm_cache ();
 #endif
+	/* let screenshots and thumbnails still being written complete */
+	wait_asimage_exports ();
 	if (restart) {
 		set_flags (MyArgs.flags, ASS_Restarting);
 		spawn_child (local_command, -1, restart_screen,
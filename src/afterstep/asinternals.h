@@ -10,6 +10,7 @@
 #include "../../libAfterStep/decor.h"
 #include "../../libAfterStep/screen.h"
 #include "../../libAfterStep/module.h"
+#include "../../libAfterStep/fdwatch.h"
 #include "../../libAfterStep/mystyle.h"
 #include "../../libAfterStep/mylook.h"
 #include "../../libAfterStep/clientprops.h"
@@ -313,17 +314,6 @@ typedef struct ASOrientation
 }ASOrientation;
 
 
-typedef struct queue_buff_struct
-{
-  struct queue_buff_struct *next;
-  unsigned char            *data;
-  short                     size;
-  short                     done;
-  short 					prealloced_idx ;
-  short 					unused;
-  /* 16 bytes total */
-}queue_buff_struct;
-
 typedef struct module_ibuf_t
 {
   /* we always use 32 bit values for communications */
@@ -345,7 +335,7 @@ typedef struct module_t
   char                 *cmd_line;
   CARD32                mask;
   CARD32                lock_on_send_mask;
-  queue_buff_struct    *output_queue;
+  ASOutputQueue         output_queue;
   module_ibuf_t         ibuf;
 }module_t;
 
@@ -707,6 +697,8 @@ void grab_window_keys (Window w, ASFlagType context_mask);
 void grab_focus_click( Window w );
 void ungrab_focus_click( Window w );
 void SetTimer (int delay);
+/* events == 0 stops watching fd; data is returned with its readiness events */
+void afterstep_watch_fd (int fd, ASFlagType events, void *data);
 
 
 /***************************** module.c ***********************************/
@@ -732,6 +724,8 @@ void broadcast_config (send_data_type event_type, ASWindow * t);
 
 
 void HandleModuleInOut(unsigned int channel, Bool has_input, Bool has_output);
+void RewatchModules ();
+void RemoveDeadModules ();
 
 void KillModuleByName (char *name);
 void KillAllModulesByName (char *name);
@@ -230,6 +230,8 @@ static dbus_bool_t add_watch(DBusWatch *w, void *data)
 		ASDBus.watchFds = create_asvector (sizeof(ASDBusFd*));
 
 	append_vector(ASDBus.watchFds, &fd, 1);
+	if (fd->readable)
+		afterstep_watch_fd (fd->fd, ASFD_READ, fd);
 
 	show_debug(__FILE__,__FUNCTION__,__LINE__,"added dbus watch fd=%d watch=%p readable =%d\n", fd->fd, w, fd->readable);
 	return TRUE;
@@ -239,6 +241,8 @@ static void remove_watch(DBusWatch *w, void *data)
 {
     ASDBusFd* fd = dbus_watch_get_data(w);
 
+    if (fd != NULL && fd->readable)
+        afterstep_watch_fd (fd->fd, 0, NULL);
     vector_remove_elem (ASDBus.watchFds, &fd);
     dbus_watch_set_data(w, NULL, NULL);
     show_debug(__FILE__,__FUNCTION__,__LINE__,"removed dbus watch watch=%p\n", w);
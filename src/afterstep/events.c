@@ -1763,6 +1763,45 @@ void HandleShmCompletion (ASEvent * event)
 
 
 
+/***************************************************************************
+ *
+ * Registry of descriptors we wait on. Module connections are added when
+ * accepted and removed when killed, write interest is toggled when module's
+ * output queue becomes non-empty/empty, D-Bus descriptors come and go with
+ * D-Bus watches. X connection and module socket are checked on every wait,
+ * as that is only a couple of compares.
+ *
+ ****************************************************************************/
+static ASFdWatcher *AfterStepFdWatcher = NULL;
+static int WatchedXFd = -1;
+static int WatchedModuleFd = -1;
+
+#define MAX_WAIT_EVENTS		64
+
+void afterstep_watch_fd (int fd, ASFlagType events, void *data)
+{
+	if (fd < 0)
+		return;
+	if (AfterStepFdWatcher == NULL) {
+		if (events == 0)
+			return;
+		AfterStepFdWatcher = create_fd_watcher ();
+		show_progress ("using %s to wait for input",
+									 fd_watcher_backend (AfterStepFdWatcher));
+	}
+	if (!fd_watcher_set (AfterStepFdWatcher, fd, events, data))
+		show_error ("unable to wait for input on fd %d", fd);
+}
+
+static inline void afterstep_rewatch_fd (int *watched_fd, int fd)
+{
+	if (*watched_fd != fd) {
+		afterstep_watch_fd (*watched_fd, 0, NULL);
+		afterstep_watch_fd (fd, ASFD_READ, NULL);
+		*watched_fd = fd;
+	}
+}
+
 /***************************************************************************
  *
  * Waits for next X event, or for an auto-raise timeout.
@@ -1770,55 +1809,17 @@ void HandleShmCompletion (ASEvent * event)
  ****************************************************************************/
 void afterstep_wait_pipes_input (int timeout_sec)
 {
-	fd_set in_fdset, out_fdset;
+	static ASFdEvent events[MAX_WAIT_EVENTS];
 	int retval;
 	struct timeval tv;
 	struct timeval *t = NULL;
-	int max_fd = 0;
-	ASVector *asdbus_fds = NULL;
-
-	if (ASDBusConnected)
-		asdbus_fds = asdbus_getFds();
-
 
 	LOCAL_DEBUG_OUT ("waiting pipes%s", "");
-	FD_ZERO (&in_fdset);
-	FD_ZERO (&out_fdset);
+	afterstep_rewatch_fd (&WatchedXFd, x_fd);
+	afterstep_rewatch_fd (&WatchedModuleFd, Module_fd);
 
-	FD_SET (x_fd, &in_fdset);
-	max_fd = x_fd;
-#define AS_FD_SET(fd,fdset) \
-	do{ if (fd>=0) { FD_SET((fd),(fdset)); if ((fd)>max_fd) max_fd = (fd);}}while(0)
-
-	LOCAL_DEBUG_OUT ("asdbus_fds = %p", asdbus_fds);
-	if (asdbus_fds != NULL) {
-		register int i;
-		LOCAL_DEBUG_OUT ("asdbus_fds->used = %d", asdbus_fds->used);
-		for ( i = 0 ; i < asdbus_fds->used; ++i) {
-			ASDBusFd* fd = PVECTOR_HEAD(ASDBusFd*,asdbus_fds)[i];
-			LOCAL_DEBUG_OUT ("asdbus_fds[%d] = %p", i, fd);
-			if (fd && fd->readable){
-				AS_FD_SET (fd->fd, &in_fdset);
-				LOCAL_DEBUG_OUT ("adding asdbus_fds[%d].fd = %d", i, fd->fd);
-			}
-		}
-	}
-	LOCAL_DEBUG_OUT ("done with asdbus_fds", "");
-
-	AS_FD_SET (Module_fd, &in_fdset);
-
-	if (Modules != NULL) {				/* adding all the modules pipes to our wait list */
-		register int i = MIN (MODULES_NUM, Module_npipes);
-		register module_t *list = MODULES_LIST;
-		while (--i >= 0) {
-			if (list[i].fd >= 0) {
-				AS_FD_SET (list[i].fd, &in_fdset);
-				if (list[i].output_queue != NULL)
-					FD_SET (list[i].fd, &out_fdset);
-			} else										/* man, this modules is dead! get rid of it - it stinks! */
-				vector_remove_index (Modules, i);
-		}
-	}
+	/* man, some modules are dead! get rid of them - they stink! */
+	RemoveDeadModules ();
 
 	/* watch for timeouts */
 	if (timer_delay_till_next_alarm
@@ -1830,42 +1831,43 @@ void afterstep_wait_pipes_input (int timeout_sec)
 		tv.tv_usec = 0;
 	}
 
-	show_debug (__FILE__, __FUNCTION__, __LINE__,"selecting ... max_fd = %d, timeout : sec = %d, usec = %d", max_fd, t?t->tv_sec:-1, t?t->tv_usec:-1);
-	retval =
-			PORTABLE_SELECT (min (max_fd + 1, fd_width), &in_fdset, &out_fdset,
-											 NULL, t);
+	show_debug (__FILE__, __FUNCTION__, __LINE__,"waiting ... timeout : sec = %d, usec = %d", t?t->tv_sec:-1, t?t->tv_usec:-1);
+	retval = fd_watcher_wait (AfterStepFdWatcher, t, &events[0], MAX_WAIT_EVENTS);
 
-	LOCAL_DEBUG_OUT ("select ret val = %d", retval);
+	LOCAL_DEBUG_OUT ("wait ret val = %d", retval);
 	if (retval > 0) {
-		register module_t *list;
 		register int i;
-		/* check for incoming module connections */
-		if (Module_fd >= 0)
-			if (FD_ISSET (Module_fd, &in_fdset))
-				if (AcceptModuleConnection (Module_fd) != -1)
-					show_progress ("accepted module connection");
-		/* note that we have to do it AFTER we accepted incoming connections as those alter the list */
-		list = MODULES_LIST;
-		i = MIN (MODULES_NUM, Module_npipes);
-		/* Check for module input. */
-		while (--i >= 0)
-			if (list[i].fd > 0) {
-				Bool has_input = FD_ISSET (list[i].fd, &in_fdset);
-				Bool has_output = FD_ISSET (list[i].fd, &out_fdset);
-				if (has_input || has_output)
-					HandleModuleInOut (i, has_input, has_output);
-			}
-		if (asdbus_fds != NULL) {
-			register int i;
-			for ( i = 0 ; i < asdbus_fds->used; ++i) {
-				ASDBusFd* fd = PVECTOR_HEAD(ASDBusFd*,asdbus_fds)[i];
-				show_debug(__FILE__,__FUNCTION__,__LINE__, "dbus fd = %d, isset = %d", fd->fd, FD_ISSET (fd->fd, &in_fdset));
-				if (fd && FD_ISSET (fd->fd, &in_fdset)){
-					asdbus_process_messages (fd);
-					break;
-				}
+		Bool accept_module = False;
+		Bool dbus_processed = False;
+
+		for (i = 0; i < retval; ++i) {
+			int fd = events[i].fd;
+			module_t *module = (module_t *) events[i].data;
+
+			if (fd == Module_fd)
+				accept_module = True;
+			else if (fd == x_fd || module == NULL)
+				continue;
+			else if (Modules != NULL && module >= MODULES_LIST
+							 && module < MODULES_LIST + MODULES_NUM) {
+				/* module fds are watched with the module itself as data;
+				 * module may have been killed while handling preceding fds */
+				if (module->fd == fd)
+					HandleModuleInOut (module - MODULES_LIST,
+														 get_flags (events[i].events,
+																				ASFD_READ | ASFD_ERROR),
+														 get_flags (events[i].events, ASFD_WRITE));
+			} else if (!dbus_processed) {
+				/* D-Bus descriptors are registered along with their ASDBusFd */
+				show_debug(__FILE__,__FUNCTION__,__LINE__, "dbus fd = %d is ready", fd);
+				asdbus_process_messages ((ASDBusFd *) events[i].data);
+				dbus_processed = True;
 			}
 		}
+		/* accepting connection alters the list of modules and therefore
+		 * their watch data, so it has to be done AFTER they are handled */
+		if (accept_module && AcceptModuleConnection (Module_fd) != -1)
+			show_progress ("accepted module connection");
 	}
 
 	/* handle timeout events */
@@ -2371,9 +2371,9 @@ void screenshot_func_handler (FunctionData * data, ASEvent * event,
 			type = "png";
 		}
 
-		if (save_asimage_to_file
+		if (save_asimage_to_file_async
 				(realfilename, im, type, compress, NULL, 0, replace))
-			show_warning ("screenshot saved as \"%s\"", realfilename);
+			show_warning ("saving screenshot as \"%s\"", realfilename);
 		free (realfilename);
 		destroy_asimage (&im);
 	}
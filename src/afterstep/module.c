@@ -60,12 +60,14 @@
 
 static DECL_VECTOR (send_data_type, module_output_buffer);
 
-static void DeleteQueueBuff (module_t * module);
-static void AddToQueue (module_t * module, send_data_type * ptr, int size,
-												int done);
+static void AddToQueue (module_t * module, ASOutputPacket * packet);
 
 int module_listen (const char *socket_name);
 
+/* killed modules stay in the list until RemoveDeadModules() - it is not safe
+ * to shift channels while we may be iterating over them */
+static int DeadModulesCount = 0;
+
 
 /* create a named UNIX socket, and start watching for connections */
 Bool module_setup_socket ()
@@ -113,12 +115,17 @@ void KillModule (module_t * module, Bool dont_free_memory)
 {
 	LOCAL_DEBUG_OUT ("module %p ", module);
 	LOCAL_DEBUG_OUT ("module name \"%s\"", module->name);
-	if (module->fd > 0)
+	if (module->fd > 0) {
+		/* forked child must not touch parent's epoll registrations */
+		if (!dont_free_memory)
+			afterstep_watch_fd (module->fd, 0, NULL);
 		close (module->fd);
+	}
+	if (module->fd >= 0)
+		DeadModulesCount++;
 
 	if (!dont_free_memory) {
-		while (module->output_queue != NULL)
-			DeleteQueueBuff (module);
+		purge_output_queue (&(module->output_queue));
 		if (module->name != NULL)
 			destroy_string (&(module->name));
 		destroy_string (&(module->cmd_line));
@@ -130,7 +137,7 @@ void KillModule (module_t * module, Bool dont_free_memory)
 		}
 		memset (module, 0x00, sizeof (module_t));
 	} else {
-		module->output_queue = NULL;
+		memset (&(module->output_queue), 0x00, sizeof (ASOutputQueue));
 		module->name = NULL;
 		module->ibuf.text = NULL;
 		module->ibuf.func = NULL;
@@ -353,106 +360,81 @@ int HandleModuleInput (module_t * module)
 	return res;
 }
 
-#define PREALLOCED_QUEUE_LEN		256
-#define PREALLOCED_QUEUE_DATA_LEN	128
-static unsigned char		_as_prealloced_queue_data[PREALLOCED_QUEUE_LEN][PREALLOCED_QUEUE_DATA_LEN];
-static Bool _as_prealloced_init = False;
-static struct queue_buff_struct		_as_prealloced_queue_elems[PREALLOCED_QUEUE_LEN];
-
-static void
-AddToQueue (module_t * module, send_data_type * ptr, int size, int done)
+/* Messages carrying complete current state of the window. Any older one of
+ * the same type for the same window that is still waiting in the queue is
+ * made redundant by the newer one, and gets dropped, while the newer one is
+ * appended to the end of the queue as usual - so that the order of all the
+ * other messages is preserved. Any other message about the window puts a
+ * barrier - nothing queued for the window before it is ever dropped, as
+ * modules may need it to make sense of the message (for example
+ * M_RES_CLASS is only accepted for the window that M_CONFIGURE_WINDOW has
+ * introduced). For the same reason names are barriers for configuration
+ * of the window, which is what introduces it. */
+#define WINDOW_ID_MSG_MASK	(M_ADD_WINDOW|M_CONFIGURE_WINDOW|M_STATUS_CHANGE| \
+														 M_MAP|M_FOCUS_CHANGE|M_DESTROY_WINDOW| \
+														 M_WINDOW_NAME|M_WINDOW_NAME_MATCHED| \
+														 M_ICON_NAME|M_RES_CLASS|M_RES_NAME| \
+														 M_SWALLOW_WINDOW)
+#define COALESCED_CONFIG_STATES	((0x01<<0)|(0x01<<1))
+
+static int coalesced_msg_idx (send_data_type msg_type)
 {
-	register struct queue_buff_struct *new_elem, **tail;
-	int i = 0;
-
-	if (!_as_prealloced_init) {
-		memset (&_as_prealloced_queue_elems[0], 0x00,
-						sizeof (_as_prealloced_queue_elems));
-		_as_prealloced_init = True;
-	}
-#if 1
-	if (size < PREALLOCED_QUEUE_DATA_LEN)
-		while (++i < PREALLOCED_QUEUE_LEN)
-			if (_as_prealloced_queue_elems[i].prealloced_idx == 0)
-				break;
-
-	if (i > 0 && i < PREALLOCED_QUEUE_LEN) {
-		new_elem = &_as_prealloced_queue_elems[i];
-		new_elem->prealloced_idx = i;
-		new_elem->data = &_as_prealloced_queue_data[i][0];
-		new_elem->next = NULL;
-	} else 
-#endif	
-	{
-		new_elem = safecalloc (1, sizeof (struct queue_buff_struct));
-		new_elem->data = safemalloc (size);
+	switch (msg_type) {
+	case M_CONFIGURE_WINDOW:
+		return 0;
+	case M_STATUS_CHANGE:
+		return 1;
+	case M_WINDOW_NAME:
+		return 2;
+	case M_WINDOW_NAME_MATCHED:
+		return 3;
+	case M_ICON_NAME:
+		return 4;
 	}
-	new_elem->size = size;
-	new_elem->done = done;
-	memcpy (new_elem->data, ptr, size);
-	LOCAL_DEBUG_OUT ("que_buff %p: size = %d, done = %d, data = %p",
-									 new_elem, size, done, new_elem->data);
-	for (tail = &(module->output_queue); *tail; tail = &((*tail)->next)) {
-		/*LOCAL_DEBUG_OUT ("*tail = %p, (*tail)->next = %p", *tail, ((*tail)->next))*/;
-	}	
-	*tail = new_elem;
+	return -1;
 }
 
-static void DeleteQueueBuff (module_t * module)
+static void AddToQueue (module_t * module, ASOutputPacket * packet)
 {
-	register struct queue_buff_struct *a = module->output_queue;
-	if (a) {
-		module->output_queue = a->next;
-		LOCAL_DEBUG_OUT ("deleting buffer %p sent to module %p - next %p ", a,
-										 module, a->next);
-		if (a->prealloced_idx == 0) {
-			free (a->data);
-			free (a);
-		} else
-			a->prealloced_idx = 0;
+	send_data_type *msg = (send_data_type *) packet->data;
+	send_data_type window = 0;
+	int state = -1;
+
+	if (packet->size >= (MSG_HEADER_SIZE + 1) * sizeof (send_data_type)
+			&& get_flags (msg[1], WINDOW_ID_MSG_MASK)) {
+		window = msg[MSG_HEADER_SIZE];
+		state = coalesced_msg_idx (msg[1]);
+		if (state < 0)
+			output_queue_barrier (&(module->output_queue), AS_HASHABLE (window),
+														OUTPUT_QUEUE_ALL_STATES);
+		else if (!get_flags (COALESCED_CONFIG_STATES, 0x01 << state))
+			output_queue_barrier (&(module->output_queue), AS_HASHABLE (window),
+														COALESCED_CONFIG_STATES);
 	}
+	append_output_queue (&(module->output_queue), packet, AS_HASHABLE (window),
+											 state);
+	if (module->output_queue.used == 1 && module->fd > 0)
+		afterstep_watch_fd (module->fd, ASFD_READ | ASFD_WRITE, module);
 }
 
 int FlushQueue (module_t * module)
 {
-	extern int errno;
-	int fd;
-	register struct queue_buff_struct *curr;
-LOCAL_DEBUG_OUT ("module \"%s\", active= %d, out_queue = %p", module->name, module->active, module->output_queue);
+	int res;
+
+	LOCAL_DEBUG_OUT ("module \"%s\", active= %d, queued = %d", module->name,
+									 module->active, module->output_queue.used);
 	if (module->active <= 0)
 		return -1;
-	if (module->output_queue == NULL)
+	if (module->output_queue.used == 0)
 		return 1;
 
-	fd = module->fd;
-	while ((curr = module->output_queue) != NULL) {
-		register unsigned char *dptr = curr->data;
-		int bytes_written = 0;
-
-		do {
-			if ((bytes_written =
-					 write (fd, &dptr[curr->done], curr->size - curr->done)) > 0)
-				curr->done += bytes_written;
-			LOCAL_DEBUG_OUT ("wrote %d bytes into the module %p pipe",
-											 bytes_written, module);
-		} while (curr->done < curr->size && bytes_written > 0);
-
-		/* the write returns EWOULDBLOCK or EAGAIN if the pipe is full.
-		 * (This is non-blocking I/O). SunOS returns EWOULDBLOCK, OSF/1
-		 * returns EAGAIN under these conditions. Hopefully other OSes
-		 * return one of these values too. Solaris 2 doesn't seem to have
-		 * a man page for write(2) (!) */
-		if (bytes_written < 0) {
-			if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
-				return 0;
-			} else {
-				KillModule (module, False);
-				return -1;
-			}
-		}
-		DeleteQueueBuff (module);
-	}
-	return 1;
+	res = flush_output_queue (&(module->output_queue), module->fd);
+	if (res < 0)
+		KillModule (module, False);
+	else if (res > 0)
+		/* nothing left to write - stop waiting for the pipe to get writable */
+		afterstep_watch_fd (module->fd, ASFD_READ, module);
+	return res;
 }
 
 void FlushAllQueues ()
@@ -473,9 +455,9 @@ void FlushAllQueues ()
 			if (list[i].fd >= 0) {
 
 				int res = 0;
-				if (list[i].output_queue && (retval < 0 || FD_ISSET (list[i].fd, &out_fdset)))
+				if (list[i].output_queue.used > 0 && (retval < 0 || FD_ISSET (list[i].fd, &out_fdset)))
 					res = FlushQueue (&(list[i]));
-				if (res >= 0 && list[i].output_queue != NULL) {
+				if (res >= 0 && list[i].output_queue.used > 0) {
 					FD_SET (list[i].fd, &out_fdset);
 					if (max_fd < list[i].fd)
 						max_fd = list[i].fd;
@@ -501,8 +483,11 @@ void FlushAllQueues ()
 
 
 #include <sys/errno.h>
+/* packet is only created when there is someone to send it to, and then
+ * shared by all the queues it gets added to */
 static inline int
-PositiveWrite (unsigned int channel, send_data_type * ptr, int size)
+PositiveWrite (unsigned int channel, send_data_type * ptr, int size,
+							 ASOutputPacket ** ppacket)
 {
 	module_t *module = &(MODULES_LIST[channel]);
 	register CARD32 mask = ptr[1];
@@ -512,7 +497,9 @@ PositiveWrite (unsigned int channel, send_data_type * ptr, int size)
 	if (module->active < 0 || !get_flags (module->mask, mask))
 		return -1;
 
-	AddToQueue (module, ptr, size, 0);
+	if (*ppacket == NULL)
+		*ppacket = create_output_packet (ptr, size);
+	AddToQueue (module, *ppacket);
 	LOCAL_DEBUG_OUT("lock_on_send_mask = %d,is_server_grabbed =%d", get_flags (module->lock_on_send_mask, mask), is_server_grabbed ());
 	if (get_flags (module->lock_on_send_mask, mask) && !is_server_grabbed ()) {
 		int res;
@@ -556,6 +543,7 @@ void SendBuffer (int channel)
 {
 	send_data_type *b = VECTOR_HEAD (send_data_type, module_output_buffer);
 	send_data_type size_to_send;
+	ASOutputPacket *packet = NULL;
 
 	size_to_send = b[2];
 	if (size_to_send > 0 && Modules) {
@@ -565,15 +553,20 @@ void SendBuffer (int channel)
 		LOCAL_DEBUG_OUT ("sending %ld words to module # %d of %d",
 										 size_to_send, channel, MODULES_NUM);
 		if (channel >= 0 && channel < MODULES_NUM)
-			PositiveWrite (channel, b, size_to_send * sizeof (send_data_type));
+			PositiveWrite (channel, b, size_to_send * sizeof (send_data_type),
+										 &packet);
 		else {
 			register int i = MODULES_NUM;
 			while (--i >= 0) {
 				LOCAL_DEBUG_OUT ("sending to module %d ...", i);
-				PositiveWrite (i, b, size_to_send * sizeof (send_data_type));
+				PositiveWrite (i, b, size_to_send * sizeof (send_data_type),
+											 &packet);
 				LOCAL_DEBUG_OUT ("done sending to module %d ...", i);
 			}
 		}
+		/* dropping our own reference - queues hold the rest */
+		if (packet)
+			release_output_packet (packet);
 	}
 }
 
@@ -624,12 +617,14 @@ int AcceptModuleConnection (int socket_fd)
 			new_module.fd = fd;
 			new_module.active = 0;
 			new_module.mask = MAX_MASK;
-			new_module.output_queue = NULL;
 			/* adding new module to the end of the list */
 			LOCAL_DEBUG_OUT
 					("adding new module:  total modules %d. list starts at %p",
 					 MODULES_NUM, MODULES_LIST);
 			channel = vector_insert_elem (Modules, &new_module, 1, NULL, False);
+			/* list could have been moved - all the modules need new address */
+			if (channel >= 0)
+				RewatchModules ();
 			LOCAL_DEBUG_OUT
 					("added module # %d : total modules %d. list starts at %p",
 					 channel, MODULES_NUM, MODULES_LIST);
@@ -726,6 +721,34 @@ HandleModuleInOut (unsigned int channel, Bool has_input, Bool has_output)
 	}
 }
 
+/* module fds are watched with pointer to the module as the data, so that
+ * it has to be updated every time list gets changed : */
+void RewatchModules ()
+{
+	if (Modules != NULL) {
+		register int i = MODULES_NUM;
+		register module_t *list = MODULES_LIST;
+		while (--i >= 0)
+			if (list[i].fd > 0)
+				afterstep_watch_fd (list[i].fd,
+														(list[i].output_queue.used > 0) ? ASFD_READ |
+														ASFD_WRITE : ASFD_READ, &(list[i]));
+	}
+}
+
+void RemoveDeadModules ()
+{
+	if (Modules != NULL && DeadModulesCount > 0) {
+		register int i = MODULES_NUM;
+		register module_t *list = MODULES_LIST;
+		while (--i >= 0)
+			if (list[i].fd < 0)
+				vector_remove_index (Modules, i);
+		RewatchModules ();
+	}
+	DeadModulesCount = 0;
+}
+
 void DeadPipe (int nonsense)
 {
 	signal (SIGPIPE, DeadPipe);
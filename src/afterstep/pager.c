@@ -566,27 +566,9 @@ MyBackground *get_desk_back_or_default (int desk, Bool old_desk)
 }
 
 
-ASImage *load_myback_image (int desk, MyBackground * back)
+/* applies background's scaling, alignment and cropping to freshly loaded image */
+static ASImage *adjust_myback_image (MyBackground * back, ASImage * im)
 {
-	ASImage *im = NULL;
-	if (back->data && back->data[0]) {
-		LOCAL_DEBUG_OUT ("Attempting to load background image from \"%s\"",
-										 back->data ? back->data : "NULL");
-		im = get_asimage (Scr.image_manager, back->data, 0xFFFFFFFF, 100);
-	}
-
-	if (im == NULL) {
-		const char *const_configfile =
-				get_session_file (Session, desk, F_CHANGE_BACKGROUND, False);
-		if (const_configfile != NULL) {
-			im = get_asimage (Scr.image_manager, const_configfile, 0xFFFFFFFF,
-												100);
-			show_progress ("BACKGROUND for desktop %d loaded from \"%s\" ...",
-										 desk, const_configfile);
-		} else
-			show_progress ("BACKGROUND file cannot be found for desktop %d",
-										 desk);
-	}
 	if (im != NULL) {
 		ASImage *scaled_im = NULL;
 		ASImage *tiled_im = NULL;
@@ -663,6 +645,32 @@ ASImage *load_myback_image (int desk, MyBackground * back)
 			}
 		}
 	}
+	return im;
+}
+
+ASImage *load_myback_image (int desk, MyBackground * back)
+{
+	ASImage *im = NULL;
+	if (back->data && back->data[0]) {
+		LOCAL_DEBUG_OUT ("Attempting to load background image from \"%s\"",
+										 back->data ? back->data : "NULL");
+		im = get_asimage (Scr.image_manager, back->data, 0xFFFFFFFF, 100);
+	}
+
+	if (im == NULL) {
+		const char *const_configfile =
+				get_session_file (Session, desk, F_CHANGE_BACKGROUND, False);
+		if (const_configfile != NULL) {
+			im = get_asimage (Scr.image_manager, const_configfile, 0xFFFFFFFF,
+												100);
+			show_progress ("BACKGROUND for desktop %d loaded from \"%s\" ...",
+										 desk, const_configfile);
+		} else
+			show_progress ("BACKGROUND file cannot be found for desktop %d",
+										 desk);
+	}
+	if (im != NULL)
+		im = adjust_myback_image (back, im);
 #ifdef LOCAL_DEBUG
 	LOCAL_DEBUG_OUT ("syncing %s", "");
 	ASSync (False);
@@ -909,6 +917,7 @@ ASBackgroundXferData *pmap2background_xfer (Pixmap pmap)
 }
 
 void do_background_xfer_iter (void *vdata);
+static void stop_background_load (void);
 
 static void stop_background_xfer (ASBackgroundXferData * data)
 {
@@ -947,6 +956,7 @@ void stop_all_background_xfer ()
 {
 	while (back_xfer_list)
 		stop_background_xfer (back_xfer_list);
+	stop_background_load ();
 }
 
 
@@ -1086,6 +1096,191 @@ void do_background_xfer_iter (void *vdata)
 
 
 
+/* Large background images are decoded in small steps from the event loop,
+ * so that we can show rows as soon as they are decoded, and stay responsive
+ * while doing so : */
+#define BACKGROUND_LOAD_STEP_BYTES	(128*1024)
+#define BACKGROUND_LOAD_STEP_DELAY	5
+#define BACKGROUND_LOAD_MAX_LINES	64
+
+typedef struct ASBackgroundLoadData {
+	int desk;
+	MyBackground *back;
+	ASImageProgressiveLoader *loader;
+	Pixmap pmap;									/* temporary root pixmap we show rows on */
+	unsigned int width, height;
+	unsigned int rows_shown;
+} ASBackgroundLoadData;
+
+static ASBackgroundLoadData *back_load = NULL;
+static Bool back_load_disabled = False;
+
+static void destroy_background_load (ASBackgroundLoadData * data)
+{
+	ASImage *im;
+	timer_remove_by_data (data);
+	if ((im = finish_progressive_image_loading (&(data->loader))) != NULL)
+		destroy_asimage (&im);
+	if (data->pmap)
+		XFreePixmap (dpy, data->pmap);
+	free (data);
+}
+
+static void stop_background_load (void)
+{
+	ASBackgroundLoadData *data = back_load;
+	if (data == NULL)
+		return;
+	back_load = NULL;
+	if (data->pmap) {							/* put back whatever was there before we started */
+		XSetWindowBackgroundPixmap (dpy, Scr.Root,
+																Scr.RootBackground ? Scr.RootBackground->
+																pmap : None);
+		XClearWindow (dpy, Scr.Root);
+	}
+	destroy_background_load (data);
+}
+
+static void show_background_load_rows (ASBackgroundLoadData * data)
+{
+	unsigned int rows_done = 0;
+	ASImage *im = get_progressive_image (data->loader, &rows_done);
+	int depth = DefaultDepth (dpy, DefaultScreen (dpy));
+
+	if (im == NULL)
+		return;
+	if (data->pmap == None) {
+		XGCValues gcv;
+		GC gc;
+		data->width = min (im->width, Scr.MyDisplayWidth);
+		data->height = min (im->height, Scr.MyDisplayHeight);
+		data->pmap =
+				create_visual_pixmap (Scr.asv, Scr.Root, data->width, data->height,
+															depth);
+		gcv.foreground = Scr.asv->black_pixel;
+		gc = XCreateGC (dpy, data->pmap, GCForeground, &gcv);
+		XFillRectangle (dpy, data->pmap, gc, 0, 0, data->width, data->height);
+		XFreeGC (dpy, gc);
+		XSetWindowBackgroundPixmap (dpy, Scr.Root, data->pmap);
+	}
+	if (rows_done > data->height)
+		rows_done = data->height;
+	if (data->rows_shown >= rows_done)
+		return;
+	while (data->rows_shown < rows_done) {
+		int lines = min (rows_done - data->rows_shown, BACKGROUND_LOAD_MAX_LINES);
+		XImage *xim =
+				create_visual_scratch_ximage (Scr.asv, im->width, lines, depth);
+		if (subimage2ximage (Scr.asv, im, 0, data->rows_shown, xim))
+			put_ximage (Scr.asv, xim, data->pmap, Scr.RootGC, 0, 0, 0,
+									data->rows_shown, data->width, lines);
+		XDestroyImage (xim);
+		data->rows_shown += lines;
+	}
+	XClearWindow (dpy, Scr.Root);
+	ASSync (False);
+}
+
+static void finish_background_load (void)
+{
+	ASBackgroundLoadData *data = back_load;
+	ASImage *im;
+
+	back_load = NULL;
+	timer_remove_by_data (data);
+	if ((im = finish_progressive_image_loading (&(data->loader))) != NULL) {
+		char *imname = make_myback_image_name (&(Scr.Look), data->back->name);
+		im = adjust_myback_image (data->back, im);
+		store_asimage (Scr.image_manager, im, imname);
+		free (imname);
+		/* all the rows we've shown are exactly what the image has now -
+		 * no need to transfer it again : */
+		if (data->pmap != None && data->rows_shown >= im->height
+				&& data->back->loaded_pixmap == None) {
+			data->back->loaded_pixmap = data->pmap;
+			data->pmap = None;
+		}
+	} else {
+		show_warning ("failed to load background image for desktop #%d",
+									data->desk);
+		back_load_disabled = True;	/* let synchronous loader handle the error */
+	}
+	if (data->desk == Scr.CurrentDesk)
+		change_desktop_background (data->desk);
+	back_load_disabled = False;
+	destroy_background_load (data);
+}
+
+static void do_background_load_iter (void *vdata)
+{
+	ASBackgroundLoadData *data = (ASBackgroundLoadData *) vdata;
+
+	if (data == NULL || data != back_load)
+		return;
+	if (continue_progressive_image_file (data->loader,
+																			 BACKGROUND_LOAD_STEP_BYTES) < 0) {
+		finish_background_load ();	/* broken file */
+		return;
+	}
+	show_background_load_rows (data);
+	if (is_progressive_image_complete (data->loader))
+		finish_background_load ();
+	else
+		timer_new (BACKGROUND_LOAD_STEP_DELAY, do_background_load_iter, vdata);
+}
+
+static Bool start_background_load (int desk, MyBackground * back)
+{
+	const char *file = NULL;
+	char *imname;
+	ASImageImportParams iparams;
+	ASImageProgressiveLoader *loader;
+
+	if (back_load_disabled || back->type != MB_BackImage
+			|| back->loaded_pixmap != None || back->loaded_im_name != NULL)
+		return False;
+	/* no point in showing partially loaded image if it needs to be scaled
+	 * or padded afterwards */
+	if (get_flags (back->scale.flags, (WidthValue | HeightValue))
+			|| back->align_flags != NO_ALIGN)
+		return False;
+	/* when we do this for the first time  - we better do it all at once */
+	if (get_flags (Scr.Feel.flags, DontAnimateBackground)
+			|| Scr.wmprops->root_pixmap == None)
+		return False;
+
+	imname = make_myback_image_name (&(Scr.Look), back->name);
+	if (query_asimage (Scr.image_manager, imname) != NULL) {
+		free (imname);
+		return False;
+	}
+	free (imname);
+
+	if (back->data && back->data[0])
+		file = back->data;
+	else
+		file = get_session_file (Session, desk, F_CHANGE_BACKGROUND, False);
+	if (file == NULL || query_asimage (Scr.image_manager, file) != NULL)
+		return False;
+
+	init_asimage_import_params (&iparams);
+	iparams.gamma = Scr.image_manager->gamma;
+	iparams.search_path = &(Scr.image_manager->search_path[0]);
+	iparams.compression = 100;
+	if ((loader = open_progressive_image_file (file, &iparams)) == NULL)
+		return False;
+
+	LOCAL_DEBUG_OUT ("loading background for desk %d from \"%s\" in steps",
+									 desk, file);
+	back_load = safecalloc (1, sizeof (ASBackgroundLoadData));
+	back_load->desk = desk;
+	back_load->back = back;
+	back_load->loader = loader;
+	/* small images will be done right here : */
+	do_background_load_iter (back_load);
+	return True;
+}
+
 void change_desktop_background (int desk)
 {
 	MyBackground *new_back = get_desk_back_or_default (desk, False);
@@ -1099,6 +1294,9 @@ void change_desktop_background (int desk)
 	if (new_back == NULL)
 		return;
 
+	/* whatever we were loading before is not needed anymore : */
+	stop_background_load ();
+
 	if (new_back->loaded_im_name != NULL && Scr.RootBackground) {
 		if (Scr.RootBackground->im != NULL
 				&& Scr.RootBackground->im->name != NULL)
@@ -1110,6 +1308,9 @@ void change_desktop_background (int desk)
 	if (new_back == old_back && desk != old_desk)	/* if desks are the same then we are reloading current background !!! */
 		return;
 
+	if (start_background_load (desk, new_back))
+		return;									/* will get back here when done loading */
+
 	if (Scr.RootBackground != NULL) {
 		LOCAL_DEBUG_OUT ("ROOT_PIXMAP = %lX at %d", Scr.RootBackground->pmap,
 										 __LINE__);